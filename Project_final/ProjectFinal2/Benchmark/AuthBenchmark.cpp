@@ -0,0 +1,221 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Benchmark.h"
+#include "../Project1/UserManagement.h"
+
+/*
+ * Logins per second while every client keeps reconnecting, with and without the login cache,
+ * after checking PBKDF2 and scrypt against the RFC 7914 test vectors.
+ * The threads log in as random users of the set, as the reader threads of the server do.
+ */
+
+typedef struct AuthThreadArgTag {
+	LPCredentialManagerT manager;
+	DWORD nrUsers;
+	DWORD dwSeed;
+	ULONGLONG nrLogins;
+	ULONGLONG nrFailures;
+	volatile LONG *pnrReady;
+	volatile LONG *pbStart;
+	volatile LONG *pbStop;
+}AuthThreadArgT, *LPAuthThreadArgT;
+
+static VOID parseHex(const CHAR *sHex, PBYTE buff)
+{
+	for (DWORD i = 0; sHex[2 * i] != '\0'; i++) {
+		CHAR sDigits[3] = { sHex[2 * i], sHex[2 * i + 1], '\0' };
+		buff[i] = (BYTE)strtoul(sDigits, NULL, 16);
+	}
+}
+
+/*
+ * RFC 7914 section 11 (PBKDF2-HMAC-SHA256) and section 12, the first two scrypt vectors.
+ */
+static BOOL verifyKdf()
+{
+	BYTE expected[64];
+	BYTE actual[64];
+
+	parseHex("55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+		"49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783", expected);
+	pbkdf2Sha256((const BYTE*)"passwd", 6, (const BYTE*)"salt", 4, 1, actual, sizeof(actual));
+	if (memcmp(expected, actual, sizeof(actual)) != 0) {
+		_tprintf(_T("pbkdf2: wrong output for the RFC 7914 test vector\n"));
+		return FALSE;
+	}
+
+	parseHex("77d6576238657b203b19ca42c18a0497f16b4844e3074ae8dfdffa3fede21442"
+		"fcd0069ded0948f8326a753a0fc81f17e8d3e0fb2e0d3628cf35e20c38d18906", expected);
+	if (!scrypt((const BYTE*)"", 0, (const BYTE*)"", 0, 4, 1, 1, actual, sizeof(actual)) ||
+		memcmp(expected, actual, sizeof(actual)) != 0) {
+		_tprintf(_T("scrypt: wrong output for the RFC 7914 test vector with N=16\n"));
+		return FALSE;
+	}
+
+	parseHex("fdbabe1c9d3472007856e7190d01e9fe7c6ad7cbc8237830e77376634b373162"
+		"2eaf30d92e22a3886ff109279d9830dac727afb94a83ee6d8360cbdfa2cc0640", expected);
+	if (!scrypt((const BYTE*)"password", 8, (const BYTE*)"NaCl", 4, 10, 8, 16, actual, sizeof(actual)) ||
+		memcmp(expected, actual, sizeof(actual)) != 0) {
+		_tprintf(_T("scrypt: wrong output for the RFC 7914 test vector with N=1024\n"));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static VOID getUserName(DWORD dwUser, PTCHAR sUserName, PTCHAR sPassword)
+{
+	_stprintf(sUserName, _T("user%u"), dwUser);
+	_stprintf(sPassword, _T("password of user %u"), dwUser);
+}
+
+static DWORD WINAPI authThread(LPVOID arg)
+{
+	LPAuthThreadArgT threadArg = (LPAuthThreadArgT)arg;
+	DWORD dwSeed = threadArg->dwSeed;
+	TCHAR sUserName[32];
+	TCHAR sPassword[32];
+
+	// all threads start together, so thread creation is not measured
+	InterlockedIncrement(threadArg->pnrReady);
+	while (ReadAcquire(threadArg->pbStart) == 0) {
+		YieldProcessor();
+	}
+
+	while (ReadAcquire(threadArg->pbStop) == 0) {
+		dwSeed = dwSeed * 1103515245 + 12345;
+		getUserName((dwSeed >> 8) % threadArg->nrUsers, sUserName, sPassword);
+		if (!checkClientCredentials(threadArg->manager, sUserName, sPassword)) {
+			threadArg->nrFailures++;
+		}
+		threadArg->nrLogins++;
+	}
+	return 0;
+}
+
+/*
+ * @return logins per second, or a negative value when a login failed.
+ */
+static double measureLogins(LPCredentialManagerT manager, DWORD nrUsers, DWORD nrThreads, DWORD dwSeconds)
+{
+	HANDLE threads[64];
+	AuthThreadArgT args[64];
+	volatile LONG nrReady = 0;
+	volatile LONG bStart = 0;
+	volatile LONG bStop = 0;
+	ULONGLONG nrLogins = 0;
+	ULONGLONG nrFailures = 0;
+	double start;
+	double elapsed;
+
+	for (DWORD i = 0; i < nrThreads; i++) {
+		args[i].manager = manager;
+		args[i].nrUsers = nrUsers;
+		args[i].dwSeed = i + 1;
+		args[i].nrLogins = 0;
+		args[i].nrFailures = 0;
+		args[i].pnrReady = &nrReady;
+		args[i].pbStart = &bStart;
+		args[i].pbStop = &bStop;
+		threads[i] = (HANDLE)_beginthreadex(NULL, 0, (_beginthreadex_proc_type)authThread, &args[i], 0, NULL);
+		if (threads[i] == NULL) {
+			_tprintf(_T("could not create benchmark threads!\n"));
+			exit(5);
+		}
+	}
+
+	while (ReadAcquire(&nrReady) != (LONG)nrThreads) {
+		Sleep(1);
+	}
+	start = benchmarkSeconds();
+	WriteRelease(&bStart, 1);
+	Sleep(dwSeconds * 1000);
+	WriteRelease(&bStop, 1);
+
+	for (DWORD i = 0; i < nrThreads; i++) {
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+		nrLogins += args[i].nrLogins;
+		nrFailures += args[i].nrFailures;
+	}
+	elapsed = benchmarkSeconds() - start;
+
+	return (nrFailures == 0) ? (double)nrLogins / elapsed : -1;
+}
+
+INT authBenchmark(INT argc, PTCHAR argv[])
+{
+	DWORD nrUsers = 32;
+	DWORD dwLogCost = DEFAULT_KDF_LOG_COST;
+	DWORD nrThreads = 4;
+	DWORD dwSeconds = 2;
+	DWORD nrCachedLogins = 256;
+	TCHAR sUserName[32];
+	TCHAR sPassword[32];
+	double start;
+
+	for (INT i = 0; i < argc; i++) {
+		if (!parseNumberArgument(argv[i], _T("users"), &nrUsers) ||
+			!parseNumberArgument(argv[i], _T("cost"), &dwLogCost) ||
+			!parseNumberArgument(argv[i], _T("threads"), &nrThreads) ||
+			!parseNumberArgument(argv[i], _T("seconds"), &dwSeconds) ||
+			!parseNumberArgument(argv[i], _T("cache"), &nrCachedLogins) ||
+			dwLogCost > MAX_KDF_LOG_COST || nrThreads > 64) {
+			_tprintf(_T("invalid parameter: \"%s\"\n"), argv[i]);
+			return 1;
+		}
+	}
+
+	if (!verifyKdf()) {
+		return 2;
+	}
+
+	_tprintf(_T("scrypt N=2^%u r=%u p=%u, %u users, %u threads, %u s per measurement\n"),
+		dwLogCost, KDF_BLOCK_SIZE, KDF_PARALLELISM, nrUsers, nrThreads, dwSeconds);
+	_tprintf(_T("%-20s %12s %10s\n"), _T("login cache"), _T("logins/s"), _T("hit rate"));
+
+	for (DWORD dwRun = 0; dwRun < 2; dwRun++) {
+		DWORD nrLogins = (dwRun == 0) ? 0 : nrCachedLogins;
+		LPCredentialManagerT manager = create_CredentialManagerT(dwLogCost, nrLogins);
+		CredentialStatsT stats;
+		TCHAR sName[32];
+		double rate;
+
+		if (manager == NULL) {
+			_tprintf(_T("Could not allocate memory!\n"));
+			return 6;
+		}
+		start = benchmarkSeconds();
+		for (DWORD i = 0; i < nrUsers; i++) {
+			PasswordHashT passwordHash;
+			LPCredentialT credential;
+
+			getUserName(i, sUserName, sPassword);
+			if (!hashPassword(sPassword, dwLogCost, &passwordHash) ||
+				(credential = create_CredentialT(sUserName, &passwordHash)) == NULL ||
+				!insertCredentials(manager, credential)) {
+				_tprintf(_T("Could not allocate memory!\n"));
+				return 6;
+			}
+		}
+		if (dwRun == 0) {
+			_tprintf(_T("%-20s %12.1f %10s\n"), _T("kdf alone"), nrUsers / (benchmarkSeconds() - start), _T("-"));
+		}
+
+		rate = measureLogins(manager, nrUsers, nrThreads, dwSeconds);
+		if (rate < 0) {
+			_tprintf(_T("a login was rejected\n"));
+			return 2;
+		}
+		getCredentialStats(manager, &stats);
+		if (nrLogins == 0) {
+			_stprintf(sName, _T("off"));
+		} else {
+			_stprintf(sName, _T("%u logins"), stats.nrCachedLogins);
+		}
+		_tprintf(_T("%-20s %12.1f %9.1f%%\n"), sName, rate,
+			100.0 * stats.nrCacheHits / (double)(stats.nrCacheHits + stats.nrKdfRuns));
+		destroyCredentialManager(manager);
+	}
+
+	return 0;
+}
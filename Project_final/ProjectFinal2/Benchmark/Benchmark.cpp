@@ -0,0 +1,78 @@
+/*
+ * file name: Benchmark.cpp
+ * Microbenchmarks of the server internals, see printUsage for the available ones.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Benchmark.h"
+
+typedef struct BenchmarkTag {
+	LPCTSTR sName;
+	INT(*run)(INT argc, PTCHAR argv[]);
+	LPCTSTR sUsage;
+}BenchmarkT;
+
+static const BenchmarkT benchmarks[] = {
+	{ _T("queue"), queueBenchmark,
+		_T("queue [max_threads=<n>] [ops=<n>] [size=<n>]: lock-free queue against the locked one") },
+	{ _T("xor"), xorBenchmark,
+		_T("xor [size=<packet bytes>] [key=<key bytes>] [mb=<n>]: xor kernels against the per byte loop") },
+	{ _T("fuzz"), fuzzBenchmark,
+		_T("fuzz [rounds=<n>] [size=<max blob bytes>] [key=<max key bytes>] [seed=<n>]: binary blobs and keys round trip through packets with every cipher") },
+	{ _T("cipher"), cipherBenchmark,
+		_T("cipher [mb=<n>] [key=<xor key bytes>]: throughput of every cipher on 4 KB, 64 KB and 1 MB packets") },
+	{ _T("auth"), authBenchmark,
+		_T("auth [users=<n>] [cost=<log2 N>] [threads=<n>] [seconds=<n>] [cache=<logins>]: logins/s of reconnecting clients with and without the login cache") },
+	{ _T("load"), loadBenchmark,
+		_T("load [server=<address>] [clients=<n>] [jobs=<files per client>] [size=<file bytes>] [packet=<bytes>] [window=<packets>] [cipher=<cipher>] [key=<xor key bytes>] [rate=<connections/s>] [user=<name>] [pass=<password>] [server_pid=<pid>] [json=<path>] [label=<text>]: end to end throughput, latency, connection setup and CPU per GB of a running server") },
+	{ _T("codec"), codecBenchmark,
+		_T("codec [size=<packet bytes>] [mb=<n>]: compression ratio and speed of log, random and mixed data, packet by packet") },
+};
+
+#define NR_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+double benchmarkSeconds()
+{
+	LARGE_INTEGER counter;
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+
+BOOL parseNumberArgument(PTCHAR arg, LPCTSTR sName, LPDWORD pdwValue)
+{
+	size_t cbName = _tcslen(sName);
+
+	if (_tcsncmp(arg, sName, cbName) != 0 || arg[cbName] != '=') {
+		return TRUE;
+	}
+	return _stscanf(arg + cbName + 1, _T("%u"), pdwValue) == 1 && *pdwValue > 0;
+}
+
+VOID printUsage()
+{
+	_tprintf(_T("Usage: Benchmark <name> [options]\n"));
+	for (DWORD i = 0; i < NR_BENCHMARKS; i++) {
+		_tprintf(_T("    %s\n"), benchmarks[i].sUsage);
+	}
+}
+
+INT _tmain(INT argc, PTCHAR argv[])
+{
+	if (argc < 2) {
+		printUsage();
+		return 1;
+	}
+
+	for (DWORD i = 0; i < NR_BENCHMARKS; i++) {
+		if (_tcscmp(argv[1], benchmarks[i].sName) == 0) {
+			return benchmarks[i].run(argc - 2, argv + 2);
+		}
+	}
+
+	printUsage();
+	return 1;
+}
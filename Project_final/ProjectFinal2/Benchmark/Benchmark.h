@@ -0,0 +1,31 @@
+#pragma once
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "../Project1/Portability.h"
+
+/*
+ * Every benchmark gets the arguments following its name and returns the exit code.
+ */
+INT queueBenchmark(INT argc, PTCHAR argv[]);
+INT xorBenchmark(INT argc, PTCHAR argv[]);
+INT fuzzBenchmark(INT argc, PTCHAR argv[]);
+INT cipherBenchmark(INT argc, PTCHAR argv[]);
+INT authBenchmark(INT argc, PTCHAR argv[]);
+INT loadBenchmark(INT argc, PTCHAR argv[]);
+INT codecBenchmark(INT argc, PTCHAR argv[]);
+
+/*
+ * Current time in seconds, for measuring intervals only.
+ */
+double benchmarkSeconds();
+
+/*
+ * Parses <name>=<number> arguments, leaves *pdwValue untouched when arg is another option.
+ *
+ * @return FALSE if arg is the option but the number is invalid.
+ */
+BOOL parseNumberArgument(PTCHAR arg, LPCTSTR sName, LPDWORD pdwValue);
+
+#endif
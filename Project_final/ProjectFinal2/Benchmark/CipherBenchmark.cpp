@@ -0,0 +1,283 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Benchmark.h"
+#include "../Project1/CipherEngine.h"
+#include "../Project1/ChaCha20.h"
+#include "../Project1/AesCtr.h"
+
+#define AES_MAX_KERNELS 4
+
+/*
+ * Throughput of every cipher of the server on the packet sizes clients use,
+ * after checking the ChaCha20 and AES kernels against published test vectors,
+ * and the cost of setting up the key of a connection with and without the key cache.
+ */
+
+// connections set up for each key setup measurement
+#define KEY_SETUP_ROUNDS 100000
+
+static const DWORD packetSizes[] = { 4096, 65536, 1 << 20 };
+
+#define NR_PACKET_SIZES (sizeof(packetSizes) / sizeof(packetSizes[0]))
+
+static VOID fillRandom(PBYTE buff, DWORD cbBuff, DWORD dwSeed)
+{
+	for (DWORD i = 0; i < cbBuff; i++) {
+		dwSeed = dwSeed * 1103515245 + 12345;
+		buff[i] = (BYTE)(dwSeed >> 16);
+	}
+}
+
+static VOID parseHex(const CHAR *sHex, PBYTE buff)
+{
+	for (DWORD i = 0; sHex[2 * i] != '\0'; i++) {
+		CHAR sDigits[3] = { sHex[2 * i], sHex[2 * i + 1], '\0' };
+		buff[i] = (BYTE)strtoul(sDigits, NULL, 16);
+	}
+}
+
+/*
+ * RFC 8439 A.1 test vector 1, and the 4 block path against the one block path
+ * on sizes around its 256 bytes.
+ */
+static BOOL verifyChaCha20()
+{
+	BYTE key[CHACHA20_KEY_SIZE];
+	BYTE nonce[CHACHA20_NONCE_SIZE];
+	BYTE expected[1000];
+	BYTE actual[1000];
+
+	memset(key, 0, sizeof(key));
+	memset(nonce, 0, sizeof(nonce));
+	memset(actual, 0, CHACHA20_BLOCK_SIZE);
+	parseHex("76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7"
+		"da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586", expected);
+	chacha20Xor(actual, CHACHA20_BLOCK_SIZE, key, nonce, 0);
+	if (memcmp(expected, actual, CHACHA20_BLOCK_SIZE) != 0) {
+		_tprintf(_T("chacha20: wrong key stream for the RFC 8439 test vector\n"));
+		return FALSE;
+	}
+
+	fillRandom(key, sizeof(key), 3);
+	fillRandom(nonce, sizeof(nonce), 4);
+	for (DWORD cbBuff = 200; cbBuff <= sizeof(actual); cbBuff += 37) {
+		fillRandom(expected, cbBuff, cbBuff);
+		memcpy(actual, expected, cbBuff);
+		for (DWORD i = 0; i < cbBuff; i += CHACHA20_BLOCK_SIZE) {
+			DWORD cbBlock = (cbBuff - i < CHACHA20_BLOCK_SIZE) ? cbBuff - i : CHACHA20_BLOCK_SIZE;
+			chacha20Xor(expected + i, cbBlock, key, nonce, 7 + i / CHACHA20_BLOCK_SIZE);
+		}
+		chacha20Xor(actual, cbBuff, key, nonce, 7);
+		if (memcmp(expected, actual, cbBuff) != 0) {
+			_tprintf(_T("chacha20: %s kernel differs from the block by block stream for %u bytes\n"),
+				getChaCha20KernelName(), cbBuff);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * NIST SP 800-38A F.5.1 and F.5.5 (CTR-AES128 and CTR-AES256) for every kernel,
+ * and every kernel against the portable one on sizes around the 8 blocks AES-NI keeps in flight.
+ */
+static BOOL verifyAesKernels(LPAesCtrKernelInfoT kernels, DWORD nrKernels)
+{
+	static const CHAR *sPlain = "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+		"30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+	static const CHAR *sKeys[2] = {
+		"2b7e151628aed2a6abf7158809cf4f3c",
+		"603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4"
+	};
+	static const CHAR *sCiphers[2] = {
+		"874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+		"5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee",
+		"601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+		"2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6"
+	};
+	AesKeyT aesKey;
+	BYTE key[32];
+	BYTE counterBlock[AES_BLOCK_SIZE];
+	BYTE expected[1000];
+	BYTE actual[1000];
+
+	for (DWORD k = 0; k < nrKernels; k++) {
+		for (DWORD v = 0; v < 2; v++) {
+			parseHex(sKeys[v], key);
+			expandAesKey(&aesKey, key, (DWORD)strlen(sKeys[v]) / 2);
+			parseHex("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", counterBlock);
+			parseHex(sCiphers[v], expected);
+			parseHex(sPlain, actual);
+			kernels[k].kernel(&aesKey, actual, 64, counterBlock);
+			if (memcmp(expected, actual, 64) != 0) {
+				_tprintf(_T("aes-ctr: %s kernel fails the SP 800-38A vector for AES-%u\n"),
+					kernels[k].sName, 128 * (v + 1));
+				return FALSE;
+			}
+		}
+
+		// the counter wraps in the middle of the buffer
+		fillRandom(key, sizeof(key), 5);
+		expandAesKey(&aesKey, key, 32);
+		fillRandom(counterBlock, sizeof(counterBlock), 6);
+		memset(counterBlock + 12, 0xff, 3);
+		counterBlock[15] = 0xf0;
+		for (DWORD cbBuff = 0; cbBuff <= sizeof(actual); cbBuff += 41) {
+			fillRandom(expected, cbBuff, cbBuff);
+			memcpy(actual, expected, cbBuff);
+			kernels[0].kernel(&aesKey, expected, cbBuff, counterBlock);
+			kernels[k].kernel(&aesKey, actual, cbBuff, counterBlock);
+			if (memcmp(expected, actual, cbBuff) != 0) {
+				_tprintf(_T("aes-ctr: %s kernel differs from the %s one for %u bytes\n"),
+					kernels[k].sName, kernels[0].sName, cbBuff);
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * @return megabytes per second of the cipher over packets of cbPacket bytes, numbered as a client's.
+ */
+static double measureCipher(LPCipherContextT cipher, PBYTE buff, DWORD cbPacket, DWORD cbTotalMb)
+{
+	DWORD nrPackets = (DWORD)(((ULONGLONG)cbTotalMb << 20) / cbPacket) + 1;
+	double start = benchmarkSeconds();
+
+	for (DWORD i = 0; i < nrPackets; i++) {
+		encryptPacket(cipher, i, makeByteSpan(buff, cbPacket));
+	}
+	return (double)cbPacket * nrPackets / (benchmarkSeconds() - start) / 1e6;
+}
+
+static double measureAesKernel(LPAesCtrKernelInfoT kernel, const AesKeyT *aesKey, PBYTE buff, DWORD cbPacket, DWORD cbTotalMb)
+{
+	DWORD nrPackets = (DWORD)(((ULONGLONG)cbTotalMb << 20) / cbPacket) + 1;
+	BYTE counterBlock[AES_BLOCK_SIZE];
+	double start = benchmarkSeconds();
+
+	memset(counterBlock, 0, sizeof(counterBlock));
+	for (DWORD i = 0; i < nrPackets; i++) {
+		kernel->kernel(aesKey, buff, cbPacket, counterBlock);
+	}
+	return (double)cbPacket * nrPackets / (benchmarkSeconds() - start) / 1e6;
+}
+
+/*
+ * @return nanoseconds to create and destroy the context of a connection,
+ *     through the cache when there is one. A first context stays alive, as for a user with parallel streams.
+ */
+static double measureKeySetup(LPKeyCacheT cache, DWORD dwCipher, ByteSpanT key, const BYTE *nonce)
+{
+	LPCipherContextT first = (cache != NULL) ? acquireCipherContext(cache, _T("david"), dwCipher, key, nonce) : NULL;
+	double start = benchmarkSeconds();
+
+	for (DWORD i = 0; i < KEY_SETUP_ROUNDS; i++) {
+		LPCipherContextT cipher = (cache != NULL) ?
+			acquireCipherContext(cache, _T("david"), dwCipher, key, nonce) : createCipherContext(dwCipher, key, nonce);
+		destroyCipherContext(cipher);
+	}
+	double seconds = benchmarkSeconds() - start;
+
+	destroyCipherContext(first);
+	return seconds / KEY_SETUP_ROUNDS * 1e9;
+}
+
+INT cipherBenchmark(INT argc, PTCHAR argv[])
+{
+	DWORD cbTotalMb = 256;
+	DWORD cbXorKey = 16;
+	AesCtrKernelInfoT aesKernels[AES_MAX_KERNELS];
+	DWORD nrAesKernels;
+	AesKeyT aesKey;
+	LPKeyCacheT keyCache;
+	BYTE key[32];
+	BYTE nonce[CIPHER_NONCE_SIZE];
+	PBYTE buff;
+
+	for (INT i = 0; i < argc; i++) {
+		if (!parseNumberArgument(argv[i], _T("mb"), &cbTotalMb) ||
+			!parseNumberArgument(argv[i], _T("key"), &cbXorKey)) {
+			_tprintf(_T("invalid parameter: \"%s\"\n"), argv[i]);
+			return 1;
+		}
+	}
+
+	nrAesKernels = getSupportedAesCtrKernels(aesKernels, AES_MAX_KERNELS);
+	if (!verifyChaCha20() || !verifyAesKernels(aesKernels, nrAesKernels)) {
+		return 2;
+	}
+
+	buff = (PBYTE)malloc(packetSizes[NR_PACKET_SIZES - 1]);
+	if (buff == NULL || cbXorKey > MAX_KEY_SIZE) {
+		_tprintf(_T("Could not allocate memory!\n"));
+		return 6;
+	}
+	fillRandom(buff, packetSizes[NR_PACKET_SIZES - 1], 1);
+	fillRandom(key, sizeof(key), 2);
+	fillRandom(nonce, sizeof(nonce), 3);
+
+	_tprintf(_T("%u MB per measurement, MB/s for each packet size\n"), cbTotalMb);
+	_tprintf(_T("%-24s %10s %10s %10s\n"), _T("cipher"), _T("4 KB"), _T("64 KB"), _T("1 MB"));
+
+	for (DWORD dwCipher = 0; dwCipher < NR_CIPHERS; dwCipher++) {
+		DWORD cbKey = (dwCipher == CIPHER_XOR) ? cbXorKey : getCipherKeySize(dwCipher);
+		PBYTE pKey = (dwCipher == CIPHER_XOR) ? (PBYTE)malloc(cbKey) : key;
+		LPCipherContextT cipher;
+		TCHAR sName[64];
+
+		if (pKey == NULL) {
+			_tprintf(_T("Could not allocate memory!\n"));
+			return 6;
+		}
+		fillRandom(pKey, cbKey, 4);
+		cipher = createCipherContext(dwCipher, makeByteSpan(pKey, cbKey), nonce);
+		if (pKey != key) {
+			free(pKey);
+		}
+		if (cipher == NULL) {
+			_tprintf(_T("could not create the %s cipher\n"), getCipherName(dwCipher));
+			return 6;
+		}
+
+		_stprintf(sName, _T("%s (%s)"), getCipherName(dwCipher), getCipherKernelName(dwCipher));
+		_tprintf(_T("%-24s"), sName);
+		for (DWORD s = 0; s < NR_PACKET_SIZES; s++) {
+			_tprintf(_T(" %10.1f"), measureCipher(cipher, buff, packetSizes[s], cbTotalMb));
+		}
+		_tprintf(_T("\n"));
+		destroyCipherContext(cipher);
+	}
+
+	// every AES kernel the processor runs, the portable one is far slower, a tenth of the data is enough
+	expandAesKey(&aesKey, key, 16);
+	for (DWORD k = 0; k < nrAesKernels; k++) {
+		TCHAR sName[64];
+
+		_stprintf(sName, _T("aes128-ctr %s"), aesKernels[k].sName);
+		_tprintf(_T("%-24s"), sName);
+		for (DWORD s = 0; s < NR_PACKET_SIZES; s++) {
+			DWORD cbMb = (k == 0 && nrAesKernels > 1) ? cbTotalMb / 10 + 1 : cbTotalMb;
+			_tprintf(_T(" %10.1f"), measureAesKernel(&aesKernels[k], &aesKey, buff, packetSizes[s], cbMb));
+		}
+		_tprintf(_T("\n"));
+	}
+
+	keyCache = createKeyCache(1);
+	if (keyCache == NULL) {
+		_tprintf(_T("Could not allocate memory!\n"));
+		return 6;
+	}
+	_tprintf(_T("\n%-24s %10s %10s\n"), _T("key setup, ns"), _T("uncached"), _T("cached"));
+	for (DWORD dwCipher = 0; dwCipher < NR_CIPHERS; dwCipher++) {
+		DWORD cbKey = (dwCipher == CIPHER_XOR) ? 16 : getCipherKeySize(dwCipher);
+		ByteSpanT cipherKey = makeByteSpan(key, cbKey);
+
+		_tprintf(_T("%-24s %10.0f %10.0f\n"), getCipherName(dwCipher),
+			measureKeySetup(NULL, dwCipher, cipherKey, nonce), measureKeySetup(keyCache, dwCipher, cipherKey, nonce));
+	}
+
+	free(buff);
+	return 0;
+}
@@ -0,0 +1,169 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Benchmark.h"
+#include "../Project1/Compression.h"
+
+typedef enum CodecInputEnum {
+	INPUT_LOG, INPUT_RANDOM, INPUT_MIXED, NR_CODEC_INPUTS
+}CodecInputE;
+
+static LPCTSTR inputNames[NR_CODEC_INPUTS] = { _T("log"), _T("random"), _T("mixed") };
+
+static const char *logLevels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARNING", "ERROR" };
+
+static DWORD nextRandom(LPDWORD pdwSeed)
+{
+	*pdwSeed = *pdwSeed * 1103515245 + 12345;
+	return *pdwSeed >> 16;
+}
+
+/*
+ * Log lines alike but for their numbers, like the server's own log.
+ */
+static VOID fillLog(PBYTE buff, DWORD cbBuff, DWORD dwSeed)
+{
+	char sLine[160];
+	DWORD cbUsed = 0;
+	DWORD cbLine;
+
+	while (cbUsed < cbBuff) {
+		cbLine = (DWORD)sprintf(sLine, "[2017. 04. 24][12:%02u][+%u.%06u][%s][%u]: client %u sent packet %u of %u bytes\n",
+			nextRandom(&dwSeed) % 60, nextRandom(&dwSeed) % 1000, nextRandom(&dwSeed) % 1000000,
+			logLevels[nextRandom(&dwSeed) % (sizeof(logLevels) / sizeof(logLevels[0]))], nextRandom(&dwSeed) % 8,
+			nextRandom(&dwSeed) % 64, nextRandom(&dwSeed), nextRandom(&dwSeed) % 65536);
+		if (cbLine > cbBuff - cbUsed) {
+			cbLine = cbBuff - cbUsed;
+		}
+		memcpy(buff + cbUsed, sLine, cbLine);
+		cbUsed += cbLine;
+	}
+}
+
+static VOID fillRandom(PBYTE buff, DWORD cbBuff, DWORD dwSeed)
+{
+	for (DWORD i = 0; i < cbBuff; i++) {
+		buff[i] = (BYTE)nextRandom(&dwSeed);
+	}
+}
+
+/*
+ * Logs with a random stretch in the middle, e.g. an archive between two logs.
+ */
+static VOID fillInput(DWORD dwInput, PBYTE buff, DWORD cbBuff)
+{
+	if (dwInput == INPUT_LOG) {
+		fillLog(buff, cbBuff, 1);
+	} else if (dwInput == INPUT_RANDOM) {
+		fillRandom(buff, cbBuff, 2);
+	} else {
+		fillLog(buff, cbBuff, 3);
+		fillRandom(buff + cbBuff / 3, cbBuff / 3, 4);
+	}
+}
+
+/*
+ * Compresses the input packet by packet as the workers do, back off included, and decompresses it back.
+ *
+ * @return FALSE if a packet did not come back the same.
+ */
+static BOOL measureInput(DWORD dwInput, PBYTE input, DWORD cbInput, DWORD cbPacket, PBYTE records, PBYTE output)
+{
+	CodecStateT codec;
+	InitExT options;
+	DWORD nrPackets = (cbInput + cbPacket - 1) / cbPacket;
+	DWORD nrRaw = 0;
+	DWORD cbPlain;
+	DWORD cbStored;
+	ULONGLONG cbStoredTotal = 0;
+	PBYTE pRecord;
+	double start;
+	double dCompressSeconds;
+	double dExpandSeconds;
+
+	memset(&options, 0, sizeof(InitExT));
+	options.dwFlags = INIT_COMPRESS;
+	options.cbMaxPacket = cbPacket + PACKET_RECORD_HEADER_SIZE;
+	initCodecState(&codec, &options);
+
+	// every record keeps the room of a whole packet, as the packet buffers do
+	start = benchmarkSeconds();
+	for (DWORD i = 0; i < nrPackets; i++) {
+		pRecord = records + (SIZE_T)i * options.cbMaxPacket;
+		cbPlain = (cbInput - i * cbPacket < cbPacket) ? cbInput - i * cbPacket : cbPacket;
+		memcpy(pRecord + PACKET_RECORD_HEADER_SIZE, input + (SIZE_T)i * cbPacket, cbPlain);
+		cbStored = compressRecord(&codec, pRecord, cbPlain);
+		cbStoredTotal += PACKET_RECORD_HEADER_SIZE + cbStored;
+		nrRaw += cbStored == cbPlain;
+	}
+	dCompressSeconds = benchmarkSeconds() - start;
+
+	start = benchmarkSeconds();
+	for (DWORD i = 0; i < nrPackets; i++) {
+		pRecord = records + (SIZE_T)i * options.cbMaxPacket;
+		cbPlain = expandRecord(pRecord);
+		if (cbPlain == 0) {
+			_tprintf(_T("%s: packet %u could not be decompressed\n"), inputNames[dwInput], i);
+			return FALSE;
+		}
+		memcpy(output + (SIZE_T)i * cbPacket, pRecord, cbPlain);
+	}
+	dExpandSeconds = benchmarkSeconds() - start;
+
+	if (memcmp(input, output, cbInput) != 0) {
+		_tprintf(_T("%s: the decompressed input differs\n"), inputNames[dwInput]);
+		return FALSE;
+	}
+
+	_tprintf(_T("%8s %10.1f%% %10u %12.2f %12.2f\n"), inputNames[dwInput], 100.0 * cbStoredTotal / cbInput, nrRaw,
+		cbInput / dCompressSeconds / 1e9, cbInput / dExpandSeconds / 1e9);
+	return TRUE;
+}
+
+INT codecBenchmark(INT argc, PTCHAR argv[])
+{
+	DWORD cbPacket = 65536;
+	DWORD cbTotalMb = 64;
+	DWORD cbInput;
+	DWORD nrPackets;
+	PBYTE input;
+	PBYTE records;
+	PBYTE output;
+	INT exitCode = 0;
+
+	for (INT i = 0; i < argc; i++) {
+		if (!parseNumberArgument(argv[i], _T("size"), &cbPacket) ||
+			!parseNumberArgument(argv[i], _T("mb"), &cbTotalMb)) {
+			_tprintf(_T("invalid parameter: \"%s\"\n"), argv[i]);
+			return 1;
+		}
+	}
+	if (cbPacket > MAX_LARGE_PACKET_SIZE - PACKET_RECORD_HEADER_SIZE || cbTotalMb > 1024) {
+		_tprintf(_T("at most %u byte packets and 1024 MB\n"), (DWORD)(MAX_LARGE_PACKET_SIZE - PACKET_RECORD_HEADER_SIZE));
+		return 1;
+	}
+
+	cbInput = cbTotalMb << 20;
+	nrPackets = (cbInput + cbPacket - 1) / cbPacket;
+	input = (PBYTE)malloc(cbInput);
+	output = (PBYTE)malloc(cbInput);
+	records = (PBYTE)malloc((SIZE_T)nrPackets * (cbPacket + PACKET_RECORD_HEADER_SIZE));
+	if (input == NULL || output == NULL || records == NULL) {
+		_tprintf(_T("Could not allocate memory!\n"));
+		return 6;
+	}
+
+	_tprintf(_T("%u byte packets, %u MB per input, one thread\n"), cbPacket, cbTotalMb);
+	_tprintf(_T("%8s %11s %10s %12s %12s\n"), _T("input"), _T("stored"), _T("raw"), _T("comp GB/s"), _T("decomp GB/s"));
+	for (DWORD i = 0; i < NR_CODEC_INPUTS && exitCode == 0; i++) {
+		fillInput(i, input, cbInput);
+		if (!measureInput(i, input, cbInput, cbPacket, records, output)) {
+			exitCode = 2;
+		}
+	}
+
+	releaseCodecScratch();
+	free(input);
+	free(output);
+	free(records);
+	return exitCode;
+}
@@ -0,0 +1,137 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Benchmark.h"
+#include "../Project1/CipherEngine.h"
+#include "../Project1/PacketPool.h"
+
+/*
+ * Property test of the server data path: random binary blobs are encrypted with random binary keys
+ * in pooled packets, as the workers do, and must decrypt back to themselves.
+ * Blobs and keys are rich in NUL bytes, which used to truncate keys.
+ * The rounds go through the ciphers in turn, with random nonces and packet numbers.
+ */
+
+static DWORD nextRandom(LPDWORD pdwSeed)
+{
+	*pdwSeed = *pdwSeed * 1103515245 + 12345;
+	return *pdwSeed >> 8;
+}
+
+/*
+ * Random bytes, about a quarter of them NUL.
+ */
+static VOID fillBinary(ByteSpanT span, LPDWORD pdwSeed)
+{
+	for (DWORD i = 0; i < span.cbData; i++) {
+		DWORD dwRandom = nextRandom(pdwSeed);
+		span.pData[i] = (dwRandom & 3) == 0 ? 0 : (BYTE)(dwRandom >> 2);
+	}
+}
+
+/*
+ * Encrypts and decrypts one blob in a pooled packet.
+ *
+ * @return FALSE if the XOR ciphertext differs from the per byte definition,
+ *     if a stream cipher leaves 16 bytes or more as they were, or if the blob does not come back.
+ */
+static BOOL roundTrip(LPPacketPoolT pool, ByteSpanT blob, ByteSpanT key, DWORD dwCipher, LPCipherContextT cipher, ULONGLONG qwSequence)
+{
+	BOOL bSuccess = TRUE;
+	LPEncryptDataT packet = acquirePacket(pool, NULL, blob.cbData, cipher, NULL, NULL);
+
+	if (packet == NULL) {
+		_tprintf(_T("Could not allocate a packet of %u bytes\n"), blob.cbData);
+		return FALSE;
+	}
+	memcpy(packet->payload.pData, blob.pData, blob.cbData);
+	packet->payload.cbData = blob.cbData;
+	packet->qwSequence = qwSequence;
+
+	encryptPacket(packet->cipher, packet->qwSequence, packet->payload);
+	if (dwCipher == CIPHER_XOR) {
+		for (DWORD i = 0; i < blob.cbData && bSuccess; i++) {
+			bSuccess = packet->payload.pData[i] == (BYTE)(blob.pData[i] ^ key.pData[i % key.cbData]);
+		}
+	} else if (blob.cbData >= 16) {
+		bSuccess = memcmp(packet->payload.pData, blob.pData, blob.cbData) != 0;
+	}
+
+	encryptPacket(packet->cipher, packet->qwSequence, packet->payload);
+	bSuccess = bSuccess && memcmp(packet->payload.pData, blob.pData, blob.cbData) == 0;
+
+	releasePacket(packet);
+	return bSuccess;
+}
+
+INT fuzzBenchmark(INT argc, PTCHAR argv[])
+{
+	DWORD nrRounds = 10000;
+	DWORD cbMaxBlob = 300000;
+	DWORD cbMaxKey = MAX_KEY_SIZE;
+	DWORD dwSeed = 1;
+	ULONGLONG cbTotal = 0;
+	LPPacketPoolT pool;
+	ByteSpanT blob;
+	ByteSpanT key;
+	BYTE nonce[CIPHER_NONCE_SIZE];
+
+	for (INT i = 0; i < argc; i++) {
+		if (!parseNumberArgument(argv[i], _T("rounds"), &nrRounds) ||
+			!parseNumberArgument(argv[i], _T("size"), &cbMaxBlob) ||
+			!parseNumberArgument(argv[i], _T("key"), &cbMaxKey) ||
+			!parseNumberArgument(argv[i], _T("seed"), &dwSeed)) {
+			_tprintf(_T("invalid parameter: \"%s\"\n"), argv[i]);
+			return 1;
+		}
+	}
+	if (cbMaxBlob > PACKET_MAX_PAYLOAD) {
+		cbMaxBlob = PACKET_MAX_PAYLOAD;
+	}
+
+	pool = createPacketPool();
+	blob = makeByteSpan(malloc(cbMaxBlob), 0);
+	// the stream ciphers take 32 byte keys whatever the bound of the xor keys
+	key = makeByteSpan(malloc((cbMaxKey < 32) ? 32 : cbMaxKey), 0);
+	if (pool == NULL || blob.pData == NULL || key.pData == NULL) {
+		_tprintf(_T("Could not allocate memory!\n"));
+		return 6;
+	}
+
+	_tprintf(_T("%u rounds, blobs of up to %u bytes, xor keys of up to %u bytes, seed %u\n"),
+		nrRounds, cbMaxBlob, cbMaxKey, dwSeed);
+
+	double start = benchmarkSeconds();
+	for (DWORD i = 0; i < nrRounds; i++) {
+		// short keys and blobs are the interesting ones, pick the bound first to get many of them
+		blob.cbData = nextRandom(&dwSeed) % (nextRandom(&dwSeed) % cbMaxBlob + 1);
+		key.cbData = nextRandom(&dwSeed) % (nextRandom(&dwSeed) % cbMaxKey + 1) + 1;
+		DWORD dwCipher = i % NR_CIPHERS;
+		if (getCipherKeySize(dwCipher) != 0) {
+			key.cbData = getCipherKeySize(dwCipher);
+		}
+		fillBinary(blob, &dwSeed);
+		fillBinary(key, &dwSeed);
+		fillBinary(makeByteSpan(nonce, CIPHER_NONCE_SIZE), &dwSeed);
+		ULONGLONG qwSequence = ((ULONGLONG)nextRandom(&dwSeed) << 24) ^ nextRandom(&dwSeed);
+
+		LPCipherContextT cipher = createCipherContext(dwCipher, key, nonce);
+		if (cipher == NULL) {
+			_tprintf(_T("round %u: could not create the %s cipher\n"), i, getCipherName(dwCipher));
+			return 6;
+		}
+		if (!roundTrip(pool, blob, key, dwCipher, cipher, qwSequence)) {
+			_tprintf(_T("round %u failed: %s, %u byte blob, %u byte key, packet %llu\n"),
+				i, getCipherName(dwCipher), blob.cbData, key.cbData, qwSequence);
+			return 2;
+		}
+		destroyCipherContext(cipher);
+		cbTotal += blob.cbData;
+	}
+	double seconds = benchmarkSeconds() - start;
+
+	_tprintf(_T("all rounds passed, %.1f MB in %.2f s\n"), (double)cbTotal / 1e6, seconds);
+
+	free(blob.pData);
+	free(key.pData);
+	return 0;
+}
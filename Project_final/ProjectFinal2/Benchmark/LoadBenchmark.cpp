@@ -0,0 +1,630 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Benchmark.h"
+#include "../Project1/CommunicationProtocol.h"
+
+/*
+ * End to end load of a running server: clients=<n> simulated clients encrypt jobs=<n> files each,
+ * one connection per file, speaking the protocol as Client.cpp does. The files are size= random bytes
+ * held in memory, so the disk is not measured. The connections are opened at rate= per second
+ * in total, as fast as the clients finish without it.
+ *
+ * Measured: the payload throughput, the latency of every packet from its send to the arrival
+ * of its encrypted copy, the connection setup time (connect, initialization, login and key),
+ * and the CPU seconds spent per GB by the load generator and, given server_pid=, by the server.
+ * A connection the server turns away, with more clients than its nr_clients connected at once,
+ * is counted as rejected apart from the failed jobs and measures nothing.
+ * With json= a line of JSON is appended to the file for every run, label= tags the variant measured.
+ */
+
+#define MAX_LOAD_CLIENTS 1024
+
+typedef struct LoadConfigTag {
+	LPCTSTR sServerAddress;
+	LPCTSTR sUserName;
+	LPCTSTR sPassword;
+	LPCTSTR sLabel;
+	LPCTSTR sJsonPath;
+	DWORD nrClients;
+	DWORD nrJobs;
+	DWORD cbFile;
+	DWORD cbPacket;
+	DWORD nrWindow;
+	DWORD cbKey;
+	DWORD dwCipher;
+	// connections opened per second by all clients together, 0 for no limit
+	DWORD nrConnectRate;
+	DWORD dwServerPid;
+}LoadConfigT, *LPLoadConfigT;
+
+typedef struct LoadClientTag {
+	LPLoadConfigT config;
+	PBYTE pFile;
+	PBYTE pKey;
+	double start;
+	volatile LONG *pnrTickets;
+
+	// the job running: its connection, the packet size granted and the send time of every packet
+	LPConnectionT connection;
+	DWORD cbMaxPacket;
+	DWORD nrPackets;
+	// room of sendTimes, and of latencies per job
+	DWORD nrMaxPackets;
+	double *sendTimes;
+	PBYTE buffer;
+	ULONGLONG cbReceived;
+	BOOL bReceived;
+
+	// packet latencies and setup times of the finished jobs, in seconds
+	double *latencies;
+	DWORD nrLatencies;
+	double *setupTimes;
+	DWORD nrSetupTimes;
+	ULONGLONG cbEncrypted;
+	DWORD nrFailed;
+	// jobs whose connection the server answered with CONNECTION_REJECTED, set by openLoadConnection
+	DWORD nrRejected;
+	BOOL bRejected;
+}LoadClientT, *LPLoadClientT;
+
+typedef struct LoadSummaryTag {
+	double mean;
+	double p50;
+	double p99;
+	double p999;
+	double max;
+}LoadSummaryT, *LPLoadSummaryT;
+
+/*
+ * Random bytes that are the same on every run, for files and keys.
+ */
+static VOID fillRandom(PBYTE buff, DWORD cbBuff, DWORD dwSeed)
+{
+	for (DWORD i = 0; i < cbBuff; i++) {
+		dwSeed = dwSeed * 1103515245 + 12345;
+		buff[i] = (BYTE)(dwSeed >> 16);
+	}
+}
+
+static INT compareSeconds(const void *a, const void *b)
+{
+	double first = *(const double*)a;
+	double second = *(const double*)b;
+
+	return (first < second) ? -1 : (first > second) ? 1 : 0;
+}
+
+/*
+ * Sorts the values and takes the nearest rank percentiles.
+ */
+static VOID summarize(double *values, DWORD nrValues, LPLoadSummaryT summary)
+{
+	double sum = 0;
+
+	memset(summary, 0, sizeof(LoadSummaryT));
+	if (nrValues == 0) {
+		return;
+	}
+	qsort(values, nrValues, sizeof(double), compareSeconds);
+	for (DWORD i = 0; i < nrValues; i++) {
+		sum += values[i];
+	}
+	summary->mean = sum / nrValues;
+	summary->p50 = values[(DWORD)(0.5 * (nrValues - 1))];
+	summary->p99 = values[(DWORD)(0.99 * (nrValues - 1))];
+	summary->p999 = values[(DWORD)(0.999 * (nrValues - 1))];
+	summary->max = values[nrValues - 1];
+}
+
+/*
+ * @return the kernel and user time of the process in seconds, negative if it cannot be read.
+ */
+static double getProcessSeconds(HANDLE hProcess)
+{
+	FILETIME creationTime;
+	FILETIME exitTime;
+	FILETIME kernelTime;
+	FILETIME userTime;
+
+	if (hProcess == NULL || !GetProcessTimes(hProcess, &creationTime, &exitTime, &kernelTime, &userTime)) {
+		return -1;
+	}
+	return ((((ULONGLONG)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime) +
+		(((ULONGLONG)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime)) / 1e7;
+}
+
+/*
+ * Initializes the connection and logs in, as Client.cpp does.
+ * The packet size granted by the server is kept in the client, and bRejected is set if it turned the connection away.
+ */
+static BOOL openLoadConnection(LPLoadClientT client, ULONGLONG qwJob)
+{
+	LPLoadConfigT config = client->config;
+	LPConnectionT connection = client->connection;
+	BOOL bWindow = config->nrWindow > 0 && connection->kind != TRANSPORT_PIPE;
+	InitT initMessage;
+	InitExT options;
+	CipherInitT cipherInit;
+	DWORD dwResponse = CONNECTION_REJECTED;
+	BOOL bSuccess;
+
+	client->bRejected = FALSE;
+	initMessage.command = (bWindow || config->dwCipher != CIPHER_XOR) ? INITIALIZE_CONNECTION_EX : INITIALIZE_CONNECTION;
+	initMessage.cbUsernameNrBytes = _tcslen(config->sUserName) * sizeof(TCHAR);
+	initMessage.cbPasswordNrBytes = _tcslen(config->sPassword) * sizeof(TCHAR);
+	initMessage.cbKeyNrBytes = config->cbKey;
+
+	memset(&options, 0, sizeof(InitExT));
+	options.dwVersion = PROTOCOL_VERSION;
+	options.dwFlags = bWindow ? INIT_PIPELINED | INIT_BATCHED : 0;
+	options.nrWindow = bWindow ? config->nrWindow : 0;
+	options.cbMaxPacket = config->cbPacket;
+
+	// every job of a run gets its own nonce
+	memset(&cipherInit, 0, sizeof(CipherInitT));
+	if (config->dwCipher != CIPHER_XOR) {
+		options.dwFlags |= INIT_CIPHER;
+		cipherInit.dwCipher = config->dwCipher;
+		memcpy(cipherInit.nonce, &qwJob, sizeof(qwJob));
+	}
+
+	bSuccess = transportWrite(connection, &initMessage, sizeof(InitT));
+	if (bSuccess && initMessage.command == INITIALIZE_CONNECTION_EX) {
+		bSuccess = transportWrite(connection, &options, sizeof(InitExT));
+	}
+	if (bSuccess && (options.dwFlags & INIT_CIPHER)) {
+		bSuccess = transportWrite(connection, &cipherInit, sizeof(CipherInitT));
+	}
+	if (!bSuccess || !transportRead(connection, &dwResponse, sizeof(DWORD))) {
+		return FALSE;
+	}
+	if (dwResponse != CONNECTION_ACCEPTED) {
+		// the server has nr_clients clients already, or refused the options
+		client->bRejected = TRUE;
+		return FALSE;
+	}
+
+	if (initMessage.command == INITIALIZE_CONNECTION_EX) {
+		if (!transportRead(connection, &options, sizeof(InitExT)) ||
+			(config->dwCipher != CIPHER_XOR && !(options.dwFlags & INIT_CIPHER))) {
+			return FALSE;
+		}
+		client->cbMaxPacket = options.cbMaxPacket;
+	} else {
+		client->cbMaxPacket = MAX_PACKET_SIZE;
+	}
+
+	dwResponse = AUTH_REJECTED;
+	if (!transportWrite(connection, config->sUserName, initMessage.cbUsernameNrBytes) ||
+		!transportWrite(connection, config->sPassword, initMessage.cbPasswordNrBytes) ||
+		!transportRead(connection, &dwResponse, sizeof(DWORD)) || dwResponse != AUTH_SUCCESSFUL) {
+		return FALSE;
+	}
+	return transportWrite(connection, client->pKey, config->cbKey);
+}
+
+/*
+ * Receives the encrypted packets of the job, each one closes the latency of the packet sent with its number.
+ */
+static DWORD WINAPI loadReceiverThread(LPVOID arg)
+{
+	LPLoadClientT client = (LPLoadClientT)arg;
+	PacketReaderT reader;
+	DWORD cbPacket;
+	DWORD nrPackets = 0;
+
+	client->bReceived = FALSE;
+	initPacketReader(&reader, client->connection, client->cbMaxPacket);
+	while (readPacketHeader(&reader, &cbPacket)) {
+		if (cbPacket == 0) {
+			client->bReceived = nrPackets == client->nrPackets;
+			break;
+		}
+		if (nrPackets == client->nrPackets || !transportRead(client->connection, client->buffer, cbPacket)) {
+			break;
+		}
+		client->latencies[client->nrLatencies + nrPackets] = benchmarkSeconds() - client->sendTimes[nrPackets];
+		client->cbReceived += cbPacket;
+		nrPackets++;
+	}
+	return 0;
+}
+
+/*
+ * Sends the file in packets of the size granted, receiving the encrypted ones on another thread
+ * when pipelined, and ends the stream as Client.cpp does.
+ */
+static BOOL runLoadJob(LPLoadClientT client)
+{
+	LPLoadConfigT config = client->config;
+	BOOL bPipelined = config->nrWindow > 0 && client->connection->kind != TRANSPORT_PIPE;
+	HANDLE hReceiver = NULL;
+	DWORD cbSent = 0;
+	BOOL bSuccess = TRUE;
+
+	client->nrPackets = (config->cbFile + client->cbMaxPacket - 1) / client->cbMaxPacket;
+	if (client->nrPackets > client->nrMaxPackets) {
+		return FALSE;
+	}
+	client->cbReceived = 0;
+	client->bReceived = FALSE;
+
+	if (bPipelined) {
+		hReceiver = (HANDLE)_beginthreadex(NULL, 0, (_beginthreadex_proc_type)loadReceiverThread, client, 0, NULL);
+		if (hReceiver == NULL) {
+			_tprintf(_T("could not create receiver thread\n"));
+			return FALSE;
+		}
+	}
+
+	for (DWORD i = 0; bSuccess && i < client->nrPackets; i++) {
+		DWORD cbPacket = (config->cbFile - cbSent < client->cbMaxPacket) ? config->cbFile - cbSent : client->cbMaxPacket;
+
+		client->sendTimes[i] = benchmarkSeconds();
+		bSuccess = sendPacket(client->connection, (PTCHAR)(client->pFile + cbSent), cbPacket);
+		cbSent += cbPacket;
+	}
+	bSuccess = sendCommand(client->connection, bSuccess ? LAST_PACKET : TERMINATE_CONNECTION) && bSuccess;
+
+	if (hReceiver != NULL) {
+		WaitForSingleObject(hReceiver, INFINITE);
+		CloseHandle(hReceiver);
+	} else if (bSuccess) {
+		loadReceiverThread(client);
+	}
+	if (!bSuccess || !client->bReceived || client->cbReceived != config->cbFile) {
+		return FALSE;
+	}
+
+	sendCommand(client->connection, LAST_PACKET);
+	client->nrLatencies += client->nrPackets;
+	client->cbEncrypted += config->cbFile;
+	return TRUE;
+}
+
+/*
+ * Waits for the start time of the next connection of all clients, when the rate is limited.
+ *
+ * @return the number of the connection.
+ */
+static ULONGLONG waitForTicket(LPLoadClientT client)
+{
+	ULONGLONG qwTicket = (ULONGLONG)(InterlockedIncrement(client->pnrTickets) - 1);
+	double wait;
+
+	if (client->config->nrConnectRate != 0) {
+		wait = client->start + (double)qwTicket / client->config->nrConnectRate - benchmarkSeconds();
+		if (wait > 0) {
+			Sleep((DWORD)(wait * 1000));
+		}
+	}
+	return qwTicket;
+}
+
+static DWORD WINAPI loadClientThread(LPVOID arg)
+{
+	LPLoadClientT client = (LPLoadClientT)arg;
+	LPLoadConfigT config = client->config;
+
+	for (DWORD i = 0; i < config->nrJobs; i++) {
+		ULONGLONG qwTicket = waitForTicket(client);
+		double start = benchmarkSeconds();
+
+		client->connection = connectTransport(config->sServerAddress);
+		if (client->connection == NULL) {
+			client->nrFailed++;
+			continue;
+		}
+		if (!openLoadConnection(client, qwTicket)) {
+			if (client->bRejected) {
+				client->nrRejected++;
+			} else {
+				client->nrFailed++;
+			}
+			closeConnection(client->connection);
+			continue;
+		}
+		client->setupTimes[client->nrSetupTimes++] = benchmarkSeconds() - start;
+
+		if (!runLoadJob(client)) {
+			client->nrFailed++;
+		}
+		closeConnection(client->connection);
+	}
+	return 0;
+}
+
+static BOOL parseCipherArgument(PTCHAR arg, LPDWORD pdwCipher)
+{
+	if (_tcsncmp(arg, _T("cipher="), 7) != 0) {
+		return TRUE;
+	}
+	for (DWORD dwCipher = 0; dwCipher < NR_CIPHERS; dwCipher++) {
+		if (_tcscmp(arg + 7, getCipherName(dwCipher)) == 0) {
+			*pdwCipher = dwCipher;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static VOID parseStringArgument(PTCHAR arg, LPCTSTR sName, LPCTSTR *psValue)
+{
+	size_t cchName = _tcslen(sName);
+
+	if (_tcsncmp(arg, sName, cchName) == 0 && arg[cchName] == '=') {
+		*psValue = arg + cchName + 1;
+	}
+}
+
+/*
+ * The address the server published in pipe.txt, as the client reads it.
+ */
+static PTCHAR readServerAddress()
+{
+	static TCHAR sAddress[1024];
+	FILE *file = _tfopen(_T("pipe.txt"), _T("r"));
+
+	if (file == NULL) {
+		return NULL;
+	}
+	if (_fgetts(sAddress, 1024, file) == NULL) {
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	return sAddress;
+}
+
+/*
+ * Appends a string with the characters JSON needs escaped.
+ */
+static VOID writeJsonString(FILE *file, LPCTSTR sValue)
+{
+	_ftprintf(file, _T("\""));
+	for (LPCTSTR p = sValue; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\') {
+			_ftprintf(file, _T("\\%c"), *p);
+		} else if ((unsigned)*p < 0x20) {
+			_ftprintf(file, _T("\\u%04x"), (unsigned)*p);
+		} else {
+			_ftprintf(file, _T("%c"), *p);
+		}
+	}
+	_ftprintf(file, _T("\""));
+}
+
+static VOID writeJsonSummary(FILE *file, LPCTSTR sName, LPLoadSummaryT summary)
+{
+	_ftprintf(file, _T("\"%s\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}"), sName,
+		summary->mean * 1e6, summary->p50 * 1e6, summary->p99 * 1e6, summary->p999 * 1e6, summary->max * 1e6);
+}
+
+INT loadBenchmark(INT argc, PTCHAR argv[])
+{
+	LoadConfigT config;
+	LPLoadClientT clients;
+	LPHANDLE threads;
+	PBYTE pFile;
+	BYTE key[MAX_KEY_SIZE];
+	volatile LONG nrTickets = 0;
+	HANDLE hServer = NULL;
+	double clientCpu;
+	double serverCpu;
+	double start;
+	double elapsed;
+	double *latencies;
+	double *setupTimes;
+	DWORD nrLatencies = 0;
+	DWORD nrSetupTimes = 0;
+	DWORD nrFailed = 0;
+	DWORD nrRejected = 0;
+	DWORD nrFiles;
+	ULONGLONG cbEncrypted = 0;
+	DWORD nrMaxPackets;
+	LoadSummaryT latency;
+	LoadSummaryT setup;
+	double gigabytes;
+
+	memset(&config, 0, sizeof(LoadConfigT));
+	config.sUserName = _T("david");
+	config.sPassword = _T("defaultpassword");
+	config.sLabel = _T("");
+	config.nrClients = 8;
+	config.nrJobs = 4;
+	config.cbFile = 1024 * 1024;
+	config.cbPacket = 65536;
+	config.nrWindow = 64;
+	config.cbKey = 16;
+	config.dwCipher = CIPHER_XOR;
+
+	for (INT i = 0; i < argc; i++) {
+		if (_tcscmp(argv[i], _T("window=0")) == 0) {
+			config.nrWindow = 0;
+			continue;
+		}
+		parseStringArgument(argv[i], _T("server"), &config.sServerAddress);
+		parseStringArgument(argv[i], _T("user"), &config.sUserName);
+		parseStringArgument(argv[i], _T("pass"), &config.sPassword);
+		parseStringArgument(argv[i], _T("label"), &config.sLabel);
+		parseStringArgument(argv[i], _T("json"), &config.sJsonPath);
+		if (!parseNumberArgument(argv[i], _T("clients"), &config.nrClients) ||
+			!parseNumberArgument(argv[i], _T("jobs"), &config.nrJobs) ||
+			!parseNumberArgument(argv[i], _T("size"), &config.cbFile) ||
+			!parseNumberArgument(argv[i], _T("packet"), &config.cbPacket) ||
+			!parseNumberArgument(argv[i], _T("window"), &config.nrWindow) ||
+			!parseNumberArgument(argv[i], _T("key"), &config.cbKey) ||
+			!parseNumberArgument(argv[i], _T("rate"), &config.nrConnectRate) ||
+			!parseNumberArgument(argv[i], _T("server_pid"), &config.dwServerPid) ||
+			!parseCipherArgument(argv[i], &config.dwCipher) ||
+			config.nrClients > MAX_LOAD_CLIENTS || config.cbKey > MAX_KEY_SIZE ||
+			config.cbPacket > MAX_LARGE_PACKET_SIZE) {
+			_tprintf(_T("invalid parameter: \"%s\"\n"), argv[i]);
+			return 1;
+		}
+	}
+
+	if (getCipherKeySize(config.dwCipher) != 0) {
+		config.cbKey = getCipherKeySize(config.dwCipher);
+	}
+	if (config.sServerAddress == NULL) {
+		config.sServerAddress = readServerAddress();
+		if (config.sServerAddress == NULL) {
+			_tprintf(_T("could not read the server address from pipe.txt, give it with server=\n"));
+			return 1;
+		}
+	}
+	if (config.dwServerPid != 0) {
+		hServer = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, config.dwServerPid);
+		if (hServer == NULL) {
+			_tprintf(_T("could not open the server process %u\n"), config.dwServerPid);
+			return 1;
+		}
+	}
+
+	// the server grants the packet size asked for, or its own limit, which is MAX_PACKET_SIZE at least
+	nrMaxPackets = (config.cbPacket < MAX_PACKET_SIZE) ? config.cbPacket : MAX_PACKET_SIZE;
+	nrMaxPackets = (config.cbFile + nrMaxPackets - 1) / nrMaxPackets;
+	pFile = (PBYTE)malloc(config.cbFile);
+	clients = (LPLoadClientT)calloc(config.nrClients, sizeof(LoadClientT));
+	threads = (LPHANDLE)calloc(config.nrClients, sizeof(HANDLE));
+	if (pFile == NULL || clients == NULL || threads == NULL) {
+		_tprintf(_T("Could not allocate memory!\n"));
+		return 6;
+	}
+	fillRandom(pFile, config.cbFile, 1);
+	fillRandom(key, config.cbKey, 2);
+
+	for (DWORD i = 0; i < config.nrClients; i++) {
+		clients[i].config = &config;
+		clients[i].pFile = pFile;
+		clients[i].pKey = key;
+		clients[i].pnrTickets = &nrTickets;
+		clients[i].nrMaxPackets = nrMaxPackets;
+		clients[i].sendTimes = (double*)malloc(nrMaxPackets * sizeof(double));
+		clients[i].buffer = (PBYTE)malloc(MAX_LARGE_PACKET_SIZE);
+		clients[i].latencies = (double*)malloc((SIZE_T)config.nrJobs * nrMaxPackets * sizeof(double));
+		clients[i].setupTimes = (double*)malloc(config.nrJobs * sizeof(double));
+		if (clients[i].sendTimes == NULL || clients[i].buffer == NULL || clients[i].latencies == NULL ||
+			clients[i].setupTimes == NULL) {
+			_tprintf(_T("Could not allocate memory!\n"));
+			return 6;
+		}
+	}
+
+	_tprintf(_T("%s: %u clients x %u files of %u bytes, %u byte packets, window %u, %s with a %u byte key, "),
+		config.sServerAddress, config.nrClients, config.nrJobs, config.cbFile, config.cbPacket, config.nrWindow,
+		getCipherName(config.dwCipher), config.cbKey);
+	if (config.nrConnectRate != 0) {
+		_tprintf(_T("%u connections/s\n"), config.nrConnectRate);
+	} else {
+		_tprintf(_T("unlimited connection rate\n"));
+	}
+
+	clientCpu = getProcessSeconds(GetCurrentProcess());
+	serverCpu = getProcessSeconds(hServer);
+	start = benchmarkSeconds();
+	for (DWORD i = 0; i < config.nrClients; i++) {
+		clients[i].start = start;
+		threads[i] = (HANDLE)_beginthreadex(NULL, 0, (_beginthreadex_proc_type)loadClientThread, &clients[i], 0, NULL);
+		if (threads[i] == NULL) {
+			_tprintf(_T("could not create benchmark threads!\n"));
+			exit(5);
+		}
+	}
+	for (DWORD i = 0; i < config.nrClients; i++) {
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+	elapsed = benchmarkSeconds() - start;
+	clientCpu = getProcessSeconds(GetCurrentProcess()) - clientCpu;
+	if (hServer != NULL) {
+		double serverCpuEnd = getProcessSeconds(hServer);
+		serverCpu = (serverCpu >= 0 && serverCpuEnd >= 0) ? serverCpuEnd - serverCpu : -1;
+		CloseHandle(hServer);
+	}
+
+	// the samples of all clients are merged in the arrays of the first one
+	for (DWORD i = 0; i < config.nrClients; i++) {
+		nrLatencies += clients[i].nrLatencies;
+		nrSetupTimes += clients[i].nrSetupTimes;
+		nrFailed += clients[i].nrFailed;
+		nrRejected += clients[i].nrRejected;
+		cbEncrypted += clients[i].cbEncrypted;
+	}
+	latencies = (double*)malloc((nrLatencies + 1) * sizeof(double));
+	setupTimes = (double*)malloc((nrSetupTimes + 1) * sizeof(double));
+	if (latencies == NULL || setupTimes == NULL) {
+		_tprintf(_T("Could not allocate memory!\n"));
+		return 6;
+	}
+	nrLatencies = 0;
+	nrSetupTimes = 0;
+	for (DWORD i = 0; i < config.nrClients; i++) {
+		memcpy(latencies + nrLatencies, clients[i].latencies, clients[i].nrLatencies * sizeof(double));
+		memcpy(setupTimes + nrSetupTimes, clients[i].setupTimes, clients[i].nrSetupTimes * sizeof(double));
+		nrLatencies += clients[i].nrLatencies;
+		nrSetupTimes += clients[i].nrSetupTimes;
+	}
+	summarize(latencies, nrLatencies, &latency);
+	summarize(setupTimes, nrSetupTimes, &setup);
+	gigabytes = cbEncrypted / (1024.0 * 1024.0 * 1024.0);
+	nrFiles = config.nrClients * config.nrJobs - nrFailed - nrRejected;
+
+	_tprintf(_T("%u files encrypted, %u failed, %u rejected by a busy server in %.3f s: %.2f MB/s, %.1f files/s\n"),
+		nrFiles, nrFailed, nrRejected, elapsed, cbEncrypted / elapsed / (1024 * 1024), nrFiles / elapsed);
+	if (nrRejected != 0) {
+		_tprintf(_T("the server was full, a client holds its slot until its connection is closed: start it with nr_clients above %u to measure every job\n"), config.nrClients);
+	}
+	_tprintf(_T("%-18s %10s %10s %10s %10s %10s\n"), _T("microseconds"), _T("mean"), _T("p50"), _T("p99"), _T("p99.9"), _T("max"));
+	_tprintf(_T("%-18s %10.1f %10.1f %10.1f %10.1f %10.1f\n"), _T("packet latency"),
+		latency.mean * 1e6, latency.p50 * 1e6, latency.p99 * 1e6, latency.p999 * 1e6, latency.max * 1e6);
+	_tprintf(_T("%-18s %10.1f %10.1f %10.1f %10.1f %10.1f\n"), _T("connection setup"),
+		setup.mean * 1e6, setup.p50 * 1e6, setup.p99 * 1e6, setup.p999 * 1e6, setup.max * 1e6);
+	_tprintf(_T("cpu: load generator %.3f s, %.2f s/GB"), clientCpu, (gigabytes > 0) ? clientCpu / gigabytes : 0);
+	if (hServer != NULL && serverCpu >= 0) {
+		_tprintf(_T("; server %.3f s, %.2f s/GB"), serverCpu, (gigabytes > 0) ? serverCpu / gigabytes : 0);
+	}
+	_tprintf(_T("\n"));
+
+	if (config.sJsonPath != NULL) {
+		FILE *file = _tfopen(config.sJsonPath, _T("a"));
+		if (file == NULL) {
+			_tprintf(_T("could not open %s\n"), config.sJsonPath);
+			return 1;
+		}
+		_ftprintf(file, _T("{\"benchmark\":\"load\",\"label\":"));
+		writeJsonString(file, config.sLabel);
+		_ftprintf(file, _T(",\"server\":"));
+		writeJsonString(file, config.sServerAddress);
+		_ftprintf(file, _T(",\"clients\":%u,\"jobs\":%u,\"size\":%u,\"packet\":%u,\"window\":%u,\"cipher\":\"%s\",\"key\":%u,\"rate\":%u,"),
+			config.nrClients, config.nrJobs, config.cbFile, config.cbPacket, config.nrWindow,
+			getCipherName(config.dwCipher), config.cbKey, config.nrConnectRate);
+		_ftprintf(file, _T("\"files\":%u,\"failed\":%u,\"rejected\":%u,\"seconds\":%.6f,\"bytes\":%llu,\"mb_per_s\":%.3f,\"files_per_s\":%.3f,"),
+			nrFiles, nrFailed, nrRejected, elapsed, cbEncrypted, cbEncrypted / elapsed / (1024 * 1024), nrFiles / elapsed);
+		writeJsonSummary(file, _T("latency_us"), &latency);
+		_ftprintf(file, _T(","));
+		writeJsonSummary(file, _T("setup_us"), &setup);
+		_ftprintf(file, _T(",\"client_cpu_s\":%.3f,\"client_cpu_s_per_gb\":%.3f"), clientCpu,
+			(gigabytes > 0) ? clientCpu / gigabytes : 0);
+		if (hServer != NULL && serverCpu >= 0) {
+			_ftprintf(file, _T(",\"server_cpu_s\":%.3f,\"server_cpu_s_per_gb\":%.3f"), serverCpu,
+				(gigabytes > 0) ? serverCpu / gigabytes : 0);
+		}
+		_ftprintf(file, _T("}\n"));
+		fclose(file);
+	}
+
+	for (DWORD i = 0; i < config.nrClients; i++) {
+		free(clients[i].sendTimes);
+		free(clients[i].buffer);
+		free(clients[i].latencies);
+		free(clients[i].setupTimes);
+	}
+	free(clients);
+	free(threads);
+	free(pFile);
+	free(latencies);
+	free(setupTimes);
+	return (nrFailed == 0) ? 0 : 2;
+}
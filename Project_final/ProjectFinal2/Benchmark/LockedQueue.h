@@ -0,0 +1,29 @@
+#pragma once
+
+#ifndef LOCKED_QUEUE_H
+#define LOCKED_QUEUE_H
+
+#include "../Project1/EncSyncQueue.h"
+
+/*
+ * The queue the server used before the lock-free one: a circular buffer
+ * guarded by one critical section and two condition variables.
+ * Kept only as the baseline of the queue benchmark.
+ */
+typedef struct LockedQueueTag {
+	DWORD dwHead;
+	DWORD dwTail;
+	LPEncryptDataT *data;
+	DWORD dwSize;
+	CRITICAL_SECTION criticalSection;
+	CONDITION_VARIABLE cvNotFull;
+	CONDITION_VARIABLE cvNotEmpty;
+}LockedQueueT, *LPLockedQueueT;
+
+VOID pushLockedQueue(LPLockedQueueT queue, LPEncryptDataT data);
+
+VOID popLockedQueue(LPLockedQueueT queue, LPEncryptDataT *data);
+
+LPLockedQueueT create_LockedQueueT(DWORD dwSize);
+
+#endif
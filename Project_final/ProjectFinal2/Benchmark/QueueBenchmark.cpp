@@ -0,0 +1,153 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Benchmark.h"
+#include "LockedQueue.h"
+
+/*
+ * Runs as many producers as consumers over one queue and measures the transfer rate.
+ * The items are fake packet pointers, only the queue itself is measured.
+ */
+
+typedef struct QueueUnderTestTag {
+	LPVOID queue;
+	VOID(*push)(LPVOID queue, LPEncryptDataT data);
+	VOID(*pop)(LPVOID queue, LPEncryptDataT *data);
+}QueueUnderTestT, *LPQueueUnderTestT;
+
+typedef struct QueueThreadArgTag {
+	LPQueueUnderTestT test;
+	DWORD nrOps;
+	BOOL bProducer;
+	volatile LONG *pnrReady;
+	volatile LONG *pbStart;
+}QueueThreadArgT, *LPQueueThreadArgT;
+
+static VOID pushLocked(LPVOID queue, LPEncryptDataT data)
+{
+	pushLockedQueue((LPLockedQueueT)queue, data);
+}
+
+static VOID popLocked(LPVOID queue, LPEncryptDataT *data)
+{
+	popLockedQueue((LPLockedQueueT)queue, data);
+}
+
+static VOID pushLockFree(LPVOID queue, LPEncryptDataT data)
+{
+	pushSyncQueue((LPSyncCircQueueT)queue, data);
+}
+
+static VOID popLockFree(LPVOID queue, LPEncryptDataT *data)
+{
+	popSyncQueue((LPSyncCircQueueT)queue, data);
+}
+
+static DWORD WINAPI queueThread(LPVOID arg)
+{
+	LPQueueThreadArgT threadArg = (LPQueueThreadArgT)arg;
+	LPQueueUnderTestT test = threadArg->test;
+	LPEncryptDataT data;
+
+	// all threads start together, so thread creation is not measured
+	InterlockedIncrement(threadArg->pnrReady);
+	while (ReadAcquire(threadArg->pbStart) == 0) {
+		YieldProcessor();
+	}
+
+	for (DWORD i = 0; i < threadArg->nrOps; i++) {
+		if (threadArg->bProducer) {
+			test->push(test->queue, (LPEncryptDataT)(uintptr_t)(i + 1));
+		} else {
+			test->pop(test->queue, &data);
+		}
+	}
+	return 0;
+}
+
+/*
+ * @return millions of items moved through the queue per second, or a negative value on failure.
+ */
+static double measureQueue(LPQueueUnderTestT test, DWORD nrThreads, DWORD nrOps)
+{
+	LPHANDLE threads = (LPHANDLE)malloc(sizeof(HANDLE) * nrThreads * 2);
+	LPQueueThreadArgT args = (LPQueueThreadArgT)malloc(sizeof(QueueThreadArgT) * nrThreads * 2);
+	volatile LONG nrReady = 0;
+	volatile LONG bStart = 0;
+	DWORD nrOpsPerThread = nrOps / nrThreads;
+	double start;
+	double elapsed;
+
+	if (threads == NULL || args == NULL) {
+		free(threads);
+		free(args);
+		return -1;
+	}
+
+	for (DWORD i = 0; i < nrThreads * 2; i++) {
+		args[i].test = test;
+		args[i].nrOps = nrOpsPerThread;
+		args[i].bProducer = (i % 2 == 0);
+		args[i].pnrReady = &nrReady;
+		args[i].pbStart = &bStart;
+		threads[i] = (HANDLE)_beginthreadex(NULL, 0, (_beginthreadex_proc_type)queueThread, &args[i], 0, NULL);
+		if (threads[i] == NULL) {
+			_tprintf(_T("could not create benchmark threads!\n"));
+			exit(5);
+		}
+	}
+
+	while (ReadAcquire(&nrReady) != (LONG)(nrThreads * 2)) {
+		Sleep(1);
+	}
+	start = benchmarkSeconds();
+	WriteRelease(&bStart, 1);
+
+	for (DWORD i = 0; i < nrThreads * 2; i++) {
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+	}
+	elapsed = benchmarkSeconds() - start;
+
+	free(threads);
+	free(args);
+	return (double)nrOpsPerThread * nrThreads / elapsed / 1e6;
+}
+
+INT queueBenchmark(INT argc, PTCHAR argv[])
+{
+	DWORD nrMaxThreads = 64;
+	DWORD nrOps = 2000000;
+	DWORD dwSize = 1024;
+	QueueUnderTestT locked;
+	QueueUnderTestT lockFree;
+
+	for (INT i = 0; i < argc; i++) {
+		if (!parseNumberArgument(argv[i], _T("max_threads"), &nrMaxThreads) ||
+			!parseNumberArgument(argv[i], _T("ops"), &nrOps) ||
+			!parseNumberArgument(argv[i], _T("size"), &dwSize)) {
+			_tprintf(_T("invalid parameter: \"%s\"\n"), argv[i]);
+			return 1;
+		}
+	}
+
+	locked.queue = create_LockedQueueT(dwSize);
+	locked.push = pushLocked;
+	locked.pop = popLocked;
+	lockFree.queue = create_SyncCircQueueT(dwSize);
+	lockFree.push = pushLockFree;
+	lockFree.pop = popLockFree;
+	if (locked.queue == NULL || lockFree.queue == NULL) {
+		_tprintf(_T("Could not allocate memory!\n"));
+		return 6;
+	}
+
+	_tprintf(_T("%u items per run, queue size %u, as many producers as consumers\n"), nrOps, dwSize);
+	_tprintf(_T("%10s %16s %16s\n"), _T("producers"), _T("locked Mops/s"), _T("lock-free Mops/s"));
+	for (DWORD nrThreads = 1; nrThreads <= nrMaxThreads; nrThreads *= 2) {
+		double lockedRate = measureQueue(&locked, nrThreads, nrOps);
+		double lockFreeRate = measureQueue(&lockFree, nrThreads, nrOps);
+		_tprintf(_T("%10u %16.2f %16.2f\n"), nrThreads, lockedRate, lockFreeRate);
+	}
+
+	return 0;
+}
@@ -0,0 +1,131 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Benchmark.h"
+#include "../Project1/XorCipher.h"
+
+#define XOR_MAX_KERNELS 8
+
+/*
+ * The loop encryptData used before the vectorized kernels, the baseline of the benchmark.
+ */
+static VOID xorPerByte(PBYTE buff, DWORD cbBuff, const BYTE *key, DWORD cbKey, DWORD dwPhase)
+{
+	for (DWORD i = 0; i < cbBuff; i++) {
+		buff[i] ^= key[(dwPhase + i) % cbKey];
+	}
+}
+
+static VOID fillRandom(PBYTE buff, DWORD cbBuff, DWORD dwSeed)
+{
+	for (DWORD i = 0; i < cbBuff; i++) {
+		dwSeed = dwSeed * 1103515245 + 12345;
+		buff[i] = (BYTE)(dwSeed >> 16);
+	}
+}
+
+/*
+ * Compares a kernel with the per byte loop over odd sizes, key lengths and phases,
+ * and checks that a stream split in packets gives the same bytes as in one piece.
+ */
+static BOOL verifyKernel(LPXorKernelInfoT info)
+{
+	static const DWORD sizes[] = { 0, 1, 15, 31, 63, 64, 65, 1000, 4096, 10007 };
+	static const DWORD keyLengths[] = { 1, 3, 16, 31, 64, 100, 1023, 1024, 1500 };
+	BYTE key[1500];
+	BYTE expected[10007];
+	BYTE actual[10007];
+
+	fillRandom(key, sizeof(key), 7);
+
+	for (DWORD s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (DWORD k = 0; k < sizeof(keyLengths) / sizeof(keyLengths[0]); k++) {
+			DWORD cbBuff = sizes[s];
+			DWORD cbKey = keyLengths[k];
+			DWORD dwPhase = (cbBuff * 7 + cbKey) % (2 * cbKey);
+
+			fillRandom(expected, cbBuff, cbBuff);
+			memcpy(actual, expected, cbBuff);
+			xorPerByte(expected, cbBuff, key, cbKey, dwPhase);
+
+			// three uneven packets of the same stream
+			DWORD cbFirst = cbBuff / 3;
+			DWORD cbSecond = cbBuff / 2;
+			info->kernel(actual, cbFirst, key, cbKey, dwPhase);
+			info->kernel(actual + cbFirst, cbSecond - cbFirst, key, cbKey, dwPhase + cbFirst);
+			info->kernel(actual + cbSecond, cbBuff - cbSecond, key, cbKey, dwPhase + cbSecond);
+
+			if (memcmp(expected, actual, cbBuff) != 0) {
+				_tprintf(_T("%s: wrong output for %u bytes, key of %u bytes, phase %u\n"),
+					info->sName, cbBuff, cbKey, dwPhase);
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * @return gigabytes per second of the kernel over packets of cbPacket bytes.
+ */
+static double measureKernel(XorKernelT kernel, PBYTE buff, DWORD cbPacket, const BYTE *key, DWORD cbKey, DWORD nrPackets)
+{
+	double start = benchmarkSeconds();
+
+	for (DWORD i = 0; i < nrPackets; i++) {
+		kernel(buff, cbPacket, key, cbKey, 0);
+	}
+	return (double)cbPacket * nrPackets / (benchmarkSeconds() - start) / 1e9;
+}
+
+INT xorBenchmark(INT argc, PTCHAR argv[])
+{
+	DWORD cbPacket = 4096;
+	DWORD cbKey = 16;
+	DWORD cbTotalMb = 512;
+	XorKernelInfoT kernels[XOR_MAX_KERNELS];
+	XorKernelInfoT baseline = { _T("per byte"), xorPerByte };
+	DWORD nrKernels;
+	DWORD nrPackets;
+	PBYTE buff;
+	PBYTE key;
+
+	for (INT i = 0; i < argc; i++) {
+		if (!parseNumberArgument(argv[i], _T("size"), &cbPacket) ||
+			!parseNumberArgument(argv[i], _T("key"), &cbKey) ||
+			!parseNumberArgument(argv[i], _T("mb"), &cbTotalMb)) {
+			_tprintf(_T("invalid parameter: \"%s\"\n"), argv[i]);
+			return 1;
+		}
+	}
+
+	buff = (PBYTE)malloc(cbPacket);
+	key = (PBYTE)malloc(cbKey);
+	if (buff == NULL || key == NULL) {
+		_tprintf(_T("Could not allocate memory!\n"));
+		return 6;
+	}
+	fillRandom(buff, cbPacket, 1);
+	fillRandom(key, cbKey, 2);
+	nrPackets = (DWORD)(((ULONGLONG)cbTotalMb << 20) / cbPacket) + 1;
+
+	nrKernels = getSupportedXorKernels(kernels, XOR_MAX_KERNELS);
+	_tprintf(_T("%u byte packets, %u byte key, %u MB per kernel, server kernel: %s\n"),
+		cbPacket, cbKey, cbTotalMb, getXorKernelName());
+	_tprintf(_T("%10s %10s %8s\n"), _T("kernel"), _T("GB/s"), _T("speedup"));
+
+	// the old loop is far slower, a tenth of the data is enough
+	double baselineRate = measureKernel(baseline.kernel, buff, cbPacket, key, cbKey, nrPackets / 10 + 1);
+	_tprintf(_T("%10s %10.2f %8.2f\n"), baseline.sName, baselineRate, 1.0);
+
+	for (DWORD i = 0; i < nrKernels; i++) {
+		if (!verifyKernel(&kernels[i])) {
+			return 2;
+		}
+		double rate = measureKernel(kernels[i].kernel, buff, cbPacket, key, cbKey, nrPackets);
+		_tprintf(_T("%10s %10.2f %8.2f\n"), kernels[i].sName, rate, rate / baselineRate);
+	}
+
+	free(buff);
+	free(key);
+	return 0;
+}
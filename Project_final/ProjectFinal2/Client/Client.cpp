@@ -8,40 +8,110 @@
 
 #include "CommunicationProtocol.h"
 
-#define BUFFSIZE 4096
-
 PTCHAR sFilePath = NULL;
 PTCHAR sUserName = _T("david");
 PTCHAR sPassword = _T("defaultpassword");
 PTCHAR sOutPutPath = NULL;
 PTCHAR sKey = NULL;
+PTCHAR sKeyFilePath = NULL;
+PTCHAR sServerAddress = NULL;
+// packets the server may hold at once, 0 for the original send everything then receive exchange
+DWORD nrWindow = 64;
+// payload size of the packets asked for when a window is used
+DWORD cbPacketSize = 65536;
+// connections the file is split across
+DWORD nrStreams = 1;
+// files on disk are mapped in memory instead of being read and written through a buffer
+BOOL bMapFiles = TRUE;
+// the key sent to the server, binary, it may contain NUL bytes
+PBYTE pKey = NULL;
+DWORD cbKey = 0;
+// the cipher the server encrypts with, xor unless cipher= is given
+DWORD dwCipher = CIPHER_XOR;
+// given with nonce=, otherwise drawn at random, it must never be used twice with the same key
+BYTE nonce[CIPHER_NONCE_SIZE];
+BOOL bNonceGiven = FALSE;
+// times a stream whose connection broke is reconnected, it goes on from the last packet it got back
+DWORD nrRetries = 3;
+// INIT_COMPRESS or INIT_DECOMPRESS when the server compresses the packets or decompresses the records, set with compress=
+DWORD dwCodecFlag = 0;
+
+// at most this many connections are opened for one file
+#define MAX_STREAMS 64
+// wait before the first reconnection of a stream, doubled for every next one
+#define RETRY_DELAY_MS 500
+#define MAX_RETRIES 16
 
 VOID printUsage()
 {
 	_tprintf(_T("Usage:\n"));
-	_tprintf(_T("    program.exe filepath=<filepath> [user=<username> pass=<password> pipe=<pipename> outputpath=<outputpath> key=<encryption key>]\n"));
-	_tprintf(_T("        where <filepath> is the path of the file to be encrypted\n"));
+	_tprintf(_T("    program.exe filepath=<filepath> [user=<username> pass=<password> server=<address> outputpath=<outputpath> key=<encryption key> keyfile=<key file> window=<nr_packets> packet_size=<bytes> streams=<nr_streams> io=<mmap|buffered> cipher=<cipher> nonce=<nonce> retries=<nr_retries> compress=<on|off|unpack>]\n"));
+	_tprintf(_T("        where <filepath> is the path of the file to be encrypted, - for the standard input.\n"));
 	_tprintf(_T("        where <username> is the username of the client requesting the encryption, default value: david\n"));
 	_tprintf(_T("        where <password> is the password of the client requesting the encryption, default value: defaultpassword\n"));
 	_tprintf(_T("        where <outputpath> is the path of the resulting encryped file, if it is not supplied <filepath>.enc is used.\n"));
+	_tprintf(_T("            It must be supplied when the file is read from the standard input.\n"));
 	_tprintf(_T("        where <key> is the encryption key used to ecrypt the file, if it not supplied <password is used.\n"));
+	_tprintf(_T("        where <key file> is a file holding a binary key of at most %u bytes, it is used instead of <key>.\n"), MAX_KEY_SIZE);
+	_tprintf(_T("        where <address> is pipe:<pipename>, unix:<socket path> or tcp:[<host>:]<port>, if it is not supplied it is read from pipe.txt.\n"));
+	_tprintf(_T("        where <nr_packets> is the number of packets the server may hold at once, the encrypted packets are\n"));
+	_tprintf(_T("            received while sending, default value of 64. With 0 the whole file is sent before receiving.\n"));
+	_tprintf(_T("        where <bytes> is the packet size asked for when a window or a cipher other than xor is used, default value of 65536.\n"));
+	_tprintf(_T("        where <nr_streams> is the number of connections the file is split across, default value of 1.\n"));
+	_tprintf(_T("        where io=mmap maps files on disk in memory, io=buffered reads and writes them through a buffer, default value of mmap.\n"));
+	_tprintf(_T("        where <cipher> is xor, chacha20 (32 byte key), aes128-ctr (16 byte key) or aes256-ctr (32 byte key), default value of xor.\n"));
+	_tprintf(_T("        where <nonce> is %u bytes in hex for the ciphers other than xor, a random one is used and printed if it is not supplied.\n"), CIPHER_NONCE_SIZE);
+	_tprintf(_T("        where <nr_retries> is how many times a broken connection is opened again, the file goes on from the last\n"));
+	_tprintf(_T("            packet received, default value of 3, at most %u. A source that is not a file on disk is never retried.\n"), MAX_RETRIES);
+	_tprintf(_T("        where compress=on has the server compress the packets before encrypting them, the output is a compressed file,\n"));
+	_tprintf(_T("            compress=unpack sends a compressed file back with the same key, cipher, nonce and packet size\n"));
+	_tprintf(_T("            and writes the file it was made of, default value of off. Both use a single stream, unpack is never retried.\n"));
 	_tprintf(_T("    program.exe /h for this message\n"));
 }
 
 
-PTCHAR getRealPipeName()
+/*
+ * Returns the address of the server, as published by the server in pipe.txt.
+ */
+PTCHAR getServerAddress()
 {
-	FILE* pipeFile = _tfopen(_T("pipe.txt"), "r");
+	FILE* pipeFile = _tfopen(_T("pipe.txt"), _T("r"));
 	if (pipeFile == NULL) {
 		_tprintf(_T("could not open file\n"));
 		exit(5);
 	}
 
-	PTCHAR realPipeName = (PTCHAR)malloc(sizeof(TCHAR) * 1024);
+	PTCHAR serverAddress = (PTCHAR)malloc(sizeof(TCHAR) * 1024);
+	if (serverAddress == NULL || _fgetts(serverAddress, 1024, pipeFile) == NULL) {
+		_tprintf(_T("could not read server address\n"));
+		exit(5);
+	}
 
-	_fgetts(realPipeName, 1024, pipeFile);
 	fclose(pipeFile);
-	return realPipeName;
+	return serverAddress;
+}
+
+/*
+ * Parses the CIPHER_NONCE_SIZE bytes of the nonce, two hex digits each.
+ */
+BOOL parseNonce(PTCHAR sNonce)
+{
+	UINT dwByte;
+
+	if (_tcslen(sNonce) != 2 * CIPHER_NONCE_SIZE) {
+		return FALSE;
+	}
+	for (DWORD i = 0; i < CIPHER_NONCE_SIZE; i++) {
+		TCHAR sDigits[3] = { sNonce[2 * i], sNonce[2 * i + 1], '\0' };
+		PTCHAR sEnd;
+
+		dwByte = (UINT)_tcstoul(sDigits, &sEnd, 16);
+		if (*sEnd != '\0') {
+			return FALSE;
+		}
+		nonce[i] = (BYTE)dwByte;
+	}
+	return TRUE;
 }
 
 VOID parseArgument(PTCHAR arg)
@@ -56,6 +126,52 @@ VOID parseArgument(PTCHAR arg)
 		sOutPutPath = arg + 11;
 	} else if (_tcsncmp(arg, _T("key="), 4) == 0) {
 		sKey = arg + 4;
+	} else if (_tcsncmp(arg, _T("keyfile="), 8) == 0) {
+		sKeyFilePath = arg + 8;
+	} else if (_tcsncmp(arg, _T("server="), 7) == 0) {
+		sServerAddress = arg + 7;
+	} else if (_tcsncmp(arg, _T("window="), 7) == 0) {
+		if (_stscanf(arg + 7, _T("%u"), &nrWindow) != 1) {
+			_tprintf(_T("invalid number at window\n"));
+			exit(1);
+		}
+	} else if (_tcsncmp(arg, _T("packet_size="), 12) == 0) {
+		if (_stscanf(arg + 12, _T("%u"), &cbPacketSize) != 1 || cbPacketSize == 0 || cbPacketSize > MAX_LARGE_PACKET_SIZE) {
+			_tprintf(_T("invalid number at packet_size\n"));
+			exit(1);
+		}
+	} else if (_tcsncmp(arg, _T("streams="), 8) == 0) {
+		if (_stscanf(arg + 8, _T("%u"), &nrStreams) != 1 || nrStreams == 0 || nrStreams > MAX_STREAMS) {
+			_tprintf(_T("invalid number at streams\n"));
+			exit(1);
+		}
+	} else if (_tcsncmp(arg, _T("cipher="), 7) == 0) {
+		for (dwCipher = 0; dwCipher < NR_CIPHERS && _tcscmp(arg + 7, getCipherName(dwCipher)) != 0; dwCipher++);
+		if (dwCipher == NR_CIPHERS) {
+			_tprintf(_T("unknown cipher: \"%s\"\n"), arg + 7);
+			exit(1);
+		}
+	} else if (_tcsncmp(arg, _T("nonce="), 6) == 0) {
+		if (!parseNonce(arg + 6)) {
+			_tprintf(_T("the nonce must be %u bytes in hex\n"), CIPHER_NONCE_SIZE);
+			exit(1);
+		}
+		bNonceGiven = TRUE;
+	} else if (_tcsncmp(arg, _T("retries="), 8) == 0) {
+		if (_stscanf(arg + 8, _T("%u"), &nrRetries) != 1 || nrRetries > MAX_RETRIES) {
+			_tprintf(_T("invalid number at retries\n"));
+			exit(1);
+		}
+	} else if (_tcscmp(arg, _T("compress=on")) == 0) {
+		dwCodecFlag = INIT_COMPRESS;
+	} else if (_tcscmp(arg, _T("compress=unpack")) == 0) {
+		dwCodecFlag = INIT_DECOMPRESS;
+	} else if (_tcscmp(arg, _T("compress=off")) == 0) {
+		dwCodecFlag = 0;
+	} else if (_tcscmp(arg, _T("io=mmap")) == 0) {
+		bMapFiles = TRUE;
+	} else if (_tcscmp(arg, _T("io=buffered")) == 0) {
+		bMapFiles = FALSE;
 	} else if(_tcscmp(arg, _T("/h")) == 0) {
 		printUsage();
 		exit(0);
@@ -67,6 +183,40 @@ VOID parseArgument(PTCHAR arg)
 	}
 }
 
+/*
+ * Reads the whole key file into pKey, its bytes are the key as they are.
+ */
+VOID readKeyFile()
+{
+	HANDLE hKeyFile;
+	LARGE_INTEGER fileSize;
+	DWORD cbRead;
+
+	hKeyFile = CreateFile(sKeyFilePath, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hKeyFile == INVALID_HANDLE_VALUE) {
+		_tprintf(_T("Key file does not exist, or could not be open: %s\n"), sKeyFilePath);
+		exit(1);
+	}
+
+	if (!GetFileSizeEx(hKeyFile, &fileSize) || fileSize.QuadPart <= 0 || fileSize.QuadPart > MAX_KEY_SIZE) {
+		_tprintf(_T("Error: the key file must hold 1 to %u bytes\n"), MAX_KEY_SIZE);
+		exit(1);
+	}
+	cbKey = (DWORD)fileSize.QuadPart;
+
+	pKey = (PBYTE)malloc(cbKey);
+	if (pKey == NULL) {
+		_tprintf(_T("memory allocation error\n"));
+		exit(2);
+	}
+
+	if (!ReadFile(hKeyFile, pKey, cbKey, &cbRead, NULL) || cbRead != cbKey) {
+		_tprintf(_T("Could not read the key file\n"));
+		exit(1);
+	}
+	CloseHandle(hKeyFile);
+}
+
 VOID validateArguments()
 {
 	if (sFilePath == NULL || _tcslen(sFilePath) <= 0) {
@@ -87,6 +237,12 @@ VOID validateArguments()
 		exit(1);
 	}
 
+	if ((sOutPutPath == NULL || _tcslen(sOutPutPath) <= 0) && _tcscmp(sFilePath, _T("-")) == 0) {
+		_tprintf(_T("Error: output path not specified for the standard input\n"));
+		printUsage();
+		exit(1);
+	}
+
 	if (sOutPutPath == NULL || _tcslen(sOutPutPath) <= 0) {
 		sOutPutPath = (PTCHAR)malloc(sizeof(TCHAR) * (_tcslen(sFilePath) + 4));
 		if (sOutPutPath == NULL) {
@@ -100,6 +256,42 @@ VOID validateArguments()
 	if (sKey == NULL || _tcslen(sKey) <= 0) {
 		sKey = sPassword;
 	}
+
+	if (sKeyFilePath != NULL) {
+		readKeyFile();
+	} else {
+		pKey = (PBYTE)sKey;
+		cbKey = _tcslen(sKey) * sizeof(TCHAR);
+	}
+
+	if (getCipherKeySize(dwCipher) != 0 && cbKey != getCipherKeySize(dwCipher)) {
+		_tprintf(_T("Error: the %s cipher needs a key of %u bytes, the key has %u\n"),
+			getCipherName(dwCipher), getCipherKeySize(dwCipher), cbKey);
+		exit(1);
+	}
+
+	// the records of a compressed file are laid out one after the other, their offsets are only known in order
+	if (dwCodecFlag != 0 && nrStreams > 1) {
+		_tprintf(_T("Compressed files are read and written in order, using a single stream\n"));
+		nrStreams = 1;
+	}
+	// the offset in the compressed file a received packet ends at is not known
+	if (dwCodecFlag == INIT_DECOMPRESS) {
+		nrRetries = 0;
+	}
+
+	// a fresh nonce for every run, so the same key can encrypt more files
+	if (dwCipher != CIPHER_XOR && !bNonceGiven) {
+		for (DWORD i = 0; i < CIPHER_NONCE_SIZE; i += sizeof(UINT)) {
+			UINT dwRandom;
+
+			if (rand_s(&dwRandom) != 0) {
+				_tprintf(_T("Error: could not draw a random nonce\n"));
+				exit(1);
+			}
+			memcpy(nonce + i, &dwRandom, sizeof(UINT));
+		}
+	}
 }
 
 VOID printArguments()
@@ -108,293 +300,821 @@ VOID printArguments()
 	_tprintf(_T("user name: \"%s\"\n"), sUserName);
 	_tprintf(_T("password: \"%s\"\n"), sPassword);
 	_tprintf(_T("output path: \"%s\"\n"), sOutPutPath);
-	_tprintf(_T("encryption key: \"%s\"\n"), sKey);
+	if (sKeyFilePath != NULL) {
+		_tprintf(_T("encryption key: %u bytes from \"%s\"\n"), cbKey, sKeyFilePath);
+	} else {
+		_tprintf(_T("encryption key: \"%s\"\n"), sKey);
+	}
+	_tprintf(_T("cipher: %s\n"), getCipherName(dwCipher));
+	if (dwCodecFlag != 0) {
+		_tprintf(_T("compression: %s\n"), (dwCodecFlag == INIT_COMPRESS) ? _T("on") : _T("unpack"));
+	}
+	if (dwCipher != CIPHER_XOR) {
+		// the nonce is needed to decrypt the file
+		_tprintf(_T("nonce: "));
+		for (DWORD i = 0; i < CIPHER_NONCE_SIZE; i++) {
+			_tprintf(_T("%02x"), nonce[i]);
+		}
+		_tprintf(_T("\n"));
+	}
 }
 
-HANDLE connectToServer()
+/*
+ * @return the connection, NULL if the server could not be reached.
+ */
+LPConnectionT connectToServer()
 {
-	PTCHAR sRealPipeName = getRealPipeName();
-	_tprintf(_T("pipename: \"%s\"\n"), sRealPipeName);
-	DWORD dwMode;
+	if (sServerAddress == NULL) {
+		sServerAddress = getServerAddress();
+	}
+	_tprintf(_T("server address: \"%s\"\n"), sServerAddress);
+
+	LPConnectionT connection = connectTransport(sServerAddress);
+	if (connection == NULL) {
+		_tprintf(_T("Could not connect to the server\n"));
+	}
+	return connection;
+}
+
+
+
+/*
+ * The source or the destination file. Files on disk are mapped whole when possible,
+ * the packets are then sent from and received into the mapping without copies.
+ */
+typedef struct FileTag {
+	HANDLE hFile;
+	HANDLE hMapping;
+	// NULL when the file is read or written with ReadFile/WriteFile
+	PBYTE pView;
+	// pipes and consoles have no offsets, they are read or written in order by a single stream
+	BOOL bSeekable;
+	// size of a seekable source, size of the mapping of a destination
+	ULONGLONG cbSize;
+}FileT, *LPFileT;
+
+/*
+ * One connection to the server and the part of the file it encrypts.
+ */
+typedef struct StreamTag {
+	LPConnectionT connection;
+	InitExT options;
+	LPFileT source;
+	LPFileT dest;
+	ULONGLONG qwOffset;
+	// where the part goes in the destination, qwOffset unless the server compresses or decompresses
+	ULONGLONG qwDestOffset;
+	// number of the first packet of the part, the stream ciphers encrypt a packet by its number
+	ULONGLONG qwFirstSequence;
+	// (ULONGLONG)-1 when the source is read up to its end
+	ULONGLONG cbLength;
+	// the encrypted packets were all received and written
+	BOOL bReceived;
 	BOOL bSuccess;
-	HANDLE hPipe;
-
-	//trying to connect to the pipe
-	while(true) {
-		hPipe = CreateFile(
-			sRealPipeName, //name of the pipe
-			GENERIC_READ | GENERIC_WRITE, //read and write access
-			0, //we don't need sharing
-			NULL, //default security attributes
-			OPEN_EXISTING, //opens an existing (duh?)
-			0, //default attributes
-			NULL //we dont' need template
+	// the server granted a session, a broken connection is resumed with its token
+	BOOL bResumable;
+	BYTE token[SESSION_TOKEN_SIZE];
+	// packets received and written by the current connection, the bytes of the source they stand for
+	// and the bytes written for them
+	ULONGLONG nrReceived;
+	ULONGLONG cbReceived;
+	ULONGLONG cbWritten;
+}StreamT, *LPStreamT;
+
+/*
+ * Opens the file and finds out if it can be read or written at any offset.
+ *
+ * @return FALSE if the file could not be opened.
+ */
+BOOL openFile(LPFileT file, PTCHAR sPath, BOOL bWritable)
+{
+	LARGE_INTEGER fileSize;
+
+	memset(file, 0, sizeof(FileT));
+
+	if (!bWritable && _tcscmp(sPath, _T("-")) == 0) {
+		file->hFile = GetStdHandle(STD_INPUT_HANDLE);
+	} else {
+		// mapping a file for writing needs read access as well
+		file->hFile = CreateFile(
+			sPath,
+			bWritable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+			0,
+			NULL,
+			bWritable ? CREATE_ALWAYS : OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL,
+			NULL
 		);
+	}
 
-		if (hPipe != INVALID_HANDLE_VALUE) {
-			//successfully connected to pipe, break the loop
-			break;
-		}
+	if (file->hFile == INVALID_HANDLE_VALUE || file->hFile == NULL) {
+		return FALSE;
+	}
 
-		if (GetLastError() != ERROR_PIPE_BUSY) {
-			_tprintf(_T("Could not connect to pipe (pipe is not busy)\n"));
-			exit(1);
+	file->bSeekable = GetFileType(file->hFile) == FILE_TYPE_DISK;
+	if (file->bSeekable && !bWritable) {
+		if (!GetFileSizeEx(file->hFile, &fileSize)) {
+			file->bSeekable = FALSE;
+		} else {
+			file->cbSize = (ULONGLONG)fileSize.QuadPart;
 		}
+	}
+	return TRUE;
+}
 
-		//all pipes are busy, wait for 1 sec
-		if (!WaitNamedPipe(sRealPipeName, 10000)) {
-			_tprintf(_T("Could not connect to pipe, timed out\n"));
-			exit(2);
-		}
+/*
+ * Maps the first cbSize bytes of the file, a destination is extended to cbSize.
+ * When the file cannot be mapped pView stays NULL and buffered I/O is used.
+ */
+VOID mapFile(LPFileT file, ULONGLONG cbSize, BOOL bWritable)
+{
+	if (!bMapFiles || !file->bSeekable || cbSize == 0 || cbSize > (SIZE_T)-1) {
+		return;
 	}
 
-	//we can only arrive here if we successfully connected
-	dwMode = PIPE_READMODE_MESSAGE;
-	bSuccess = SetNamedPipeHandleState(
-		hPipe,
-		&dwMode,
-		NULL, // must be NULL, since processes are on the same computer
-		NULL // must be NULL, since processes are on the same computer
+	file->hMapping = CreateFileMapping(
+		file->hFile,
+		NULL,
+		bWritable ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)(cbSize >> 32),
+		(DWORD)cbSize,
+		NULL
 	);
+	if (file->hMapping != NULL) {
+		file->pView = (PBYTE)MapViewOfFile(file->hMapping, bWritable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)cbSize);
+	}
 
-	if (!bSuccess) {
-		_tprintf(_T("Could not set the pipe to message mode\n"));
-		exit(3);
+	if (file->pView == NULL) {
+		_tprintf(_T("Could not map the %s file, using buffered I/O\n"), bWritable ? _T("destination") : _T("source"));
+		if (file->hMapping != NULL) {
+			CloseHandle(file->hMapping);
+			file->hMapping = NULL;
+		}
+		return;
+	}
+	file->cbSize = cbSize;
+}
+
+VOID closeFile(LPFileT file)
+{
+	if (file->pView != NULL) {
+		UnmapViewOfFile(file->pView);
+	}
+	if (file->hMapping != NULL) {
+		CloseHandle(file->hMapping);
+	}
+	// the standard input belongs to the process
+	if (file->hFile != GetStdHandle(STD_INPUT_HANDLE)) {
+		CloseHandle(file->hFile);
 	}
-	return hPipe;
 }
 
+/*
+ * Fills an OVERLAPPED with a file offset, for positional reads and writes.
+ */
+VOID setFileOffset(LPOVERLAPPED overlapped, ULONGLONG qwOffset)
+{
+	memset(overlapped, 0, sizeof(OVERLAPPED));
+	overlapped->Offset = (DWORD)qwOffset;
+	overlapped->OffsetHigh = (DWORD)(qwOffset >> 32);
+}
+
+/*
+ * Reads up to cbBuff bytes of the file at qwOffset, or where it is for a file that is not seekable.
+ *
+ * @param pcbRead: less than cbBuff only at the end of the file.
+ */
+BOOL readFileFully(LPFileT file, ULONGLONG qwOffset, PBYTE buff, DWORD cbBuff, LPDWORD pcbRead)
+{
+	OVERLAPPED overlapped;
+	DWORD cbRead;
 
+	*pcbRead = 0;
+	while (*pcbRead < cbBuff) {
+		setFileOffset(&overlapped, qwOffset + *pcbRead);
+		if (!ReadFile(file->hFile, buff + *pcbRead, cbBuff - *pcbRead, &cbRead, file->bSeekable ? &overlapped : NULL)) {
+			return FALSE;
+		}
+		if (cbRead == 0) {
+			break;
+		}
+		*pcbRead += cbRead;
+	}
+	return TRUE;
+}
 
-BOOL readAndSendFile(HANDLE hFileSource, HANDLE hPipe)
+/*
+ * Sends the records of a compressed source, each one as a packet (see PacketRecordT),
+ * read through a buffer header first.
+ */
+BOOL readAndSendRecords(LPStreamT stream)
 {
+	LPFileT source = stream->source;
+	DWORD cbMaxPacket = stream->options.cbMaxPacket;
+	ULONGLONG qwOffset = stream->qwOffset;
+	PacketRecordT header;
 	DWORD cbRead;
-	BOOL bSuccess;
-	TCHAR buffer[BUFFSIZE];
+	BOOL bSuccess = TRUE;
+	// room for the header in front of the record
+	PBYTE buffer = (PBYTE)malloc(PACKET_HEADER_SIZE + cbMaxPacket);
+	PBYTE pRecord = buffer + PACKET_HEADER_SIZE;
+
+	if (buffer == NULL) {
+		_tprintf(_T("memory allocation error\n"));
+		return FALSE;
+	}
 
 	while (true) {
-		bSuccess = ReadFile(
-			hFileSource,
-			buffer,
-			BUFFSIZE,
-			&cbRead,
-			NULL
-		);
+		bSuccess = readFileFully(source, qwOffset, pRecord, PACKET_RECORD_HEADER_SIZE, &cbRead);
+		if (!bSuccess) {
+			_tprintf(_T("Could not read from source file\n"));
+			break;
+		}
+		if (cbRead == 0) {
+			// at the end of the file
+			break;
+		}
+		memcpy(&header, pRecord, PACKET_RECORD_HEADER_SIZE);
+		if (cbRead < PACKET_RECORD_HEADER_SIZE || header.cbStored > header.cbPlain ||
+			header.cbStored > cbMaxPacket - PACKET_RECORD_HEADER_SIZE) {
+			_tprintf(_T("The source is not a compressed file of packets of at most %u bytes\n"), cbMaxPacket);
+			bSuccess = FALSE;
+			break;
+		}
 
+		bSuccess = readFileFully(source, qwOffset + PACKET_RECORD_HEADER_SIZE, pRecord + PACKET_RECORD_HEADER_SIZE,
+			header.cbStored, &cbRead) && cbRead == header.cbStored;
 		if (!bSuccess) {
 			_tprintf(_T("Could not read from source file\n"));
+			break;
+		}
+
+		bSuccess = sendFramedPacket(stream->connection, (PTCHAR)pRecord, PACKET_RECORD_HEADER_SIZE + header.cbStored);
+		if (!bSuccess) {
+			_tprintf(_T("could not send packet\n"));
+			break;
+		}
+		qwOffset += PACKET_RECORD_HEADER_SIZE + header.cbStored;
+	}
+
+	if (bSuccess) {
+		_tprintf(_T("Successfully arrived at the end of the file part\n"));
+	}
+
+	free(buffer);
+	return bSuccess;
+}
+
+/*
+ * Sends the stream's part of the source in packets of cbMaxPacket bytes,
+ * less the room of the record header when the server compresses them.
+ * From a mapped source the packets are sent straight from the mapping, otherwise each one
+ * is read in a buffer and sent with a single write. Seekable files are read at positions,
+ * other streams may read the same handle at the same time.
+ */
+BOOL readAndSendFile(LPStreamT stream)
+{
+	LPFileT source = stream->source;
+	DWORD cbMaxPacket = stream->options.cbMaxPacket;
+	ULONGLONG qwOffset = stream->qwOffset;
+	ULONGLONG cbLength = stream->cbLength;
+	DWORD cbRead;
+	BOOL bSuccess = TRUE;
+	OVERLAPPED overlapped;
+	PBYTE buffer = NULL;
+
+	if (stream->options.dwFlags & INIT_DECOMPRESS) {
+		return readAndSendRecords(stream);
+	}
+	if (stream->options.dwFlags & INIT_COMPRESS) {
+		cbMaxPacket -= PACKET_RECORD_HEADER_SIZE;
+	}
+
+	if (source->pView == NULL) {
+		// room for the header in front of the payload
+		buffer = (PBYTE)malloc(PACKET_HEADER_SIZE + cbMaxPacket);
+		if (buffer == NULL) {
+			_tprintf(_T("memory allocation error\n"));
 			return FALSE;
 		}
+	}
 
-		if (cbRead == 0) {
-			// at the end of file
-			_tprintf(_T("Successfully arrived at the end of file\n"));
-			return TRUE;
+	while (cbLength > 0) {
+		cbRead = (cbLength < cbMaxPacket) ? (DWORD)cbLength : cbMaxPacket;
+
+		if (source->pView != NULL) {
+			bSuccess = sendPacket(stream->connection, (PTCHAR)(source->pView + qwOffset), cbRead);
+		} else {
+			setFileOffset(&overlapped, qwOffset);
+			bSuccess = ReadFile(
+				source->hFile,
+				buffer + PACKET_HEADER_SIZE,
+				cbRead,
+				&cbRead,
+				source->bSeekable ? &overlapped : NULL
+			);
+
+			if (!bSuccess) {
+				_tprintf(_T("Could not read from source file\n"));
+				break;
+			}
+
+			if (cbRead == 0) {
+				// at the end of the file, or it got shorter since its size was taken
+				break;
+			}
+
+			bSuccess = sendFramedPacket(stream->connection, (PTCHAR)(buffer + PACKET_HEADER_SIZE), cbRead);
 		}
 
-		if (!sendPacket(hPipe, buffer, cbRead)) {
+		if (!bSuccess) {
 			_tprintf(_T("could not send packet\n"));
-			return FALSE;
+			break;
 		}
+		qwOffset += cbRead;
+		cbLength -= cbRead;
+	}
+
+	if (bSuccess) {
+		_tprintf(_T("Successfully arrived at the end of the file part\n"));
 	}
+
+	free(buffer);
+	return bSuccess;
 }
 
-BOOL getPacketsAndWriteFile(HANDLE hPipe, HANDLE hFileDest)
+/*
+ * Receives the encrypted packets and writes them to the destination file from the stream's offset on,
+ * counting them in the stream as they are written. A record stands for the cbPlain bytes of its header.
+ * With a mapped destination the packets are read straight into the mapping. Otherwise the writes
+ * are positional when the file is seekable, the streams fill their own part of the file.
+ */
+BOOL getPacketsAndWriteFile(LPStreamT stream)
 {
+	LPFileT dest = stream->dest;
+	DWORD cbMaxPacket = stream->options.cbMaxPacket;
+	BOOL bCompressed = (stream->options.dwFlags & INIT_COMPRESS) != 0;
+	ULONGLONG qwOffset = stream->qwDestOffset;
 	BOOL bSuccess;
 	DWORD cbReadOrWritten;
 	DWORD cbPacketSize;
-	TCHAR buff[BUFFSIZE];
+	PacketReaderT reader;
+	OVERLAPPED overlapped;
+	PTCHAR buff = NULL;
+
+	if (dest->pView == NULL) {
+		buff = (PTCHAR)malloc(cbMaxPacket);
+		if (buff == NULL) {
+			return FALSE;
+		}
+	}
+	initPacketReader(&reader, stream->connection, cbMaxPacket);
 
 	while (true) {
 
-		bSuccess = getNextPacket(hPipe, buff, &cbPacketSize);
+		bSuccess = readPacketHeader(&reader, &cbPacketSize);
 		if (!bSuccess) {
-			return FALSE;
+			break;
 		}
 
 		if (cbPacketSize == 0) {
 			//succesfully read all the packets
-			return TRUE;
+			break;
+		}
+
+		if (dest->pView != NULL) {
+			// the server sends back as many bytes as it got, more would not fit in the mapping
+			if (qwOffset + cbPacketSize > dest->cbSize) {
+				bSuccess = FALSE;
+				break;
+			}
+			bSuccess = transportRead(stream->connection, dest->pView + qwOffset, cbPacketSize);
+			if (!bSuccess) {
+				break;
+			}
+			qwOffset += cbPacketSize;
+			stream->nrReceived++;
+			stream->cbReceived += cbPacketSize;
+			stream->cbWritten += cbPacketSize;
+			continue;
+		}
+
+		bSuccess = transportRead(stream->connection, buff, cbPacketSize);
+		if (!bSuccess || (bCompressed && cbPacketSize < PACKET_RECORD_HEADER_SIZE)) {
+			bSuccess = FALSE;
+			break;
 		}
 		
+		setFileOffset(&overlapped, qwOffset);
 		bSuccess = WriteFile(
-			hFileDest,
+			dest->hFile,
 			buff,
 			cbPacketSize,
 			&cbReadOrWritten,
-			NULL
+			dest->bSeekable ? &overlapped : NULL
 		);
 
 		if (!bSuccess) {
-			return FALSE;
+			break;
 		}
+		qwOffset += cbPacketSize;
+		stream->nrReceived++;
+		stream->cbReceived += bCompressed ? ((LPPacketRecordT)buff)->cbPlain : cbPacketSize;
+		stream->cbWritten += cbPacketSize;
 	}
+
+	free(buff);
+	return bSuccess;
+}
+
+DWORD WINAPI receiverThread(LPStreamT stream)
+{
+	stream->bReceived = getPacketsAndWriteFile(stream);
+	return 0;
 }
 
 /*
- * Starts encryption process: reads bytes from the source file, sends them to the server, 
- * waits for the response(encrypted packet) and writes it to the destination file.
+ * Starts encryption process: reads the bytes of the stream's part from the source file, sends them to the server, 
+ * waits for the response(encrypted packet) and writes it to the same part of the destination file.
+ * In pipelined mode the encrypted packets are received on a separate thread while sending.
  */
-BOOL encryptFileWithServer(HANDLE hFileSource, HANDLE hPipe, HANDLE hFileDest)
+BOOL encryptFileWithServer(LPStreamT stream)
 {
+	LPConnectionT connection = stream->connection;
+	BOOL bPipelined = (stream->options.dwFlags & INIT_PIPELINED) != 0;
 	BOOL bSuccess;
-	DWORD cbWritten;
 	DWORD dwResponse;
+	HANDLE hReceiver = NULL;
 
-	bSuccess = readAndSendFile(hFileSource, hPipe);
+	stream->bReceived = FALSE;
+
+	if (bPipelined) {
+		hReceiver = (HANDLE)_beginthreadex(
+			NULL,
+			0,
+			(_beginthreadex_proc_type)receiverThread,
+			stream,
+			0,
+			NULL
+		);
+		if (hReceiver == NULL) {
+			_tprintf(_T("could not create receiver thread\n"));
+			return FALSE;
+		}
+	}
+
+	bSuccess = readAndSendFile(stream);
 
 	dwResponse = (bSuccess) ? LAST_PACKET : TERMINATE_CONNECTION;
 
 	// send appropiate response to server
-	bSuccess = WriteFile(
-		hPipe,
-		&dwResponse,
-		sizeof(DWORD),
-		&cbWritten,
-		NULL
-	);
+	bSuccess = sendCommand(connection, dwResponse);
+
+	if (hReceiver != NULL) {
+		WaitForSingleObject(hReceiver, INFINITE);
+		CloseHandle(hReceiver);
+	} else if (bSuccess) {
+		receiverThread(stream);
+	}
 
 	if (!bSuccess) {
 		return FALSE;
 	}
 
-	bSuccess = getPacketsAndWriteFile(hPipe, hFileDest);
+	sendCommand(connection, dwResponse);
 
-	WriteFile(
-		hPipe,
-		&dwResponse,
-		sizeof(DWORD),
-		&cbWritten,
-		NULL
-	);
+	return stream->bReceived;
+}
 
-	return bSuccess;
+INT reopenStream(LPStreamT stream);
+
+/*
+ * Moves the part of the stream past the packets its connection got back,
+ * they are neither sent nor written again.
+ */
+VOID checkpointStream(LPStreamT stream)
+{
+	stream->qwOffset += stream->cbReceived;
+	stream->qwDestOffset += stream->cbWritten;
+	if (stream->cbLength != (ULONGLONG)-1) {
+		stream->cbLength -= stream->cbReceived;
+	}
+	stream->qwFirstSequence += stream->nrReceived;
+	stream->cbReceived = 0;
+	stream->cbWritten = 0;
+	stream->nrReceived = 0;
+}
+
+/*
+ * Encrypts the part of the stream. When its connection breaks, the stream is connected again
+ * up to nrRetries times and goes on from the last packet it got back.
+ * A source that is not seekable cannot be read again from there, its stream is not retried.
+ */
+DWORD WINAPI streamThread(LPStreamT stream)
+{
+	DWORD dwDelayMs = RETRY_DELAY_MS;
+
+	stream->bSuccess = encryptFileWithServer(stream);
+
+	for (DWORD i = 0; !stream->bSuccess && i < nrRetries && stream->source->bSeekable; i++) {
+		checkpointStream(stream);
+		_tprintf(_T("The connection broke, going on from byte %llu in %u ms\n"), stream->qwOffset, dwDelayMs);
+		Sleep(dwDelayMs);
+		dwDelayMs *= 2;
+
+		if (reopenStream(stream) == 0) {
+			stream->bSuccess = encryptFileWithServer(stream);
+		}
+	}
+	return 0;
 }
 
 
 /*
  * Initializes the connection to the server by sending and receiving specific packets.
+ * With a window, a cipher other than xor or retries the options are negotiated,
+ * options holds the ones granted by the server. A stream that may be retried asks for a session
+ * and always sends the number of its first packet, the server numbers the packets of the session from it.
+ * A server that does not compress when asked to is refused like one that does not know the cipher.
  */
-BOOL initilizeConnection(HANDLE hPipe)
+BOOL initilizeConnection(LPConnectionT connection, LPInitExT options, ULONGLONG qwFirstSequence)
 {
 	BOOL bSuccess;
-	DWORD cbWritten;
 	InitT initMessage;
+	CipherInitT cipherInit;
 	DWORD dwResponse = CONNECTION_REJECTED;
-	DWORD dwRead;
+	// synchronous I/O on a pipe handle is serialized, a pipe cannot be read and written at once
+	BOOL bWindow = nrWindow > 0 && connection->kind != TRANSPORT_PIPE;
 
-	initMessage.command = INITIALIZE_CONNECTION;
+	initMessage.command = (bWindow || dwCipher != CIPHER_XOR || nrRetries > 0 || dwCodecFlag != 0) ?
+		INITIALIZE_CONNECTION_EX : INITIALIZE_CONNECTION;
 	initMessage.cbPasswordNrBytes = _tcslen(sPassword) * sizeof(TCHAR);
 	initMessage.cbUsernameNrBytes = _tcslen(sUserName) * sizeof(TCHAR);
-	initMessage.cbKeyNrBytes = _tcslen(sKey) * sizeof(TCHAR);
-
-	bSuccess = WriteFile(
-		hPipe, //handle to pipe
-		&initMessage, //message to be written
-		sizeof(InitT), //number bytes to write
-		&cbWritten, //number of bytes written
-		NULL //no overlap
-	);
+	initMessage.cbKeyNrBytes = cbKey;
+
+	memset(options, 0, sizeof(InitExT));
+	options->dwVersion = PROTOCOL_VERSION;
+	options->dwFlags = (bWindow ? INIT_PIPELINED | INIT_BATCHED : 0) | dwCodecFlag;
+	options->nrWindow = bWindow ? nrWindow : 0;
+	options->cbMaxPacket = cbPacketSize;
+
+	memset(&cipherInit, 0, sizeof(CipherInitT));
+	if (nrRetries > 0) {
+		options->dwFlags |= INIT_RESUMABLE;
+	}
+	if (dwCipher != CIPHER_XOR || nrRetries > 0) {
+		options->dwFlags |= INIT_CIPHER;
+		cipherInit.dwCipher = dwCipher;
+		memcpy(cipherInit.nonce, nonce, CIPHER_NONCE_SIZE);
+		cipherInit.qwFirstSequence = qwFirstSequence;
+	}
+
+	bSuccess = transportWrite(connection, &initMessage, sizeof(InitT));
+
+	if (bSuccess && initMessage.command == INITIALIZE_CONNECTION_EX) {
+		bSuccess = transportWrite(connection, options, sizeof(InitExT));
+	}
+
+	if (bSuccess && (options->dwFlags & INIT_CIPHER)) {
+		bSuccess = transportWrite(connection, &cipherInit, sizeof(CipherInitT));
+	}
 
 	if (!bSuccess) {
 		return FALSE;
 	}
 
-	bSuccess = ReadFile(
-		hPipe, //handle to pipe
-		&dwResponse, // buffer for response 
-		sizeof(DWORD), // number of bytes to be read
-		&dwRead, // number of bytes read
-		NULL//no overlap
-	);
+	bSuccess = transportRead(connection, &dwResponse, sizeof(DWORD));
 
-	if (!bSuccess) {
+	if (!bSuccess || dwResponse != CONNECTION_ACCEPTED) {
 		return FALSE;
 	}
 
-	return dwResponse == CONNECTION_ACCEPTED;
+	if (initMessage.command == INITIALIZE_CONNECTION_EX) {
+		bSuccess = transportRead(connection, options, sizeof(InitExT));
+		// a server that does not know the cipher would encrypt with xor
+		return bSuccess && (dwCipher == CIPHER_XOR || (options->dwFlags & INIT_CIPHER)) &&
+			(options->dwFlags & dwCodecFlag) == dwCodecFlag;
+	}
+
+	memset(options, 0, sizeof(InitExT));
+	options->cbMaxPacket = MAX_PACKET_SIZE;
+	return TRUE;
 }
 
 /*
  * Tries to authenticate the user with the server, by sending the username and password.
  * If auth is successful then it return TRUE, otherwise FALSE.
+ * When the server granted a session its token follows AUTH_SUCCESSFUL, it is kept in the stream.
  */
-BOOL authenthicate(HANDLE hPipe)
+BOOL authenthicate(LPStreamT stream)
 {
+	LPConnectionT connection = stream->connection;
 	BOOL bSuccess;
 	DWORD cbUserNameNrBytes = _tcslen(sUserName) * sizeof(TCHAR);
 	DWORD cbPasswordNrBytes = _tcslen(sPassword) * sizeof(TCHAR);
-	DWORD cbWritten;
 	DWORD dwResponse = AUTH_REJECTED;
 
-	bSuccess = WriteFile(
-		hPipe,
-		sUserName,
-		cbUserNameNrBytes,
-		&cbWritten,
-		NULL
-	);
+	bSuccess = transportWrite(connection, sUserName, cbUserNameNrBytes);
 
 	if (!bSuccess) {
 		return FALSE;
 	}
 
-	bSuccess = WriteFile(
-		hPipe,
-		sPassword,
-		cbPasswordNrBytes,
-		&cbWritten,
-		NULL
-	);
+	bSuccess = transportWrite(connection, sPassword, cbPasswordNrBytes);
 
 	if (!bSuccess) {
 		return FALSE;
 	}
 
-	bSuccess = ReadFile(
-		hPipe,
-		&dwResponse,
-		sizeof(DWORD),
-		&cbWritten,
-		NULL
-	);
+	bSuccess = transportRead(connection, &dwResponse, sizeof(DWORD));
 
-	if (!bSuccess) {
+	if (!bSuccess || dwResponse != AUTH_SUCCESSFUL) {
 		return FALSE;
 	}
 
-	return dwResponse == AUTH_SUCCESSFUL;
+	stream->bResumable = (stream->options.dwFlags & INIT_RESUMABLE) != 0;
+	if (stream->bResumable) {
+		return transportRead(connection, stream->token, SESSION_TOKEN_SIZE);
+	}
+	return TRUE;
 }
 
 /*
  * Sends the ecryption key to the server.
 */
-BOOL sendEncryptionKey(HANDLE hPipe)
+BOOL sendEncryptionKey(LPConnectionT connection)
 {
 	BOOL bSuccess;
-	DWORD cbWritten;
 
-	bSuccess = WriteFile(
-		hPipe,
-		sKey,
-		sizeof(TCHAR) * _tcslen(sKey),
-		&cbWritten,
-		NULL
-	);
+	bSuccess = transportWrite(connection, pKey, cbKey);
 
 	return bSuccess;
 }
 
+/*
+ * Connects, initializes the connection, authenticates and sends the key on a new stream.
+ *
+ * @return 0 on success, otherwise the exit code of the failed step.
+ */
+INT openStream(LPStreamT stream)
+{
+	_tprintf(_T("Attempting to connect to the server\n"));
+	stream->connection = connectToServer();
+	if (stream->connection == NULL) {
+		return 1;
+	}
+	_tprintf(_T("Successfully connected to the server\n"));
+
+	if (!initilizeConnection(stream->connection, &stream->options, stream->qwFirstSequence)) {
+		_tprintf(_T("Could not initialize connection (server is probably busy)\n"));
+		return 2;
+	}
+	_tprintf(_T("Initialized connection\n"));
+
+	if (!authenthicate(stream)) {
+		_tprintf(_T("Authentication not successful!\n"));
+		return 3;
+	}
+	_tprintf(_T("Authenticated successfully\n"));
+
+	if (!sendEncryptionKey(stream->connection)) {
+		_tprintf(_T("An error occoured while sending encryption key\n"));
+		return 4;
+	}
+	return 0;
+}
+
+/*
+ * Asks the server to resume the session of the stream on its new connection,
+ * from the first packet the stream did not get back. The options granted to the session are asked for again.
+ *
+ * @return FALSE if the server does not resume it or grants another packet size or compression.
+ */
+BOOL resumeStream(LPStreamT stream)
+{
+	LPConnectionT connection = stream->connection;
+	DWORD cbMaxPacket = stream->options.cbMaxPacket;
+	DWORD dwCodecFlags = stream->options.dwFlags & (INIT_COMPRESS | INIT_DECOMPRESS);
+	DWORD dwResponse = CONNECTION_REJECTED;
+	InitT initMessage;
+	ResumeT resume;
+	BOOL bSuccess;
+
+	memset(&initMessage, 0, sizeof(InitT));
+	initMessage.command = RESUME_SESSION;
+	stream->options.dwVersion = PROTOCOL_VERSION;
+	memcpy(resume.token, stream->token, SESSION_TOKEN_SIZE);
+	resume.qwSequence = stream->qwFirstSequence;
+
+	bSuccess = transportWrite(connection, &initMessage, sizeof(InitT)) &&
+		transportWrite(connection, &stream->options, sizeof(InitExT)) &&
+		transportWrite(connection, &resume, sizeof(ResumeT));
+
+	if (!bSuccess) {
+		return FALSE;
+	}
+
+	bSuccess = transportRead(connection, &dwResponse, sizeof(DWORD));
+
+	if (!bSuccess || dwResponse != CONNECTION_ACCEPTED) {
+		return FALSE;
+	}
+
+	bSuccess = transportRead(connection, &stream->options, sizeof(InitExT)) &&
+		transportRead(connection, &dwResponse, sizeof(DWORD));
+
+	return bSuccess && dwResponse == AUTH_SUCCESSFUL && stream->options.cbMaxPacket == cbMaxPacket &&
+		(stream->options.dwFlags & (INIT_COMPRESS | INIT_DECOMPRESS)) == dwCodecFlags;
+}
+
+/*
+ * Connects the stream again once its connection broke. With a session token the server is asked
+ * to resume the session, when it lost it a new one is opened from the first packet the stream
+ * did not get back: the output is the same either way. The file was split by the packet size,
+ * the new connection must keep it.
+ *
+ * @return 0 on success, otherwise the exit code of the failed step.
+ */
+INT reopenStream(LPStreamT stream)
+{
+	DWORD cbMaxPacket = stream->options.cbMaxPacket;
+	INT ERROR_CODE;
+
+	if (stream->connection != NULL) {
+		closeConnection(stream->connection);
+		stream->connection = NULL;
+	}
+
+	if (stream->bResumable) {
+		stream->connection = connectToServer();
+		if (stream->connection == NULL) {
+			return 1;
+		}
+		if (resumeStream(stream)) {
+			_tprintf(_T("Resumed the session from packet %llu\n"), stream->qwFirstSequence);
+			return 0;
+		}
+		_tprintf(_T("The server could not resume the session, opening a new one\n"));
+		closeConnection(stream->connection);
+		stream->connection = NULL;
+	}
+
+	ERROR_CODE = openStream(stream);
+	if (ERROR_CODE == 0 && stream->options.cbMaxPacket != cbMaxPacket) {
+		_tprintf(_T("The server granted another packet size to the new connection\n"));
+		ERROR_CODE = 5;
+	}
+	return ERROR_CODE;
+}
+
+/*
+ * Splits the source file between the streams, by the packet size granted to the first one.
+ * Every packet is encrypted on its own, by its number for the stream ciphers, so the parts
+ * are cut at packet boundaries and each stream numbers its packets from the first one of its part:
+ * the output is the same as the one of a single stream.
+ * A source that is not seekable is read up to its end by the only stream.
+ */
+VOID splitFile(LPFileT source, LPStreamT streams, DWORD nrStreams)
+{
+	ULONGLONG cbFile = source->cbSize;
+	ULONGLONG cbPart;
+	ULONGLONG nrPackets;
+	DWORD cbMaxPacket = streams[0].options.cbMaxPacket;
+
+	if (!source->bSeekable) {
+		streams[0].qwOffset = 0;
+		streams[0].qwDestOffset = 0;
+		streams[0].cbLength = (ULONGLONG)-1;
+		return;
+	}
+
+	nrPackets = (cbFile + cbMaxPacket - 1) / cbMaxPacket;
+	cbPart = ((nrPackets + nrStreams - 1) / nrStreams) * cbMaxPacket;
+
+	for (DWORD i = 0; i < nrStreams; i++) {
+		streams[i].qwOffset = (cbPart * i < cbFile) ? cbPart * i : cbFile;
+		streams[i].qwDestOffset = streams[i].qwOffset;
+		streams[i].cbLength = (cbFile - streams[i].qwOffset < cbPart) ? cbFile - streams[i].qwOffset : cbPart;
+		streams[i].qwFirstSequence = streams[i].qwOffset / cbMaxPacket;
+	}
+}
+
 /*
  * Client program for encryption.
  * Tries to connect to server, then authenticates the user(credential provided in command line arguments).
  * Once authenticated the client sends the bytes of the file, whose path is specified by the user, to the server for ecryption.
  * The ecrypted file is saved to the file path specified by the user.
+ * With more streams the file is split in parts, each part goes through its own connection on its own thread.
+ * Files on disk are mapped in memory, pipes and the standard input are read and written in order.
  */
 INT _tmain(INT argc, PTCHAR argv[])
 {
 	INT ERROR_CODE = 0;
+	DWORD nrOpened = 0;
+	LPStreamT streams = NULL;
+	LPHANDLE hThreads = NULL;
+	FileT source;
+	FileT dest;
 
 	for(INT i = 1; i < argc; i++) {
 		parseArgument(argv[i]);
@@ -403,75 +1123,110 @@ INT _tmain(INT argc, PTCHAR argv[])
 	validateArguments();
 	printArguments();
 
-	HANDLE hFileSource = CreateFile(
-		sFilePath,
-		GENERIC_READ,
-		0,
-		NULL,
-		OPEN_EXISTING,
-		FILE_ATTRIBUTE_NORMAL,
-		NULL
-	);
-
-	if (hFileSource == INVALID_HANDLE_VALUE) {
+	if (!openFile(&source, sFilePath, FALSE)) {
 		_tprintf(_T("File does not exist, or could not be open: %s\n"), sFilePath);
 		exit(1);
 	}
 
-	HANDLE hFileDest = CreateFile(
-		sOutPutPath,
-		GENERIC_WRITE,
-		0,
-		NULL,
-		CREATE_ALWAYS,
-		FILE_ATTRIBUTE_NORMAL,
-		NULL
-	);
-
-	if (hFileDest == INVALID_HANDLE_VALUE) {
+	if (!openFile(&dest, sOutPutPath, TRUE)) {
 		_tprintf(_T("Could not create destination file\n"));
 		ERROR_CODE = 1;
 		goto CLEAN_UP_SOURCE;
 	}
 
-	_tprintf(_T("Attempting to connect to pipe\n"));
-	HANDLE hPipe = connectToServer();
-	_tprintf(_T("Successfully connected to the pipe\n"));
+	if (nrStreams > 1 && (!source.bSeekable || !dest.bSeekable)) {
+		_tprintf(_T("Pipes are read and written in order, using a single stream\n"));
+		nrStreams = 1;
+	}
 
-	if (!initilizeConnection(hPipe)) {
-		_tprintf(_T("Could not initialize connection (server is probably busy)\n"));
+	// the encrypted file is as large as the source, unless it is compressed or decompressed
+	mapFile(&source, source.cbSize, FALSE);
+	if (source.bSeekable && dwCodecFlag == 0) {
+		mapFile(&dest, source.cbSize, TRUE);
+	}
+
+	streams = (LPStreamT)calloc(nrStreams, sizeof(StreamT));
+	hThreads = (LPHANDLE)calloc(nrStreams, sizeof(HANDLE));
+	if (streams == NULL || hThreads == NULL) {
+		_tprintf(_T("memory allocation error\n"));
 		ERROR_CODE = 2;
 		goto CLEAN_UP_WITHOUT_PIPE;
 	}
-	_tprintf(_T("Initialized connection\n"));
 
-	if (!authenthicate(hPipe)) {
-		_tprintf(_T("Authentication not successful!\n"));
-		ERROR_CODE = 3;
-		goto CLEAN_UP;
+	// the file is split once the first stream knows its packet size,
+	// the others tell the server the number of the first packet of their part
+	for (; nrOpened < nrStreams; nrOpened++) {
+		streams[nrOpened].source = &source;
+		streams[nrOpened].dest = &dest;
+		ERROR_CODE = openStream(&streams[nrOpened]);
+		if (ERROR_CODE == 0 && nrOpened == 0) {
+			splitFile(&source, streams, nrStreams);
+		} else if (ERROR_CODE == 0 && streams[nrOpened].options.cbMaxPacket != streams[0].options.cbMaxPacket) {
+			_tprintf(_T("The server granted different packet sizes to the streams\n"));
+			ERROR_CODE = 5;
+		}
+		if (ERROR_CODE != 0) {
+			nrOpened++;
+			goto CLEAN_UP;
+		}
 	}
-	_tprintf(_T("Authenticated successfully\n"));
+	_tprintf(_T("beginning encrypting the file\n"));
 
-	if (!sendEncryptionKey(hPipe)) {
-		_tprintf(_T("An error occoured while sending encryption key\n"));
-		ERROR_CODE = 4;
-		goto CLEAN_UP;
+	// the first stream runs on this thread
+	for (DWORD i = 1; i < nrStreams; i++) {
+		hThreads[i] = (HANDLE)_beginthreadex(
+			NULL,
+			0,
+			(_beginthreadex_proc_type)streamThread,
+			&streams[i],
+			0,
+			NULL
+		);
+		if (hThreads[i] == NULL) {
+			_tprintf(_T("could not create stream thread\n"));
+		}
+	}
+	streamThread(&streams[0]);
+
+	for (DWORD i = 1; i < nrStreams; i++) {
+		if (hThreads[i] != NULL) {
+			WaitForSingleObject(hThreads[i], INFINITE);
+			CloseHandle(hThreads[i]);
+		}
+	}
+
+	// a stream whose thread could not be created did not encrypt its part
+	for (DWORD i = 0; i < nrStreams; i++) {
+		if (!streams[i].bSuccess) {
+			ERROR_CODE = 5;
+		}
 	}
-	_tprintf(_T("beginning encrypting the file\n"));
 
-	if(!encryptFileWithServer(hFileSource, hPipe, hFileDest)) {
+	if (ERROR_CODE != 0) {
 		_tprintf(_T("An error occured while ecrypting\n"));
-		ERROR_CODE = 5;
 		goto CLEAN_UP;
 	}
 	_tprintf(_T("Encryption completed without error\n"));
 
 CLEAN_UP:
-	CloseHandle(hPipe);
+	for (DWORD i = 0; i < nrOpened; i++) {
+		// a stream that could not be connected again has none
+		if (streams[i].connection != NULL) {
+			closeConnection(streams[i].connection);
+		}
+	}
 CLEAN_UP_WITHOUT_PIPE:
-	CloseHandle(hFileDest);
+	free(streams);
+	free(hThreads);
+	closeFile(&dest);
+	// a cut file must not pass for an encrypted one, pipes are left to their reader
+	if (ERROR_CODE != 0 && dest.bSeekable) {
+		if (_tremove(sOutPutPath) == 0) {
+			_tprintf(_T("Removed the incomplete output %s\n"), sOutPutPath);
+		}
+	}
 CLEAN_UP_SOURCE:
-	CloseHandle(hFileSource);
+	closeFile(&source);
 
 	return ERROR_CODE;
-}
\ No newline at end of file
+}
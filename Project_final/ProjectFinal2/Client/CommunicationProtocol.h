@@ -1,13 +1,34 @@
 #ifndef COMMUNICATION_PROTOCOL_H
 #define  COMMUNICATION_PROTOCOL_H
-#include "Everything.h"
+#include "Portability.h"
+#include "Transport.h"
+
+// the largest packet payload a peer may send, unless a larger one was negotiated
+#define MAX_PACKET_SIZE 4096
+
+// the largest packet payload that can be negotiated
+#define MAX_LARGE_PACKET_SIZE (4 * 1024 * 1024)
+
+// the largest encryption key, keys are binary and may hold any byte
+#define MAX_KEY_SIZE 65536
+
+// the largest user name and the largest password a server reads, in bytes each
+#define MAX_CREDENTIAL_SIZE 4096
+
+// the largest number of packets in a NEXT_BATCH frame
+#define MAX_BATCH_PACKETS 32
+
+// the NEXT_PACKET command and the payload length in front of every payload
+#define PACKET_HEADER_SIZE (2 * sizeof(DWORD))
 
 typedef enum CommandEnum {
 	INITIALIZE_CONNECTION, CONNECTION_ACCEPTED, CONNECTION_REJECTED,
 	AUTHENTICATE, AUTH_SUCCESSFUL, AUTH_REJECTED, 
 	ENCRYPT_DATA, LAST_PACKET, NEXT_PACKET, 
 	DATA_ENCRYPTED, DATA_NOT_ENCRYPTED,
-	TERMINATE_CONNECTION
+	TERMINATE_CONNECTION,
+	INITIALIZE_CONNECTION_EX, NEXT_BATCH,
+	RESUME_SESSION
 }CommandE;
 
 typedef struct InitStruct {
@@ -18,24 +39,172 @@ typedef struct InitStruct {
 }InitT, *LPInitT;
 
 /*
- * Gets the next packet from the pipe.
+ * Protocol options. A client sending INITIALIZE_CONNECTION_EX follows its InitT with
+ * the options it asks for, the server answers CONNECTION_ACCEPTED with the options it grants.
+ * Clients sending INITIALIZE_CONNECTION get the original exchange: every packet is sent
+ * before the first encrypted packet is read.
+ */
+#define PROTOCOL_VERSION 5
+
+// encrypted packets come back while the client is still sending, it must read them concurrently
+#define INIT_PIPELINED 0x1
+// the peers may send NEXT_BATCH frames: the command, the number of packets,
+// then the length and the payload of every packet (version 2)
+#define INIT_BATCHED 0x2
+// the client picks the cipher: a CipherInitT follows its InitExT (version 3)
+#define INIT_CIPHER 0x4
+// the server follows AUTH_SUCCESSFUL with a session token, the client may take the session
+// over on a new connection with RESUME_SESSION when its connection breaks (version 4)
+#define INIT_RESUMABLE 0x8
+// the server compresses every packet before encrypting it and sends back records (see PacketRecordT),
+// the packets of the client are then at most cbMaxPacket - PACKET_RECORD_HEADER_SIZE bytes (version 5)
+#define INIT_COMPRESS 0x10
+// the way back: the client sends the records of a compressed file, the server decrypts and
+// decompresses them and sends back the packets they were made of (version 5)
+#define INIT_DECOMPRESS 0x20
+
+typedef struct InitExStruct {
+	DWORD dwVersion;
+	DWORD dwFlags;
+	// packets of the client the server holds at most at once when pipelined, 0 lets the server choose
+	DWORD nrWindow;
+	// largest packet payload either peer sends, 0 lets the server choose (version 2)
+	DWORD cbMaxPacket;
+}InitExT, *LPInitExT;
+
+/*
+ * Ciphers the server encrypts with. XOR repeats a key of any length and is the one
+ * used without INIT_CIPHER. The others take a key of exactly their key size and a nonce
+ * that must never be used twice with the same key.
+ */
+typedef enum CipherEnum {
+	CIPHER_XOR, CIPHER_CHACHA20, CIPHER_AES128_CTR, CIPHER_AES256_CTR,
+	NR_CIPHERS
+}CipherE;
+
+#define CIPHER_NONCE_SIZE 12
+
+/*
+ * Packets are numbered in the order they are sent, starting at qwFirstSequence, and each one is
+ * encrypted with a counter derived from the nonce and its number. A file split across connections
+ * gives each one the number of its first packet, so the ciphertext does not depend on the split.
+ */
+typedef struct CipherInitStruct {
+	DWORD dwCipher;
+	BYTE nonce[CIPHER_NONCE_SIZE];
+	ULONGLONG qwFirstSequence;
+}CipherInitT, *LPCipherInitT;
+
+/*
+ * A client holding a session token continues a broken connection on a new one: it sends an InitT
+ * with RESUME_SESSION and no credentials nor key, its InitExT, then a ResumeT.
+ * The server answers CONNECTION_ACCEPTED with the options it grants, then AUTH_SUCCESSFUL
+ * if it resumes the session, AUTH_REJECTED if the session is unknown, expired or still in use,
+ * or if it never sent the packets before qwSequence. The session keeps its token, no new one is sent.
+ * The packets are then numbered from qwSequence and encrypted with the cipher, key and nonce of the session.
+ */
+#define SESSION_TOKEN_SIZE 16
+
+typedef struct ResumeStruct {
+	BYTE token[SESSION_TOKEN_SIZE];
+	// number of the first packet the client did not get back, every packet before it was written
+	ULONGLONG qwSequence;
+}ResumeT, *LPResumeT;
+
+/*
+ * Payload of a packet sent back with INIT_COMPRESS: the header, then cbStored bytes encrypted
+ * as the packet of the same number. The header itself is not encrypted.
+ * The bytes are compressed in the LZ4 block format when cbStored < cbPlain,
+ * packets that do not get smaller are stored as they are, cbStored == cbPlain.
+ * A compressed file is the records one after the other, each one a packet of INIT_DECOMPRESS.
+ */
+typedef struct PacketRecordStruct {
+	// bytes of the packet of the client
+	DWORD cbPlain;
+	DWORD cbStored;
+}PacketRecordT, *LPPacketRecordT;
+
+#define PACKET_RECORD_HEADER_SIZE sizeof(PacketRecordT)
+
+/*
+ * Names of the ciphers, as given on the command line of the client:
+ * xor, chacha20, aes128-ctr and aes256-ctr.
+ *
+ * @return NULL for an unknown cipher.
+ */
+LPCTSTR getCipherName(DWORD dwCipher);
+
+/*
+ * @return the size the key of the cipher must have, 0 for XOR, which takes any length.
+ */
+DWORD getCipherKeySize(DWORD dwCipher);
+
+/*
+ * Reads packets framed with NEXT_PACKET or NEXT_BATCH, one header at a time,
+ * so the caller can pick a buffer for the payload once it knows its size.
+ */
+typedef struct PacketReaderTag {
+	LPConnectionT connection;
+	DWORD cbMaxPacket;
+	// packets of the current NEXT_BATCH frame not read yet
+	DWORD nrBatchLeft;
+}PacketReaderT, *LPPacketReaderT;
+
+VOID initPacketReader(LPPacketReaderT reader, LPConnectionT connection, DWORD cbMaxPacket);
+
+/*
+ * Reads the header of the next packet, the payload must be read next with transportRead.
+ *
+ * @param pcbPacketSize: the size of the payload, 0 when LAST_PACKET is the command.
+ * @return FALSE on a failed read, an unexpected command or a packet larger than cbMaxPacket.
+ */
+BOOL readPacketHeader(LPPacketReaderT reader, LPDWORD pcbPacketSize);
+
+/*
+ * Gets the next packet from the connection.
  * 
- * @param hPipe: handle to the pipe
+ * @param connection: connection to the peer
  * @param buff: buffer where the packet will be stored, it is 0 when LAST_PACKET is the command.
  * @param pcbPacketSize: where the size of the packet will be after successful operation.
  * @return if operation successful
 */
-BOOL getNextPacket(HANDLE hPipe, PTCHAR buff, LPDWORD pcbPacketSize);
+BOOL getNextPacket(LPConnectionT connection, PTCHAR buff, LPDWORD pcbPacketSize);
 
 /*
- * Sends the next packet to the pipe.
+ * Sends the next packet to the connection.
  * 
- * @param hPipe: handle to the pipe
+ * @param connection: connection to the peer
  * @param buff: buffer where the packet to be sent is stored.
  * @param cbPacketLen: the size of the packet to be sent.
  * @return if operation successful or not.
  */
-BOOL sendPacket(HANDLE hPipe, PTCHAR buff, DWORD cbPacketLen);
+BOOL sendPacket(LPConnectionT connection, PTCHAR buff, DWORD cbPacketLen);
+
+/*
+ * Writes the NEXT_PACKET header into the PACKET_HEADER_SIZE bytes in front of buff.
+ *
+ * @return the start of the framed packet, PACKET_HEADER_SIZE + cbPacketLen bytes long.
+ */
+PBYTE framePacket(PTCHAR buff, DWORD cbPacketLen);
+
+/*
+ * Same as sendPacket, but buff must be preceded by PACKET_HEADER_SIZE writable bytes:
+ * the header is written there and the whole packet goes out in one write.
+ */
+BOOL sendFramedPacket(LPConnectionT connection, PTCHAR buff, DWORD cbPacketLen);
+
+/*
+ * Sends the packets in a single NEXT_BATCH frame, with one gather write.
+ * Every buffer must be preceded by PACKET_HEADER_SIZE writable bytes, like for sendFramedPacket.
+ *
+ * @param nrPackets: at most MAX_BATCH_PACKETS.
+ */
+BOOL sendPacketBatch(LPConnectionT connection, PTCHAR *buffs, const DWORD *cbPacketLens, DWORD nrPackets);
+
+/*
+ * Sends a single command (LAST_PACKET, TERMINATE_CONNECTION, ...) to the connection.
+ */
+BOOL sendCommand(LPConnectionT connection, DWORD dwCommand);
 
 
 #endif
@@ -0,0 +1,1027 @@
+/*
+ * author: Acs David
+ * file name: Portability.h
+ * Maps the subset of the Win32 API used by the server and the client onto POSIX,
+ * in the spirit of thread_emulation.h from WSP4_Examples/INCLUDE.
+ * On Windows it only pulls in Everything.h, so the Win32 build is unchanged.
+ * The emulation is not complete, it covers only what this project calls.
+ */
+
+#ifndef PORTABILITY_H
+#define PORTABILITY_H
+
+#ifdef _WIN32
+
+// rand_s is declared by stdlib.h only when asked for
+#define _CRT_RAND_S
+#include "Everything.h"
+#include <crtdbg.h>
+
+// WaitOnAddress and WakeByAddressSingle
+#pragma comment(lib, "Synchronization.lib")
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <signal.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/* basic types */
+typedef uint32_t DWORD, *LPDWORD;
+typedef int32_t LONG;
+typedef long long LONGLONG;
+typedef uint16_t WORD;
+typedef unsigned long long ULONGLONG;
+typedef int BOOL;
+typedef int INT;
+typedef unsigned int UINT;
+typedef void VOID;
+typedef void *LPVOID;
+typedef const void *LPCVOID;
+typedef char CHAR;
+typedef char TCHAR, *PTCHAR, *LPTSTR;
+typedef const char *LPCTSTR;
+typedef unsigned char BYTE, *PBYTE, *LPBYTE;
+typedef size_t SIZE_T;
+typedef void *HANDLE, **LPHANDLE;
+
+#define TRUE 1
+#define FALSE 0
+#define WINAPI
+#define INFINITE 0xFFFFFFFF
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED 0xFFFFFFFF
+#define ERROR_TIMEOUT ETIMEDOUT
+
+/* generic text mappings, the project is built without UNICODE */
+#define _T(x) x
+#define _tmain main
+#define _tprintf printf
+#define _ftprintf fprintf
+#define _stprintf sprintf
+#define _sntprintf snprintf
+#define _vsntprintf vsnprintf
+#define _stscanf sscanf
+#define _tcslen strlen
+#define _tcscpy strcpy
+#define _tcsncpy strncpy
+#define _tcscat strcat
+#define _tcsdup strdup
+#define _tcscmp strcmp
+#define _tcsncmp strncmp
+#define _tcschr strchr
+#define _tcsrchr strrchr
+#define _tcstok strtok
+#define _tcstoul strtoul
+#define _fgetts fgets
+#define _tfopen fopen
+#define _tremove remove
+#define _trename rename
+#define _ttoi atoi
+
+/* debug heap flags have no meaning outside of the MS CRT */
+#define _CRTDBG_CHECK_ALWAYS_DF 0
+#define _CrtSetDbgFlag(flags) ((void)(flags))
+
+#define ExitProcess(code) exit(code)
+#define Sleep(ms) usleep((useconds_t)(ms) * 1000)
+
+inline DWORD GetLastError()
+{
+	return (DWORD)errno;
+}
+
+inline DWORD GetCurrentThreadId()
+{
+	return (DWORD)(uintptr_t)pthread_self();
+}
+
+/* time */
+typedef struct _SYSTEMTIME {
+	WORD wYear;
+	WORD wMonth;
+	WORD wDayOfWeek;
+	WORD wDay;
+	WORD wHour;
+	WORD wMinute;
+	WORD wSecond;
+	WORD wMilliseconds;
+}SYSTEMTIME, *LPSYSTEMTIME;
+
+inline VOID GetLocalTime(LPSYSTEMTIME st)
+{
+	struct timeval tv;
+	struct tm tmLocal;
+
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &tmLocal);
+	st->wYear = (WORD)(tmLocal.tm_year + 1900);
+	st->wMonth = (WORD)(tmLocal.tm_mon + 1);
+	st->wDayOfWeek = (WORD)tmLocal.tm_wday;
+	st->wDay = (WORD)tmLocal.tm_mday;
+	st->wHour = (WORD)tmLocal.tm_hour;
+	st->wMinute = (WORD)tmLocal.tm_min;
+	st->wSecond = (WORD)tmLocal.tm_sec;
+	st->wMilliseconds = (WORD)(tv.tv_usec / 1000);
+}
+
+/* performance counter, in nanoseconds */
+typedef union _LARGE_INTEGER {
+	LONGLONG QuadPart;
+}LARGE_INTEGER;
+
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER *counter)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	counter->QuadPart = (LONGLONG)now.tv_sec * 1000000000 + now.tv_nsec;
+	return TRUE;
+}
+
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency)
+{
+	frequency->QuadPart = 1000000000;
+	return TRUE;
+}
+
+/* milliseconds since an unspecified point, they never go back */
+inline ULONGLONG GetTickCount64()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (ULONGLONG)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* interlocked operations, all of them are full barriers as on Windows */
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YieldProcessor() __builtin_ia32_pause()
+#else
+#define YieldProcessor() ((void)0)
+#endif
+
+inline LONG InterlockedIncrement(LONG volatile *addend)
+{
+	return __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedDecrement(LONG volatile *addend)
+{
+	return __atomic_sub_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchangeAdd(LONG volatile *addend, LONG value)
+{
+	return __atomic_fetch_add(addend, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedExchange(LONG volatile *target, LONG value)
+{
+	return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG InterlockedCompareExchange(LONG volatile *destination, LONG exchange, LONG comparand)
+{
+	__atomic_compare_exchange_n(destination, &comparand, exchange, FALSE, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return comparand;
+}
+
+inline LONG ReadAcquire(LONG const volatile *source)
+{
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+inline VOID WriteRelease(LONG volatile *destination, LONG value)
+{
+	__atomic_store_n(destination, value, __ATOMIC_RELEASE);
+}
+
+inline LONGLONG InterlockedExchangeAdd64(LONGLONG volatile *addend, LONGLONG value)
+{
+	return __atomic_fetch_add(addend, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONGLONG InterlockedIncrement64(LONGLONG volatile *addend)
+{
+	return __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+inline LONGLONG ReadAcquire64(LONGLONG const volatile *source)
+{
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+inline VOID WriteRelease64(LONGLONG volatile *destination, LONGLONG value)
+{
+	__atomic_store_n(destination, value, __ATOMIC_RELEASE);
+}
+
+inline LPVOID ReadPointerAcquire(LPVOID const volatile *source)
+{
+	return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+inline VOID WritePointerRelease(LPVOID volatile *destination, LPVOID value)
+{
+	__atomic_store_n(destination, value, __ATOMIC_RELEASE);
+}
+
+/*
+ * Address waits are futexes on Linux, only 4 byte values are supported.
+ * Elsewhere the wait degrades to a short sleep, callers recheck their condition anyway.
+ */
+inline BOOL WaitOnAddress(volatile VOID *address, LPVOID compareAddress, SIZE_T addressSize, DWORD dwMilliseconds)
+{
+#ifdef __linux__
+	struct timespec timeout;
+
+	timeout.tv_sec = dwMilliseconds / 1000;
+	timeout.tv_nsec = (long)(dwMilliseconds % 1000) * 1000000;
+	return syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, *(int32_t*)compareAddress,
+		dwMilliseconds == INFINITE ? NULL : &timeout, NULL, 0) == 0 || errno == EAGAIN;
+#else
+	usleep(1000);
+	return TRUE;
+#endif
+}
+
+inline VOID WakeByAddressSingle(LPVOID address)
+{
+#ifdef __linux__
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+inline VOID WakeByAddressAll(LPVOID address)
+{
+#ifdef __linux__
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* critical sections and condition variables (critical sections are recursive on Windows) */
+typedef pthread_mutex_t CRITICAL_SECTION, *LPCRITICAL_SECTION;
+typedef pthread_cond_t CONDITION_VARIABLE, *PCONDITION_VARIABLE;
+
+inline VOID InitializeCriticalSection(LPCRITICAL_SECTION cs)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(cs, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+inline VOID DeleteCriticalSection(LPCRITICAL_SECTION cs)
+{
+	pthread_mutex_destroy(cs);
+}
+
+inline VOID EnterCriticalSection(LPCRITICAL_SECTION cs)
+{
+	pthread_mutex_lock(cs);
+}
+
+inline VOID LeaveCriticalSection(LPCRITICAL_SECTION cs)
+{
+	pthread_mutex_unlock(cs);
+}
+
+inline VOID InitializeConditionVariable(PCONDITION_VARIABLE cv)
+{
+	pthread_cond_init(cv, NULL);
+}
+
+inline BOOL SleepConditionVariableCS(PCONDITION_VARIABLE cv, LPCRITICAL_SECTION cs, DWORD dwMilliseconds)
+{
+	struct timespec deadline;
+	INT result;
+
+	if (dwMilliseconds == INFINITE) {
+		return pthread_cond_wait(cv, cs) == 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += dwMilliseconds / 1000;
+	deadline.tv_nsec += (long)(dwMilliseconds % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	result = pthread_cond_timedwait(cv, cs, &deadline);
+	if (result != 0) {
+		errno = result;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+inline VOID WakeConditionVariable(PCONDITION_VARIABLE cv)
+{
+	pthread_cond_signal(cv);
+}
+
+inline VOID WakeAllConditionVariable(PCONDITION_VARIABLE cv)
+{
+	pthread_cond_broadcast(cv);
+}
+
+/*
+ * Kernel object emulation. Threads, files and processes share the HANDLE type,
+ * so CloseHandle and WaitForSingleObject can tell them apart.
+ */
+#define PORTABLE_HANDLE_FILE 1
+#define PORTABLE_HANDLE_THREAD 2
+#define PORTABLE_HANDLE_MAPPING 3
+#define PORTABLE_HANDLE_PROCESS 4
+
+typedef struct PortableHandleTag {
+	DWORD dwType;
+	// the file descriptor, or the id of a process
+	INT fd;
+	pthread_t thread;
+	BOOL bJoined;
+	// size and protection of a file mapping
+	ULONGLONG cbMapping;
+	DWORD flProtect;
+}PortableHandleT, *LPPortableHandleT;
+
+typedef unsigned (*_beginthreadex_proc_type)(void *);
+
+typedef struct PortableThreadStartTag {
+	_beginthreadex_proc_type proc;
+	void *arg;
+}PortableThreadStartT, *LPPortableThreadStartT;
+
+inline void *portableThreadStart(void *arg)
+{
+	PortableThreadStartT start = *(LPPortableThreadStartT)arg;
+
+	free(arg);
+	start.proc(start.arg);
+	return NULL;
+}
+
+inline uintptr_t _beginthreadex(void *security, unsigned stackSize, _beginthreadex_proc_type proc,
+	void *arg, unsigned initFlags, unsigned *threadId)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)malloc(sizeof(PortableHandleT));
+	LPPortableThreadStartT start = (LPPortableThreadStartT)malloc(sizeof(PortableThreadStartT));
+
+	if (handle == NULL || start == NULL) {
+		free(handle);
+		free(start);
+		return 0;
+	}
+
+	start->proc = proc;
+	start->arg = arg;
+	handle->dwType = PORTABLE_HANDLE_THREAD;
+	handle->fd = -1;
+	handle->bJoined = FALSE;
+
+	if (pthread_create(&handle->thread, NULL, portableThreadStart, start) != 0) {
+		free(handle);
+		free(start);
+		return 0;
+	}
+
+	if (threadId != NULL) {
+		*threadId = (unsigned)(uintptr_t)handle->thread;
+	}
+	return (uintptr_t)handle;
+}
+
+inline DWORD WaitForSingleObject(HANDLE hObject, DWORD dwMilliseconds)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)hObject;
+
+	if (handle == NULL || handle->dwType != PORTABLE_HANDLE_THREAD) {
+		return WAIT_FAILED;
+	}
+	if (handle->bJoined) {
+		return WAIT_OBJECT_0;
+	}
+
+	if (dwMilliseconds != INFINITE) {
+#ifdef __linux__
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += dwMilliseconds / 1000;
+		deadline.tv_nsec += (long)(dwMilliseconds % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if (pthread_timedjoin_np(handle->thread, NULL, &deadline) != 0) {
+			return WAIT_TIMEOUT;
+		}
+		handle->bJoined = TRUE;
+		return WAIT_OBJECT_0;
+#else
+		return WAIT_TIMEOUT;
+#endif
+	}
+
+	if (pthread_join(handle->thread, NULL) != 0) {
+		return WAIT_FAILED;
+	}
+	handle->bJoined = TRUE;
+	return WAIT_OBJECT_0;
+}
+
+/* files */
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define CREATE_NEW 1
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define FILE_ATTRIBUTE_NORMAL 0x80
+
+inline HANDLE CreateFile(LPCTSTR path, DWORD dwAccess, DWORD dwShareMode, LPVOID security,
+	DWORD dwCreation, DWORD dwFlags, HANDLE hTemplate)
+{
+	INT flags;
+	LPPortableHandleT handle;
+
+	if ((dwAccess & GENERIC_READ) && (dwAccess & GENERIC_WRITE)) {
+		flags = O_RDWR;
+	} else if (dwAccess & GENERIC_WRITE) {
+		flags = O_WRONLY;
+	} else {
+		flags = O_RDONLY;
+	}
+
+	switch (dwCreation) {
+	case CREATE_NEW:
+		flags |= O_CREAT | O_EXCL;
+		break;
+	case CREATE_ALWAYS:
+		flags |= O_CREAT | O_TRUNC;
+		break;
+	case OPEN_ALWAYS:
+		flags |= O_CREAT;
+		break;
+	default:
+		break;
+	}
+
+	handle = (LPPortableHandleT)malloc(sizeof(PortableHandleT));
+	if (handle == NULL) {
+		return INVALID_HANDLE_VALUE;
+	}
+
+	handle->fd = open(path, flags, 0644);
+	if (handle->fd < 0) {
+		free(handle);
+		return INVALID_HANDLE_VALUE;
+	}
+	handle->dwType = PORTABLE_HANDLE_FILE;
+	handle->bJoined = FALSE;
+	return handle;
+}
+
+/* only the offset is used, a transfer with an OVERLAPPED leaves the file position alone */
+typedef struct _OVERLAPPED {
+	DWORD Offset;
+	DWORD OffsetHigh;
+	HANDLE hEvent;
+}OVERLAPPED, *LPOVERLAPPED;
+
+inline off_t overlappedOffset(LPOVERLAPPED overlapped, DWORD cbDone)
+{
+	return (off_t)(((ULONGLONG)overlapped->OffsetHigh << 32) | overlapped->Offset) + cbDone;
+}
+
+inline BOOL ReadFile(HANDLE hFile, LPVOID buff, DWORD cbToRead, LPDWORD pcbRead, LPOVERLAPPED overlapped)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)hFile;
+	ssize_t cbResult;
+	DWORD cbDone = 0;
+
+	while (cbDone < cbToRead) {
+		if (overlapped != NULL) {
+			cbResult = pread(handle->fd, (char*)buff + cbDone, cbToRead - cbDone, overlappedOffset(overlapped, cbDone));
+		} else {
+			cbResult = read(handle->fd, (char*)buff + cbDone, cbToRead - cbDone);
+		}
+		if (cbResult < 0 && errno == EINTR) {
+			continue;
+		}
+		if (cbResult < 0) {
+			*pcbRead = cbDone;
+			return FALSE;
+		}
+		if (cbResult == 0) {
+			break;
+		}
+		cbDone += (DWORD)cbResult;
+	}
+
+	*pcbRead = cbDone;
+	return TRUE;
+}
+
+inline BOOL WriteFile(HANDLE hFile, const void *buff, DWORD cbToWrite, LPDWORD pcbWritten, LPOVERLAPPED overlapped)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)hFile;
+	ssize_t cbResult;
+	DWORD cbDone = 0;
+
+	while (cbDone < cbToWrite) {
+		if (overlapped != NULL) {
+			cbResult = pwrite(handle->fd, (const char*)buff + cbDone, cbToWrite - cbDone, overlappedOffset(overlapped, cbDone));
+		} else {
+			cbResult = write(handle->fd, (const char*)buff + cbDone, cbToWrite - cbDone);
+		}
+		if (cbResult < 0 && errno == EINTR) {
+			continue;
+		}
+		if (cbResult < 0) {
+			*pcbWritten = cbDone;
+			return FALSE;
+		}
+		cbDone += (DWORD)cbResult;
+	}
+
+	*pcbWritten = cbDone;
+	return TRUE;
+}
+
+inline BOOL GetFileSizeEx(HANDLE hFile, LARGE_INTEGER *size)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)hFile;
+	struct stat st;
+
+	if (fstat(handle->fd, &st) != 0) {
+		return FALSE;
+	}
+	size->QuadPart = (LONGLONG)st.st_size;
+	return TRUE;
+}
+
+typedef struct _FILETIME {
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+}FILETIME;
+
+typedef struct _WIN32_FILE_ATTRIBUTE_DATA {
+	DWORD dwFileAttributes;
+	FILETIME ftCreationTime;
+	FILETIME ftLastAccessTime;
+	FILETIME ftLastWriteTime;
+	DWORD nFileSizeHigh;
+	DWORD nFileSizeLow;
+}WIN32_FILE_ATTRIBUTE_DATA;
+
+typedef enum _GET_FILEEX_INFO_LEVELS {
+	GetFileExInfoStandard
+}GET_FILEEX_INFO_LEVELS;
+
+inline VOID toFileTime(struct timespec *time, FILETIME *fileTime)
+{
+	// 100 ns intervals since 1601
+	ULONGLONG qwTime = (ULONGLONG)time->tv_sec * 10000000 + time->tv_nsec / 100 + 116444736000000000ULL;
+
+	fileTime->dwLowDateTime = (DWORD)qwTime;
+	fileTime->dwHighDateTime = (DWORD)(qwTime >> 32);
+}
+
+/* only the standard level exists, the attributes are 0 */
+inline BOOL GetFileAttributesEx(LPCTSTR sFileName, GET_FILEEX_INFO_LEVELS infoLevel, LPVOID fileInformation)
+{
+	WIN32_FILE_ATTRIBUTE_DATA *data = (WIN32_FILE_ATTRIBUTE_DATA*)fileInformation;
+	struct timespec time;
+	struct stat st;
+
+	if (stat(sFileName, &st) != 0) {
+		return FALSE;
+	}
+	memset(data, 0, sizeof(WIN32_FILE_ATTRIBUTE_DATA));
+#ifdef __linux__
+	time = st.st_mtim;
+#else
+	time.tv_sec = st.st_mtime;
+	time.tv_nsec = 0;
+#endif
+	toFileTime(&time, &data->ftLastWriteTime);
+	data->nFileSizeHigh = (DWORD)((ULONGLONG)st.st_size >> 32);
+	data->nFileSizeLow = (DWORD)st.st_size;
+	return TRUE;
+}
+
+/*
+ * Process handles only give the CPU times of the process, other processes are read from /proc on Linux.
+ * As on Windows, the handle of the current process is a pseudo handle that needs no closing.
+ */
+#define PROCESS_QUERY_LIMITED_INFORMATION 0x1000
+
+inline HANDLE GetCurrentProcess()
+{
+	return (HANDLE)(intptr_t)-1;
+}
+
+inline HANDLE OpenProcess(DWORD dwDesiredAccess, BOOL bInheritHandle, DWORD dwProcessId)
+{
+	LPPortableHandleT handle;
+
+	if (kill((pid_t)dwProcessId, 0) != 0 && errno != EPERM) {
+		return NULL;
+	}
+	handle = (LPPortableHandleT)malloc(sizeof(PortableHandleT));
+	if (handle == NULL) {
+		return NULL;
+	}
+	handle->dwType = PORTABLE_HANDLE_PROCESS;
+	handle->fd = (INT)dwProcessId;
+	return (HANDLE)handle;
+}
+
+inline VOID toFileTimeSpan(ULONGLONG qwMicroseconds, FILETIME *fileTime)
+{
+	ULONGLONG qwTime = qwMicroseconds * 10;
+
+	fileTime->dwLowDateTime = (DWORD)qwTime;
+	fileTime->dwHighDateTime = (DWORD)(qwTime >> 32);
+}
+
+/* only the kernel and user times are set */
+inline BOOL GetProcessTimes(HANDLE hProcess, FILETIME *creationTime, FILETIME *exitTime, FILETIME *kernelTime, FILETIME *userTime)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)hProcess;
+
+	memset(creationTime, 0, sizeof(FILETIME));
+	memset(exitTime, 0, sizeof(FILETIME));
+	if (hProcess == GetCurrentProcess()) {
+		struct rusage usage;
+
+		if (getrusage(RUSAGE_SELF, &usage) != 0) {
+			return FALSE;
+		}
+		toFileTimeSpan((ULONGLONG)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec, kernelTime);
+		toFileTimeSpan((ULONGLONG)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec, userTime);
+		return TRUE;
+	}
+	if (handle == NULL || handle->dwType != PORTABLE_HANDLE_PROCESS) {
+		return FALSE;
+	}
+
+#ifdef __linux__
+	CHAR sPath[64];
+	CHAR sStat[1024];
+	CHAR *sFields;
+	unsigned long long qwUser;
+	unsigned long long qwKernel;
+	long nrTicks = sysconf(_SC_CLK_TCK);
+	FILE *file;
+	size_t cbStat;
+
+	snprintf(sPath, sizeof(sPath), "/proc/%d/stat", handle->fd);
+	file = fopen(sPath, "r");
+	if (file == NULL) {
+		return FALSE;
+	}
+	cbStat = fread(sStat, 1, sizeof(sStat) - 1, file);
+	fclose(file);
+	sStat[cbStat] = '\0';
+
+	// the name in parentheses may hold spaces, the fields after it start with the state
+	sFields = strrchr(sStat, ')');
+	if (sFields == NULL || nrTicks <= 0 ||
+		sscanf(sFields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &qwUser, &qwKernel) != 2) {
+		return FALSE;
+	}
+	toFileTimeSpan(qwKernel * 1000000 / nrTicks, kernelTime);
+	toFileTimeSpan(qwUser * 1000000 / nrTicks, userTime);
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+#define FILE_BEGIN 0
+#define FILE_CURRENT 1
+#define FILE_END 2
+
+inline BOOL SetFilePointerEx(HANDLE hFile, LARGE_INTEGER distance, LARGE_INTEGER *newPointer, DWORD dwMoveMethod)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)hFile;
+	INT whence = (dwMoveMethod == FILE_BEGIN) ? SEEK_SET : (dwMoveMethod == FILE_END) ? SEEK_END : SEEK_CUR;
+	off_t offset = lseek(handle->fd, (off_t)distance.QuadPart, whence);
+
+	if (offset < 0) {
+		return FALSE;
+	}
+	if (newPointer != NULL) {
+		newPointer->QuadPart = (LONGLONG)offset;
+	}
+	return TRUE;
+}
+
+/* cuts the file at the current position */
+inline BOOL SetEndOfFile(HANDLE hFile)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)hFile;
+	off_t offset = lseek(handle->fd, 0, SEEK_CUR);
+
+	return offset >= 0 && ftruncate(handle->fd, offset) == 0;
+}
+
+inline BOOL FlushFileBuffers(HANDLE hFile)
+{
+	return fsync(((LPPortableHandleT)hFile)->fd) == 0;
+}
+
+#define MOVEFILE_REPLACE_EXISTING 0x01
+#define MOVEFILE_WRITE_THROUGH 0x08
+
+/*
+ * rename replaces the target atomically, with MOVEFILE_WRITE_THROUGH
+ * the directory is synced as well so the new name survives a crash.
+ */
+inline BOOL MoveFileEx(LPCTSTR sFrom, LPCTSTR sTo, DWORD dwFlags)
+{
+	TCHAR sDirectory[PATH_MAX];
+	PTCHAR sSlash;
+	INT fd;
+	BOOL bSynced = TRUE;
+
+	if (!(dwFlags & MOVEFILE_REPLACE_EXISTING) && access(sTo, F_OK) == 0) {
+		return FALSE;
+	}
+	if (rename(sFrom, sTo) != 0) {
+		return FALSE;
+	}
+	if (!(dwFlags & MOVEFILE_WRITE_THROUGH)) {
+		return TRUE;
+	}
+
+	strncpy(sDirectory, sTo, PATH_MAX - 1);
+	sDirectory[PATH_MAX - 1] = '\0';
+	sSlash = strrchr(sDirectory, '/');
+	if (sSlash == NULL) {
+		strcpy(sDirectory, ".");
+	} else if (sSlash == sDirectory) {
+		sSlash[1] = '\0';
+	} else {
+		*sSlash = '\0';
+	}
+	fd = open(sDirectory, O_RDONLY);
+	if (fd < 0) {
+		return FALSE;
+	}
+	bSynced = fsync(fd) == 0;
+	close(fd);
+	return bSynced;
+}
+
+#define FILE_TYPE_UNKNOWN 0x0000
+#define FILE_TYPE_DISK 0x0001
+#define FILE_TYPE_CHAR 0x0002
+#define FILE_TYPE_PIPE 0x0003
+
+inline DWORD GetFileType(HANDLE hFile)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)hFile;
+	struct stat st;
+
+	if (fstat(handle->fd, &st) != 0) {
+		return FILE_TYPE_UNKNOWN;
+	}
+	if (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) {
+		return FILE_TYPE_DISK;
+	}
+	if (S_ISCHR(st.st_mode)) {
+		return FILE_TYPE_CHAR;
+	}
+	if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) {
+		return FILE_TYPE_PIPE;
+	}
+	return FILE_TYPE_UNKNOWN;
+}
+
+/* the standard handles are shared by the whole process, they must not be closed */
+#define STD_INPUT_HANDLE ((DWORD)-10)
+#define STD_OUTPUT_HANDLE ((DWORD)-11)
+#define STD_ERROR_HANDLE ((DWORD)-12)
+
+inline HANDLE GetStdHandle(DWORD nStdHandle)
+{
+	static PortableHandleT stdHandles[3] = {
+		{ PORTABLE_HANDLE_FILE, 0 }, { PORTABLE_HANDLE_FILE, 1 }, { PORTABLE_HANDLE_FILE, 2 }
+	};
+
+	switch (nStdHandle) {
+	case STD_INPUT_HANDLE:
+		return &stdHandles[0];
+	case STD_OUTPUT_HANDLE:
+		return &stdHandles[1];
+	case STD_ERROR_HANDLE:
+		return &stdHandles[2];
+	default:
+		return INVALID_HANDLE_VALUE;
+	}
+}
+
+/*
+ * File mappings. As on Windows a read-write mapping larger than the file extends it.
+ * munmap needs the length UnmapViewOfFile does not get, so every view is preceded
+ * by a private page holding the reserved range. Views are aligned to 2 MB as the
+ * kernel does for large mappings, so the page cache can map them with large pages.
+ */
+#define PAGE_READONLY 0x02
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_WRITE 0x0002
+#define FILE_MAP_READ 0x0004
+
+#define PORTABLE_VIEW_ALIGNMENT (2 * 1024 * 1024)
+
+typedef struct PortableViewTag {
+	PBYTE base;
+	size_t cbReserved;
+}PortableViewT, *LPPortableViewT;
+
+inline HANDLE CreateFileMapping(HANDLE hFile, LPVOID security, DWORD flProtect,
+	DWORD dwMaximumSizeHigh, DWORD dwMaximumSizeLow, LPCTSTR name)
+{
+	LPPortableHandleT file = (LPPortableHandleT)hFile;
+	LPPortableHandleT handle;
+	ULONGLONG cbMapping = ((ULONGLONG)dwMaximumSizeHigh << 32) | dwMaximumSizeLow;
+	struct stat st;
+	INT error;
+
+	if (fstat(file->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		return NULL;
+	}
+
+	if (cbMapping == 0) {
+		cbMapping = (ULONGLONG)st.st_size;
+	} else if (cbMapping > (ULONGLONG)st.st_size) {
+		if (flProtect != PAGE_READWRITE) {
+			return NULL;
+		}
+		// reserve the blocks, a write to a sparse page on a full disk would raise SIGBUS
+		error = posix_fallocate(file->fd, 0, (off_t)cbMapping);
+		if (error == EOPNOTSUPP || error == EINVAL) {
+			error = ftruncate(file->fd, (off_t)cbMapping);
+		}
+		if (error != 0) {
+			return NULL;
+		}
+	}
+	if (cbMapping == 0) {
+		// empty files cannot be mapped on Windows either
+		return NULL;
+	}
+
+	handle = (LPPortableHandleT)malloc(sizeof(PortableHandleT));
+	if (handle == NULL) {
+		return NULL;
+	}
+	handle->fd = dup(file->fd);
+	if (handle->fd < 0) {
+		free(handle);
+		return NULL;
+	}
+	handle->dwType = PORTABLE_HANDLE_MAPPING;
+	handle->bJoined = FALSE;
+	handle->cbMapping = cbMapping;
+	handle->flProtect = flProtect;
+	return handle;
+}
+
+inline LPVOID MapViewOfFile(HANDLE hMapping, DWORD dwDesiredAccess,
+	DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T cbToMap)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)hMapping;
+	ULONGLONG qwOffset = ((ULONGLONG)dwFileOffsetHigh << 32) | dwFileOffsetLow;
+	size_t cbPage = (size_t)sysconf(_SC_PAGESIZE);
+	INT prot = (dwDesiredAccess & FILE_MAP_WRITE) ? PROT_READ | PROT_WRITE : PROT_READ;
+	size_t cbReserved;
+	PBYTE base;
+	PBYTE view;
+
+	if (handle == NULL || handle->dwType != PORTABLE_HANDLE_MAPPING || qwOffset >= handle->cbMapping) {
+		return NULL;
+	}
+	if ((prot & PROT_WRITE) && handle->flProtect != PAGE_READWRITE) {
+		return NULL;
+	}
+	if (cbToMap == 0) {
+		cbToMap = (SIZE_T)(handle->cbMapping - qwOffset);
+	}
+
+	cbReserved = cbPage + PORTABLE_VIEW_ALIGNMENT + cbToMap;
+	base = (PBYTE)mmap(NULL, cbReserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+	view = (PBYTE)(((uintptr_t)base + cbPage + PORTABLE_VIEW_ALIGNMENT - 1) & ~(uintptr_t)(PORTABLE_VIEW_ALIGNMENT - 1));
+	if (mmap(view, cbToMap, prot, MAP_SHARED | MAP_FIXED, handle->fd, (off_t)qwOffset) == MAP_FAILED) {
+		munmap(base, cbReserved);
+		return NULL;
+	}
+	((LPPortableViewT)(view - cbPage))->base = base;
+	((LPPortableViewT)(view - cbPage))->cbReserved = cbReserved;
+	return view;
+}
+
+inline BOOL UnmapViewOfFile(LPCVOID view)
+{
+	size_t cbPage = (size_t)sysconf(_SC_PAGESIZE);
+	PortableViewT reserved = *(LPPortableViewT)((PBYTE)view - cbPage);
+
+	return munmap(reserved.base, reserved.cbReserved) == 0;
+}
+
+inline BOOL CloseHandle(HANDLE hObject)
+{
+	LPPortableHandleT handle = (LPPortableHandleT)hObject;
+
+	if (handle == NULL || handle == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+
+	if (handle->dwType == PORTABLE_HANDLE_FILE || handle->dwType == PORTABLE_HANDLE_MAPPING) {
+		close(handle->fd);
+	} else if (handle->dwType == PORTABLE_HANDLE_THREAD && !handle->bJoined) {
+		pthread_detach(handle->thread);
+	}
+
+	free(handle);
+	return TRUE;
+}
+
+/* private heaps are plain malloc on POSIX, the process heap allocator is already thread safe */
+#define HEAP_ZERO_MEMORY 0x00000008
+
+inline HANDLE HeapCreate(DWORD flOptions, SIZE_T dwInitialSize, SIZE_T dwMaximumSize)
+{
+	return (HANDLE)(intptr_t)1;
+}
+
+inline LPVOID HeapAlloc(HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes)
+{
+	return (dwFlags & HEAP_ZERO_MEMORY) ? calloc(1, dwBytes) : malloc(dwBytes);
+}
+
+inline LPVOID HeapReAlloc(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem, SIZE_T dwBytes)
+{
+	return realloc(lpMem, dwBytes);
+}
+
+inline BOOL HeapFree(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem)
+{
+	free(lpMem);
+	return TRUE;
+}
+
+inline BOOL HeapDestroy(HANDLE hHeap)
+{
+	return TRUE;
+}
+
+/* rand_s draws from the cryptographic generator of the system, as on Windows */
+typedef int errno_t;
+
+inline errno_t rand_s(UINT *pValue)
+{
+	INT fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	ssize_t cbRead;
+
+	if (fd < 0) {
+		return errno;
+	}
+	cbRead = read(fd, pValue, sizeof(UINT));
+	close(fd);
+	return (cbRead == sizeof(UINT)) ? 0 : EIO;
+}
+
+#endif
+
+#endif
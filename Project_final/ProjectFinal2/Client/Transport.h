@@ -0,0 +1,167 @@
+#pragma once
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "Portability.h"
+
+/*
+ * Transport layer used by the communication protocol.
+ * A transport address has the form <scheme>:<location>:
+ *     pipe:<pipename>        named pipe \\.\pipe\<pipename> (Windows only)
+ *     unix:<path>            AF_UNIX stream socket bound to <path>
+ *     tcp:[<host>:]<port>    TCP socket, the host defaults to 127.0.0.1
+ * An address without a known scheme is treated as a full named pipe path,
+ * which keeps the pipe.txt files written by older servers usable.
+ */
+
+typedef enum TransportKindEnum {
+	TRANSPORT_PIPE, TRANSPORT_UNIX, TRANSPORT_TCP
+}TransportKindE;
+
+#ifdef _WIN32
+typedef SOCKET TransportSocketT;
+#else
+typedef INT TransportSocketT;
+#endif
+
+struct ConnectionTag;
+
+// buffers written with one gather call at most
+#define TRANSPORT_MAX_GATHER 64
+
+/*
+ * One of the buffers of a gather write.
+ */
+typedef struct TransportBufferTag {
+	const void *buff;
+	DWORD cbBuff;
+}TransportBufferT, *LPTransportBufferT;
+
+/*
+ * Operations implemented by every transport backend.
+ * read and write transfer exactly the requested number of bytes or fail.
+ */
+typedef struct TransportOpsTag {
+	BOOL(*read)(struct ConnectionTag *connection, LPVOID buff, DWORD cbToRead);
+	BOOL(*write)(struct ConnectionTag *connection, const void *buff, DWORD cbToWrite);
+	BOOL(*writeGather)(struct ConnectionTag *connection, const TransportBufferT *buffers, DWORD nrBuffers);
+	VOID(*interrupt)(struct ConnectionTag *connection);
+	VOID(*close)(struct ConnectionTag *connection);
+}TransportOpsT;
+
+typedef struct ConnectionTag {
+	const TransportOpsT *ops;
+	TransportKindE kind;
+	HANDLE hPipe;
+	TransportSocketT socket;
+}ConnectionT, *LPConnectionT;
+
+typedef struct ListenerTag {
+	TransportKindE kind;
+	PTCHAR sAddress;
+	PTCHAR sLocation;
+	TransportSocketT socket;
+}ListenerT, *LPListenerT;
+
+/*
+ * Creates a listener on the given transport address.
+ *
+ * @return the listener, or NULL if the address is invalid or it could not be bound.
+ */
+LPListenerT createListener(LPCTSTR sAddress);
+
+/*
+ * Blocks until a client connects to the listener.
+ *
+ * @return the connection, or NULL on failure.
+ */
+LPConnectionT acceptConnection(LPListenerT listener);
+
+/*
+ * Returns the address clients should use to connect to the listener.
+ * For named pipes this is the full pipe path, as in the pipe.txt of older servers.
+ */
+PTCHAR getListenerAddress(LPListenerT listener);
+
+VOID closeListener(LPListenerT listener);
+
+/*
+ * Connects to a server listening on sAddress.
+ *
+ * @return the connection, or NULL on failure.
+ */
+LPConnectionT connectTransport(LPCTSTR sAddress);
+
+/*
+ * Reads exactly cbToRead bytes from the connection.
+ *
+ * @return FALSE if the connection failed or was closed before all bytes arrived.
+ */
+BOOL transportRead(LPConnectionT connection, LPVOID buff, DWORD cbToRead);
+
+/*
+ * Writes exactly cbToWrite bytes to the connection.
+ */
+BOOL transportWrite(LPConnectionT connection, const void *buff, DWORD cbToWrite);
+
+/*
+ * Writes the buffers one after the other, with a single system call when the transport allows it.
+ *
+ * @param nrBuffers: at most TRANSPORT_MAX_GATHER.
+ */
+BOOL transportWriteGather(LPConnectionT connection, const TransportBufferT *buffers, DWORD nrBuffers);
+
+/*
+ * Makes the reads and writes blocked on the connection in other threads fail, and the later ones as well.
+ * The connection stays allocated, it still has to be closed.
+ */
+VOID interruptConnection(LPConnectionT connection);
+
+/*
+ * Closes the connection and frees it.
+ */
+VOID closeConnection(LPConnectionT connection);
+
+/*
+ * Makes a blocking read or write that waits longer than dwTimeoutMs fail, socket backends only.
+ *
+ * @return FALSE for named pipes or if the timeout could not be set.
+ */
+BOOL setConnectionTimeout(LPConnectionT connection, DWORD dwTimeoutMs);
+
+/*
+ * Non-blocking access for event driven servers, socket backends only.
+ */
+
+/*
+ * Puts the connection in non-blocking mode.
+ *
+ * @return FALSE for named pipes or if the mode could not be changed.
+ */
+BOOL setConnectionNonBlocking(LPConnectionT connection);
+
+/*
+ * Reads at most cbMax bytes from a non-blocking connection.
+ * *pcbRead is 0 when no data is available yet.
+ *
+ * @return FALSE if the connection failed or the peer closed it.
+ */
+BOOL transportReadSome(LPConnectionT connection, LPVOID buff, DWORD cbMax, LPDWORD pcbRead);
+
+/*
+ * Writes at most cbMax bytes to a non-blocking connection.
+ * *pcbWritten is 0 when the send buffer is full.
+ *
+ * @return FALSE if the connection failed.
+ */
+BOOL transportWriteSome(LPConnectionT connection, const void *buff, DWORD cbMax, LPDWORD pcbWritten);
+
+/*
+ * Gather variant of transportWriteSome, *pcbWritten counts the bytes of all the buffers.
+ *
+ * @param nrBuffers: at most TRANSPORT_MAX_GATHER.
+ */
+BOOL transportWriteSomeGather(LPConnectionT connection, const TransportBufferT *buffers, DWORD nrBuffers, LPDWORD pcbWritten);
+
+#endif
@@ -0,0 +1,586 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Accounting.h"
+
+// users of the snapshot or the journal that are not in the credential file
+typedef struct OrphanAccountTag {
+	PTCHAR sUserName;
+	ULONGLONG qwTotal;
+	struct OrphanAccountTag *next;
+}OrphanAccountT, *LPOrphanAccountT;
+
+// a credential of the batch, its journaled total once the batch is on disk
+typedef struct PendingRecordTag {
+	LPCredentialT credential;
+	ULONGLONG qwJournaled;
+}PendingRecordT, *LPPendingRecordT;
+
+typedef struct AccountingTag {
+	PTCHAR sPath;
+	PTCHAR sSnapshotPath;
+	PTCHAR sTempPath;
+	LPCredentialManagerT manager;
+	HANDLE hJournal;
+	ULONGLONG cbJournal;
+	DWORD nrJournalRecords;
+	ULONGLONG qwNextSequence;
+	LPOrphanAccountT orphans;
+
+	// text of the batch or snapshot being written, only used by the writer
+	PTCHAR sBatch;
+	DWORD cchBatch;
+	DWORD cchBatchSize;
+	LPPendingRecordT pending;
+	DWORD nrPending;
+	DWORD nrPendingSize;
+	BOOL bBatchFailed;
+
+	HANDLE hWriter;
+	volatile LONG dwSignal;
+	volatile LONG bStop;
+
+	DWORD nrReplayed;
+	DWORD cbTorn;
+	volatile LONGLONG nrCommits;
+	volatile LONGLONG nrRecords;
+	volatile LONGLONG nrSnapshots;
+	volatile LONGLONG nrFailures;
+	volatile LONGLONG qwLastSequence;
+}AccountingT;
+
+static DWORD crcTable[256];
+
+static VOID initCrcTable()
+{
+	for (DWORD i = 0; i < 256; i++) {
+		DWORD dwCrc = i;
+		for (DWORD j = 0; j < 8; j++) {
+			dwCrc = (dwCrc & 1) ? (dwCrc >> 1) ^ 0xEDB88320 : dwCrc >> 1;
+		}
+		crcTable[i] = dwCrc;
+	}
+}
+
+/*
+ * CRC-32 of the characters of a line, as they are stored in the file.
+ */
+static DWORD crc32Line(const TCHAR *sLine, DWORD cchLine)
+{
+	const BYTE *pData = (const BYTE*)sLine;
+	DWORD dwCrc = 0xFFFFFFFF;
+
+	for (DWORD i = 0; i < cchLine * sizeof(TCHAR); i++) {
+		dwCrc = crcTable[(dwCrc ^ pData[i]) & 0xFF] ^ (dwCrc >> 8);
+	}
+	return ~dwCrc;
+}
+
+static PTCHAR concatPath(LPCTSTR sPath, const TCHAR *sSuffix)
+{
+	DWORD cchPath = (DWORD)_tcslen(sPath);
+	PTCHAR sResult = (PTCHAR)malloc((cchPath + _tcslen(sSuffix) + 1) * sizeof(TCHAR));
+
+	if (sResult != NULL) {
+		_tcscpy(sResult, sPath);
+		_tcscpy(sResult + cchPath, sSuffix);
+	}
+	return sResult;
+}
+
+/*
+ * Appends a line followed by ;<crc32 of the line> to the batch.
+ */
+static VOID appendLine(LPAccountingT accounting, const TCHAR *format, ...)
+{
+	TCHAR sLine[ACCOUNTING_LINE_SIZE];
+	va_list args;
+	INT cchLine;
+
+	if (accounting->bBatchFailed) {
+		return;
+	}
+
+	va_start(args, format);
+	cchLine = _vsntprintf(sLine, ACCOUNTING_LINE_SIZE - 12, format, args);
+	va_end(args);
+	if (cchLine < 0 || cchLine >= ACCOUNTING_LINE_SIZE - 12) {
+		accounting->bBatchFailed = TRUE;
+		return;
+	}
+	cchLine += _stprintf(sLine + cchLine, _T(";%08x\n"), crc32Line(sLine, cchLine));
+
+	if (accounting->cchBatch + cchLine > accounting->cchBatchSize) {
+		DWORD cchSize = (accounting->cchBatchSize == 0) ? 4096 : accounting->cchBatchSize;
+		while (cchSize < accounting->cchBatch + cchLine) {
+			cchSize *= 2;
+		}
+		PTCHAR sBatch = (PTCHAR)realloc(accounting->sBatch, cchSize * sizeof(TCHAR));
+		if (sBatch == NULL) {
+			accounting->bBatchFailed = TRUE;
+			return;
+		}
+		accounting->sBatch = sBatch;
+		accounting->cchBatchSize = cchSize;
+	}
+	memcpy(accounting->sBatch + accounting->cchBatch, sLine, cchLine * sizeof(TCHAR));
+	accounting->cchBatch += cchLine;
+}
+
+/*
+ * Checks the crc32 at the end of a line and splits the rest of it in fields.
+ *
+ * @param sLine: the line without its new line, it is modified.
+ * @return the number of fields, 0 if the line is damaged.
+ */
+static DWORD splitLine(PTCHAR sLine, DWORD cchLine, PTCHAR *fields, DWORD nrMaxFields)
+{
+	DWORD dwCrc;
+	DWORD nrFields = 0;
+	PTCHAR sField;
+	PTCHAR sCrc = NULL;
+
+	for (DWORD i = cchLine; i > 0; i--) {
+		if (sLine[i - 1] == ';') {
+			sCrc = sLine + i;
+			sLine[i - 1] = '\0';
+			cchLine = i - 1;
+			break;
+		}
+	}
+	if (sCrc == NULL || _stscanf(sCrc, _T("%8x"), &dwCrc) != 1 || crc32Line(sLine, cchLine) != dwCrc) {
+		return 0;
+	}
+
+	sField = sLine;
+	while (nrFields < nrMaxFields) {
+		fields[nrFields++] = sField;
+		sField = _tcschr(sField, ';');
+		if (sField == NULL) {
+			break;
+		}
+		*sField++ = '\0';
+	}
+	return (sField == NULL) ? nrFields : 0;
+}
+
+static BOOL parseCount(PTCHAR sField, ULONGLONG *pqwValue)
+{
+	TCHAR cEnd;
+
+	return _stscanf(sField, _T("%llu%c"), pqwValue, &cEnd) == 1;
+}
+
+/*
+ * Reads a whole file, the snapshot and the journal stay small thanks to the compaction.
+ *
+ * @return FALSE if the file does not exist or cannot be read, *psText is NULL then.
+ */
+static BOOL readWholeFile(PTCHAR sPath, PTCHAR *psText, LPDWORD pcchText)
+{
+	HANDLE hFile = CreateFile(sPath, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER cbFile;
+	DWORD cbRead;
+	BOOL bSuccess;
+
+	*psText = NULL;
+	*pcchText = 0;
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return FALSE;
+	}
+	bSuccess = GetFileSizeEx(hFile, &cbFile) && cbFile.QuadPart < 0x40000000;
+	if (bSuccess) {
+		*psText = (PTCHAR)malloc((SIZE_T)cbFile.QuadPart + sizeof(TCHAR));
+		bSuccess = *psText != NULL && ReadFile(hFile, *psText, (DWORD)cbFile.QuadPart, &cbRead, NULL) &&
+			cbRead == (DWORD)cbFile.QuadPart;
+	}
+	CloseHandle(hFile);
+	if (!bSuccess) {
+		free(*psText);
+		*psText = NULL;
+		return FALSE;
+	}
+
+	*pcchText = cbRead / sizeof(TCHAR);
+	(*psText)[*pcchText] = '\0';
+	return TRUE;
+}
+
+/*
+ * Adds replayed bytes to the credential of the user, or to its orphan account.
+ */
+static BOOL addReplayedBytes(LPAccountingT accounting, PTCHAR sUserName, ULONGLONG qwBytes)
+{
+	LPCredentialT credential = findCredential(accounting->manager, sUserName, (DWORD)_tcslen(sUserName));
+	LPOrphanAccountT orphan;
+
+	accounting->nrReplayed++;
+	if (credential != NULL) {
+		InterlockedExchangeAdd64(&credential->qwBytesEncrypted, (LONGLONG)qwBytes);
+		credential->qwBytesJournaled += qwBytes;
+		return TRUE;
+	}
+
+	for (orphan = accounting->orphans; orphan != NULL; orphan = orphan->next) {
+		if (_tcscmp(orphan->sUserName, sUserName) == 0) {
+			orphan->qwTotal += qwBytes;
+			return TRUE;
+		}
+	}
+	orphan = (LPOrphanAccountT)malloc(sizeof(OrphanAccountT));
+	if (orphan == NULL || (orphan->sUserName = _tcsdup(sUserName)) == NULL) {
+		free(orphan);
+		return FALSE;
+	}
+	orphan->qwTotal = qwBytes;
+	orphan->next = accounting->orphans;
+	accounting->orphans = orphan;
+	return TRUE;
+}
+
+/*
+ * Replays the snapshot, it is written whole and renamed into place, so it must be intact.
+ *
+ * @param pqwLastSequence: the last journal record included in the snapshot, 0 without a snapshot.
+ */
+static BOOL replaySnapshot(LPAccountingT accounting, ULONGLONG *pqwLastSequence)
+{
+	PTCHAR sText;
+	DWORD cchText;
+	PTCHAR fields[3];
+	PTCHAR sLine;
+	PTCHAR sEnd;
+	DWORD nrFields;
+	ULONGLONG qwValue;
+	ULONGLONG nrUsers = 0;
+	BOOL bHeader = FALSE;
+	BOOL bComplete = FALSE;
+
+	*pqwLastSequence = 0;
+	if (!readWholeFile(accounting->sSnapshotPath, &sText, &cchText)) {
+		// a missing snapshot is an empty one, an unreadable one is found by the journal open
+		return TRUE;
+	}
+
+	for (sLine = sText; !bComplete && (sEnd = _tcschr(sLine, '\n')) != NULL; sLine = sEnd + 1) {
+		*sEnd = '\0';
+		nrFields = splitLine(sLine, (DWORD)(sEnd - sLine), fields, 3);
+		if (nrFields != 2 || !parseCount(fields[1], &qwValue)) {
+			break;
+		}
+		if (!bHeader) {
+			bHeader = _tcscmp(fields[0], _T("snapshot")) == 0;
+			if (!bHeader) {
+				break;
+			}
+			*pqwLastSequence = qwValue;
+		} else if (_tcscmp(fields[0], _T("end")) == 0) {
+			bComplete = qwValue == nrUsers;
+		} else {
+			nrUsers++;
+			if (!addReplayedBytes(accounting, fields[0], qwValue)) {
+				break;
+			}
+		}
+	}
+
+	free(sText);
+	return bComplete;
+}
+
+/*
+ * Replays the journal records following the snapshot.
+ *
+ * @param pcbGood: bytes of intact records, the journal is cut there.
+ */
+static BOOL replayJournal(LPAccountingT accounting, ULONGLONG qwSnapshotSequence, ULONGLONG *pcbGood)
+{
+	PTCHAR sText;
+	DWORD cchText;
+	PTCHAR fields[4];
+	PTCHAR sLine;
+	PTCHAR sEnd;
+	ULONGLONG qwSequence;
+	ULONGLONG qwBytes;
+	ULONGLONG qwLastSequence = qwSnapshotSequence;
+
+	*pcbGood = 0;
+	accounting->qwNextSequence = qwSnapshotSequence + 1;
+	if (!readWholeFile(accounting->sPath, &sText, &cchText)) {
+		return TRUE;
+	}
+
+	for (sLine = sText; (sEnd = _tcschr(sLine, '\n')) != NULL; sLine = sEnd + 1) {
+		*sEnd = '\0';
+		if (splitLine(sLine, (DWORD)(sEnd - sLine), fields, 4) != 3 || !parseCount(fields[0], &qwSequence) ||
+			!parseCount(fields[2], &qwBytes) || (qwSequence <= qwLastSequence && qwSequence > qwSnapshotSequence)) {
+			break;
+		}
+		// records up to the snapshot are left over by a compaction cut short
+		if (qwSequence > qwSnapshotSequence) {
+			if (!addReplayedBytes(accounting, fields[1], qwBytes)) {
+				free(sText);
+				return FALSE;
+			}
+			qwLastSequence = qwSequence;
+			accounting->nrJournalRecords++;
+		}
+		*pcbGood = (ULONGLONG)(sEnd + 1 - sText) * sizeof(TCHAR);
+	}
+
+	accounting->cbTorn = (DWORD)(cchText * sizeof(TCHAR) - *pcbGood);
+	accounting->qwNextSequence = qwLastSequence + 1;
+	free(sText);
+	return TRUE;
+}
+
+static BOOL writeBatch(HANDLE hFile, LPAccountingT accounting)
+{
+	DWORD cbBatch = accounting->cchBatch * sizeof(TCHAR);
+	DWORD cbWritten;
+
+	return WriteFile(hFile, accounting->sBatch, cbBatch, &cbWritten, NULL) && cbWritten == cbBatch &&
+		FlushFileBuffers(hFile);
+}
+
+static BOOL seekJournal(LPAccountingT accounting, ULONGLONG cbOffset)
+{
+	LARGE_INTEGER offset;
+
+	offset.QuadPart = (LONGLONG)cbOffset;
+	return SetFilePointerEx(accounting->hJournal, offset, NULL, FILE_BEGIN);
+}
+
+static VOID addJournalRecord(LPCredentialT credential, LPVOID context)
+{
+	LPAccountingT accounting = (LPAccountingT)context;
+	ULONGLONG qwTotal = (ULONGLONG)ReadAcquire64(&credential->qwBytesEncrypted);
+
+	if (qwTotal == credential->qwBytesJournaled || accounting->bBatchFailed) {
+		return;
+	}
+
+	if (accounting->nrPending == accounting->nrPendingSize) {
+		DWORD nrSize = (accounting->nrPendingSize == 0) ? 64 : accounting->nrPendingSize * 2;
+		LPPendingRecordT pending = (LPPendingRecordT)realloc(accounting->pending, nrSize * sizeof(PendingRecordT));
+		if (pending == NULL) {
+			accounting->bBatchFailed = TRUE;
+			return;
+		}
+		accounting->pending = pending;
+		accounting->nrPendingSize = nrSize;
+	}
+	accounting->pending[accounting->nrPending].credential = credential;
+	accounting->pending[accounting->nrPending].qwJournaled = qwTotal;
+	accounting->nrPending++;
+
+	appendLine(accounting, _T("%llu;%s;%llu"), accounting->qwNextSequence + accounting->nrPending - 1,
+		credential->sUserName, qwTotal - credential->qwBytesJournaled);
+}
+
+/*
+ * Group commit: the growth of every total since the last commit goes to the journal
+ * in one write, followed by one flush.
+ */
+static BOOL commitAccounting(LPAccountingT accounting)
+{
+	accounting->cchBatch = 0;
+	accounting->nrPending = 0;
+	accounting->bBatchFailed = FALSE;
+	visitCredentials(accounting->manager, addJournalRecord, accounting);
+	if (accounting->nrPending == 0) {
+		return !accounting->bBatchFailed;
+	}
+
+	if (accounting->bBatchFailed || !writeBatch(accounting->hJournal, accounting)) {
+		// a partly written batch is cut off, so the next one follows intact records
+		seekJournal(accounting, accounting->cbJournal);
+		SetEndOfFile(accounting->hJournal);
+		InterlockedIncrement64(&accounting->nrFailures);
+		return FALSE;
+	}
+
+	for (DWORD i = 0; i < accounting->nrPending; i++) {
+		accounting->pending[i].credential->qwBytesJournaled = accounting->pending[i].qwJournaled;
+	}
+	accounting->cbJournal += accounting->cchBatch * sizeof(TCHAR);
+	accounting->nrJournalRecords += accounting->nrPending;
+	accounting->qwNextSequence += accounting->nrPending;
+
+	InterlockedIncrement64(&accounting->nrCommits);
+	InterlockedExchangeAdd64(&accounting->nrRecords, accounting->nrPending);
+	WriteRelease64(&accounting->qwLastSequence, (LONGLONG)(accounting->qwNextSequence - 1));
+	return TRUE;
+}
+
+static VOID addSnapshotLine(LPCredentialT credential, LPVOID context)
+{
+	LPAccountingT accounting = (LPAccountingT)context;
+
+	if (credential->qwBytesJournaled != 0) {
+		appendLine(accounting, _T("%s;%llu"), credential->sUserName, credential->qwBytesJournaled);
+		accounting->nrPending++;
+	}
+}
+
+/*
+ * Writes the journaled totals to the snapshot and starts the journal over.
+ * A crash before the rename keeps the old snapshot and the whole journal,
+ * a crash after it leaves journal records the new snapshot already includes.
+ */
+static BOOL compactAccounting(LPAccountingT accounting)
+{
+	HANDLE hTemp;
+	BOOL bSuccess;
+
+	accounting->cchBatch = 0;
+	accounting->nrPending = 0;
+	accounting->bBatchFailed = FALSE;
+	appendLine(accounting, _T("snapshot;%llu"), accounting->qwNextSequence - 1);
+	visitCredentials(accounting->manager, addSnapshotLine, accounting);
+	for (LPOrphanAccountT orphan = accounting->orphans; orphan != NULL; orphan = orphan->next) {
+		appendLine(accounting, _T("%s;%llu"), orphan->sUserName, orphan->qwTotal);
+		accounting->nrPending++;
+	}
+	appendLine(accounting, _T("end;%u"), accounting->nrPending);
+	accounting->nrPending = 0;
+	if (accounting->bBatchFailed) {
+		InterlockedIncrement64(&accounting->nrFailures);
+		return FALSE;
+	}
+
+	hTemp = CreateFile(accounting->sTempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hTemp == INVALID_HANDLE_VALUE) {
+		InterlockedIncrement64(&accounting->nrFailures);
+		return FALSE;
+	}
+	bSuccess = writeBatch(hTemp, accounting);
+	CloseHandle(hTemp);
+	if (!bSuccess || !MoveFileEx(accounting->sTempPath, accounting->sSnapshotPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+		_tremove(accounting->sTempPath);
+		InterlockedIncrement64(&accounting->nrFailures);
+		return FALSE;
+	}
+
+	// the snapshot is in place, a journal that cannot be emptied is only replayed for nothing
+	if (seekJournal(accounting, 0) && SetEndOfFile(accounting->hJournal) && FlushFileBuffers(accounting->hJournal)) {
+		accounting->cbJournal = 0;
+		accounting->nrJournalRecords = 0;
+	} else {
+		seekJournal(accounting, accounting->cbJournal);
+	}
+	InterlockedIncrement64(&accounting->nrSnapshots);
+	return TRUE;
+}
+
+static DWORD WINAPI accountingWriterThread(LPVOID arg)
+{
+	LPAccountingT accounting = (LPAccountingT)arg;
+
+	for (;;) {
+		LONG dwSignal = ReadAcquire(&accounting->dwSignal);
+
+		if (ReadAcquire(&accounting->bStop)) {
+			break;
+		}
+		WaitOnAddress(&accounting->dwSignal, &dwSignal, sizeof(LONG), ACCOUNTING_COMMIT_MS);
+		if (ReadAcquire(&accounting->bStop)) {
+			break;
+		}
+
+		if (commitAccounting(accounting) && accounting->nrJournalRecords >= ACCOUNTING_COMPACT_RECORDS) {
+			compactAccounting(accounting);
+		}
+	}
+	return 0;
+}
+
+static VOID freeAccounting(LPAccountingT accounting)
+{
+	while (accounting->orphans != NULL) {
+		LPOrphanAccountT orphan = accounting->orphans;
+		accounting->orphans = orphan->next;
+		free(orphan->sUserName);
+		free(orphan);
+	}
+	if (accounting->hJournal != NULL && accounting->hJournal != INVALID_HANDLE_VALUE) {
+		CloseHandle(accounting->hJournal);
+	}
+	free(accounting->sBatch);
+	free(accounting->pending);
+	free(accounting->sPath);
+	free(accounting->sSnapshotPath);
+	free(accounting->sTempPath);
+	free(accounting);
+}
+
+LPAccountingT openAccounting(LPCTSTR sPath, LPCredentialManagerT manager)
+{
+	ULONGLONG qwSnapshotSequence;
+	ULONGLONG cbGood;
+
+	LPAccountingT accounting = (LPAccountingT)calloc(1, sizeof(AccountingT));
+	if (accounting == NULL) {
+		return NULL;
+	}
+	initCrcTable();
+	accounting->manager = manager;
+	accounting->sPath = _tcsdup(sPath);
+	accounting->sSnapshotPath = concatPath(sPath, _T(".snapshot"));
+	accounting->sTempPath = concatPath(sPath, _T(".snapshot.tmp"));
+	if (accounting->sPath == NULL || accounting->sSnapshotPath == NULL || accounting->sTempPath == NULL) {
+		freeAccounting(accounting);
+		return NULL;
+	}
+
+	if (!replaySnapshot(accounting, &qwSnapshotSequence) ||
+		!replayJournal(accounting, qwSnapshotSequence, &cbGood)) {
+		freeAccounting(accounting);
+		return NULL;
+	}
+	accounting->qwLastSequence = (LONGLONG)(accounting->qwNextSequence - 1);
+
+	// appended from the end of the last intact record
+	accounting->hJournal = CreateFile(sPath, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (accounting->hJournal == INVALID_HANDLE_VALUE || !seekJournal(accounting, cbGood) ||
+		(accounting->cbTorn != 0 && (!SetEndOfFile(accounting->hJournal) || !FlushFileBuffers(accounting->hJournal)))) {
+		freeAccounting(accounting);
+		return NULL;
+	}
+	accounting->cbJournal = cbGood;
+
+	accounting->hWriter = (HANDLE)_beginthreadex(NULL, 0, (_beginthreadex_proc_type)accountingWriterThread, accounting, 0, NULL);
+	if (accounting->hWriter == NULL) {
+		freeAccounting(accounting);
+		return NULL;
+	}
+	return accounting;
+}
+
+BOOL closeAccounting(LPAccountingT accounting)
+{
+	BOOL bSuccess;
+
+	WriteRelease(&accounting->bStop, TRUE);
+	InterlockedIncrement(&accounting->dwSignal);
+	WakeByAddressAll((LPVOID)&accounting->dwSignal);
+	WaitForSingleObject(accounting->hWriter, INFINITE);
+	CloseHandle(accounting->hWriter);
+
+	bSuccess = commitAccounting(accounting);
+	if (bSuccess) {
+		compactAccounting(accounting);
+	}
+	freeAccounting(accounting);
+	return bSuccess;
+}
+
+VOID getAccountingStats(LPAccountingT accounting, LPAccountingStatsT stats)
+{
+	stats->nrReplayed = accounting->nrReplayed;
+	stats->cbTorn = accounting->cbTorn;
+	stats->nrCommits = (ULONGLONG)ReadAcquire64(&accounting->nrCommits);
+	stats->nrRecords = (ULONGLONG)ReadAcquire64(&accounting->nrRecords);
+	stats->nrSnapshots = (ULONGLONG)ReadAcquire64(&accounting->nrSnapshots);
+	stats->nrFailures = (ULONGLONG)ReadAcquire64(&accounting->nrFailures);
+	stats->qwLastSequence = (ULONGLONG)ReadAcquire64(&accounting->qwLastSequence);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef ACCOUNTING_H
+#define ACCOUNTING_H
+
+#include "Portability.h"
+#include "UserManagement.h"
+
+/*
+ * Crash safe accounting of the bytes encrypted for every user, so they can be billed.
+ * The totals live in the credentials (qwBytesEncrypted), the packet path only adds to them.
+ * A writer thread commits what they grew by every ACCOUNTING_COMMIT_MS to an append-only journal:
+ * one record per user that changed, one write and one flush to disk for the whole batch.
+ * A crash loses at most the bytes of the last interval, never counts them twice.
+ *
+ * Once the journal holds ACCOUNTING_COMPACT_RECORDS records, and when the accounting is closed,
+ * the totals are written to <journal>.snapshot (a temporary file flushed and renamed over it)
+ * and the journal starts over. At startup the snapshot and then the journal are replayed
+ * into the credentials; the totals of users no longer in the credential file are kept.
+ *
+ * A journal record is <sequence>;<user name>;<bytes>;<crc32> and the sequences keep growing
+ * across compactions. The snapshot is snapshot;<last sequence>, a <user name>;<total> line
+ * per user and end;<number of users>, every line ending with its crc32 as well.
+ * The records of the journal up to the last sequence of the snapshot are already in it,
+ * they are left over by a crash during a compaction and skipped.
+ * A record cut by a crash at the end of the journal is dropped and the journal is truncated before it.
+ */
+
+#define ACCOUNTING_COMMIT_MS 1000
+#define ACCOUNTING_COMPACT_RECORDS 4096
+// a record holds a user name of up to 1024 characters
+#define ACCOUNTING_LINE_SIZE 1100
+
+typedef struct AccountingTag *LPAccountingT;
+
+typedef struct AccountingStatsTag {
+	// records replayed from the snapshot and the journal at startup
+	DWORD nrReplayed;
+	// bytes cut from the end of the journal at startup
+	DWORD cbTorn;
+	ULONGLONG nrCommits;
+	ULONGLONG nrRecords;
+	ULONGLONG nrSnapshots;
+	ULONGLONG nrFailures;
+	ULONGLONG qwLastSequence;
+}AccountingStatsT, *LPAccountingStatsT;
+
+/*
+ * Replays the snapshot and the journal into the credentials and starts the writer.
+ *
+ * @return the accounting, or NULL if the journal cannot be written or the snapshot is damaged.
+ */
+LPAccountingT openAccounting(LPCTSTR sPath, LPCredentialManagerT manager);
+
+/*
+ * Stops the writer, commits the last bytes and compacts the journal.
+ * The accounting is freed, the credential manager must still exist.
+ *
+ * @return FALSE if the last bytes could not be written.
+ */
+BOOL closeAccounting(LPAccountingT accounting);
+
+VOID getAccountingStats(LPAccountingT accounting, LPAccountingStatsT stats);
+
+#endif
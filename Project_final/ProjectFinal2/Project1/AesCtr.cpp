@@ -0,0 +1,263 @@
+#include "AesCtr.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AES_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AES_TARGET(isa)
+#else
+#define AES_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// blocks AES-NI keeps in flight, enough to hide the latency of aesenc
+#define AES_NI_PARALLEL_BLOCKS 8
+
+static const BYTE sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static BYTE xtime(BYTE x)
+{
+	return (BYTE)((x << 1) ^ ((x & 0x80) ? 0x1b : 0x00));
+}
+
+BOOL expandAesKey(LPAesKeyT aesKey, const BYTE *key, DWORD cbKey)
+{
+	DWORD nrKeyWords = cbKey / 4;
+	DWORD nrWords;
+	BYTE rcon = 0x01;
+	PBYTE w = aesKey->roundKeys;
+
+	if (cbKey != 16 && cbKey != 32) {
+		return FALSE;
+	}
+	aesKey->nrRounds = nrKeyWords + 6;
+	nrWords = 4 * (aesKey->nrRounds + 1);
+
+	memcpy(w, key, cbKey);
+	for (DWORD i = nrKeyWords; i < nrWords; i++) {
+		BYTE temp[4];
+
+		memcpy(temp, w + 4 * (i - 1), 4);
+		if (i % nrKeyWords == 0) {
+			// RotWord, SubWord and the round constant
+			BYTE first = temp[0];
+			temp[0] = (BYTE)(sbox[temp[1]] ^ rcon);
+			temp[1] = sbox[temp[2]];
+			temp[2] = sbox[temp[3]];
+			temp[3] = sbox[first];
+			rcon = xtime(rcon);
+		} else if (nrKeyWords > 6 && i % nrKeyWords == 4) {
+			for (INT j = 0; j < 4; j++) {
+				temp[j] = sbox[temp[j]];
+			}
+		}
+		for (INT j = 0; j < 4; j++) {
+			w[4 * i + j] = w[4 * (i - nrKeyWords) + j] ^ temp[j];
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Encrypts one block, the state is in column order as in FIPS 197.
+ */
+static VOID encryptBlock(const AesKeyT *aesKey, const BYTE *in, PBYTE out)
+{
+	BYTE s[AES_BLOCK_SIZE];
+	BYTE t[AES_BLOCK_SIZE];
+	const BYTE *roundKey = aesKey->roundKeys;
+
+	for (INT i = 0; i < AES_BLOCK_SIZE; i++) {
+		s[i] = in[i] ^ roundKey[i];
+	}
+
+	for (DWORD round = 1; round <= aesKey->nrRounds; round++) {
+		roundKey += AES_BLOCK_SIZE;
+
+		// SubBytes and ShiftRows: row r moves r columns to the left
+		for (INT c = 0; c < 4; c++) {
+			for (INT r = 0; r < 4; r++) {
+				t[4 * c + r] = sbox[s[4 * ((c + r) % 4) + r]];
+			}
+		}
+
+		if (round == aesKey->nrRounds) {
+			for (INT i = 0; i < AES_BLOCK_SIZE; i++) {
+				out[i] = t[i] ^ roundKey[i];
+			}
+			return;
+		}
+
+		// MixColumns
+		for (INT c = 0; c < 4; c++) {
+			PBYTE a = t + 4 * c;
+			BYTE all = a[0] ^ a[1] ^ a[2] ^ a[3];
+			s[4 * c + 0] = a[0] ^ all ^ xtime(a[0] ^ a[1]);
+			s[4 * c + 1] = a[1] ^ all ^ xtime(a[1] ^ a[2]);
+			s[4 * c + 2] = a[2] ^ all ^ xtime(a[2] ^ a[3]);
+			s[4 * c + 3] = a[3] ^ all ^ xtime(a[3] ^ a[0]);
+		}
+		for (INT i = 0; i < AES_BLOCK_SIZE; i++) {
+			s[i] ^= roundKey[i];
+		}
+	}
+}
+
+static VOID aesCtrXorPortable(const AesKeyT *aesKey, PBYTE buff, DWORD cbBuff, const BYTE *counterBlock)
+{
+	BYTE counter[AES_BLOCK_SIZE];
+	BYTE keyStream[AES_BLOCK_SIZE];
+	DWORD dwCounter;
+
+	memcpy(counter, counterBlock, AES_BLOCK_SIZE);
+	dwCounter = ((DWORD)counter[12] << 24) | ((DWORD)counter[13] << 16) | ((DWORD)counter[14] << 8) | counter[15];
+
+	for (DWORD cbDone = 0; cbDone < cbBuff; cbDone += AES_BLOCK_SIZE) {
+		DWORD cbBlock = (cbBuff - cbDone < AES_BLOCK_SIZE) ? cbBuff - cbDone : AES_BLOCK_SIZE;
+
+		encryptBlock(aesKey, counter, keyStream);
+		for (DWORD i = 0; i < cbBlock; i++) {
+			buff[cbDone + i] ^= keyStream[i];
+		}
+
+		dwCounter++;
+		counter[12] = (BYTE)(dwCounter >> 24);
+		counter[13] = (BYTE)(dwCounter >> 16);
+		counter[14] = (BYTE)(dwCounter >> 8);
+		counter[15] = (BYTE)dwCounter;
+	}
+}
+
+#ifdef AES_X86
+
+/*
+ * The counter block is kept byte reversed, so its counter is the low 32 bit lane
+ * and _mm_add_epi32 increments it modulo 2^32 as counter mode requires.
+ */
+AES_TARGET("aes,ssse3")
+static VOID aesCtrXorNi(const AesKeyT *aesKey, PBYTE buff, DWORD cbBuff, const BYTE *counterBlock)
+{
+	const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	__m128i roundKeys[AES_MAX_ROUNDS + 1];
+	__m128i counter = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)counterBlock), reverse);
+	DWORD nrRounds = aesKey->nrRounds;
+	DWORD cbDone = 0;
+
+	for (DWORD i = 0; i <= nrRounds; i++) {
+		roundKeys[i] = _mm_loadu_si128((const __m128i*)(aesKey->roundKeys + AES_BLOCK_SIZE * i));
+	}
+
+	for (; cbBuff - cbDone >= AES_NI_PARALLEL_BLOCKS * AES_BLOCK_SIZE; cbDone += AES_NI_PARALLEL_BLOCKS * AES_BLOCK_SIZE) {
+		__m128i blocks[AES_NI_PARALLEL_BLOCKS];
+
+		for (INT j = 0; j < AES_NI_PARALLEL_BLOCKS; j++) {
+			__m128i block = _mm_shuffle_epi8(_mm_add_epi32(counter, _mm_setr_epi32(j, 0, 0, 0)), reverse);
+			blocks[j] = _mm_xor_si128(block, roundKeys[0]);
+		}
+		counter = _mm_add_epi32(counter, _mm_setr_epi32(AES_NI_PARALLEL_BLOCKS, 0, 0, 0));
+
+		for (DWORD round = 1; round < nrRounds; round++) {
+			for (INT j = 0; j < AES_NI_PARALLEL_BLOCKS; j++) {
+				blocks[j] = _mm_aesenc_si128(blocks[j], roundKeys[round]);
+			}
+		}
+		for (INT j = 0; j < AES_NI_PARALLEL_BLOCKS; j++) {
+			__m128i *p = (__m128i*)(buff + cbDone + AES_BLOCK_SIZE * j);
+			blocks[j] = _mm_aesenclast_si128(blocks[j], roundKeys[nrRounds]);
+			_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), blocks[j]));
+		}
+	}
+
+	for (; cbDone < cbBuff; cbDone += AES_BLOCK_SIZE) {
+		BYTE keyStream[AES_BLOCK_SIZE];
+		DWORD cbBlock = (cbBuff - cbDone < AES_BLOCK_SIZE) ? cbBuff - cbDone : AES_BLOCK_SIZE;
+		__m128i block = _mm_xor_si128(_mm_shuffle_epi8(counter, reverse), roundKeys[0]);
+
+		for (DWORD round = 1; round < nrRounds; round++) {
+			block = _mm_aesenc_si128(block, roundKeys[round]);
+		}
+		_mm_storeu_si128((__m128i*)keyStream, _mm_aesenclast_si128(block, roundKeys[nrRounds]));
+		counter = _mm_add_epi32(counter, _mm_setr_epi32(1, 0, 0, 0));
+
+		for (DWORD i = 0; i < cbBlock; i++) {
+			buff[cbDone + i] ^= keyStream[i];
+		}
+	}
+}
+
+static BOOL detectAesNi()
+{
+#ifdef _MSC_VER
+	INT info[4];
+
+	__cpuid(info, 1);
+	// AES and SSSE3
+	return (info[2] & (1 << 25)) && (info[2] & (1 << 9));
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3");
+#endif
+}
+
+#endif
+
+DWORD getSupportedAesCtrKernels(LPAesCtrKernelInfoT kernels, DWORD nrMaxKernels)
+{
+	AesCtrKernelInfoT supported[2];
+	DWORD nrSupported = 0;
+
+	supported[nrSupported].sName = _T("portable");
+	supported[nrSupported++].kernel = aesCtrXorPortable;
+
+#ifdef AES_X86
+	if (detectAesNi()) {
+		supported[nrSupported].sName = _T("aes-ni");
+		supported[nrSupported++].kernel = aesCtrXorNi;
+	}
+#endif
+
+	if (nrSupported > nrMaxKernels) {
+		nrSupported = nrMaxKernels;
+	}
+	memcpy(kernels, supported, sizeof(AesCtrKernelInfoT) * nrSupported);
+	return nrSupported;
+}
+
+static AesCtrKernelInfoT selectAesCtrKernel()
+{
+	AesCtrKernelInfoT kernels[2];
+	DWORD nrKernels = getSupportedAesCtrKernels(kernels, 2);
+
+	return kernels[nrKernels - 1];
+}
+
+// picked once, before main runs
+static const AesCtrKernelInfoT gAesCtrKernel = selectAesCtrKernel();
+
+VOID aesCtrXor(const AesKeyT *aesKey, PBYTE buff, DWORD cbBuff, const BYTE *counterBlock)
+{
+	gAesCtrKernel.kernel(aesKey, buff, cbBuff, counterBlock);
+}
+
+LPCTSTR getAesCtrKernelName()
+{
+	return gAesCtrKernel.sName;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#ifndef AES_CTR_H
+#define AES_CTR_H
+
+#include "Portability.h"
+
+/*
+ * AES-128 and AES-256 in counter mode (NIST SP 800-38A). The counter is the last
+ * 32 bits of the counter block, big endian, the first 96 bits stay the same.
+ * Blocks are encrypted with AES-NI when the processor has it, eight at a time,
+ * otherwise with a portable byte oriented implementation.
+ */
+
+#define AES_BLOCK_SIZE 16
+#define AES_MAX_ROUNDS 14
+
+/*
+ * Expanded encryption key, counter mode never decrypts a block.
+ */
+typedef struct AesKeyTag {
+	BYTE roundKeys[AES_BLOCK_SIZE * (AES_MAX_ROUNDS + 1)];
+	DWORD nrRounds;
+}AesKeyT, *LPAesKeyT;
+
+typedef VOID(*AesCtrKernelT)(const AesKeyT *aesKey, PBYTE buff, DWORD cbBuff, const BYTE *counterBlock);
+
+typedef struct AesCtrKernelInfoTag {
+	LPCTSTR sName;
+	AesCtrKernelT kernel;
+}AesCtrKernelInfoT, *LPAesCtrKernelInfoT;
+
+/*
+ * @param cbKey: 16 for AES-128, 32 for AES-256.
+ * @return FALSE for other key sizes.
+ */
+BOOL expandAesKey(LPAesKeyT aesKey, const BYTE *key, DWORD cbKey);
+
+/*
+ * XORs buff in place with the key stream starting at counterBlock.
+ */
+VOID aesCtrXor(const AesKeyT *aesKey, PBYTE buff, DWORD cbBuff, const BYTE *counterBlock);
+
+/*
+ * Name of the kernel aesCtrXor runs on this processor.
+ */
+LPCTSTR getAesCtrKernelName();
+
+/*
+ * Lists the kernels this processor can run, the portable one first.
+ *
+ * @return the number of kernels written to kernels.
+ */
+DWORD getSupportedAesCtrKernels(LPAesCtrKernelInfoT kernels, DWORD nrMaxKernels);
+
+#endif
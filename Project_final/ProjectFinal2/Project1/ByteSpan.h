@@ -0,0 +1,27 @@
+#pragma once
+
+#ifndef BYTE_SPAN_H
+#define BYTE_SPAN_H
+
+#include "Portability.h"
+
+/*
+ * A run of bytes given by its start and its length, it does not own the bytes.
+ * Keys and payloads are binary, they may contain NUL bytes and are never terminated,
+ * so they are always passed around as spans instead of strings.
+ */
+typedef struct ByteSpanTag {
+	PBYTE pData;
+	DWORD cbData;
+}ByteSpanT, *LPByteSpanT;
+
+inline ByteSpanT makeByteSpan(LPVOID pData, DWORD cbData)
+{
+	ByteSpanT span;
+
+	span.pData = (PBYTE)pData;
+	span.cbData = cbData;
+	return span;
+}
+
+#endif
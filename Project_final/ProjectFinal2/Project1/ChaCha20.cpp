@@ -0,0 +1,159 @@
+#include "ChaCha20.h"
+
+#if defined(_M_X64) || defined(__SSE2__)
+#define CHACHA_SSE2
+#include <emmintrin.h>
+#endif
+
+#define CHACHA_ROUNDS 20
+
+static DWORD loadLittleEndian(const BYTE *p)
+{
+	return (DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24);
+}
+
+static DWORD rotateLeft(DWORD x, INT n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+#define QUARTER_ROUND(a, b, c, d) \
+	a += b; d ^= a; d = rotateLeft(d, 16); \
+	c += d; b ^= c; b = rotateLeft(b, 12); \
+	a += b; d ^= a; d = rotateLeft(d, 8); \
+	c += d; b ^= c; b = rotateLeft(b, 7);
+
+/*
+ * The initial state: constants, key, counter and nonce.
+ */
+static VOID initState(DWORD state[16], const BYTE *key, const BYTE *nonce, DWORD dwCounter)
+{
+	// "expand 32-byte k"
+	state[0] = 0x61707865;
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	for (INT i = 0; i < 8; i++) {
+		state[4 + i] = loadLittleEndian(key + 4 * i);
+	}
+	state[12] = dwCounter;
+	for (INT i = 0; i < 3; i++) {
+		state[13 + i] = loadLittleEndian(nonce + 4 * i);
+	}
+}
+
+/*
+ * XORs at most one block of buff with the key stream block of state.
+ */
+static VOID xorBlock(PBYTE buff, DWORD cbBuff, const DWORD state[16])
+{
+	DWORD x[16];
+
+	memcpy(x, state, sizeof(x));
+	for (INT i = 0; i < CHACHA_ROUNDS; i += 2) {
+		QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+		QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+		QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+		QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+		QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+		QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+		QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+		QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+	}
+
+	for (DWORD i = 0; i < cbBuff; i++) {
+		DWORD dwWord = x[i / 4] + state[i / 4];
+		buff[i] ^= (BYTE)(dwWord >> (8 * (i % 4)));
+	}
+}
+
+#ifdef CHACHA_SSE2
+
+#define ROTATE_LEFT_128(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+#define QUARTER_ROUND_128(a, b, c, d) \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTATE_LEFT_128(d, 16); \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTATE_LEFT_128(b, 12); \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTATE_LEFT_128(d, 8); \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTATE_LEFT_128(b, 7);
+
+/*
+ * XORs four whole blocks, 256 bytes, with the blocks of state and the three following counters.
+ * Lane j of x[i] holds word i of block j, the lanes are transposed back into blocks at the end.
+ */
+static VOID xorFourBlocks(PBYTE buff, const DWORD state[16])
+{
+	__m128i x[16];
+	__m128i initial[16];
+
+	for (INT i = 0; i < 16; i++) {
+		initial[i] = _mm_set1_epi32((INT)state[i]);
+	}
+	initial[12] = _mm_add_epi32(initial[12], _mm_setr_epi32(0, 1, 2, 3));
+	memcpy(x, initial, sizeof(x));
+
+	for (INT i = 0; i < CHACHA_ROUNDS; i += 2) {
+		QUARTER_ROUND_128(x[0], x[4], x[8], x[12]);
+		QUARTER_ROUND_128(x[1], x[5], x[9], x[13]);
+		QUARTER_ROUND_128(x[2], x[6], x[10], x[14]);
+		QUARTER_ROUND_128(x[3], x[7], x[11], x[15]);
+		QUARTER_ROUND_128(x[0], x[5], x[10], x[15]);
+		QUARTER_ROUND_128(x[1], x[6], x[11], x[12]);
+		QUARTER_ROUND_128(x[2], x[7], x[8], x[13]);
+		QUARTER_ROUND_128(x[3], x[4], x[9], x[14]);
+	}
+
+	for (INT i = 0; i < 16; i += 4) {
+		__m128i a = _mm_add_epi32(x[i], initial[i]);
+		__m128i b = _mm_add_epi32(x[i + 1], initial[i + 1]);
+		__m128i c = _mm_add_epi32(x[i + 2], initial[i + 2]);
+		__m128i d = _mm_add_epi32(x[i + 3], initial[i + 3]);
+
+		// 4x4 transpose, row j gets words i to i + 3 of block j
+		__m128i ab0 = _mm_unpacklo_epi32(a, b);
+		__m128i ab1 = _mm_unpackhi_epi32(a, b);
+		__m128i cd0 = _mm_unpacklo_epi32(c, d);
+		__m128i cd1 = _mm_unpackhi_epi32(c, d);
+		__m128i rows[4] = {
+			_mm_unpacklo_epi64(ab0, cd0), _mm_unpackhi_epi64(ab0, cd0),
+			_mm_unpacklo_epi64(ab1, cd1), _mm_unpackhi_epi64(ab1, cd1)
+		};
+
+		for (INT j = 0; j < 4; j++) {
+			__m128i *p = (__m128i*)(buff + j * CHACHA20_BLOCK_SIZE + i * 4);
+			_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), rows[j]));
+		}
+	}
+}
+
+#endif
+
+VOID chacha20Xor(PBYTE buff, DWORD cbBuff, const BYTE *key, const BYTE *nonce, DWORD dwCounter)
+{
+	DWORD state[16];
+	DWORD cbDone = 0;
+
+	initState(state, key, nonce, dwCounter);
+
+#ifdef CHACHA_SSE2
+	for (; cbBuff - cbDone >= 4 * CHACHA20_BLOCK_SIZE; cbDone += 4 * CHACHA20_BLOCK_SIZE) {
+		xorFourBlocks(buff + cbDone, state);
+		state[12] += 4;
+	}
+#endif
+
+	for (; cbDone < cbBuff; cbDone += CHACHA20_BLOCK_SIZE) {
+		DWORD cbBlock = cbBuff - cbDone;
+		xorBlock(buff + cbDone, (cbBlock < CHACHA20_BLOCK_SIZE) ? cbBlock : CHACHA20_BLOCK_SIZE, state);
+		state[12]++;
+	}
+}
+
+LPCTSTR getChaCha20KernelName()
+{
+#ifdef CHACHA_SSE2
+	return _T("sse2");
+#else
+	return _T("scalar");
+#endif
+}
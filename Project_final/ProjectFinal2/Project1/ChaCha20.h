@@ -0,0 +1,28 @@
+#pragma once
+
+#ifndef CHACHA20_H
+#define CHACHA20_H
+
+#include "Portability.h"
+
+/*
+ * ChaCha20 stream cipher of RFC 8439: a 256 bit key, a 96 bit nonce and a 32 bit block counter.
+ * Four blocks are computed at once with SSE2 where it is available.
+ */
+
+#define CHACHA20_KEY_SIZE 32
+#define CHACHA20_NONCE_SIZE 12
+#define CHACHA20_BLOCK_SIZE 64
+
+/*
+ * XORs buff in place with the key stream, starting at block dwCounter.
+ * At most 2^32 blocks (256 GB) can be encrypted with one nonce.
+ */
+VOID chacha20Xor(PBYTE buff, DWORD cbBuff, const BYTE *key, const BYTE *nonce, DWORD dwCounter);
+
+/*
+ * Name of the implementation chacha20Xor runs.
+ */
+LPCTSTR getChaCha20KernelName();
+
+#endif
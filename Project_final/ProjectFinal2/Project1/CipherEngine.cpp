@@ -0,0 +1,329 @@
+#include "CipherEngine.h"
+#include "XorCipher.h"
+#include "ChaCha20.h"
+#include "AesCtr.h"
+
+// buckets of a key cache, the cache holds about as many schedules as clients
+#define KEY_CACHE_BUCKETS 1024
+
+typedef struct KeyScheduleTag {
+	DWORD dwCipher;
+	// XOR and ChaCha20 use the key as is, AES its expansion, the cache compares keys with it
+	ByteSpanT key;
+	AesKeyT aesKey;
+	// the rest belongs to the cache, guarded by its critical section, cache is NULL for uncached schedules
+	struct KeyCacheTag *cache;
+	PTCHAR sUserName;
+	ULONGLONG qwDigest;
+	LONG nrRefs;
+	struct KeyScheduleTag *nextInBucket;
+	// links in the idle list of the cache, from the most recently released one
+	struct KeyScheduleTag *newer;
+	struct KeyScheduleTag *older;
+}KeyScheduleT, *LPKeyScheduleT;
+
+typedef struct CipherContextTag {
+	LPKeyScheduleT schedule;
+	BYTE nonce[CIPHER_NONCE_SIZE];
+}CipherContextT;
+
+typedef struct KeyCacheTag {
+	CRITICAL_SECTION criticalSection;
+	LPKeyScheduleT buckets[KEY_CACHE_BUCKETS];
+	LPKeyScheduleT newestIdle;
+	LPKeyScheduleT oldestIdle;
+	DWORD nrMaxIdle;
+	KeyCacheStatsT stats;
+}KeyCacheT;
+
+static BOOL isValidKey(DWORD dwCipher, ByteSpanT key)
+{
+	DWORD cbKeySize = getCipherKeySize(dwCipher);
+
+	return dwCipher < NR_CIPHERS && key.cbData != 0 && (cbKeySize == 0 || key.cbData == cbKeySize);
+}
+
+/*
+ * @return the schedule holding one reference, or NULL when out of memory.
+ */
+static LPKeyScheduleT createKeySchedule(DWORD dwCipher, ByteSpanT key)
+{
+	LPKeyScheduleT schedule = (LPKeyScheduleT)malloc(sizeof(KeyScheduleT));
+
+	if (schedule == NULL) {
+		return NULL;
+	}
+	memset(schedule, 0, sizeof(KeyScheduleT));
+	schedule->dwCipher = dwCipher;
+	schedule->nrRefs = 1;
+
+	schedule->key = makeByteSpan(malloc(key.cbData), key.cbData);
+	if (schedule->key.pData == NULL) {
+		free(schedule);
+		return NULL;
+	}
+	memcpy(schedule->key.pData, key.pData, key.cbData);
+
+	if (dwCipher == CIPHER_AES128_CTR || dwCipher == CIPHER_AES256_CTR) {
+		expandAesKey(&schedule->aesKey, key.pData, key.cbData);
+	}
+	return schedule;
+}
+
+/*
+ * Frees the schedule and wipes its key material.
+ */
+static VOID freeKeySchedule(LPKeyScheduleT schedule)
+{
+	memset(schedule->key.pData, 0, schedule->key.cbData);
+	free(schedule->key.pData);
+	free(schedule->sUserName);
+	memset(schedule, 0, sizeof(KeyScheduleT));
+	free(schedule);
+}
+
+static LPCipherContextT createContext(LPKeyScheduleT schedule, const BYTE *nonce)
+{
+	LPCipherContextT cipher = (LPCipherContextT)malloc(sizeof(CipherContextT));
+
+	if (cipher == NULL) {
+		return NULL;
+	}
+	cipher->schedule = schedule;
+	memcpy(cipher->nonce, nonce, CIPHER_NONCE_SIZE);
+	return cipher;
+}
+
+LPCipherContextT createCipherContext(DWORD dwCipher, ByteSpanT key, const BYTE *nonce)
+{
+	LPKeyScheduleT schedule;
+	LPCipherContextT cipher;
+
+	if (!isValidKey(dwCipher, key)) {
+		return NULL;
+	}
+
+	schedule = createKeySchedule(dwCipher, key);
+	if (schedule == NULL) {
+		return NULL;
+	}
+	cipher = createContext(schedule, nonce);
+	if (cipher == NULL) {
+		freeKeySchedule(schedule);
+	}
+	return cipher;
+}
+
+/*
+ * FNV-1a over the user name, the cipher and the key.
+ */
+static ULONGLONG getKeyDigest(const TCHAR *sUserName, DWORD dwCipher, ByteSpanT key)
+{
+	ULONGLONG qwDigest = 14695981039346656037ULL;
+	const BYTE *pName = (const BYTE*)sUserName;
+	DWORD cbName = (DWORD)(_tcslen(sUserName) * sizeof(TCHAR));
+
+	for (DWORD i = 0; i < cbName; i++) {
+		qwDigest = (qwDigest ^ pName[i]) * 1099511628211ULL;
+	}
+	// the cipher also separates the name from the key
+	qwDigest = (qwDigest ^ (0x100 + dwCipher)) * 1099511628211ULL;
+	for (DWORD i = 0; i < key.cbData; i++) {
+		qwDigest = (qwDigest ^ key.pData[i]) * 1099511628211ULL;
+	}
+	return qwDigest;
+}
+
+static VOID unlinkIdle(LPKeyCacheT cache, LPKeyScheduleT schedule)
+{
+	if (schedule->newer != NULL) {
+		schedule->newer->older = schedule->older;
+	} else {
+		cache->newestIdle = schedule->older;
+	}
+	if (schedule->older != NULL) {
+		schedule->older->newer = schedule->newer;
+	} else {
+		cache->oldestIdle = schedule->newer;
+	}
+	schedule->newer = NULL;
+	schedule->older = NULL;
+	cache->stats.nrIdle--;
+}
+
+static VOID removeFromBucket(LPKeyCacheT cache, LPKeyScheduleT schedule)
+{
+	LPKeyScheduleT *link = &cache->buckets[schedule->qwDigest % KEY_CACHE_BUCKETS];
+
+	while (*link != schedule) {
+		link = &(*link)->nextInBucket;
+	}
+	*link = schedule->nextInBucket;
+}
+
+/*
+ * Drops a reference to the schedule, the idle schedules over nrMaxIdle are evicted from the oldest.
+ */
+static VOID releaseKeySchedule(LPKeyScheduleT schedule)
+{
+	LPKeyCacheT cache = schedule->cache;
+
+	if (cache == NULL) {
+		freeKeySchedule(schedule);
+		return;
+	}
+
+	EnterCriticalSection(&cache->criticalSection);
+	if (--schedule->nrRefs == 0) {
+		schedule->older = cache->newestIdle;
+		if (cache->newestIdle != NULL) {
+			cache->newestIdle->newer = schedule;
+		} else {
+			cache->oldestIdle = schedule;
+		}
+		cache->newestIdle = schedule;
+		cache->stats.nrIdle++;
+
+		while (cache->stats.nrIdle > cache->nrMaxIdle) {
+			LPKeyScheduleT oldest = cache->oldestIdle;
+
+			unlinkIdle(cache, oldest);
+			removeFromBucket(cache, oldest);
+			freeKeySchedule(oldest);
+			cache->stats.nrSchedules--;
+			cache->stats.nrEvictions++;
+		}
+	}
+	LeaveCriticalSection(&cache->criticalSection);
+}
+
+LPCipherContextT acquireCipherContext(LPKeyCacheT cache, const TCHAR *sUserName, DWORD dwCipher, ByteSpanT key, const BYTE *nonce)
+{
+	LPKeyScheduleT schedule;
+	LPCipherContextT cipher;
+	ULONGLONG qwDigest;
+
+	if (!isValidKey(dwCipher, key)) {
+		return NULL;
+	}
+
+	qwDigest = getKeyDigest(sUserName, dwCipher, key);
+
+	EnterCriticalSection(&cache->criticalSection);
+	for (schedule = cache->buckets[qwDigest % KEY_CACHE_BUCKETS]; schedule != NULL; schedule = schedule->nextInBucket) {
+		if (schedule->qwDigest == qwDigest && schedule->dwCipher == dwCipher &&
+			schedule->key.cbData == key.cbData && memcmp(schedule->key.pData, key.pData, key.cbData) == 0 &&
+			_tcscmp(schedule->sUserName, sUserName) == 0) {
+			break;
+		}
+	}
+
+	if (schedule != NULL) {
+		if (schedule->nrRefs++ == 0) {
+			unlinkIdle(cache, schedule);
+		}
+		cache->stats.nrHits++;
+	} else {
+		// the setup runs under the lock, so parallel streams of a user never expand the same key twice
+		schedule = createKeySchedule(dwCipher, key);
+		if (schedule != NULL) {
+			schedule->sUserName = _tcsdup(sUserName);
+			if (schedule->sUserName == NULL) {
+				freeKeySchedule(schedule);
+				schedule = NULL;
+			}
+		}
+		if (schedule == NULL) {
+			LeaveCriticalSection(&cache->criticalSection);
+			return NULL;
+		}
+		schedule->cache = cache;
+		schedule->qwDigest = qwDigest;
+		schedule->nextInBucket = cache->buckets[qwDigest % KEY_CACHE_BUCKETS];
+		cache->buckets[qwDigest % KEY_CACHE_BUCKETS] = schedule;
+		cache->stats.nrSchedules++;
+		cache->stats.nrMisses++;
+	}
+	LeaveCriticalSection(&cache->criticalSection);
+
+	cipher = createContext(schedule, nonce);
+	if (cipher == NULL) {
+		releaseKeySchedule(schedule);
+	}
+	return cipher;
+}
+
+VOID destroyCipherContext(LPCipherContextT cipher)
+{
+	if (cipher == NULL) {
+		return;
+	}
+	releaseKeySchedule(cipher->schedule);
+	memset(cipher, 0, sizeof(CipherContextT));
+	free(cipher);
+}
+
+LPKeyCacheT createKeyCache(DWORD nrMaxIdle)
+{
+	LPKeyCacheT cache = (LPKeyCacheT)malloc(sizeof(KeyCacheT));
+
+	if (cache == NULL) {
+		return NULL;
+	}
+	memset(cache, 0, sizeof(KeyCacheT));
+	InitializeCriticalSection(&cache->criticalSection);
+	cache->nrMaxIdle = nrMaxIdle;
+	return cache;
+}
+
+VOID getKeyCacheStats(LPKeyCacheT cache, LPKeyCacheStatsT stats)
+{
+	EnterCriticalSection(&cache->criticalSection);
+	*stats = cache->stats;
+	LeaveCriticalSection(&cache->criticalSection);
+}
+
+VOID encryptPacket(LPCipherContextT cipher, ULONGLONG qwSequence, ByteSpanT data)
+{
+	LPKeyScheduleT schedule = cipher->schedule;
+	BYTE nonce[CIPHER_NONCE_SIZE];
+	BYTE counterBlock[AES_BLOCK_SIZE];
+
+	switch (schedule->dwCipher) {
+	case CIPHER_XOR:
+		xorKeystream(data.pData, data.cbData, schedule->key.pData, schedule->key.cbData, 0);
+		return;
+
+	case CIPHER_CHACHA20:
+		memcpy(nonce, cipher->nonce, CIPHER_NONCE_SIZE);
+		for (INT i = 0; i < 8; i++) {
+			nonce[4 + i] ^= (BYTE)(qwSequence >> (8 * i));
+		}
+		chacha20Xor(data.pData, data.cbData, schedule->key.pData, nonce, 0);
+		return;
+
+	default:
+		memcpy(counterBlock, cipher->nonce, CIPHER_NONCE_SIZE);
+		for (INT i = 0; i < 8; i++) {
+			counterBlock[7 - i] ^= (BYTE)(qwSequence >> (8 * i));
+		}
+		memset(counterBlock + CIPHER_NONCE_SIZE, 0, AES_BLOCK_SIZE - CIPHER_NONCE_SIZE);
+		aesCtrXor(&schedule->aesKey, data.pData, data.cbData, counterBlock);
+		return;
+	}
+}
+
+LPCTSTR getCipherKernelName(DWORD dwCipher)
+{
+	switch (dwCipher) {
+	case CIPHER_XOR:
+		return getXorKernelName();
+	case CIPHER_CHACHA20:
+		return getChaCha20KernelName();
+	case CIPHER_AES128_CTR:
+	case CIPHER_AES256_CTR:
+		return getAesCtrKernelName();
+	default:
+		return NULL;
+	}
+}
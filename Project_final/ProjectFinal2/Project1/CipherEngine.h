@@ -0,0 +1,79 @@
+#pragma once
+
+#ifndef CIPHER_ENGINE_H
+#define CIPHER_ENGINE_H
+
+#include "Portability.h"
+#include "ByteSpan.h"
+#include "CommunicationProtocol.h"
+
+/*
+ * The ciphers of CipherE behind one interface, so the workers encrypt a packet
+ * without knowing which cipher its client picked.
+ *
+ * XOR restarts the repeated key at every packet, as clients of older versions expect.
+ * The stream ciphers derive the counter of a packet from the nonce and the packet number,
+ * a packet can be encrypted by any worker, in any order:
+ *     ChaCha20: nonce bytes 4 to 11 XOR the packet number (little endian), block counter from 0
+ *     AES-CTR:  nonce bytes 0 to 7 XOR the packet number (big endian), then bytes 8 to 11,
+ *               then the 32 bit block counter from 0
+ * A packet holds at most MAX_LARGE_PACKET_SIZE bytes, far from the 2^32 blocks of a counter.
+ *
+ * A context is the nonce of a connection and a key schedule: the key and its expansion.
+ * Schedules can be shared through a key cache, so the parallel streams of a user and a user
+ * coming back with the same key skip the key setup.
+ */
+
+typedef struct CipherContextTag *LPCipherContextT;
+
+typedef struct KeyCacheTag *LPKeyCacheT;
+
+typedef struct KeyCacheStatsTag {
+	// schedules in the cache, in use or idle
+	DWORD nrSchedules;
+	DWORD nrIdle;
+	ULONGLONG nrHits;
+	ULONGLONG nrMisses;
+	ULONGLONG nrEvictions;
+}KeyCacheStatsT, *LPKeyCacheStatsT;
+
+/*
+ * @param key: copied, the caller may free it.
+ * @param nonce: CIPHER_NONCE_SIZE bytes, ignored by XOR.
+ * @return the context, or NULL for an unknown cipher, a key of the wrong size or no memory.
+ */
+LPCipherContextT createCipherContext(DWORD dwCipher, ByteSpanT key, const BYTE *nonce);
+
+/*
+ * Creates a context whose key schedule is shared with the other contexts of the same user,
+ * cipher and key. The schedule is looked up by a digest of the three, then by the key itself.
+ *
+ * @return the context, or NULL for an unknown cipher, a key of the wrong size or no memory.
+ */
+LPCipherContextT acquireCipherContext(LPKeyCacheT cache, const TCHAR *sUserName, DWORD dwCipher, ByteSpanT key, const BYTE *nonce);
+
+/*
+ * Frees the context. A schedule no context uses anymore is wiped,
+ * or kept idle by its cache until it is the least recently used one over nrMaxIdle.
+ */
+VOID destroyCipherContext(LPCipherContextT cipher);
+
+/*
+ * Encrypts data in place as packet number qwSequence. Safe to call from several threads at once.
+ */
+VOID encryptPacket(LPCipherContextT cipher, ULONGLONG qwSequence, ByteSpanT data);
+
+/*
+ * @param nrMaxIdle: schedules kept once no context uses them, 0 keeps only the ones in use.
+ * @return the cache, or NULL when out of memory.
+ */
+LPKeyCacheT createKeyCache(DWORD nrMaxIdle);
+
+VOID getKeyCacheStats(LPKeyCacheT cache, LPKeyCacheStatsT stats);
+
+/*
+ * Name of the implementation that runs the cipher on this processor.
+ */
+LPCTSTR getCipherKernelName(DWORD dwCipher);
+
+#endif
@@ -1,91 +1,120 @@
 
 #include "CommunicationProtocol.h"
 
-BOOL getNextPacket(HANDLE hPipe, PTCHAR buff, LPDWORD pcbPacketSize)
+VOID initPacketReader(LPPacketReaderT reader, LPConnectionT connection, DWORD cbMaxPacket)
+{
+	reader->connection = connection;
+	reader->cbMaxPacket = cbMaxPacket;
+	reader->nrBatchLeft = 0;
+}
+
+BOOL readPacketHeader(LPPacketReaderT reader, LPDWORD pcbPacketSize)
 {
 	BOOL bSuccess;
-	DWORD cbRead;
 	DWORD command;
 
-	bSuccess = ReadFile(
-		hPipe,
-		&command,
-		sizeof(DWORD),
-		&cbRead,
-		NULL
-	);
-
-	//check for failed read or incorrect packet header.
-	if (!bSuccess || (command != LAST_PACKET && command != NEXT_PACKET)) {
-		return FALSE;
+	while (reader->nrBatchLeft == 0) {
+		bSuccess = transportRead(reader->connection, &command, sizeof(DWORD));
+
+		//check for failed read or incorrect packet header.
+		if (!bSuccess || (command != LAST_PACKET && command != NEXT_PACKET && command != NEXT_BATCH)) {
+			return FALSE;
+		}
+
+		if (command == LAST_PACKET) {
+			*pcbPacketSize = 0;
+			return TRUE;
+		}
+
+		if (command == NEXT_PACKET) {
+			reader->nrBatchLeft = 1;
+		} else {
+			bSuccess = transportRead(reader->connection, &reader->nrBatchLeft, sizeof(DWORD));
+			if (!bSuccess || reader->nrBatchLeft > MAX_BATCH_PACKETS) {
+				return FALSE;
+			}
+		}
 	}
 
-	if (command == LAST_PACKET) {
-		*pcbPacketSize = 0;
-		return TRUE;
-	}
+	reader->nrBatchLeft--;
+	bSuccess = transportRead(reader->connection, pcbPacketSize, sizeof(DWORD));
 
-	//command is only NEXT_PACKET
-	bSuccess = ReadFile(
-		hPipe,
-		pcbPacketSize,
-		sizeof(DWORD),
-		&cbRead,
-		NULL
-	);
+	return bSuccess && *pcbPacketSize <= reader->cbMaxPacket;
+}
 
-	if (!bSuccess) {
+BOOL getNextPacket(LPConnectionT connection, PTCHAR buff, LPDWORD pcbPacketSize)
+{
+	PacketReaderT reader;
+
+	initPacketReader(&reader, connection, MAX_PACKET_SIZE);
+	if (!readPacketHeader(&reader, pcbPacketSize)) {
 		return FALSE;
 	}
 
-	bSuccess = ReadFile(
-		hPipe,
-		buff,
-		*pcbPacketSize,
-		&cbRead,
-		NULL
-	);
+	return transportRead(connection, buff, *pcbPacketSize);
+}
+
+BOOL sendPacket(LPConnectionT connection, PTCHAR buff, DWORD cbPacketLen)
+{
+	DWORD header[2] = { NEXT_PACKET, cbPacketLen };
+	TransportBufferT buffers[2] = {
+		{ header, sizeof(header) },
+		{ buff, cbPacketLen }
+	};
 
-	return bSuccess;
+	return transportWriteGather(connection, buffers, 2);
 }
 
-BOOL sendPacket(HANDLE hPipe, PTCHAR buff, DWORD cbPacketLen)
+PBYTE framePacket(PTCHAR buff, DWORD cbPacketLen)
 {
-	DWORD cbWritten;
-	BOOL bSuccess;
+	PBYTE header = (PBYTE)buff - PACKET_HEADER_SIZE;
 	DWORD command = NEXT_PACKET;
 
-	bSuccess = WriteFile(
-		hPipe,
-		&command,
-		sizeof(DWORD),
-		&cbWritten,
-		NULL
-	);
+	memcpy(header, &command, sizeof(DWORD));
+	memcpy(header + sizeof(DWORD), &cbPacketLen, sizeof(DWORD));
+	return header;
+}
 
-	if (!bSuccess) {
-		return FALSE;
+BOOL sendFramedPacket(LPConnectionT connection, PTCHAR buff, DWORD cbPacketLen)
+{
+	return transportWrite(connection, framePacket(buff, cbPacketLen), PACKET_HEADER_SIZE + cbPacketLen);
+}
+
+BOOL sendPacketBatch(LPConnectionT connection, PTCHAR *buffs, const DWORD *cbPacketLens, DWORD nrPackets)
+{
+	DWORD header[2] = { NEXT_BATCH, nrPackets };
+	TransportBufferT buffers[MAX_BATCH_PACKETS + 1];
+
+	buffers[0].buff = header;
+	buffers[0].cbBuff = sizeof(header);
+	for (DWORD i = 0; i < nrPackets; i++) {
+		// the length goes right in front of the payload
+		PBYTE length = (PBYTE)buffs[i] - sizeof(DWORD);
+		memcpy(length, &cbPacketLens[i], sizeof(DWORD));
+		buffers[i + 1].buff = length;
+		buffers[i + 1].cbBuff = sizeof(DWORD) + cbPacketLens[i];
 	}
 
-	bSuccess = WriteFile(
-		hPipe,
-		&cbPacketLen,
-		sizeof(DWORD),
-		&cbWritten,
-		NULL
-	);
+	return transportWriteGather(connection, buffers, nrPackets + 1);
+}
 
-	if (!bSuccess) {
-		return FALSE;
-	}
+BOOL sendCommand(LPConnectionT connection, DWORD dwCommand)
+{
+	return transportWrite(connection, &dwCommand, sizeof(DWORD));
+}
+
+LPCTSTR getCipherName(DWORD dwCipher)
+{
+	static LPCTSTR names[NR_CIPHERS] = {
+		_T("xor"), _T("chacha20"), _T("aes128-ctr"), _T("aes256-ctr")
+	};
 
-	bSuccess = WriteFile(
-		hPipe,
-		buff,
-		cbPacketLen,
-		&cbWritten,
-		NULL
-	);
+	return (dwCipher < NR_CIPHERS) ? names[dwCipher] : NULL;
+}
+
+DWORD getCipherKeySize(DWORD dwCipher)
+{
+	static const DWORD cbKeySizes[NR_CIPHERS] = { 0, 32, 16, 32 };
 
-	return bSuccess;
+	return (dwCipher < NR_CIPHERS) ? cbKeySizes[dwCipher] : 0;
 }
@@ -0,0 +1,360 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Compression.h"
+
+/*
+ * LZ4 block format: sequences of a token (the literal length in its high 4 bits, the match
+ * length minus LZ4_MIN_MATCH in its low 4 bits), more length bytes when a length is 15 or more,
+ * the literals, then the 2 byte little endian offset of the match.
+ * The last sequence has literals only: the last LZ4_LAST_LITERALS bytes are always literals
+ * and no match starts in the last LZ4_MFLIMIT bytes.
+ */
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_RUN_MASK 15
+// the matcher steps faster over bytes that keep missing, one more byte every 1 << LZ4_SKIP_TRIGGER misses
+#define LZ4_SKIP_TRIGGER 6
+
+typedef struct CodecScratchTag {
+	PBYTE pBuffer;
+	DWORD cbBuffer;
+	LPDWORD hashTable;
+}CodecScratchT, *LPCodecScratchT;
+
+static thread_local CodecScratchT tScratch;
+
+static DWORD read32(const BYTE *p)
+{
+	DWORD dwValue;
+
+	memcpy(&dwValue, p, sizeof(DWORD));
+	return dwValue;
+}
+
+static DWORD hashSequence(DWORD dwSequence)
+{
+	return (dwSequence * 2654435761U) >> (32 - CODEC_HASH_LOG);
+}
+
+/*
+ * Writes the bytes of a length past the 15 held by the token.
+ */
+static PBYTE writeLength(PBYTE op, DWORD cbLength)
+{
+	for (cbLength -= LZ4_RUN_MASK; cbLength >= 255; cbLength -= 255) {
+		*op++ = 255;
+	}
+	*op++ = (BYTE)cbLength;
+	return op;
+}
+
+/*
+ * @return FALSE when the bytes of the length run past the end of the block.
+ */
+static BOOL readLength(const BYTE **pip, const BYTE *iend, LPDWORD pcbLength)
+{
+	BYTE bNext;
+
+	do {
+		if (*pip >= iend) {
+			return FALSE;
+		}
+		bNext = *(*pip)++;
+		*pcbLength += bNext;
+	} while (bNext == 255);
+	return TRUE;
+}
+
+DWORD compressBlock(const BYTE *src, DWORD cbSrc, PBYTE dst, DWORD cbDstMax, LPDWORD hashTable)
+{
+	const BYTE *ip = src;
+	const BYTE *anchor = src;
+	const BYTE *iend = src + cbSrc;
+	const BYTE *mflimit = iend - LZ4_MFLIMIT;
+	const BYTE *matchlimit = iend - LZ4_LAST_LITERALS;
+	const BYTE *match;
+	const BYTE *matchEnd;
+	PBYTE op = dst;
+	PBYTE oend = dst + cbDstMax;
+	DWORD nrAttempts = 1 << LZ4_SKIP_TRIGGER;
+	DWORD dwHash;
+	DWORD cbLiterals;
+	DWORD cbMatch;
+
+	// shorter blocks are all literals
+	if (cbSrc > LZ4_MFLIMIT) {
+		memset(hashTable, 0, sizeof(DWORD) << CODEC_HASH_LOG);
+		ip++;
+
+		while (ip <= mflimit) {
+			dwHash = hashSequence(read32(ip));
+			match = src + hashTable[dwHash];
+			hashTable[dwHash] = (DWORD)(ip - src);
+			if (match >= ip || ip - match > LZ4_MAX_DISTANCE || read32(match) != read32(ip)) {
+				ip += nrAttempts++ >> LZ4_SKIP_TRIGGER;
+				continue;
+			}
+			nrAttempts = 1 << LZ4_SKIP_TRIGGER;
+
+			while (ip > anchor && match > src && ip[-1] == match[-1]) {
+				ip--;
+				match--;
+			}
+			matchEnd = ip + LZ4_MIN_MATCH;
+			match += LZ4_MIN_MATCH;
+			while (matchEnd < matchlimit && *matchEnd == *match) {
+				matchEnd++;
+				match++;
+			}
+
+			cbLiterals = (DWORD)(ip - anchor);
+			cbMatch = (DWORD)(matchEnd - ip) - LZ4_MIN_MATCH;
+			if ((DWORD)(oend - op) < 1 + cbLiterals / 255 + 1 + cbLiterals + 2 + cbMatch / 255 + 1) {
+				return 0;
+			}
+
+			PBYTE token = op++;
+			*token = (BYTE)(((cbLiterals < LZ4_RUN_MASK) ? cbLiterals : LZ4_RUN_MASK) << 4);
+			if (cbLiterals >= LZ4_RUN_MASK) {
+				op = writeLength(op, cbLiterals);
+			}
+			memcpy(op, anchor, cbLiterals);
+			op += cbLiterals;
+
+			DWORD dwOffset = (DWORD)(matchEnd - match);
+			*op++ = (BYTE)dwOffset;
+			*op++ = (BYTE)(dwOffset >> 8);
+			*token |= (BYTE)((cbMatch < LZ4_RUN_MASK) ? cbMatch : LZ4_RUN_MASK);
+			if (cbMatch >= LZ4_RUN_MASK) {
+				op = writeLength(op, cbMatch);
+			}
+
+			ip = anchor = matchEnd;
+			// the bytes just before the next search are likely to start a later match
+			if (ip <= mflimit) {
+				hashTable[hashSequence(read32(ip - 2))] = (DWORD)(ip - 2 - src);
+			}
+		}
+	}
+
+	cbLiterals = (DWORD)(iend - anchor);
+	if ((DWORD)(oend - op) < 1 + cbLiterals / 255 + 1 + cbLiterals) {
+		return 0;
+	}
+	*op++ = (BYTE)(((cbLiterals < LZ4_RUN_MASK) ? cbLiterals : LZ4_RUN_MASK) << 4);
+	if (cbLiterals >= LZ4_RUN_MASK) {
+		op = writeLength(op, cbLiterals);
+	}
+	memcpy(op, anchor, cbLiterals);
+	op += cbLiterals;
+
+	return (DWORD)(op - dst);
+}
+
+BOOL decompressBlock(const BYTE *src, DWORD cbSrc, PBYTE dst, DWORD cbDst)
+{
+	const BYTE *ip = src;
+	const BYTE *iend = src + cbSrc;
+	const BYTE *match;
+	PBYTE op = dst;
+	PBYTE oend = dst + cbDst;
+	DWORD dwToken;
+	DWORD cbLiterals;
+	DWORD cbMatch;
+	DWORD dwOffset;
+
+	while (ip < iend) {
+		dwToken = *ip++;
+
+		cbLiterals = dwToken >> 4;
+		if (cbLiterals == LZ4_RUN_MASK && !readLength(&ip, iend, &cbLiterals)) {
+			return FALSE;
+		}
+		if (cbLiterals > (DWORD)(iend - ip) || cbLiterals > (DWORD)(oend - op)) {
+			return FALSE;
+		}
+		memcpy(op, ip, cbLiterals);
+		op += cbLiterals;
+		ip += cbLiterals;
+		if (ip == iend) {
+			// the last sequence has no match
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return FALSE;
+		}
+		dwOffset = ip[0] | ((DWORD)ip[1] << 8);
+		ip += 2;
+		if (dwOffset == 0 || dwOffset > (DWORD)(op - dst)) {
+			return FALSE;
+		}
+
+		cbMatch = dwToken & LZ4_RUN_MASK;
+		if (cbMatch == LZ4_RUN_MASK && !readLength(&ip, iend, &cbMatch)) {
+			return FALSE;
+		}
+		cbMatch += LZ4_MIN_MATCH;
+		if (cbMatch > (DWORD)(oend - op)) {
+			return FALSE;
+		}
+
+		match = op - dwOffset;
+		if (dwOffset >= cbMatch) {
+			memcpy(op, match, cbMatch);
+			op += cbMatch;
+		} else {
+			// the match repeats the bytes it is copying
+			while (cbMatch-- > 0) {
+				*op++ = *match++;
+			}
+		}
+	}
+
+	return op == oend;
+}
+
+/*
+ * @return the scratch buffer of the calling thread, at least cbNeeded bytes, NULL when out of memory.
+ */
+static LPCodecScratchT getCodecScratch(DWORD cbNeeded)
+{
+	LPCodecScratchT scratch = &tScratch;
+	PBYTE pBuffer;
+
+	if (scratch->hashTable == NULL) {
+		scratch->hashTable = (LPDWORD)malloc(sizeof(DWORD) << CODEC_HASH_LOG);
+		if (scratch->hashTable == NULL) {
+			return NULL;
+		}
+	}
+	if (scratch->cbBuffer < cbNeeded) {
+		pBuffer = (PBYTE)realloc(scratch->pBuffer, cbNeeded);
+		if (pBuffer == NULL) {
+			return NULL;
+		}
+		scratch->pBuffer = pBuffer;
+		scratch->cbBuffer = cbNeeded;
+	}
+	return scratch;
+}
+
+VOID releaseCodecScratch()
+{
+	free(tScratch.pBuffer);
+	free(tScratch.hashTable);
+	memset(&tScratch, 0, sizeof(CodecScratchT));
+}
+
+VOID initCodecState(LPCodecStateT codec, LPInitExT options)
+{
+	memset(codec, 0, sizeof(CodecStateT));
+	if (options->dwFlags & INIT_COMPRESS) {
+		codec->dwMode = CODEC_COMPRESS;
+		codec->cbMaxPlain = options->cbMaxPacket - PACKET_RECORD_HEADER_SIZE;
+	} else if (options->dwFlags & INIT_DECOMPRESS) {
+		codec->dwMode = CODEC_DECOMPRESS;
+		codec->cbMaxPlain = options->cbMaxPacket;
+	}
+}
+
+DWORD getRecordBufferSize(LPCodecStateT codec, DWORD cbPacket, LPDWORD pdwOffset)
+{
+	*pdwOffset = 0;
+	if (codec->dwMode == CODEC_COMPRESS) {
+		if (cbPacket > codec->cbMaxPlain) {
+			return 0;
+		}
+		*pdwOffset = PACKET_RECORD_HEADER_SIZE;
+		return PACKET_RECORD_HEADER_SIZE + cbPacket;
+	}
+	if (codec->dwMode == CODEC_DECOMPRESS) {
+		return (cbPacket > codec->cbMaxPlain) ? cbPacket : codec->cbMaxPlain;
+	}
+	return cbPacket;
+}
+
+/*
+ * Whether to try compressing the next packet, or store it as it is while backing off.
+ * The workers update the back off of a stream concurrently, a lost update only skips a packet
+ * more or less.
+ */
+static BOOL shouldCompress(LPCodecStateT codec)
+{
+	return ReadAcquire(&codec->nrSkip) <= 0 || InterlockedDecrement(&codec->nrSkip) < 0;
+}
+
+static VOID updateBackoff(LPCodecStateT codec, BOOL bCompressed)
+{
+	LONG nrBackoff;
+
+	if (bCompressed) {
+		WriteRelease(&codec->nrBackoff, 0);
+		return;
+	}
+	nrBackoff = ReadAcquire(&codec->nrBackoff) * 2;
+	if (nrBackoff == 0) {
+		nrBackoff = 1;
+	} else if (nrBackoff > CODEC_MAX_BACKOFF) {
+		nrBackoff = CODEC_MAX_BACKOFF;
+	}
+	WriteRelease(&codec->nrBackoff, nrBackoff);
+	WriteRelease(&codec->nrSkip, nrBackoff);
+}
+
+DWORD compressRecord(LPCodecStateT codec, PBYTE pRecord, DWORD cbPlain)
+{
+	LPPacketRecordT header = (LPPacketRecordT)pRecord;
+	PBYTE pData = pRecord + PACKET_RECORD_HEADER_SIZE;
+	LPCodecScratchT scratch = NULL;
+	DWORD cbStored = 0;
+
+	if (shouldCompress(codec)) {
+		scratch = getCodecScratch(cbPlain);
+		if (scratch != NULL) {
+			cbStored = compressBlock(pData, cbPlain, scratch->pBuffer, cbPlain - cbPlain / CODEC_MIN_GAIN, scratch->hashTable);
+			updateBackoff(codec, cbStored != 0);
+		}
+	}
+
+	header->cbPlain = cbPlain;
+	if (cbStored == 0) {
+		header->cbStored = cbPlain;
+		return cbPlain;
+	}
+	memcpy(pData, scratch->pBuffer, cbStored);
+	header->cbStored = cbStored;
+	return cbStored;
+}
+
+BOOL checkRecord(LPCodecStateT codec, ByteSpanT record)
+{
+	LPPacketRecordT header = (LPPacketRecordT)record.pData;
+
+	return record.cbData >= PACKET_RECORD_HEADER_SIZE &&
+		header->cbStored == record.cbData - PACKET_RECORD_HEADER_SIZE &&
+		header->cbPlain != 0 && header->cbPlain <= codec->cbMaxPlain &&
+		header->cbStored <= header->cbPlain;
+}
+
+DWORD expandRecord(PBYTE pRecord)
+{
+	PacketRecordT header = *(LPPacketRecordT)pRecord;
+	PBYTE pData = pRecord + PACKET_RECORD_HEADER_SIZE;
+	LPCodecScratchT scratch;
+
+	if (header.cbStored == header.cbPlain) {
+		memmove(pRecord, pData, header.cbPlain);
+		return header.cbPlain;
+	}
+
+	// the packet may be larger than the record, it cannot be decompressed over it
+	scratch = getCodecScratch(header.cbPlain);
+	if (scratch == NULL || !decompressBlock(pData, header.cbStored, scratch->pBuffer, header.cbPlain)) {
+		return 0;
+	}
+	memcpy(pRecord, scratch->pBuffer, header.cbPlain);
+	return header.cbPlain;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include "Portability.h"
+#include "ByteSpan.h"
+#include "CommunicationProtocol.h"
+
+/*
+ * Compression stage of the workers, ahead of the cipher (see INIT_COMPRESS and PacketRecordT).
+ * Packets are compressed on their own in the LZ4 block format, with a greedy matcher over
+ * a hash table of 4 byte sequences, so any worker can take any packet of a stream.
+ * A packet is stored as it is when it does not get at least 1/CODEC_MIN_GAIN smaller,
+ * then the next packets of its stream are stored without trying, twice as many after every
+ * packet that did not compress, up to CODEC_MAX_BACKOFF; a packet that compresses ends the back off.
+ *
+ * The workers compress into a scratch buffer of their own, released with releaseCodecScratch.
+ */
+
+// a packet must get at least 1/CODEC_MIN_GAIN smaller to be stored compressed
+#define CODEC_MIN_GAIN 16
+// most packets stored without trying after packets that did not compress
+#define CODEC_MAX_BACKOFF 16
+// entries of the hash table of the matcher, as a power of two
+#define CODEC_HASH_LOG 12
+
+typedef enum CodecModeEnum {
+	CODEC_NONE, CODEC_COMPRESS, CODEC_DECOMPRESS
+}CodecModeE;
+
+/*
+ * Codec of a connection, its packets borrow it like the cipher context.
+ */
+typedef struct CodecStateTag {
+	DWORD dwMode;
+	// largest packet of the client before compression, or after decompression
+	DWORD cbMaxPlain;
+	// packets still to be stored without trying, and how many the next failure skips
+	volatile LONG nrSkip;
+	volatile LONG nrBackoff;
+}CodecStateT, *LPCodecStateT;
+
+/*
+ * Sets the codec up for the options granted to a connection, CODEC_NONE without
+ * INIT_COMPRESS nor INIT_DECOMPRESS.
+ */
+VOID initCodecState(LPCodecStateT codec, LPInitExT options);
+
+/*
+ * Where a packet of cbPacket bytes read from the client goes: compressed packets are read
+ * behind the room of their record header, records are read in a buffer the decompressed packet fits in.
+ *
+ * @param pdwOffset: offset in the payload the packet is read at.
+ * @return the bytes to acquire for the payload, 0 when the packet is too large for the codec.
+ */
+DWORD getRecordBufferSize(LPCodecStateT codec, DWORD cbPacket, LPDWORD pdwOffset);
+
+/*
+ * Compresses the packet following the header of pRecord in place and fills the header.
+ *
+ * @param cbPlain: bytes of the packet, at most codec->cbMaxPlain.
+ * @return the bytes stored after the header, cbPlain when the packet is stored as it is.
+ */
+DWORD compressRecord(LPCodecStateT codec, PBYTE pRecord, DWORD cbPlain);
+
+/*
+ * Checks the header of a record received for decompression against its length.
+ *
+ * @return FALSE for a record that is cut, or larger than codec->cbMaxPlain once decompressed.
+ */
+BOOL checkRecord(LPCodecStateT codec, ByteSpanT record);
+
+/*
+ * Decompresses a checked record, its stored bytes decrypted already, to the start of its buffer.
+ *
+ * @return the bytes of the packet, 0 when the stored bytes are not a valid LZ4 block of cbPlain bytes.
+ */
+DWORD expandRecord(PBYTE pRecord);
+
+/*
+ * LZ4 block compression of src into dst.
+ *
+ * @param hashTable: (1 << CODEC_HASH_LOG) entries, overwritten.
+ * @return the bytes written, 0 when they would not fit in cbDstMax.
+ */
+DWORD compressBlock(const BYTE *src, DWORD cbSrc, PBYTE dst, DWORD cbDstMax, LPDWORD hashTable);
+
+/*
+ * @return FALSE unless src is a valid LZ4 block decompressing to exactly cbDst bytes.
+ */
+BOOL decompressBlock(const BYTE *src, DWORD cbSrc, PBYTE dst, DWORD cbDst);
+
+/*
+ * Frees the scratch buffer of the calling thread, workers call it before returning.
+ */
+VOID releaseCodecScratch();
+
+#endif
@@ -1,111 +1,231 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include "EncSyncQueue.h"
-#include "../Client/CommunicationProtocol.h"
-
-LPEncryptDataT create_EcryptData(
-	HANDLE hHeap, 
-	PTCHAR toBeEncrypted,
-	DWORD dwBufflen,
-	PTCHAR encryptionKey,
-	DWORD dwKeyLen,
-	LPCRITICAL_SECTION pCriticalSection,
-	PCONDITION_VARIABLE pConditionVariable)
+
+// spins before a thread parks on an empty or full queue
+#define QUEUE_SPIN_COUNT 128
+
+// positions wrap around, compare them as a signed distance
+static LONG positionDistance(LONG dwFirst, LONG dwSecond)
 {
-	LPEncryptDataT pEncryptData = (LPEncryptDataT)HeapAlloc(
-		hHeap,
-		0,
-		sizeof(EncryptDataT)
-	);
-	if (pEncryptData == NULL) {
-		return NULL;
-	}
+	return (LONG)((DWORD)dwFirst - (DWORD)dwSecond);
+}
 
-	pEncryptData->toBeEncrypted = (PTCHAR) HeapAlloc(hHeap, 0, dwBufflen * sizeof(TCHAR));
-	if (pEncryptData->toBeEncrypted == NULL) {
-		HeapFree(hHeap, 0, pEncryptData);
-		return NULL;
-	}
+static LONG positionAdd(LONG dwPos, DWORD dwCount)
+{
+	return (LONG)((DWORD)dwPos + dwCount);
+}
 
-	pEncryptData->encryptionKey = (PTCHAR) HeapAlloc(hHeap, 0, dwKeyLen * sizeof(TCHAR));
-	if (pEncryptData->encryptionKey == NULL) {
-		HeapFree(hHeap, 0, pEncryptData->toBeEncrypted);
-		HeapFree(hHeap, 0, pEncryptData);
-		return NULL;
+#define PARKING_WAITER 1
+#define PARKING_WOKEN 0x10000
+#define parkingWaiters(dwState) ((DWORD)(dwState) & 0xFFFF)
+#define parkingWoken(dwState) ((DWORD)(dwState) >> 16)
+
+/*
+ * The barrier orders the caller's change before reading the state,
+ * parkThread does the opposite.
+ */
+BOOL wakeParkedThread(LPQueueParkingT parking)
+{
+	LONG dwState;
+	LONG dwSeen;
+
+	MemoryBarrier();
+	dwState = ReadAcquire(&parking->dwState);
+	while (parkingWaiters(dwState) > parkingWoken(dwState)) {
+		dwSeen = InterlockedCompareExchange(&parking->dwState, dwState + PARKING_WOKEN, dwState);
+		if (dwSeen == dwState) {
+			InterlockedIncrement(&parking->dwSignal);
+			WakeByAddressSingle((LPVOID)&parking->dwSignal);
+			return TRUE;
+		}
+		dwState = dwSeen;
 	}
+	return parkingWaiters(dwState) > 0;
+}
 
-	_tcscpy(pEncryptData->toBeEncrypted, toBeEncrypted);
+BOOL tryPushSyncQueue(LPSyncCircQueueT queue, LPEncryptDataT data)
+{
+	LPQueueCellT cell;
+	LONG dwPos = ReadAcquire(&queue->dwEnqueuePos);
+	LONG dwDistance;
+
+	while (TRUE) {
+		cell = &queue->cells[(DWORD)dwPos & queue->dwMask];
+		dwDistance = positionDistance(ReadAcquire(&cell->dwSequence), dwPos);
+
+		if (dwDistance == 0) {
+			LONG dwSeen = InterlockedCompareExchange(&queue->dwEnqueuePos, positionAdd(dwPos, 1), dwPos);
+			if (dwSeen == dwPos) {
+				break;
+			}
+			dwPos = dwSeen;
+		} else if (dwDistance < 0) {
+			// the consumers did not free this cell yet, the queue is full
+			return FALSE;
+		} else {
+			dwPos = ReadAcquire(&queue->dwEnqueuePos);
+		}
+	}
 
-	_tcscpy(pEncryptData->encryptionKey, encryptionKey);
+	cell->data = data;
+	WriteRelease(&cell->dwSequence, positionAdd(dwPos, 1));
+	wakeParkedThread(&queue->notEmpty);
+	return TRUE;
+}
 
-	pEncryptData->dwBuffLen = dwBufflen;
-	pEncryptData->dwKeyLen = dwKeyLen;
-	pEncryptData->dwStatus = DATA_NOT_ENCRYPTED;
-	pEncryptData->pCriticalSection = pCriticalSection;
-	pEncryptData->pConditionVariable = pConditionVariable;
+BOOL tryPopSyncQueue(LPSyncCircQueueT queue, LPEncryptDataT *data)
+{
+	LPQueueCellT cell;
+	LONG dwPos = ReadAcquire(&queue->dwDequeuePos);
+	LONG dwDistance;
+
+	while (TRUE) {
+		cell = &queue->cells[(DWORD)dwPos & queue->dwMask];
+		dwDistance = positionDistance(ReadAcquire(&cell->dwSequence), positionAdd(dwPos, 1));
+
+		if (dwDistance == 0) {
+			LONG dwSeen = InterlockedCompareExchange(&queue->dwDequeuePos, positionAdd(dwPos, 1), dwPos);
+			if (dwSeen == dwPos) {
+				break;
+			}
+			dwPos = dwSeen;
+		} else if (dwDistance < 0) {
+			// no producer filled this cell yet, the queue is empty
+			return FALSE;
+		} else {
+			dwPos = ReadAcquire(&queue->dwDequeuePos);
+		}
+	}
 
-	return pEncryptData;
+	*data = cell->data;
+	WriteRelease(&cell->dwSequence, positionAdd(dwPos, queue->dwMask + 1));
+	wakeParkedThread(&queue->notFull);
+	return TRUE;
 }
 
-VOID free_EncryptData(HANDLE hHeap, LPEncryptDataT lpEncryptData)
+DWORD getSyncQueueLength(LPSyncCircQueueT queue)
 {
-	HeapFree(hHeap, 0, lpEncryptData->encryptionKey);
-
-	HeapFree(hHeap, 0, lpEncryptData->toBeEncrypted);
+	// the dequeue position never passes the enqueue position, read it first
+	LONG dwDequeuePos = ReadAcquire(&queue->dwDequeuePos);
+	LONG dwDistance = positionDistance(ReadAcquire(&queue->dwEnqueuePos), dwDequeuePos);
 
-	HeapFree(hHeap, 0, lpEncryptData);
+	return (dwDistance > 0) ? (DWORD)dwDistance : 0;
 }
-VOID pushSyncQueue(LPSyncCircQueueT queue, LPEncryptDataT data)
+
+BOOL parkThread(LPQueueParkingT parking, BOOL(*tryAgain)(LPVOID context), LPVOID context)
 {
-	EnterCriticalSection(&queue->criticalSection);
+	LONG dwSignal = ReadAcquire(&parking->dwSignal);
+	LONG dwState;
+	LONG dwNewState;
+	BOOL bSuccess;
 
-	while (queue->dwTail + 1 == queue->dwHead || (queue->dwHead == 0 && queue->dwTail == queue->dwSize - 1)) {
-		//queue is full
-		SleepConditionVariableCS(&queue->cvNotFull, &queue->criticalSection, INFINITE);
+	InterlockedExchangeAdd(&parking->dwState, PARKING_WAITER);
+
+	bSuccess = tryAgain(context);
+	if (!bSuccess) {
+		WaitOnAddress(&parking->dwSignal, &dwSignal, sizeof(LONG), INFINITE);
 	}
 
-	queue->data[queue->dwTail] = data;
-	queue->dwTail = (queue->dwTail + 1) % queue->dwSize;
+	// leave, taking one of the pending wake ups with us
+	do {
+		dwState = ReadAcquire(&parking->dwState);
+		dwNewState = dwState - PARKING_WAITER;
+		if (parkingWoken(dwState) > 0) {
+			dwNewState -= PARKING_WOKEN;
+		}
+	} while (InterlockedCompareExchange(&parking->dwState, dwNewState, dwState) != dwState);
+
+	return bSuccess;
+}
 
-	LeaveCriticalSection(&queue->criticalSection);
+typedef struct QueueOperationTag {
+	LPSyncCircQueueT queue;
+	LPEncryptDataT data;
+	LPEncryptDataT *pData;
+}QueueOperationT, *LPQueueOperationT;
 
-	WakeConditionVariable(&queue->cvNotEmpty);
+static BOOL tryPushOperation(LPVOID context)
+{
+	LPQueueOperationT operation = (LPQueueOperationT)context;
+	return tryPushSyncQueue(operation->queue, operation->data);
 }
 
-VOID popSyncQueue(LPSyncCircQueueT queue, LPEncryptDataT *data)
+static BOOL tryPopOperation(LPVOID context)
 {
-	EnterCriticalSection(&queue->criticalSection);
+	LPQueueOperationT operation = (LPQueueOperationT)context;
+	return tryPopSyncQueue(operation->queue, operation->pData);
+}
 
-	while(queue->dwTail == queue->dwHead) {
-		//queue is empty
-		SleepConditionVariableCS(&queue->cvNotEmpty, &queue->criticalSection, INFINITE);
+VOID pushSyncQueue(LPSyncCircQueueT queue, LPEncryptDataT data)
+{
+	QueueOperationT operation = { queue, data, NULL };
+	DWORD dwSpin = 0;
+
+	while (!tryPushSyncQueue(queue, data)) {
+		if (dwSpin < QUEUE_SPIN_COUNT) {
+			dwSpin++;
+			YieldProcessor();
+			continue;
+		}
+		if (parkThread(&queue->notFull, tryPushOperation, &operation)) {
+			break;
+		}
 	}
+}
 
-	*data = queue->data[queue->dwHead];
-	queue->dwHead = (queue->dwHead + 1) % queue->dwSize;
-	LeaveCriticalSection(&queue->criticalSection);
-
-	WakeConditionVariable(&queue->cvNotFull);
+VOID popSyncQueue(LPSyncCircQueueT queue, LPEncryptDataT *data)
+{
+	QueueOperationT operation = { queue, NULL, data };
+	DWORD dwSpin = 0;
+
+	while (!tryPopSyncQueue(queue, data)) {
+		if (dwSpin < QUEUE_SPIN_COUNT) {
+			dwSpin++;
+			YieldProcessor();
+			continue;
+		}
+		if (parkThread(&queue->notEmpty, tryPopOperation, &operation)) {
+			break;
+		}
+	}
 }
 
 LPSyncCircQueueT create_SyncCircQueueT(DWORD dwSize)
 {
+	DWORD dwCapacity = 2;
+
+	while (dwCapacity < dwSize) {
+		dwCapacity *= 2;
+	}
+
 	LPSyncCircQueueT queue = (LPSyncCircQueueT)malloc(sizeof(SyncCircQueueT));
 	if (queue == NULL) {
 		return NULL;
 	}
 
-	queue->data = (LPEncryptDataT*)malloc(sizeof(LPEncryptDataT) * dwSize);
-	if (queue->data == NULL) {
+	queue->cells = (LPQueueCellT)malloc(sizeof(QueueCellT) * dwCapacity);
+	if (queue->cells == NULL) {
 		free(queue);
 		return NULL;
 	}
 
-	queue->dwSize = dwSize;
-	queue->dwHead = queue->dwTail = 0;
-	InitializeCriticalSection(&queue->criticalSection);
-	InitializeConditionVariable(&queue->cvNotEmpty);
-	InitializeConditionVariable(&queue->cvNotFull);
+	// cell i is free for the producer at position i
+	for (DWORD i = 0; i < dwCapacity; i++) {
+		queue->cells[i].dwSequence = (LONG)i;
+		queue->cells[i].data = NULL;
+	}
+
+	queue->dwMask = dwCapacity - 1;
+	queue->dwEnqueuePos = queue->dwDequeuePos = 0;
+	queue->notEmpty.dwState = queue->notFull.dwState = 0;
+	queue->notEmpty.dwSignal = queue->notFull.dwSignal = 0;
 
 	return queue;
 }
+
+VOID destroy_SyncCircQueueT(LPSyncCircQueueT queue)
+{
+	free(queue->cells);
+	free(queue);
+}
@@ -3,45 +3,130 @@
 #ifndef ENCRYPT_DATA_H
 #define ENCRYPT_DATA_H
 
-#include "Everything.h"
+#include "Portability.h"
+#include "ByteSpan.h"
 
 typedef struct EncryptDataTag{
-	PTCHAR toBeEncrypted;
-	DWORD dwBuffLen;
-	PTCHAR encryptionKey;
-	DWORD dwKeyLen;
+	// encrypted in place
+	ByteSpanT payload;
+	// borrowed from the owner, see CipherEngine.h
+	struct CipherContextTag *cipher;
+	// borrowed from the owner as well, NULL when the packet is encrypted as it is (see Compression.h)
+	struct CodecStateTag *codec;
+	// number of the packet in the stream of its owner, the stream ciphers derive their counter from it
+	ULONGLONG qwSequence;
+	// metricTicks() when the payload was read and when it was queued for a worker, see Metrics.h
+	LONGLONG llReadTicks;
+	LONGLONG llQueuedTicks;
 	LPCRITICAL_SECTION pCriticalSection;
 	PCONDITION_VARIABLE pConditionVariable;
 	DWORD dwStatus;
 	DWORD dwIndex;
+	// set by the worker when the record could not be decompressed, the packet must not be sent back
+	BOOL bInvalid;
+	// when set, the worker calls it instead of signaling pConditionVariable
+	VOID(*onEncrypted)(struct EncryptDataTag *data, LPVOID context);
+	LPVOID lpContext;
+	// the packet goes back to its pool when the last reference is released (see PacketPool.h)
+	volatile LONG nrRefs;
+	struct PacketPoolTag *pool;
+	struct PacketQuotaTag *quota;
+	DWORD dwSizeClass;
+	// link in a list of packets of the owner
+	struct EncryptDataTag *next;
+	// link in the queue of its flow in the work scheduler
+	struct EncryptDataTag *nextQueued;
+	// the flow it was submitted to, see WorkScheduler.h
+	struct WorkFlowTag *flow;
 }EncryptDataT, *LPEncryptDataT;
 
-typedef struct SyncCircQueueTag {
-	DWORD dwHead;
-	DWORD dwTail;
-	LPEncryptDataT *data;
-	DWORD dwSize;
-	CRITICAL_SECTION criticalSection;
-	CONDITION_VARIABLE cvNotFull;
-	CONDITION_VARIABLE cvNotEmpty;
-}SyncCircQueueT, *LPSyncCircQueueT;
+/*
+ * Bounded multi-producer multi-consumer queue, after Dmitry Vyukov's design:
+ * every cell carries a sequence number telling whose turn it is, so producers
+ * and consumers only compete on a compare exchange of their own position.
+ * Threads park on an address only after spinning on an empty or full queue.
+ */
+#define QUEUE_CACHE_LINE 64
+
+typedef struct QueueCellTag {
+	volatile LONG dwSequence;
+	LPEncryptDataT data;
+}QueueCellT, *LPQueueCellT;
 
-LPEncryptDataT create_EcryptData(
-	HANDLE hHeap, 
-	PTCHAR toBeEncrypted,
-	DWORD dwBufflen,
-	PTCHAR encryptionKey,
-	DWORD dwKeyLen,
-	LPCRITICAL_SECTION pCriticalSection,
-	PCONDITION_VARIABLE pConditionVariable
-);
+/*
+ * Where threads park on an empty or full queue. dwState counts the parked
+ * threads in its low 16 bits and the wake ups on their way to them in the
+ * high bits, so a burst of pushes or pops wakes each parked thread only once.
+ */
+typedef struct QueueParkingTag {
+	volatile LONG dwState;
+	volatile LONG dwSignal;
+}QueueParkingT, *LPQueueParkingT;
 
-VOID free_EncryptData(HANDLE hHeap, LPEncryptDataT lpEncryptData);
+/*
+ * Parks the calling thread until wakeParkedThread is called. The signal is read
+ * before registering and tryAgain is called once more after it, so neither a wake up
+ * nor the event tryAgain checks for is missed in between.
+ *
+ * @return TRUE if the last try succeeded, FALSE after a wake up.
+ */
+BOOL parkThread(LPQueueParkingT parking, BOOL(*tryAgain)(LPVOID context), LPVOID context);
 
+/*
+ * Wakes one parked thread, unless every parked thread already has a wake up coming.
+ * Call it after making the change parked threads wait for.
+ *
+ * @return FALSE if no thread was parked.
+ */
+BOOL wakeParkedThread(LPQueueParkingT parking);
+
+typedef struct SyncCircQueueTag {
+	LPQueueCellT cells;
+	DWORD dwMask;
+	BYTE pad0[QUEUE_CACHE_LINE];
+	volatile LONG dwEnqueuePos;
+	BYTE pad1[QUEUE_CACHE_LINE - sizeof(LONG)];
+	volatile LONG dwDequeuePos;
+	BYTE pad2[QUEUE_CACHE_LINE - sizeof(LONG)];
+	QueueParkingT notEmpty;
+	QueueParkingT notFull;
+}SyncCircQueueT, *LPSyncCircQueueT;
+
+/*
+ * Blocks while the queue is full.
+ */
 VOID pushSyncQueue(LPSyncCircQueueT queue, LPEncryptDataT data);
 
+/*
+ * Blocks while the queue is empty.
+ */
 VOID popSyncQueue(LPSyncCircQueueT queue, LPEncryptDataT *data);
 
+/*
+ * Non-blocking variants, they still wake the threads parked on the other side.
+ *
+ * @return FALSE if the queue is full.
+ */
+BOOL tryPushSyncQueue(LPSyncCircQueueT queue, LPEncryptDataT data);
+
+/*
+ * @return FALSE if the queue is empty.
+ */
+BOOL tryPopSyncQueue(LPSyncCircQueueT queue, LPEncryptDataT *data);
+
+/*
+ * @return the packets queued, or being pushed, at the time of the call.
+ */
+DWORD getSyncQueueLength(LPSyncCircQueueT queue);
+
+/*
+ * @param dwSize: capacity, rounded up to a power of two.
+ */
 LPSyncCircQueueT create_SyncCircQueueT(DWORD dwSize);
 
+/*
+ * Frees the queue once no thread uses it anymore, the packets left in it are not freed.
+ */
+VOID destroy_SyncCircQueueT(LPSyncCircQueueT queue);
+
 #endif
@@ -0,0 +1,362 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Logger.h"
+
+static LPCTSTR levelNames[NR_LOG_LEVELS] = { _T("debug"), _T("info"), _T("warning"), _T("error") };
+
+typedef struct LogRecordTag {
+	// QueryPerformanceCounter ticks
+	ULONGLONG qwTicks;
+	DWORD dwLevel;
+	DWORD dwThreadId;
+	TCHAR sMessage[LOG_MESSAGE_CHARS];
+}LogRecordT, *LPLogRecordT;
+
+/*
+ * Single producer, single consumer ring: only the owning thread moves dwTail, only the writer moves dwHead.
+ */
+typedef struct LogRingTag {
+	struct LoggerTag *logger;
+	volatile LONG bOwned;
+	volatile LONG dwHead;
+	volatile LONG dwTail;
+	volatile LONGLONG nrDropped;
+	LogRecordT records[LOG_RING_RECORDS];
+}LogRingT, *LPLogRingT;
+
+typedef struct LoggerTag {
+	// rings are never freed, a released ring is claimed by the next thread that logs
+	LPLogRingT volatile rings[LOG_MAX_RINGS];
+	volatile LONG nrRings;
+	volatile LONG dwMinLevel;
+	volatile LONG bStop;
+	// bumped to wake the writer up
+	volatile LONG dwSignal;
+	volatile LONGLONG nrNoRing;
+	HANDLE hWriter;
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER start;
+	// the rest belongs to the writer
+	FILE *file;
+	PTCHAR sPath;
+	ULONGLONG cbMaxFile;
+	ULONGLONG cbFile;
+	ULONGLONG nrDroppedReported;
+	volatile LONGLONG nrWritten;
+	volatile LONGLONG nrRotations;
+}LoggerT;
+
+// ring of the calling thread
+static thread_local LPLogRingT tRing;
+
+static VOID wakeWriter(LPLoggerT logger)
+{
+	InterlockedIncrement(&logger->dwSignal);
+	WakeByAddressSingle((LPVOID)&logger->dwSignal);
+}
+
+static LPLogRingT claimRing(LPLoggerT logger)
+{
+	LONG nrRings = ReadAcquire(&logger->nrRings);
+	LONG dwIndex;
+	LPLogRingT ring;
+
+	for (LONG i = 0; i < nrRings && i < LOG_MAX_RINGS; i++) {
+		ring = (LPLogRingT)ReadPointerAcquire((LPVOID const volatile*)&logger->rings[i]);
+		if (ring != NULL && ReadAcquire(&ring->bOwned) == 0 && InterlockedCompareExchange(&ring->bOwned, 1, 0) == 0) {
+			return ring;
+		}
+	}
+
+	dwIndex = InterlockedIncrement(&logger->nrRings) - 1;
+	if (dwIndex >= LOG_MAX_RINGS) {
+		return NULL;
+	}
+	ring = (LPLogRingT)calloc(1, sizeof(LogRingT));
+	if (ring == NULL) {
+		return NULL;
+	}
+	ring->logger = logger;
+	ring->bOwned = TRUE;
+	WritePointerRelease((LPVOID volatile*)&logger->rings[dwIndex], ring);
+	return ring;
+}
+
+BOOL isLogEnabled(LPLoggerT logger, DWORD dwLevel)
+{
+	return dwLevel >= (DWORD)logger->dwMinLevel && !logger->bStop;
+}
+
+VOID writeLog(LPLoggerT logger, DWORD dwLevel, const TCHAR *sMessage)
+{
+	LPLogRingT ring = tRing;
+	LARGE_INTEGER now;
+	DWORD dwTail;
+	DWORD nrQueued;
+	size_t cchMessage;
+
+	if (!isLogEnabled(logger, dwLevel)) {
+		return;
+	}
+	if (ring == NULL || ring->logger != logger) {
+		ring = claimRing(logger);
+		if (ring == NULL) {
+			InterlockedExchangeAdd64(&logger->nrNoRing, 1);
+			return;
+		}
+		tRing = ring;
+	}
+
+	dwTail = (DWORD)ring->dwTail;
+	nrQueued = dwTail - (DWORD)ReadAcquire(&ring->dwHead);
+	if (nrQueued >= LOG_RING_RECORDS) {
+		InterlockedExchangeAdd64(&ring->nrDropped, 1);
+		return;
+	}
+
+	LPLogRecordT record = &ring->records[dwTail % LOG_RING_RECORDS];
+	QueryPerformanceCounter(&now);
+	record->qwTicks = (ULONGLONG)now.QuadPart;
+	record->dwLevel = dwLevel;
+	record->dwThreadId = GetCurrentThreadId();
+	cchMessage = _tcslen(sMessage);
+	if (cchMessage >= LOG_MESSAGE_CHARS) {
+		cchMessage = LOG_MESSAGE_CHARS - 1;
+	}
+	memcpy(record->sMessage, sMessage, cchMessage * sizeof(TCHAR));
+	record->sMessage[cchMessage] = '\0';
+	WriteRelease(&ring->dwTail, (LONG)(dwTail + 1));
+
+	// the writer would not come in time to empty the ring
+	if (nrQueued + 1 == LOG_RING_RECORDS * 3 / 4) {
+		wakeWriter(logger);
+	}
+}
+
+VOID releaseLogRing()
+{
+	LPLogRingT ring = tRing;
+
+	if (ring != NULL) {
+		tRing = NULL;
+		WriteRelease(&ring->bOwned, FALSE);
+	}
+}
+
+/*
+ * Moves the file to <path>.1, the older ones one number up, and starts a new file.
+ */
+static VOID rotateLogFile(LPLoggerT logger)
+{
+	size_t cchPath = _tcslen(logger->sPath) + 16;
+	PTCHAR sFrom = (PTCHAR)malloc(cchPath * sizeof(TCHAR));
+	PTCHAR sTo = (PTCHAR)malloc(cchPath * sizeof(TCHAR));
+
+	if (sFrom == NULL || sTo == NULL) {
+		free(sFrom);
+		free(sTo);
+		return;
+	}
+
+	fclose(logger->file);
+	for (INT i = LOG_ROTATED_FILES; i > 0; i--) {
+		if (i == 1) {
+			_tcscpy(sFrom, logger->sPath);
+		} else {
+			_stprintf(sFrom, _T("%s.%d"), logger->sPath, i - 1);
+		}
+		_stprintf(sTo, _T("%s.%d"), logger->sPath, i);
+		_tremove(sTo);
+		_trename(sFrom, sTo);
+	}
+	logger->file = _tfopen(logger->sPath, _T("w"));
+	logger->cbFile = 0;
+	InterlockedExchangeAdd64(&logger->nrRotations, 1);
+
+	free(sFrom);
+	free(sTo);
+}
+
+static VOID writeLine(LPLoggerT logger, const SYSTEMTIME *st, ULONGLONG qwTicks, DWORD dwLevel, DWORD dwThreadId, const TCHAR *sMessage)
+{
+	double seconds = (double)(LONGLONG)(qwTicks - (ULONGLONG)logger->start.QuadPart) / (double)logger->frequency.QuadPart;
+	INT cchWritten;
+
+	if (logger->file == NULL) {
+		return;
+	}
+	cchWritten = _ftprintf(logger->file, _T("[%u. %u. %u][%u:%u][+%.6f][%s][%u]: %s\n"),
+		st->wYear, st->wMonth, st->wDay, st->wHour, st->wMinute, seconds, levelNames[dwLevel], dwThreadId, sMessage);
+	if (cchWritten > 0) {
+		logger->cbFile += cchWritten;
+	}
+	InterlockedExchangeAdd64(&logger->nrWritten, 1);
+
+	if (logger->cbMaxFile != 0 && logger->cbFile >= logger->cbMaxFile) {
+		rotateLogFile(logger);
+	}
+}
+
+static ULONGLONG countDropped(LPLoggerT logger)
+{
+	LONG nrRings = ReadAcquire(&logger->nrRings);
+	ULONGLONG nrDropped = (ULONGLONG)ReadAcquire64(&logger->nrNoRing);
+
+	for (LONG i = 0; i < nrRings && i < LOG_MAX_RINGS; i++) {
+		LPLogRingT ring = (LPLogRingT)ReadPointerAcquire((LPVOID const volatile*)&logger->rings[i]);
+		if (ring != NULL) {
+			nrDropped += (ULONGLONG)ReadAcquire64(&ring->nrDropped);
+		}
+	}
+	return nrDropped;
+}
+
+/*
+ * Writes the records queued in the rings when it starts, oldest first.
+ */
+static VOID drainRings(LPLoggerT logger)
+{
+	LPLogRingT rings[LOG_MAX_RINGS];
+	DWORD tails[LOG_MAX_RINGS];
+	LONG nrRings = ReadAcquire(&logger->nrRings);
+	DWORD nrActive = 0;
+	ULONGLONG nrDropped;
+	SYSTEMTIME st;
+	LARGE_INTEGER now;
+
+	for (LONG i = 0; i < nrRings && i < LOG_MAX_RINGS; i++) {
+		LPLogRingT ring = (LPLogRingT)ReadPointerAcquire((LPVOID const volatile*)&logger->rings[i]);
+		if (ring != NULL && (DWORD)ReadAcquire(&ring->dwTail) != (DWORD)ring->dwHead) {
+			rings[nrActive] = ring;
+			tails[nrActive] = (DWORD)ReadAcquire(&ring->dwTail);
+			nrActive++;
+		}
+	}
+
+	GetLocalTime(&st);
+	// merge: the ring whose next record is the oldest goes first
+	while (nrActive > 0) {
+		DWORD dwOldest = 0;
+		for (DWORD i = 1; i < nrActive; i++) {
+			if (rings[i]->records[(DWORD)rings[i]->dwHead % LOG_RING_RECORDS].qwTicks <
+				rings[dwOldest]->records[(DWORD)rings[dwOldest]->dwHead % LOG_RING_RECORDS].qwTicks) {
+				dwOldest = i;
+			}
+		}
+
+		LPLogRingT ring = rings[dwOldest];
+		DWORD dwHead = (DWORD)ring->dwHead;
+		LPLogRecordT record = &ring->records[dwHead % LOG_RING_RECORDS];
+		writeLine(logger, &st, record->qwTicks, record->dwLevel, record->dwThreadId, record->sMessage);
+		WriteRelease(&ring->dwHead, (LONG)(dwHead + 1));
+
+		if (dwHead + 1 == tails[dwOldest]) {
+			rings[dwOldest] = rings[nrActive - 1];
+			tails[dwOldest] = tails[nrActive - 1];
+			nrActive--;
+		}
+	}
+
+	nrDropped = countDropped(logger);
+	if (nrDropped != logger->nrDroppedReported) {
+		TCHAR sMessage[LOG_MESSAGE_CHARS];
+
+		_stprintf(sMessage, _T("%llu log records dropped, the log rings were full"), nrDropped - logger->nrDroppedReported);
+		QueryPerformanceCounter(&now);
+		writeLine(logger, &st, (ULONGLONG)now.QuadPart, LOG_WARNING, GetCurrentThreadId(), sMessage);
+		logger->nrDroppedReported = nrDropped;
+	}
+	if (logger->file != NULL) {
+		fflush(logger->file);
+	}
+}
+
+static DWORD WINAPI logWriterThread(LPVOID arg)
+{
+	LPLoggerT logger = (LPLoggerT)arg;
+
+	for (;;) {
+		LONG dwSignal = ReadAcquire(&logger->dwSignal);
+		BOOL bStop = ReadAcquire(&logger->bStop);
+
+		drainRings(logger);
+		if (bStop) {
+			break;
+		}
+		WaitOnAddress(&logger->dwSignal, &dwSignal, sizeof(LONG), LOG_FLUSH_INTERVAL_MS);
+	}
+	return 0;
+}
+
+LPLoggerT createLogger(PTCHAR sPath, DWORD dwMinLevel, ULONGLONG cbMaxFile)
+{
+	LPLoggerT logger = (LPLoggerT)calloc(1, sizeof(LoggerT));
+	if (logger == NULL) {
+		return NULL;
+	}
+
+	logger->sPath = _tcsdup(sPath);
+	logger->file = (logger->sPath != NULL) ? _tfopen(sPath, _T("w")) : NULL;
+	if (logger->file == NULL) {
+		free(logger->sPath);
+		free(logger);
+		return NULL;
+	}
+	logger->dwMinLevel = (LONG)dwMinLevel;
+	logger->cbMaxFile = cbMaxFile;
+	QueryPerformanceFrequency(&logger->frequency);
+	QueryPerformanceCounter(&logger->start);
+
+	logger->hWriter = (HANDLE)_beginthreadex(NULL, 0, (_beginthreadex_proc_type)logWriterThread, logger, 0, NULL);
+	if (logger->hWriter == NULL) {
+		fclose(logger->file);
+		free(logger->sPath);
+		free(logger);
+		return NULL;
+	}
+	return logger;
+}
+
+VOID closeLogger(LPLoggerT logger)
+{
+	if (InterlockedExchange(&logger->bStop, TRUE)) {
+		return;
+	}
+	wakeWriter(logger);
+	WaitForSingleObject(logger->hWriter, INFINITE);
+	CloseHandle(logger->hWriter);
+
+	if (logger->file != NULL) {
+		fclose(logger->file);
+		logger->file = NULL;
+	}
+}
+
+VOID getLoggerStats(LPLoggerT logger, LPLoggerStatsT stats)
+{
+	LONG nrRings = ReadAcquire(&logger->nrRings);
+
+	stats->nrWritten = (ULONGLONG)ReadAcquire64(&logger->nrWritten);
+	stats->nrDropped = countDropped(logger);
+	stats->nrRotations = (ULONGLONG)ReadAcquire64(&logger->nrRotations);
+	stats->nrRings = (DWORD)((nrRings < LOG_MAX_RINGS) ? nrRings : LOG_MAX_RINGS);
+}
+
+LPCTSTR getLogLevelName(DWORD dwLevel)
+{
+	if (dwLevel >= NR_LOG_LEVELS) {
+		return _T("unknown");
+	}
+	return levelNames[dwLevel];
+}
+
+BOOL parseLogLevel(PTCHAR sName, LPDWORD pdwLevel)
+{
+	for (DWORD i = 0; i < NR_LOG_LEVELS; i++) {
+		if (_tcscmp(sName, levelNames[i]) == 0) {
+			*pdwLevel = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
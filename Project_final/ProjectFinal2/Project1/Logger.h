@@ -0,0 +1,78 @@
+#pragma once
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include "Portability.h"
+
+/*
+ * Asynchronous log: every thread appends records to a ring of its own, without locks,
+ * and a writer thread merges the rings in timestamp order into the log file.
+ * A record is the monotonic time it was logged at, its level, the logging thread and the text.
+ * When a ring is full the record is dropped and counted, logging never blocks;
+ * the writer reports the drops in the file.
+ * The file is rotated to <path>.1 ... <path>.LOG_ROTATED_FILES once it grows over the size limit.
+ */
+
+#define LOG_MESSAGE_CHARS 240
+#define LOG_RING_RECORDS 256
+#define LOG_MAX_RINGS 256
+#define LOG_ROTATED_FILES 3
+// the writer wakes up at least this often, earlier when a ring is getting full
+#define LOG_FLUSH_INTERVAL_MS 50
+
+typedef enum LogLevelEnum {
+	LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR, NR_LOG_LEVELS
+}LogLevelE;
+
+typedef struct LoggerTag *LPLoggerT;
+
+typedef struct LoggerStatsTag {
+	ULONGLONG nrWritten;
+	// full rings, and threads that found no free ring
+	ULONGLONG nrDropped;
+	ULONGLONG nrRotations;
+	DWORD nrRings;
+}LoggerStatsT, *LPLoggerStatsT;
+
+/*
+ * Creates the log file and starts the writer.
+ *
+ * @param cbMaxFile: size at which the file is rotated, 0 never rotates it.
+ * @return the logger, or NULL if the file could not be created.
+ */
+LPLoggerT createLogger(PTCHAR sPath, DWORD dwMinLevel, ULONGLONG cbMaxFile);
+
+/*
+ * Lets callers skip formatting messages that would be filtered out.
+ */
+BOOL isLogEnabled(LPLoggerT logger, DWORD dwLevel);
+
+/*
+ * Appends a record to the ring of the calling thread, the message is cut at LOG_MESSAGE_CHARS - 1.
+ */
+VOID writeLog(LPLoggerT logger, DWORD dwLevel, const TCHAR *sMessage);
+
+/*
+ * Gives the ring of the calling thread back, the records in it are still written.
+ * Threads that end while the server keeps running must call it before returning.
+ */
+VOID releaseLogRing();
+
+/*
+ * Stops the writer once it wrote everything logged so far and closes the file.
+ * Records logged afterwards are dropped. The logger stays allocated,
+ * threads still running while the process exits may keep logging.
+ */
+VOID closeLogger(LPLoggerT logger);
+
+VOID getLoggerStats(LPLoggerT logger, LPLoggerStatsT stats);
+
+LPCTSTR getLogLevelName(DWORD dwLevel);
+
+/*
+ * @return FALSE if sName is not debug, info, warning or error.
+ */
+BOOL parseLogLevel(PTCHAR sName, LPDWORD pdwLevel);
+
+#endif
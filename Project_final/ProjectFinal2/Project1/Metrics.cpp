@@ -0,0 +1,278 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Metrics.h"
+
+// the Prometheus buckets end just below these powers of two of nanoseconds, 256 ns to about 69 s
+#define PROMETHEUS_FIRST_EXPONENT 8
+#define PROMETHEUS_LAST_EXPONENT 36
+
+static LPCTSTR counterNames[NR_METRIC_COUNTERS] = {
+	_T("packets"), _T("bytes"), _T("connections"), _T("rejected busy"), _T("rejected auth"), _T("rejected invalid"),
+	_T("codec plain bytes"), _T("codec stored bytes"), _T("codec raw packets")
+};
+static LPCTSTR histogramNames[NR_METRIC_HISTOGRAMS] = {
+	_T("queue wait"), _T("encrypt time"), _T("packet latency")
+};
+static LPCTSTR histogramMetrics[NR_METRIC_HISTOGRAMS] = {
+	_T("encsrv_queue_wait_seconds"), _T("encsrv_encrypt_seconds"), _T("encsrv_packet_latency_seconds")
+};
+static LPCTSTR histogramHelp[NR_METRIC_HISTOGRAMS] = {
+	_T("Time packets waited in the worker queues."),
+	_T("Time spent encrypting a packet."),
+	_T("Time from a packet being read to it being sent back encrypted.")
+};
+
+typedef struct MetricShardTag {
+	volatile LONGLONG counters[NR_METRIC_COUNTERS];
+	volatile LONGLONG sums[NR_METRIC_HISTOGRAMS];
+	volatile LONGLONG buckets[NR_METRIC_HISTOGRAMS][METRIC_BUCKETS];
+}MetricShardT, *LPMetricShardT;
+
+static MetricShardT shards[METRIC_SHARDS];
+static volatile LONG nrShardUsers = 0;
+static LONGLONG llStartTicks = 0;
+static double dNsPerTick = 0;
+
+static thread_local LPMetricShardT tShard;
+
+static LPMetricShardT getShard()
+{
+	if (tShard == NULL) {
+		tShard = &shards[(DWORD)InterlockedIncrement(&nrShardUsers) % METRIC_SHARDS];
+	}
+	return tShard;
+}
+
+/*
+ * Values below METRIC_SUB_BUCKETS have a bucket each, a larger value with its highest bit at e
+ * goes to the bucket of its next METRIC_SUB_BUCKET_BITS bits in the row of e.
+ */
+static DWORD getBucketIndex(ULONGLONG qwValue)
+{
+	DWORD dwExponent = 0;
+
+	if (qwValue < METRIC_SUB_BUCKETS) {
+		return (DWORD)qwValue;
+	}
+	if (qwValue >> METRIC_MAX_EXPONENT) {
+		return METRIC_BUCKETS - 1;
+	}
+	while ((qwValue >> (dwExponent + 1)) != 0) {
+		dwExponent++;
+	}
+	return (dwExponent - METRIC_SUB_BUCKET_BITS + 1) * METRIC_SUB_BUCKETS +
+		(DWORD)((qwValue >> (dwExponent - METRIC_SUB_BUCKET_BITS)) & (METRIC_SUB_BUCKETS - 1));
+}
+
+/*
+ * @return the largest value counted in the bucket.
+ */
+static ULONGLONG getBucketLimit(DWORD dwBucket)
+{
+	DWORD dwExponent;
+	ULONGLONG qwSub;
+
+	if (dwBucket < METRIC_SUB_BUCKETS) {
+		return dwBucket;
+	}
+	dwExponent = dwBucket / METRIC_SUB_BUCKETS + METRIC_SUB_BUCKET_BITS - 1;
+	qwSub = dwBucket % METRIC_SUB_BUCKETS;
+	return ((METRIC_SUB_BUCKETS + qwSub + 1) << (dwExponent - METRIC_SUB_BUCKET_BITS)) - 1;
+}
+
+VOID initMetrics()
+{
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceFrequency(&frequency);
+	dNsPerTick = 1e9 / (double)frequency.QuadPart;
+	llStartTicks = metricTicks();
+}
+
+LONGLONG metricTicks()
+{
+	LARGE_INTEGER counter;
+
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+}
+
+VOID countMetric(DWORD dwCounter, ULONGLONG qwValue)
+{
+	InterlockedExchangeAdd64(&getShard()->counters[dwCounter], (LONGLONG)qwValue);
+}
+
+VOID recordLatency(DWORD dwHistogram, LONGLONG llTicks)
+{
+	LPMetricShardT shard = getShard();
+	ULONGLONG qwNs = (llTicks > 0) ? (ULONGLONG)(llTicks * dNsPerTick) : 0;
+
+	InterlockedExchangeAdd64(&shard->buckets[dwHistogram][getBucketIndex(qwNs)], 1);
+	InterlockedExchangeAdd64(&shard->sums[dwHistogram], (LONGLONG)qwNs);
+}
+
+VOID getMetricsSnapshot(LPMetricsSnapshotT snapshot)
+{
+	memset(snapshot, 0, sizeof(MetricsSnapshotT));
+	snapshot->dUptime = (metricTicks() - llStartTicks) * dNsPerTick / 1e9;
+
+	for (DWORD i = 0; i < METRIC_SHARDS; i++) {
+		LPMetricShardT shard = &shards[i];
+
+		for (DWORD j = 0; j < NR_METRIC_COUNTERS; j++) {
+			snapshot->counters[j] += (ULONGLONG)ReadAcquire64(&shard->counters[j]);
+		}
+		for (DWORD j = 0; j < NR_METRIC_HISTOGRAMS; j++) {
+			LPHistogramSnapshotT histogram = &snapshot->histograms[j];
+
+			for (DWORD k = 0; k < METRIC_BUCKETS; k++) {
+				histogram->buckets[k] += (ULONGLONG)ReadAcquire64(&shard->buckets[j][k]);
+			}
+			histogram->qwSumNs += (ULONGLONG)ReadAcquire64(&shard->sums[j]);
+		}
+	}
+
+	// counted from the buckets, so the total always matches them
+	for (DWORD j = 0; j < NR_METRIC_HISTOGRAMS; j++) {
+		for (DWORD k = 0; k < METRIC_BUCKETS; k++) {
+			snapshot->histograms[j].nrValues += snapshot->histograms[j].buckets[k];
+		}
+	}
+}
+
+ULONGLONG getHistogramPercentile(const HistogramSnapshotT *histogram, double dPercentile)
+{
+	ULONGLONG qwRank = (ULONGLONG)(dPercentile / 100 * histogram->nrValues + 0.5);
+	ULONGLONG qwSeen = 0;
+	DWORD dwLast = 0;
+
+	if (histogram->nrValues == 0) {
+		return 0;
+	}
+	if (qwRank == 0) {
+		qwRank = 1;
+	}
+	for (DWORD i = 0; i < METRIC_BUCKETS; i++) {
+		if (histogram->buckets[i] == 0) {
+			continue;
+		}
+		qwSeen += histogram->buckets[i];
+		dwLast = i;
+		if (qwSeen >= qwRank) {
+			break;
+		}
+	}
+	return getBucketLimit(dwLast);
+}
+
+LPCTSTR getMetricCounterName(DWORD dwCounter)
+{
+	return counterNames[dwCounter];
+}
+
+LPCTSTR getMetricHistogramName(DWORD dwHistogram)
+{
+	return histogramNames[dwHistogram];
+}
+
+VOID formatLatency(ULONGLONG qwNs, PTCHAR sBuff)
+{
+	if (qwNs < 1000) {
+		_stprintf(sBuff, _T("%llu ns"), qwNs);
+	} else if (qwNs < 1000000) {
+		_stprintf(sBuff, _T("%.1f us"), qwNs / 1e3);
+	} else if (qwNs < 1000000000) {
+		_stprintf(sBuff, _T("%.1f ms"), qwNs / 1e6);
+	} else {
+		_stprintf(sBuff, _T("%.2f s"), qwNs / 1e9);
+	}
+}
+
+BOOL appendMetricsText(LPMetricsTextT text, const TCHAR *format, ...)
+{
+	va_list args;
+	INT cchWritten;
+
+	while (!text->bFailed) {
+		if (text->cchSize - text->cchUsed > 1) {
+			va_start(args, format);
+			cchWritten = _vsntprintf(text->sText + text->cchUsed, text->cchSize - text->cchUsed, format, args);
+			va_end(args);
+			// _vsntprintf reports a cut message as -1 on Windows and with the full length elsewhere
+			if (cchWritten >= 0 && (DWORD)cchWritten < text->cchSize - text->cchUsed) {
+				text->cchUsed += cchWritten;
+				return TRUE;
+			}
+		}
+
+		DWORD cchSize = (text->cchSize == 0) ? 4096 : text->cchSize * 2;
+		PTCHAR sText = (PTCHAR)realloc(text->sText, cchSize * sizeof(TCHAR));
+		if (sText == NULL) {
+			text->bFailed = TRUE;
+			break;
+		}
+		text->sText = sText;
+		text->cchSize = cchSize;
+		text->sText[text->cchUsed] = '\0';
+	}
+	return FALSE;
+}
+
+VOID appendPrometheusMetrics(LPMetricsTextT text, const MetricsSnapshotT *snapshot)
+{
+	const ULONGLONG *counters = snapshot->counters;
+
+	appendMetricsText(text, _T("# HELP encsrv_uptime_seconds Time since the server started.\n"));
+	appendMetricsText(text, _T("# TYPE encsrv_uptime_seconds gauge\n"));
+	appendMetricsText(text, _T("encsrv_uptime_seconds %.3f\n"), snapshot->dUptime);
+
+	appendMetricsText(text, _T("# HELP encsrv_packets_total Packets sent back encrypted.\n"));
+	appendMetricsText(text, _T("# TYPE encsrv_packets_total counter\n"));
+	appendMetricsText(text, _T("encsrv_packets_total %llu\n"), counters[METRIC_PACKETS]);
+
+	appendMetricsText(text, _T("# HELP encsrv_bytes_total Payload bytes sent back encrypted.\n"));
+	appendMetricsText(text, _T("# TYPE encsrv_bytes_total counter\n"));
+	appendMetricsText(text, _T("encsrv_bytes_total %llu\n"), counters[METRIC_BYTES]);
+
+	appendMetricsText(text, _T("# HELP encsrv_connections_total Clients that started streaming.\n"));
+	appendMetricsText(text, _T("# TYPE encsrv_connections_total counter\n"));
+	appendMetricsText(text, _T("encsrv_connections_total %llu\n"), counters[METRIC_CONNECTIONS]);
+
+	appendMetricsText(text, _T("# HELP encsrv_rejected_total Connections refused, by reason.\n"));
+	appendMetricsText(text, _T("# TYPE encsrv_rejected_total counter\n"));
+	appendMetricsText(text, _T("encsrv_rejected_total{reason=\"busy\"} %llu\n"), counters[METRIC_REJECTED_BUSY]);
+	appendMetricsText(text, _T("encsrv_rejected_total{reason=\"auth\"} %llu\n"), counters[METRIC_REJECTED_AUTH]);
+	appendMetricsText(text, _T("encsrv_rejected_total{reason=\"invalid\"} %llu\n"), counters[METRIC_REJECTED_INVALID]);
+
+	appendMetricsText(text, _T("# HELP encsrv_codec_bytes_total Bytes of the compressed packets, before and after compression.\n"));
+	appendMetricsText(text, _T("# TYPE encsrv_codec_bytes_total counter\n"));
+	appendMetricsText(text, _T("encsrv_codec_bytes_total{stage=\"plain\"} %llu\n"), counters[METRIC_CODEC_PLAIN_BYTES]);
+	appendMetricsText(text, _T("encsrv_codec_bytes_total{stage=\"stored\"} %llu\n"), counters[METRIC_CODEC_STORED_BYTES]);
+
+	appendMetricsText(text, _T("# HELP encsrv_codec_raw_packets_total Packets of compressing clients stored as they are.\n"));
+	appendMetricsText(text, _T("# TYPE encsrv_codec_raw_packets_total counter\n"));
+	appendMetricsText(text, _T("encsrv_codec_raw_packets_total %llu\n"), counters[METRIC_CODEC_RAW_PACKETS]);
+
+	for (DWORD i = 0; i < NR_METRIC_HISTOGRAMS; i++) {
+		const HistogramSnapshotT *histogram = &snapshot->histograms[i];
+		ULONGLONG qwCumulative = 0;
+		DWORD dwBucket = 0;
+
+		appendMetricsText(text, _T("# HELP %s %s\n"), histogramMetrics[i], histogramHelp[i]);
+		appendMetricsText(text, _T("# TYPE %s histogram\n"), histogramMetrics[i]);
+		// the power of two 2^e starts bucket (e - METRIC_SUB_BUCKET_BITS + 1) * METRIC_SUB_BUCKETS,
+		// le is inclusive, so the line is labelled with the largest value of the bucket before it, 2^e - 1 ns
+		for (DWORD e = PROMETHEUS_FIRST_EXPONENT; e <= PROMETHEUS_LAST_EXPONENT; e++) {
+			DWORD dwEnd = (e - METRIC_SUB_BUCKET_BITS + 1) * METRIC_SUB_BUCKETS;
+
+			for (; dwBucket < dwEnd; dwBucket++) {
+				qwCumulative += histogram->buckets[dwBucket];
+			}
+			appendMetricsText(text, _T("%s_bucket{le=\"%.12g\"} %llu\n"), histogramMetrics[i],
+				(double)getBucketLimit(dwEnd - 1) / 1e9, qwCumulative);
+		}
+		appendMetricsText(text, _T("%s_bucket{le=\"+Inf\"} %llu\n"), histogramMetrics[i], histogram->nrValues);
+		appendMetricsText(text, _T("%s_sum %.9f\n"), histogramMetrics[i], histogram->qwSumNs / 1e9);
+		appendMetricsText(text, _T("%s_count %llu\n"), histogramMetrics[i], histogram->nrValues);
+	}
+}
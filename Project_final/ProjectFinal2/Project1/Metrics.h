@@ -0,0 +1,114 @@
+#pragma once
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "Portability.h"
+
+/*
+ * Counters and latency histograms of the server.
+ * Every thread updates a shard of its own, so the packet paths do not share cache lines,
+ * and readers add the shards up; a snapshot may be slightly behind.
+ * The histograms are log-linear like HDR histograms: values below METRIC_SUB_BUCKETS ns are exact,
+ * above that every power of two is split in METRIC_SUB_BUCKETS buckets, so a value
+ * is known within 1/16 of itself, up to 2^METRIC_MAX_EXPONENT ns (about 18 minutes).
+ * Latencies are measured in QueryPerformanceCounter ticks and kept in nanoseconds.
+ */
+
+#define METRIC_SUB_BUCKET_BITS 4
+#define METRIC_SUB_BUCKETS (1 << METRIC_SUB_BUCKET_BITS)
+// larger values are counted in the last bucket
+#define METRIC_MAX_EXPONENT 40
+#define METRIC_BUCKETS ((METRIC_MAX_EXPONENT - METRIC_SUB_BUCKET_BITS + 1) * METRIC_SUB_BUCKETS)
+// shards shared round robin by the threads, more threads than shards share them with interlocked adds
+#define METRIC_SHARDS 16
+
+typedef enum MetricCounterEnum {
+	// packets and payload bytes sent back encrypted
+	METRIC_PACKETS, METRIC_BYTES,
+	// clients that started streaming
+	METRIC_CONNECTIONS,
+	// connections refused because the server was full, the login failed or the init message was invalid
+	METRIC_REJECTED_BUSY, METRIC_REJECTED_AUTH, METRIC_REJECTED_INVALID,
+	// bytes of the packets of INIT_COMPRESS clients, before and after compression,
+	// and those of their packets stored as they are
+	METRIC_CODEC_PLAIN_BYTES, METRIC_CODEC_STORED_BYTES, METRIC_CODEC_RAW_PACKETS,
+	NR_METRIC_COUNTERS
+}MetricCounterE;
+
+typedef enum MetricHistogramEnum {
+	// from submitWork to a worker taking the packet
+	METRIC_QUEUE_WAIT,
+	// encryption of one packet
+	METRIC_ENCRYPT_TIME,
+	// from the packet being read to it being sent back
+	METRIC_PACKET_LATENCY,
+	NR_METRIC_HISTOGRAMS
+}MetricHistogramE;
+
+typedef struct HistogramSnapshotTag {
+	ULONGLONG nrValues;
+	ULONGLONG qwSumNs;
+	ULONGLONG buckets[METRIC_BUCKETS];
+}HistogramSnapshotT, *LPHistogramSnapshotT;
+
+typedef struct MetricsSnapshotTag {
+	// seconds since initMetrics
+	double dUptime;
+	ULONGLONG counters[NR_METRIC_COUNTERS];
+	HistogramSnapshotT histograms[NR_METRIC_HISTOGRAMS];
+}MetricsSnapshotT, *LPMetricsSnapshotT;
+
+/*
+ * Text built with appendMetricsText, sText is NULL until something is appended.
+ * bFailed is set when the text could not grow, the caller frees sText.
+ */
+typedef struct MetricsTextTag {
+	PTCHAR sText;
+	DWORD cchUsed;
+	DWORD cchSize;
+	BOOL bFailed;
+}MetricsTextT, *LPMetricsTextT;
+
+/*
+ * Starts the uptime clock, call it before the first metric is recorded.
+ */
+VOID initMetrics();
+
+/*
+ * @return the current QueryPerformanceCounter ticks, the unit of recordLatency.
+ */
+LONGLONG metricTicks();
+
+VOID countMetric(DWORD dwCounter, ULONGLONG qwValue);
+
+/*
+ * Adds a latency to a histogram, negative values count as 0.
+ */
+VOID recordLatency(DWORD dwHistogram, LONGLONG llTicks);
+
+VOID getMetricsSnapshot(LPMetricsSnapshotT snapshot);
+
+/*
+ * @param dPercentile: 0 to 100.
+ * @return the largest value, in ns, of the bucket holding the percentile, 0 for an empty histogram.
+ */
+ULONGLONG getHistogramPercentile(const HistogramSnapshotT *histogram, double dPercentile);
+
+LPCTSTR getMetricCounterName(DWORD dwCounter);
+LPCTSTR getMetricHistogramName(DWORD dwHistogram);
+
+/*
+ * Prints a latency in ns with a readable unit, sBuff holds at least 16 characters.
+ */
+VOID formatLatency(ULONGLONG qwNs, PTCHAR sBuff);
+
+BOOL appendMetricsText(LPMetricsTextT text, const TCHAR *format, ...);
+
+/*
+ * Appends the counters and histograms in the Prometheus text format, the names start with encsrv_.
+ * The histograms are exported with a bucket per power of two of nanoseconds, in seconds.
+ */
+VOID appendPrometheusMetrics(LPMetricsTextT text, const MetricsSnapshotT *snapshot);
+
+#endif
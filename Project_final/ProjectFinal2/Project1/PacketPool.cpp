@@ -0,0 +1,178 @@
+#include "PacketPool.h"
+
+// memory taken from the system at a time by each allocator
+#define PACKET_SLAB_SIZE (256 * 1024)
+
+typedef struct PacketPoolTag {
+	LPSlabAllocatorT descriptors;
+	// payloads with room for the header, by size class
+	LPSlabAllocatorT payloads[PACKET_SIZE_CLASSES];
+}PacketPoolT;
+
+static DWORD getClassSize(DWORD dwSizeClass)
+{
+	return PACKET_MIN_PAYLOAD << (2 * dwSizeClass);
+}
+
+LPPacketPoolT createPacketPool()
+{
+	LPPacketPoolT pool = (LPPacketPoolT)malloc(sizeof(PacketPoolT));
+	if (pool == NULL) {
+		return NULL;
+	}
+
+	pool->descriptors = createSlabAllocator(sizeof(EncryptDataT), PACKET_SLAB_SIZE);
+	if (pool->descriptors == NULL) {
+		return NULL;
+	}
+	for (DWORD i = 0; i < PACKET_SIZE_CLASSES; i++) {
+		pool->payloads[i] = createSlabAllocator(PACKET_HEADER_SIZE + getClassSize(i), PACKET_SLAB_SIZE);
+		if (pool->payloads[i] == NULL) {
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+VOID initPacketQuota(LPPacketQuotaT quota, LONG cbLimit, LPPacketQuotaT shared)
+{
+	quota->cbUsed = 0;
+	quota->cbLimit = cbLimit;
+	quota->shared = shared;
+	quota->nrWaiters = 0;
+}
+
+BOOL isPacketQuotaOpen(LPPacketQuotaT quota)
+{
+	LPPacketQuotaT shared = quota->shared;
+
+	return shared == NULL || ReadAcquire(&shared->cbUsed) < shared->cbLimit;
+}
+
+BOOL waitPacketQuota(LPPacketQuotaT quota, DWORD dwMilliseconds)
+{
+	LPPacketQuotaT shared = quota->shared;
+	LONG cbUsed;
+
+	if (isPacketQuotaOpen(quota)) {
+		return TRUE;
+	}
+
+	// counted before reading the usage again, so a refund in between wakes this thread
+	InterlockedIncrement(&shared->nrWaiters);
+	cbUsed = ReadAcquire(&shared->cbUsed);
+	if (cbUsed >= shared->cbLimit) {
+		WaitOnAddress(&shared->cbUsed, &cbUsed, sizeof(LONG), dwMilliseconds);
+	}
+	InterlockedDecrement(&shared->nrWaiters);
+
+	return isPacketQuotaOpen(quota);
+}
+
+static VOID refundPacketQuota(LPPacketQuotaT quota, LONG cbCharge)
+{
+	LPPacketQuotaT shared = quota->shared;
+
+	InterlockedExchangeAdd(&quota->cbUsed, -cbCharge);
+	if (shared != NULL) {
+		InterlockedExchangeAdd(&shared->cbUsed, -cbCharge);
+		if (ReadAcquire(&shared->nrWaiters) != 0) {
+			WakeByAddressAll((LPVOID)&shared->cbUsed);
+		}
+	}
+}
+
+LPEncryptDataT acquirePacket(
+	LPPacketPoolT pool,
+	LPPacketQuotaT quota,
+	DWORD cbPayload,
+	struct CipherContextTag *cipher,
+	LPCRITICAL_SECTION pCriticalSection,
+	PCONDITION_VARIABLE pConditionVariable)
+{
+	DWORD dwSizeClass = 0;
+	LONG cbCharge;
+	PBYTE payload;
+
+	while (getClassSize(dwSizeClass) < cbPayload) {
+		if (++dwSizeClass == PACKET_SIZE_CLASSES) {
+			return NULL;
+		}
+	}
+
+	cbCharge = (LONG)getClassSize(dwSizeClass);
+	if (quota != NULL) {
+		if (InterlockedExchangeAdd(&quota->cbUsed, cbCharge) + cbCharge > quota->cbLimit) {
+			InterlockedExchangeAdd(&quota->cbUsed, -cbCharge);
+			return NULL;
+		}
+		if (quota->shared != NULL) {
+			InterlockedExchangeAdd(&quota->shared->cbUsed, cbCharge);
+		}
+	}
+
+	LPEncryptDataT packet = (LPEncryptDataT)slabAlloc(pool->descriptors);
+	payload = (PBYTE)slabAlloc(pool->payloads[dwSizeClass]);
+	if (packet == NULL || payload == NULL) {
+		if (packet != NULL) {
+			slabFree(pool->descriptors, packet);
+		}
+		if (payload != NULL) {
+			slabFree(pool->payloads[dwSizeClass], payload);
+		}
+		if (quota != NULL) {
+			refundPacketQuota(quota, cbCharge);
+		}
+		return NULL;
+	}
+
+	packet->payload = makeByteSpan(payload + PACKET_HEADER_SIZE, 0);
+	packet->cipher = cipher;
+	packet->codec = NULL;
+	packet->qwSequence = 0;
+	packet->llReadTicks = 0;
+	packet->llQueuedTicks = 0;
+	packet->dwStatus = DATA_NOT_ENCRYPTED;
+	packet->bInvalid = FALSE;
+	packet->pCriticalSection = pCriticalSection;
+	packet->pConditionVariable = pConditionVariable;
+	packet->onEncrypted = NULL;
+	packet->lpContext = NULL;
+	packet->nrRefs = 1;
+	packet->pool = pool;
+	packet->quota = quota;
+	packet->dwSizeClass = dwSizeClass;
+	packet->next = NULL;
+	packet->nextQueued = NULL;
+
+	return packet;
+}
+
+VOID retainPacket(LPEncryptDataT packet)
+{
+	InterlockedIncrement(&packet->nrRefs);
+}
+
+VOID releasePacket(LPEncryptDataT packet)
+{
+	LPPacketPoolT pool = packet->pool;
+
+	if (InterlockedDecrement(&packet->nrRefs) != 0) {
+		return;
+	}
+
+	if (packet->quota != NULL) {
+		refundPacketQuota(packet->quota, (LONG)getClassSize(packet->dwSizeClass));
+	}
+	slabFree(pool->payloads[packet->dwSizeClass], packet->payload.pData - PACKET_HEADER_SIZE);
+	slabFree(pool->descriptors, packet);
+}
+
+VOID getPacketPoolStats(LPPacketPoolT pool, LPPacketPoolStatsT stats)
+{
+	getSlabStats(pool->descriptors, &stats->descriptors);
+	for (DWORD i = 0; i < PACKET_SIZE_CLASSES; i++) {
+		getSlabStats(pool->payloads[i], &stats->payloads[i]);
+	}
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include "Portability.h"
+#include "CommunicationProtocol.h"
+#include "EncSyncQueue.h"
+#include "SlabAllocator.h"
+
+/*
+ * Pool of packet buffers, so packets are never copied:
+ * a packet is read from the connection straight into its buffer, encrypted there
+ * by a worker and sent back from the same buffer, which has PACKET_HEADER_SIZE
+ * bytes of room in front for the header (see sendFramedPacket).
+ * The cipher context is borrowed from the client, it must outlive its packets.
+ *
+ * Descriptors and payloads come from slab allocators, the payloads in size classes
+ * of 4 KB, 16 KB, 64 KB, 256 KB, 1 MB and 4 MB.
+ */
+
+#define PACKET_SIZE_CLASSES 6
+#define PACKET_MIN_PAYLOAD 4096
+#define PACKET_MAX_PAYLOAD (PACKET_MIN_PAYLOAD << (2 * (PACKET_SIZE_CLASSES - 1)))
+
+/*
+ * Bounds the payload memory of one client. The owner of the packets must hold its
+ * reference until the packet is encrypted, the workers release theirs before signaling,
+ * so the quota is refunded by the owner and may live as long as the owner does.
+ *
+ * The quota of a client may be linked to a shared one, e.g. of its user, charged along with it.
+ * The shared limit is not enforced by acquirePacket: the readers check it before reading
+ * the next packet and wait while it is exceeded (see isPacketQuotaOpen), so a busy user
+ * is slowed down instead of being refused.
+ */
+typedef struct PacketQuotaTag {
+	volatile LONG cbUsed;
+	LONG cbLimit;
+	struct PacketQuotaTag *shared;
+	// readers in waitPacketQuota, the refunds wake them
+	volatile LONG nrWaiters;
+}PacketQuotaT, *LPPacketQuotaT;
+
+typedef struct PacketPoolStatsTag {
+	SlabStatsT descriptors;
+	SlabStatsT payloads[PACKET_SIZE_CLASSES];
+}PacketPoolStatsT, *LPPacketPoolStatsT;
+
+typedef struct PacketPoolTag *LPPacketPoolT;
+
+LPPacketPoolT createPacketPool();
+
+/*
+ * @param shared: charged along with the quota, NULL for none. It must outlive the quota.
+ */
+VOID initPacketQuota(LPPacketQuotaT quota, LONG cbLimit, LPPacketQuotaT shared);
+
+/*
+ * @return FALSE while the shared quota of quota is exceeded, the reader should not read more.
+ */
+BOOL isPacketQuotaOpen(LPPacketQuotaT quota);
+
+/*
+ * Waits up to dwMilliseconds for the shared quota of quota to be under its limit.
+ *
+ * @return isPacketQuotaOpen(quota).
+ */
+BOOL waitPacketQuota(LPPacketQuotaT quota, DWORD dwMilliseconds);
+
+/*
+ * @param quota: charged with the payload size class, NULL for no limit. Its shared quota is charged as well.
+ * @param cbPayload: bytes the packet must hold, at most PACKET_MAX_PAYLOAD.
+ *     The payload span starts empty, the caller sets its length once the bytes are in.
+ *     The sequence number starts at 0, the caller numbers the packets of stream ciphers.
+ * @return a packet holding one reference,
+ *     or NULL when out of memory or when the quota would be exceeded.
+ */
+LPEncryptDataT acquirePacket(
+	LPPacketPoolT pool,
+	LPPacketQuotaT quota,
+	DWORD cbPayload,
+	struct CipherContextTag *cipher,
+	LPCRITICAL_SECTION pCriticalSection,
+	PCONDITION_VARIABLE pConditionVariable
+);
+
+/*
+ * Adds a reference, e.g. for the worker the packet is handed to.
+ */
+VOID retainPacket(LPEncryptDataT packet);
+
+/*
+ * Drops a reference, the last one gives the packet back to the pool.
+ */
+VOID releasePacket(LPEncryptDataT packet);
+
+VOID getPacketPoolStats(LPPacketPoolT pool, LPPacketPoolStatsT stats);
+
+#endif
@@ -0,0 +1,436 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "PasswordHash.h"
+
+static const DWORD sha256RoundConstants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static DWORD rotateRight(DWORD x, INT n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static DWORD rotateLeft(DWORD x, INT n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static DWORD loadBigEndian(const BYTE *p)
+{
+	return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | (DWORD)p[3];
+}
+
+static VOID storeBigEndian(PBYTE p, DWORD x)
+{
+	p[0] = (BYTE)(x >> 24);
+	p[1] = (BYTE)(x >> 16);
+	p[2] = (BYTE)(x >> 8);
+	p[3] = (BYTE)x;
+}
+
+static DWORD loadLittleEndian(const BYTE *p)
+{
+	return (DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24);
+}
+
+static VOID storeLittleEndian(PBYTE p, DWORD x)
+{
+	p[0] = (BYTE)x;
+	p[1] = (BYTE)(x >> 8);
+	p[2] = (BYTE)(x >> 16);
+	p[3] = (BYTE)(x >> 24);
+}
+
+static VOID sha256Compress(DWORD state[8], const BYTE *block)
+{
+	DWORD w[64];
+	DWORD a = state[0], b = state[1], c = state[2], d = state[3];
+	DWORD e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (INT i = 0; i < 16; i++) {
+		w[i] = loadBigEndian(block + 4 * i);
+	}
+	for (INT i = 16; i < 64; i++) {
+		DWORD s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		DWORD s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	for (INT i = 0; i < 64; i++) {
+		DWORD t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) + ((e & f) ^ (~e & g)) +
+			sha256RoundConstants[i] + w[i];
+		DWORD t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+VOID sha256Init(LPSha256T sha)
+{
+	static const DWORD initialState[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(sha->state, initialState, sizeof(initialState));
+	sha->cbTotal = 0;
+	sha->cbBlock = 0;
+}
+
+VOID sha256Update(LPSha256T sha, const void *data, DWORD cbData)
+{
+	const BYTE *p = (const BYTE*)data;
+
+	sha->cbTotal += cbData;
+	if (sha->cbBlock != 0) {
+		DWORD cbCopy = (cbData < SHA256_BLOCK_SIZE - sha->cbBlock) ? cbData : SHA256_BLOCK_SIZE - sha->cbBlock;
+		memcpy(sha->block + sha->cbBlock, p, cbCopy);
+		sha->cbBlock += cbCopy;
+		p += cbCopy;
+		cbData -= cbCopy;
+		if (sha->cbBlock < SHA256_BLOCK_SIZE) {
+			return;
+		}
+		sha256Compress(sha->state, sha->block);
+		sha->cbBlock = 0;
+	}
+	for (; cbData >= SHA256_BLOCK_SIZE; p += SHA256_BLOCK_SIZE, cbData -= SHA256_BLOCK_SIZE) {
+		sha256Compress(sha->state, p);
+	}
+	memcpy(sha->block, p, cbData);
+	sha->cbBlock = cbData;
+}
+
+VOID sha256Final(LPSha256T sha, PBYTE digest)
+{
+	ULONGLONG cbitsTotal = sha->cbTotal * 8;
+
+	sha->block[sha->cbBlock++] = 0x80;
+	if (sha->cbBlock > SHA256_BLOCK_SIZE - 8) {
+		memset(sha->block + sha->cbBlock, 0, SHA256_BLOCK_SIZE - sha->cbBlock);
+		sha256Compress(sha->state, sha->block);
+		sha->cbBlock = 0;
+	}
+	memset(sha->block + sha->cbBlock, 0, SHA256_BLOCK_SIZE - 8 - sha->cbBlock);
+	storeBigEndian(sha->block + SHA256_BLOCK_SIZE - 8, (DWORD)(cbitsTotal >> 32));
+	storeBigEndian(sha->block + SHA256_BLOCK_SIZE - 4, (DWORD)cbitsTotal);
+	sha256Compress(sha->state, sha->block);
+
+	for (INT i = 0; i < 8; i++) {
+		storeBigEndian(digest + 4 * i, sha->state[i]);
+	}
+	memset(sha, 0, sizeof(Sha256T));
+}
+
+/*
+ * The inner and outer hashes of HMAC with the key absorbed, cloned for every message.
+ */
+typedef struct HmacSha256Tag {
+	Sha256T inner;
+	Sha256T outer;
+}HmacSha256T;
+
+static VOID hmacSha256Init(HmacSha256T *hmac, const BYTE *key, DWORD cbKey)
+{
+	BYTE pad[SHA256_BLOCK_SIZE];
+	BYTE keyDigest[SHA256_DIGEST_SIZE];
+
+	if (cbKey > SHA256_BLOCK_SIZE) {
+		sha256Init(&hmac->inner);
+		sha256Update(&hmac->inner, key, cbKey);
+		sha256Final(&hmac->inner, keyDigest);
+		key = keyDigest;
+		cbKey = SHA256_DIGEST_SIZE;
+	}
+
+	memset(pad, 0x36, sizeof(pad));
+	for (DWORD i = 0; i < cbKey; i++) {
+		pad[i] ^= key[i];
+	}
+	sha256Init(&hmac->inner);
+	sha256Update(&hmac->inner, pad, sizeof(pad));
+
+	memset(pad, 0x5c, sizeof(pad));
+	for (DWORD i = 0; i < cbKey; i++) {
+		pad[i] ^= key[i];
+	}
+	sha256Init(&hmac->outer);
+	sha256Update(&hmac->outer, pad, sizeof(pad));
+
+	memset(pad, 0, sizeof(pad));
+	memset(keyDigest, 0, sizeof(keyDigest));
+}
+
+/*
+ * Finishes the HMAC of the message absorbed by inner, a clone of the keyed inner hash.
+ */
+static VOID hmacSha256Final(const HmacSha256T *hmac, LPSha256T inner, PBYTE mac)
+{
+	Sha256T outer = hmac->outer;
+
+	sha256Final(inner, mac);
+	sha256Update(&outer, mac, SHA256_DIGEST_SIZE);
+	sha256Final(&outer, mac);
+}
+
+VOID pbkdf2Sha256(const BYTE *password, DWORD cbPassword, const BYTE *salt, DWORD cbSalt,
+	DWORD nrIterations, PBYTE out, DWORD cbOut)
+{
+	HmacSha256T hmac;
+
+	hmacSha256Init(&hmac, password, cbPassword);
+	for (DWORD dwBlock = 1; cbOut > 0; dwBlock++) {
+		BYTE u[SHA256_DIGEST_SIZE];
+		BYTE t[SHA256_DIGEST_SIZE];
+		BYTE blockIndex[4];
+		Sha256T inner = hmac.inner;
+		DWORD cbCopy = (cbOut < SHA256_DIGEST_SIZE) ? cbOut : SHA256_DIGEST_SIZE;
+
+		storeBigEndian(blockIndex, dwBlock);
+		sha256Update(&inner, salt, cbSalt);
+		sha256Update(&inner, blockIndex, sizeof(blockIndex));
+		hmacSha256Final(&hmac, &inner, u);
+		memcpy(t, u, sizeof(t));
+
+		for (DWORD i = 1; i < nrIterations; i++) {
+			inner = hmac.inner;
+			sha256Update(&inner, u, sizeof(u));
+			hmacSha256Final(&hmac, &inner, u);
+			for (INT j = 0; j < SHA256_DIGEST_SIZE; j++) {
+				t[j] ^= u[j];
+			}
+		}
+
+		memcpy(out, t, cbCopy);
+		out += cbCopy;
+		cbOut -= cbCopy;
+		memset(u, 0, sizeof(u));
+		memset(t, 0, sizeof(t));
+	}
+	memset(&hmac, 0, sizeof(hmac));
+}
+
+/*
+ * Salsa20/8 core on a 16 word block, in place.
+ */
+static VOID salsa208(DWORD b[16])
+{
+	DWORD x[16];
+
+	memcpy(x, b, sizeof(x));
+	for (INT i = 0; i < 8; i += 2) {
+		x[4] ^= rotateLeft(x[0] + x[12], 7);   x[8] ^= rotateLeft(x[4] + x[0], 9);
+		x[12] ^= rotateLeft(x[8] + x[4], 13);  x[0] ^= rotateLeft(x[12] + x[8], 18);
+		x[9] ^= rotateLeft(x[5] + x[1], 7);    x[13] ^= rotateLeft(x[9] + x[5], 9);
+		x[1] ^= rotateLeft(x[13] + x[9], 13);  x[5] ^= rotateLeft(x[1] + x[13], 18);
+		x[14] ^= rotateLeft(x[10] + x[6], 7);  x[2] ^= rotateLeft(x[14] + x[10], 9);
+		x[6] ^= rotateLeft(x[2] + x[14], 13);  x[10] ^= rotateLeft(x[6] + x[2], 18);
+		x[3] ^= rotateLeft(x[15] + x[11], 7);  x[7] ^= rotateLeft(x[3] + x[15], 9);
+		x[11] ^= rotateLeft(x[7] + x[3], 13);  x[15] ^= rotateLeft(x[11] + x[7], 18);
+
+		x[1] ^= rotateLeft(x[0] + x[3], 7);    x[2] ^= rotateLeft(x[1] + x[0], 9);
+		x[3] ^= rotateLeft(x[2] + x[1], 13);   x[0] ^= rotateLeft(x[3] + x[2], 18);
+		x[6] ^= rotateLeft(x[5] + x[4], 7);    x[7] ^= rotateLeft(x[6] + x[5], 9);
+		x[4] ^= rotateLeft(x[7] + x[6], 13);   x[5] ^= rotateLeft(x[4] + x[7], 18);
+		x[11] ^= rotateLeft(x[10] + x[9], 7);  x[8] ^= rotateLeft(x[11] + x[10], 9);
+		x[9] ^= rotateLeft(x[8] + x[11], 13);  x[10] ^= rotateLeft(x[9] + x[8], 18);
+		x[12] ^= rotateLeft(x[15] + x[14], 7); x[13] ^= rotateLeft(x[12] + x[15], 9);
+		x[14] ^= rotateLeft(x[13] + x[12], 13); x[15] ^= rotateLeft(x[14] + x[13], 18);
+	}
+	for (INT i = 0; i < 16; i++) {
+		b[i] += x[i];
+	}
+}
+
+/*
+ * scryptBlockMix of 2 * r 16 word blocks from b into y, the even blocks first, then the odd ones.
+ */
+static VOID blockMix(const DWORD *b, DWORD *y, DWORD dwBlockSize)
+{
+	DWORD x[16];
+
+	memcpy(x, b + (2 * dwBlockSize - 1) * 16, sizeof(x));
+	for (DWORD i = 0; i < 2 * dwBlockSize; i++) {
+		for (INT j = 0; j < 16; j++) {
+			x[j] ^= b[i * 16 + j];
+		}
+		salsa208(x);
+		memcpy(y + ((i & 1) * dwBlockSize + i / 2) * 16, x, sizeof(x));
+	}
+}
+
+/*
+ * scryptROMix on one 128 * r byte block of b, v holds 2^dwLogCost blocks and xy two.
+ */
+static VOID roMix(PBYTE b, DWORD dwBlockSize, DWORD dwLogCost, DWORD *v, DWORD *xy)
+{
+	DWORD nrWords = 32 * dwBlockSize;
+	DWORD n = 1u << dwLogCost;
+	DWORD *x = xy;
+	DWORD *y = xy + nrWords;
+
+	for (DWORD i = 0; i < nrWords; i++) {
+		x[i] = loadLittleEndian(b + 4 * i);
+	}
+	for (DWORD i = 0; i < n; i++) {
+		memcpy(v + (size_t)i * nrWords, x, nrWords * sizeof(DWORD));
+		blockMix(x, y, dwBlockSize);
+		memcpy(x, y, nrWords * sizeof(DWORD));
+	}
+	for (DWORD i = 0; i < n; i++) {
+		// integerify: the first word of the last 64 byte block, n is a power of 2
+		const DWORD *vj = v + (size_t)(x[nrWords - 16] & (n - 1)) * nrWords;
+		for (DWORD k = 0; k < nrWords; k++) {
+			x[k] ^= vj[k];
+		}
+		blockMix(x, y, dwBlockSize);
+		memcpy(x, y, nrWords * sizeof(DWORD));
+	}
+	for (DWORD i = 0; i < nrWords; i++) {
+		storeLittleEndian(b + 4 * i, x[i]);
+	}
+}
+
+BOOL scrypt(const BYTE *password, DWORD cbPassword, const BYTE *salt, DWORD cbSalt,
+	DWORD dwLogCost, DWORD dwBlockSize, DWORD dwParallelism, PBYTE out, DWORD cbOut)
+{
+	DWORD cbBlock = 128 * dwBlockSize;
+	PBYTE b;
+	DWORD *v;
+	DWORD *xy;
+
+	if (dwLogCost == 0 || dwLogCost > MAX_KDF_LOG_COST || dwBlockSize == 0 || dwBlockSize > 64 ||
+		dwParallelism == 0 || dwParallelism > 64) {
+		return FALSE;
+	}
+
+	b = (PBYTE)malloc((size_t)cbBlock * dwParallelism);
+	v = (DWORD*)malloc((size_t)cbBlock << dwLogCost);
+	xy = (DWORD*)malloc(2 * (size_t)cbBlock);
+	if (b == NULL || v == NULL || xy == NULL) {
+		free(b);
+		free(v);
+		free(xy);
+		return FALSE;
+	}
+
+	pbkdf2Sha256(password, cbPassword, salt, cbSalt, 1, b, cbBlock * dwParallelism);
+	for (DWORD i = 0; i < dwParallelism; i++) {
+		roMix(b + i * cbBlock, dwBlockSize, dwLogCost, v, xy);
+	}
+	pbkdf2Sha256(password, cbPassword, b, cbBlock * dwParallelism, 1, out, cbOut);
+
+	// v and xy hold every intermediate state, the password can be recomputed from any of them
+	memset(b, 0, (size_t)cbBlock * dwParallelism);
+	memset(v, 0, (size_t)cbBlock << dwLogCost);
+	memset(xy, 0, 2 * (size_t)cbBlock);
+	free(b);
+	free(v);
+	free(xy);
+	return TRUE;
+}
+
+static BOOL runKdf(const PasswordHashT *passwordHash, const TCHAR *sPassword, PBYTE hash)
+{
+	return scrypt((const BYTE*)sPassword, (DWORD)(_tcslen(sPassword) * sizeof(TCHAR)),
+		passwordHash->salt, PASSWORD_SALT_SIZE, passwordHash->dwLogCost, passwordHash->dwBlockSize,
+		passwordHash->dwParallelism, hash, PASSWORD_HASH_SIZE);
+}
+
+BOOL hashPassword(const TCHAR *sPassword, DWORD dwLogCost, LPPasswordHashT passwordHash)
+{
+	passwordHash->dwLogCost = dwLogCost;
+	passwordHash->dwBlockSize = KDF_BLOCK_SIZE;
+	passwordHash->dwParallelism = KDF_PARALLELISM;
+	for (DWORD i = 0; i < PASSWORD_SALT_SIZE; i += sizeof(UINT)) {
+		UINT dwRandom;
+		if (rand_s(&dwRandom) != 0) {
+			return FALSE;
+		}
+		memcpy(passwordHash->salt + i, &dwRandom, sizeof(UINT));
+	}
+	return runKdf(passwordHash, sPassword, passwordHash->hash);
+}
+
+BOOL verifyPassword(const PasswordHashT *passwordHash, const TCHAR *sPassword)
+{
+	BYTE hash[PASSWORD_HASH_SIZE];
+	BYTE diff = 0;
+
+	if (!runKdf(passwordHash, sPassword, hash)) {
+		return FALSE;
+	}
+	for (INT i = 0; i < PASSWORD_HASH_SIZE; i++) {
+		diff |= hash[i] ^ passwordHash->hash[i];
+	}
+	return diff == 0;
+}
+
+static BOOL parseHexBytes(const TCHAR *sHex, PBYTE buff, DWORD cbBuff)
+{
+	if (_tcslen(sHex) != 2 * cbBuff) {
+		return FALSE;
+	}
+	for (DWORD i = 0; i < cbBuff; i++) {
+		UINT dwByte;
+		if (_stscanf(sHex + 2 * i, _T("%2x"), &dwByte) != 1) {
+			return FALSE;
+		}
+		buff[i] = (BYTE)dwByte;
+	}
+	return TRUE;
+}
+
+BOOL parsePasswordHash(PTCHAR sEncoded, LPPasswordHashT passwordHash)
+{
+	TCHAR sSalt[2 * PASSWORD_SALT_SIZE + 2];
+	TCHAR sHash[2 * PASSWORD_HASH_SIZE + 2];
+	INT cchParsed = -1;
+
+	if (_stscanf(sEncoded, _T("$scrypt$ln=%u,r=%u,p=%u$%33[0-9a-fA-F]$%65[0-9a-fA-F]%n"),
+		&passwordHash->dwLogCost, &passwordHash->dwBlockSize, &passwordHash->dwParallelism,
+		sSalt, sHash, &cchParsed) != 5 || sEncoded[cchParsed] != '\0') {
+		return FALSE;
+	}
+	if (passwordHash->dwLogCost == 0 || passwordHash->dwLogCost > MAX_KDF_LOG_COST ||
+		passwordHash->dwBlockSize == 0 || passwordHash->dwBlockSize > 64 ||
+		passwordHash->dwParallelism == 0 || passwordHash->dwParallelism > 64) {
+		return FALSE;
+	}
+	return parseHexBytes(sSalt, passwordHash->salt, PASSWORD_SALT_SIZE) &&
+		parseHexBytes(sHash, passwordHash->hash, PASSWORD_HASH_SIZE);
+}
+
+VOID formatPasswordHash(const PasswordHashT *passwordHash, PTCHAR sEncoded)
+{
+	PTCHAR p = sEncoded + _stprintf(sEncoded, _T("$scrypt$ln=%u,r=%u,p=%u$"),
+		passwordHash->dwLogCost, passwordHash->dwBlockSize, passwordHash->dwParallelism);
+
+	for (INT i = 0; i < PASSWORD_SALT_SIZE; i++) {
+		p += _stprintf(p, _T("%02x"), passwordHash->salt[i]);
+	}
+	*p++ = '$';
+	for (INT i = 0; i < PASSWORD_HASH_SIZE; i++) {
+		p += _stprintf(p, _T("%02x"), passwordHash->hash[i]);
+	}
+}
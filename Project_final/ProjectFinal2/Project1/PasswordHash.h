@@ -0,0 +1,80 @@
+#pragma once
+
+#ifndef PASSWORD_HASH_H
+#define PASSWORD_HASH_H
+
+#include "Portability.h"
+
+/*
+ * Salted password hashes with scrypt (RFC 7914), and the SHA-256, HMAC and PBKDF2 it is built on.
+ * A hash is stored as
+ *     $scrypt$ln=<log2 N>,r=<r>,p=<p>$<salt hex>$<hash hex>
+ * A verification allocates 128 * r * 2^ln bytes, 16 MB with the default cost.
+ * The password is hashed as the bytes of its TCHAR string.
+ */
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+#define PASSWORD_SALT_SIZE 16
+#define PASSWORD_HASH_SIZE 32
+
+// scrypt N = 2^14, r = 8, p = 1: the interactive login parameters of the scrypt paper
+#define DEFAULT_KDF_LOG_COST 14
+#define MAX_KDF_LOG_COST 20
+#define KDF_BLOCK_SIZE 8
+#define KDF_PARALLELISM 1
+
+// characters of an encoded hash, with the terminator
+#define PASSWORD_HASH_MAX_CHARS 128
+
+typedef struct Sha256Tag {
+	DWORD state[8];
+	ULONGLONG cbTotal;
+	BYTE block[SHA256_BLOCK_SIZE];
+	DWORD cbBlock;
+}Sha256T, *LPSha256T;
+
+typedef struct PasswordHashTag {
+	// scrypt N = 2^dwLogCost
+	DWORD dwLogCost;
+	DWORD dwBlockSize;
+	DWORD dwParallelism;
+	BYTE salt[PASSWORD_SALT_SIZE];
+	BYTE hash[PASSWORD_HASH_SIZE];
+}PasswordHashT, *LPPasswordHashT;
+
+VOID sha256Init(LPSha256T sha);
+VOID sha256Update(LPSha256T sha, const void *data, DWORD cbData);
+VOID sha256Final(LPSha256T sha, PBYTE digest);
+
+VOID pbkdf2Sha256(const BYTE *password, DWORD cbPassword, const BYTE *salt, DWORD cbSalt,
+	DWORD nrIterations, PBYTE out, DWORD cbOut);
+
+/*
+ * @return FALSE for invalid parameters or when the 128 * r * 2^dwLogCost bytes could not be allocated.
+ */
+BOOL scrypt(const BYTE *password, DWORD cbPassword, const BYTE *salt, DWORD cbSalt,
+	DWORD dwLogCost, DWORD dwBlockSize, DWORD dwParallelism, PBYTE out, DWORD cbOut);
+
+/*
+ * Hashes the password with a random salt and the given cost, r and p take their default values.
+ */
+BOOL hashPassword(const TCHAR *sPassword, DWORD dwLogCost, LPPasswordHashT passwordHash);
+
+/*
+ * Runs the KDF and compares the result in constant time.
+ */
+BOOL verifyPassword(const PasswordHashT *passwordHash, const TCHAR *sPassword);
+
+/*
+ * @return FALSE if sEncoded is not a hash of the form above or its parameters are out of range.
+ */
+BOOL parsePasswordHash(PTCHAR sEncoded, LPPasswordHashT passwordHash);
+
+/*
+ * @param sEncoded: at least PASSWORD_HASH_MAX_CHARS characters.
+ */
+VOID formatPasswordHash(const PasswordHashT *passwordHash, PTCHAR sEncoded);
+
+#endif
@@ -0,0 +1,1319 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Reactor.h"
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_INPUT_SIZE 65536
+// how often destroyReactor checks whether the connections are gone
+#define REACTOR_STOP_POLL_MS 10
+// how often connections waiting for the quota of their user are checked again
+#define REACTOR_THROTTLE_POLL_MS 5
+// threads checking the passwords, the KDF would stall every connection of an I/O thread
+#define REACTOR_AUTH_THREADS 2
+
+/*
+ * Shutdown of the reactor: streaming connections stop reading and send their packets back
+ * followed by TERMINATE_CONNECTION, then whatever is left is failed.
+ */
+typedef enum ReactorStopEnum {
+	REACTOR_RUNNING, REACTOR_STOP_ABORT, REACTOR_STOP_FAIL
+}ReactorStopE;
+
+/*
+ * Life of a connection: init [-> options [-> cipher]] -> auth -> verify -> key -> streaming -> draining -> done,
+ * or init -> options -> resume -> streaming for a client taking over its session.
+ * Verify reads at most the key while an auth thread checks the password, key goes on with the rest of it.
+ * Streaming reads packets until LAST_PACKET, draining waits for the workers
+ * to finish the packets still in flight, done flushes the output and closes.
+ */
+typedef enum ReactorStateEnum {
+	STATE_INIT, STATE_OPTIONS, STATE_CIPHER, STATE_RESUME, STATE_AUTH, STATE_VERIFY, STATE_KEY, STATE_STREAMING, STATE_DRAINING, STATE_DONE
+}ReactorStateE;
+
+// part of a packet the streaming state is waiting for
+typedef enum StreamStepEnum {
+	STEP_COMMAND, STEP_BATCH_COUNT, STEP_LENGTH, STEP_PAYLOAD
+}StreamStepE;
+
+typedef struct ReactorConnectionTag {
+	LPConnectionT connection;
+	struct ReactorThreadTag *thread;
+	ReactorStateE state;
+	StreamStepE step;
+	BOOL bFailed;
+	BOOL bRegistered;
+	BOOL bClosing;
+	BOOL bQueuedReady;
+	// stopped by the shutdown, it ends with TERMINATE_CONNECTION instead of LAST_PACKET
+	BOOL bAborted;
+	// every packet went back and LAST_PACKET is queued
+	BOOL bCompleted;
+	// not read while the quota of its user is used up
+	BOOL bThrottled;
+	// handed to the auth threads, it is not closed until the answer is back through the ready list
+	BOOL bVerifying;
+	DWORD dwEvents;
+
+	// bytes still expected by the current state
+	PBYTE pTarget;
+	DWORD cbTarget;
+	DWORD cbReceived;
+
+	InitT init;
+	InitExT options;
+	CipherInitT cipherInit;
+	ResumeT resume;
+	// NULL unless the client was granted INIT_RESUMABLE
+	LPSessionT session;
+	PTCHAR sCredentials;
+	PTCHAR sUserName;
+	// of the authenticated user, the bytes sent back are accounted to it;
+	// written by the auth thread before it queues the connection as ready, NULL if rejected
+	LPCredentialT credential;
+	// only until the cipher context is set up
+	ByteSpanT encryptionKey;
+	LPCipherContextT cipher;
+	// compression of the packets, borrowed by them like the cipher
+	CodecStateT codec;
+	// flow and quota of the user, set once registered
+	LPUserShareT share;
+	ULONGLONG qwNextSequence;
+	DWORD dwCommand;
+	DWORD cbPacketSize;
+	// packets of the current NEXT_PACKET or NEXT_BATCH frame not received yet
+	DWORD nrBatchLeft;
+	// packet being received, its payload is read straight into it
+	LPEncryptDataT current;
+	PacketQuotaT quota;
+
+	// packets in the order they were received, released once sent back from their own buffer
+	LPEncryptDataT *pending;
+	DWORD dwPendingHead;
+	DWORD dwPendingCount;
+	DWORD dwPendingSize;
+	DWORD nrInFlight;
+	// bytes of the packet at the head of pending already sent, header included
+	DWORD cbPacketSent;
+
+	// control messages, they never interleave with packets
+	PBYTE outBuff;
+	DWORD cbOutSize;
+	DWORD cbOutUsed;
+	DWORD cbOutSent;
+	BOOL bWriteBlocked;
+
+	// link in the inbox, ready or closing list of the owning thread, or in the auth queue
+	struct ReactorConnectionTag *next;
+	// links in the list of connections of the owning thread, only it touches them
+	struct ReactorConnectionTag *prevLive;
+	struct ReactorConnectionTag *nextLive;
+}ReactorConnectionT, *LPReactorConnectionT;
+
+typedef struct ReactorThreadTag {
+	struct ReactorTag *reactor;
+	INT epollFd;
+	INT eventFd;
+	// guards inbox, ready, the bQueuedReady flags and the status of pending packets
+	CRITICAL_SECTION criticalSection;
+	LPReactorConnectionT inbox;
+	LPReactorConnectionT ready;
+	LPReactorConnectionT closing;
+	LPReactorConnectionT live;
+	// live connections with bThrottled set
+	DWORD nrThrottled;
+	HANDLE hThread;
+	BYTE inputBuff[REACTOR_INPUT_SIZE];
+}ReactorThreadT, *LPReactorThreadT;
+
+typedef struct ReactorTag {
+	DWORD nrThreads;
+	LPReactorThreadT *threads;
+	DWORD dwNextThread;
+	LPWorkSchedulerT scheduler;
+	LPPacketPoolT pool;
+	LPKeyCacheT keyCache;
+	LONG cbClientQuota;
+	const ReactorCallbacksT *callbacks;
+	volatile LONG nrConnections;
+	volatile LONG dwStopPhase;
+
+	// connections waiting for the check of their password, oldest first
+	CRITICAL_SECTION csAuth;
+	CONDITION_VARIABLE authQueued;
+	LPReactorConnectionT authFirst;
+	LPReactorConnectionT authLast;
+	// set once the I/O threads are gone, the auth threads leave then
+	BOOL bAuthStopping;
+	DWORD nrAuthThreads;
+	HANDLE authThreads[REACTOR_AUTH_THREADS];
+}ReactorT;
+
+BOOL reactorSupported()
+{
+	return TRUE;
+}
+
+static VOID wakeThread(LPReactorThreadT thread)
+{
+	uint64_t value = 1;
+	ssize_t cbWritten = write(thread->eventFd, &value, sizeof(value));
+	(void)cbWritten;
+}
+
+static VOID setTarget(LPReactorConnectionT conn, LPVOID pTarget, DWORD cbTarget)
+{
+	conn->pTarget = (PBYTE)pTarget;
+	conn->cbTarget = cbTarget;
+	conn->cbReceived = 0;
+}
+
+static BOOL isReading(LPReactorConnectionT conn)
+{
+	return !conn->bFailed && conn->state <= STATE_STREAMING &&
+		(conn->state != STATE_VERIFY || conn->cbReceived < conn->cbTarget);
+}
+
+/*
+ * A pipelined connection is not read while its window is full.
+ * Clients reading only after sending everything are never throttled, that would deadlock them.
+ */
+static BOOL isWindowOpen(LPReactorConnectionT conn)
+{
+	return conn->options.nrWindow == 0 || conn->dwPendingCount < conn->options.nrWindow;
+}
+
+/*
+ * A pipelined connection is not read either while the quota of its user is used up,
+ * it is checked again every REACTOR_THROTTLE_POLL_MS and whenever its packets are sent.
+ */
+static BOOL isQuotaOpen(LPReactorConnectionT conn)
+{
+	return conn->options.nrWindow == 0 || isPacketQuotaOpen(&conn->quota);
+}
+
+static BOOL appendOutput(LPReactorConnectionT conn, const void *data, DWORD cbData)
+{
+	if (conn->cbOutUsed + cbData > conn->cbOutSize) {
+		DWORD cbNewSize = (conn->cbOutSize == 0) ? MAX_PACKET_SIZE * 2 : conn->cbOutSize;
+		while (cbNewSize < conn->cbOutUsed + cbData) {
+			cbNewSize *= 2;
+		}
+		PBYTE newBuff = (PBYTE)realloc(conn->outBuff, cbNewSize);
+		if (newBuff == NULL) {
+			return FALSE;
+		}
+		conn->outBuff = newBuff;
+		conn->cbOutSize = cbNewSize;
+	}
+
+	memcpy(conn->outBuff + conn->cbOutUsed, data, cbData);
+	conn->cbOutUsed += cbData;
+	return TRUE;
+}
+
+static BOOL appendCommand(LPReactorConnectionT conn, DWORD dwCommand)
+{
+	return appendOutput(conn, &dwCommand, sizeof(DWORD));
+}
+
+static BOOL pushPending(LPReactorConnectionT conn, LPEncryptDataT data)
+{
+	if (conn->dwPendingCount == conn->dwPendingSize) {
+		DWORD dwNewSize = (conn->dwPendingSize == 0) ? 64 : conn->dwPendingSize * 2;
+		LPEncryptDataT *newPending = (LPEncryptDataT*)malloc(sizeof(LPEncryptDataT) * dwNewSize);
+		if (newPending == NULL) {
+			return FALSE;
+		}
+		for (DWORD i = 0; i < conn->dwPendingCount; i++) {
+			newPending[i] = conn->pending[(conn->dwPendingHead + i) % conn->dwPendingSize];
+		}
+		free(conn->pending);
+		conn->pending = newPending;
+		conn->dwPendingHead = 0;
+		conn->dwPendingSize = dwNewSize;
+	}
+
+	conn->pending[(conn->dwPendingHead + conn->dwPendingCount) % conn->dwPendingSize] = data;
+	conn->dwPendingCount++;
+	return TRUE;
+}
+
+/*
+ * Stops all traffic on the connection, it is closed once the workers are done with its packets.
+ */
+static VOID failConnection(LPReactorConnectionT conn)
+{
+	conn->bFailed = TRUE;
+	conn->state = STATE_DONE;
+}
+
+/*
+ * Called by the worker threads when a packet of a reactor connection is encrypted.
+ */
+static VOID onPacketEncrypted(LPEncryptDataT data, LPVOID context)
+{
+	LPReactorConnectionT conn = (LPReactorConnectionT)context;
+	LPReactorThreadT thread = conn->thread;
+	BOOL bWake = FALSE;
+
+	EnterCriticalSection(&thread->criticalSection);
+	data->dwStatus = DATA_ENCRYPTED;
+	if (!conn->bQueuedReady) {
+		conn->bQueuedReady = TRUE;
+		conn->next = thread->ready;
+		thread->ready = conn;
+		bWake = TRUE;
+	}
+	LeaveCriticalSection(&thread->criticalSection);
+
+	if (bWake) {
+		wakeThread(thread);
+	}
+}
+
+/*
+ * The cipher of the connection is set up, it registers and starts reading packets.
+ */
+static VOID startStreaming(LPReactorConnectionT conn)
+{
+	const ReactorCallbacksT *callbacks = conn->thread->reactor->callbacks;
+
+	if (conn->cipher == NULL) {
+		failConnection(conn);
+		return;
+	}
+	conn->share = callbacks->registerClient(conn->credential);
+	if (conn->share == NULL) {
+		failConnection(conn);
+		return;
+	}
+	conn->quota.shared = &conn->share->quota;
+	conn->bRegistered = TRUE;
+	initCodecState(&conn->codec, &conn->options);
+	conn->state = STATE_STREAMING;
+	conn->step = STEP_COMMAND;
+	setTarget(conn, &conn->dwCommand, sizeof(DWORD));
+}
+
+/*
+ * Takes over the session a reconnecting client presents, in place of the authentication and the key.
+ * The connection is admitted already.
+ */
+static VOID resumeConnection(LPReactorConnectionT conn)
+{
+	const ReactorCallbacksT *callbacks = conn->thread->reactor->callbacks;
+	LPSessionT session;
+
+	if (!appendCommand(conn, CONNECTION_ACCEPTED) || !appendOutput(conn, &conn->options, sizeof(InitExT))) {
+		failConnection(conn);
+		return;
+	}
+	if (!(conn->options.dwFlags & INIT_PIPELINED)) {
+		conn->options.nrWindow = 0;
+	}
+
+	session = callbacks->resumeClientSession(&conn->resume);
+	if (session == NULL) {
+		appendCommand(conn, AUTH_REJECTED);
+		conn->state = STATE_DONE;
+		return;
+	}
+	conn->session = session;
+	conn->credential = session->credential;
+	conn->sCredentials = _tcsdup(session->sUserName);
+	conn->sUserName = conn->sCredentials;
+	if (conn->sCredentials == NULL || !appendCommand(conn, AUTH_SUCCESSFUL)) {
+		failConnection(conn);
+		return;
+	}
+
+	// the packets continue from the last one the client got back, with the key of the session
+	conn->cipher = acquireCipherContext(conn->thread->reactor->keyCache, conn->sUserName,
+		session->dwCipher, session->key, session->nonce);
+	conn->qwNextSequence = conn->resume.qwSequence;
+	startStreaming(conn);
+}
+
+static PTCHAR getPassword(LPReactorConnectionT conn)
+{
+	return (PTCHAR)((PBYTE)conn->sCredentials + conn->init.cbUsernameNrBytes + sizeof(TCHAR));
+}
+
+/*
+ * Hands the credentials of the connection to the auth threads.
+ */
+static VOID queueVerification(LPReactorConnectionT conn)
+{
+	LPReactorT reactor = conn->thread->reactor;
+
+	conn->bVerifying = TRUE;
+	EnterCriticalSection(&reactor->csAuth);
+	conn->next = NULL;
+	if (reactor->authLast != NULL) {
+		reactor->authLast->next = conn;
+	} else {
+		reactor->authFirst = conn;
+	}
+	reactor->authLast = conn;
+	LeaveCriticalSection(&reactor->csAuth);
+	WakeConditionVariable(&reactor->authQueued);
+}
+
+/*
+ * Checks the passwords of the queued connections and sends each back to its I/O thread through the ready list.
+ * Once the reactor stops the passwords are not checked anymore, the connections are failed anyway.
+ */
+static DWORD WINAPI authThread(LPVOID arg)
+{
+	LPReactorT reactor = (LPReactorT)arg;
+	LPReactorConnectionT conn;
+	LPReactorThreadT thread;
+	BOOL bWake;
+
+	while (TRUE) {
+		EnterCriticalSection(&reactor->csAuth);
+		while (reactor->authFirst == NULL && !reactor->bAuthStopping) {
+			SleepConditionVariableCS(&reactor->authQueued, &reactor->csAuth, INFINITE);
+		}
+		conn = reactor->authFirst;
+		if (conn == NULL) {
+			LeaveCriticalSection(&reactor->csAuth);
+			return 0;
+		}
+		reactor->authFirst = conn->next;
+		if (reactor->authFirst == NULL) {
+			reactor->authLast = NULL;
+		}
+		LeaveCriticalSection(&reactor->csAuth);
+
+		thread = conn->thread;
+		bWake = FALSE;
+		conn->credential = (ReadAcquire(&reactor->dwStopPhase) == REACTOR_RUNNING) ?
+			reactor->callbacks->verifyClient(conn->sUserName, getPassword(conn)) : NULL;
+
+		// no packet is in flight yet, only this thread can queue the connection
+		EnterCriticalSection(&thread->criticalSection);
+		if (!conn->bQueuedReady) {
+			conn->bQueuedReady = TRUE;
+			conn->next = thread->ready;
+			thread->ready = conn;
+			bWake = TRUE;
+		}
+		LeaveCriticalSection(&thread->criticalSection);
+
+		if (bWake) {
+			wakeThread(thread);
+		}
+	}
+}
+
+/*
+ * Advances the state machine once the current target has been received completely.
+ */
+static VOID onTargetComplete(LPReactorConnectionT conn)
+{
+	const ReactorCallbacksT *callbacks = conn->thread->reactor->callbacks;
+	LPInitT init = &conn->init;
+
+	switch (conn->state) {
+	case STATE_INIT:
+		if (init->command == INITIALIZE_CONNECTION_EX || init->command == RESUME_SESSION) {
+			conn->state = STATE_OPTIONS;
+			setTarget(conn, &conn->options, sizeof(InitExT));
+			return;
+		}
+		// fall through
+
+	case STATE_OPTIONS:
+		if (conn->state == STATE_OPTIONS && init->command == RESUME_SESSION) {
+			conn->state = STATE_RESUME;
+			setTarget(conn, &conn->resume, sizeof(ResumeT));
+			return;
+		}
+		if (conn->state == STATE_OPTIONS && (conn->options.dwFlags & INIT_CIPHER)) {
+			conn->state = STATE_CIPHER;
+			setTarget(conn, &conn->cipherInit, sizeof(CipherInitT));
+			return;
+		}
+		// fall through
+
+	case STATE_CIPHER:
+	case STATE_RESUME:
+		// admitClient bounds the user name and the password
+		if (!callbacks->admitClient(init, &conn->options, &conn->cipherInit)) {
+			appendCommand(conn, CONNECTION_REJECTED);
+			conn->state = STATE_DONE;
+			return;
+		}
+		if (init->command == RESUME_SESSION) {
+			resumeConnection(conn);
+			return;
+		}
+		conn->sCredentials = (PTCHAR)malloc(init->cbUsernameNrBytes + init->cbPasswordNrBytes + 2 * sizeof(TCHAR));
+		if (conn->sCredentials == NULL || !appendCommand(conn, CONNECTION_ACCEPTED) ||
+			(init->command == INITIALIZE_CONNECTION_EX && !appendOutput(conn, &conn->options, sizeof(InitExT)))) {
+			failConnection(conn);
+			return;
+		}
+		if (!(conn->options.dwFlags & INIT_PIPELINED)) {
+			conn->options.nrWindow = 0;
+		}
+		conn->state = STATE_AUTH;
+		setTarget(conn, conn->sCredentials, init->cbUsernameNrBytes + init->cbPasswordNrBytes);
+		return;
+
+	case STATE_AUTH: {
+		// the user name is followed by the password, split them in two strings
+		PBYTE pCredentials = (PBYTE)conn->sCredentials;
+		PTCHAR sPassword = (PTCHAR)(pCredentials + init->cbUsernameNrBytes + sizeof(TCHAR));
+
+		memmove(sPassword, pCredentials + init->cbUsernameNrBytes, init->cbPasswordNrBytes);
+		sPassword[init->cbPasswordNrBytes / sizeof(TCHAR)] = '\0';
+		conn->sCredentials[init->cbUsernameNrBytes / sizeof(TCHAR)] = '\0';
+		conn->sUserName = conn->sCredentials;
+
+		// admitClient checked the key length, the key is binary and is not terminated
+		conn->encryptionKey = makeByteSpan(malloc(init->cbKeyNrBytes), init->cbKeyNrBytes);
+		if (conn->encryptionKey.pData == NULL) {
+			failConnection(conn);
+			return;
+		}
+		conn->state = STATE_VERIFY;
+		setTarget(conn, conn->encryptionKey.pData, conn->encryptionKey.cbData);
+		queueVerification(conn);
+		return;
+	}
+
+	case STATE_KEY:
+		// without its key the session cannot be resumed, the stream goes on anyway
+		if (conn->session != NULL) {
+			startSession(conn->session, &conn->cipherInit, conn->encryptionKey);
+		}
+		// the cache keeps its own copy of the key
+		conn->cipher = acquireCipherContext(conn->thread->reactor->keyCache, conn->sUserName,
+			conn->cipherInit.dwCipher, conn->encryptionKey, conn->cipherInit.nonce);
+		free(conn->encryptionKey.pData);
+		conn->encryptionKey.pData = NULL;
+		conn->qwNextSequence = conn->cipherInit.qwFirstSequence;
+		startStreaming(conn);
+		return;
+
+	case STATE_STREAMING:
+		break;
+
+	default:
+		return;
+	}
+
+	switch (conn->step) {
+	case STEP_COMMAND:
+		if (conn->dwCommand == LAST_PACKET) {
+			conn->state = STATE_DRAINING;
+		} else if (conn->dwCommand == NEXT_PACKET) {
+			conn->nrBatchLeft = 1;
+			conn->step = STEP_LENGTH;
+			setTarget(conn, &conn->cbPacketSize, sizeof(DWORD));
+		} else if (conn->dwCommand == NEXT_BATCH) {
+			conn->step = STEP_BATCH_COUNT;
+			setTarget(conn, &conn->nrBatchLeft, sizeof(DWORD));
+		} else {
+			failConnection(conn);
+		}
+		return;
+
+	case STEP_BATCH_COUNT:
+		if (conn->nrBatchLeft > MAX_BATCH_PACKETS) {
+			failConnection(conn);
+		} else if (conn->nrBatchLeft == 0) {
+			conn->step = STEP_COMMAND;
+			setTarget(conn, &conn->dwCommand, sizeof(DWORD));
+		} else {
+			conn->step = STEP_LENGTH;
+			setTarget(conn, &conn->cbPacketSize, sizeof(DWORD));
+		}
+		return;
+
+	case STEP_LENGTH: {
+		DWORD dwRecordOffset;
+		DWORD cbBuffer = getRecordBufferSize(&conn->codec, conn->cbPacketSize, &dwRecordOffset);
+
+		if (conn->cbPacketSize > conn->options.cbMaxPacket || cbBuffer == 0) {
+			failConnection(conn);
+			return;
+		}
+		conn->nrBatchLeft--;
+		conn->current = acquirePacket(conn->thread->reactor->pool, &conn->quota,
+			cbBuffer, conn->cipher, NULL, NULL);
+		if (conn->current == NULL) {
+			failConnection(conn);
+			return;
+		}
+		conn->current->qwSequence = conn->qwNextSequence++;
+		if (conn->codec.dwMode != CODEC_NONE) {
+			conn->current->codec = &conn->codec;
+		}
+		conn->step = STEP_PAYLOAD;
+		setTarget(conn, conn->current->payload.pData + dwRecordOffset, conn->cbPacketSize);
+		return;
+	}
+
+	case STEP_PAYLOAD: {
+		LPEncryptDataT data = conn->current;
+
+		// a packet to compress is read behind the room of its record header
+		data->payload.cbData = (DWORD)(conn->pTarget + conn->cbTarget - data->payload.pData);
+		data->llReadTicks = metricTicks();
+		data->llQueuedTicks = data->llReadTicks;
+		data->onEncrypted = onPacketEncrypted;
+		data->lpContext = conn;
+		if (!pushPending(conn, data)) {
+			failConnection(conn);
+			return;
+		}
+		conn->current = NULL;
+		conn->nrInFlight++;
+		// the worker holds its own reference, the connection keeps the one it acquired
+		retainPacket(data);
+		submitWork(conn->thread->reactor->scheduler, conn->share->flow, data);
+
+		if (conn->nrBatchLeft > 0) {
+			conn->step = STEP_LENGTH;
+			setTarget(conn, &conn->cbPacketSize, sizeof(DWORD));
+		} else {
+			conn->step = STEP_COMMAND;
+			setTarget(conn, &conn->dwCommand, sizeof(DWORD));
+		}
+		return;
+	}
+	}
+}
+
+/*
+ * The auth thread answered, the connection goes on with its key or is rejected.
+ */
+static VOID finishVerification(LPReactorConnectionT conn)
+{
+	const ReactorCallbacksT *callbacks = conn->thread->reactor->callbacks;
+	LPInitT init = &conn->init;
+
+	conn->bVerifying = FALSE;
+	memset(getPassword(conn), 0, init->cbPasswordNrBytes);
+	if (conn->state != STATE_VERIFY) {
+		// failed meanwhile, by the shutdown
+		return;
+	}
+
+	if (conn->credential == NULL) {
+		appendCommand(conn, AUTH_REJECTED);
+		conn->state = STATE_DONE;
+		return;
+	}
+
+	if (conn->options.dwFlags & INIT_RESUMABLE) {
+		conn->session = callbacks->openClientSession(conn->credential);
+		if (conn->session == NULL) {
+			failConnection(conn);
+			return;
+		}
+	}
+
+	if (!appendCommand(conn, AUTH_SUCCESSFUL) ||
+		(conn->session != NULL && !appendOutput(conn, conn->session->token, SESSION_TOKEN_SIZE))) {
+		failConnection(conn);
+		return;
+	}
+	conn->state = STATE_KEY;
+	if (conn->cbReceived == conn->cbTarget) {
+		// the key came along with the credentials
+		onTargetComplete(conn);
+	}
+}
+
+/*
+ * Reads whatever the socket has and feeds it to the state machine.
+ */
+static VOID handleReadable(LPReactorConnectionT conn)
+{
+	LPReactorThreadT thread = conn->thread;
+	DWORD cbRead;
+	DWORD cbUsed;
+	DWORD cbChunk;
+
+	// the window and the quota are checked before every read, the packets of one read may overshoot them
+	while (isReading(conn) && isWindowOpen(conn) && isQuotaOpen(conn)) {
+		if (conn->state == STATE_STREAMING && conn->step == STEP_PAYLOAD) {
+			// payloads skip the input buffer, they go straight to the packet
+			cbChunk = conn->cbTarget - conn->cbReceived;
+			if (!transportReadSome(conn->connection, conn->pTarget + conn->cbReceived, cbChunk, &cbRead)) {
+				failConnection(conn);
+				return;
+			}
+			conn->cbReceived += cbRead;
+			if (conn->cbReceived == conn->cbTarget) {
+				onTargetComplete(conn);
+			}
+			if (cbRead < cbChunk) {
+				return;
+			}
+			continue;
+		}
+
+		if (!transportReadSome(conn->connection, thread->inputBuff, REACTOR_INPUT_SIZE, &cbRead)) {
+			failConnection(conn);
+			return;
+		}
+		if (cbRead == 0) {
+			// nothing more for now
+			return;
+		}
+
+		cbUsed = 0;
+		while (isReading(conn)) {
+			cbChunk = conn->cbTarget - conn->cbReceived;
+			if (cbChunk > cbRead - cbUsed) {
+				cbChunk = cbRead - cbUsed;
+			}
+			memcpy(conn->pTarget + conn->cbReceived, thread->inputBuff + cbUsed, cbChunk);
+			conn->cbReceived += cbChunk;
+			cbUsed += cbChunk;
+
+			if (conn->cbReceived < conn->cbTarget) {
+				break;
+			}
+			onTargetComplete(conn);
+		}
+		if (conn->state == STATE_VERIFY && cbUsed < cbRead) {
+			// nothing but the key may come before the answer to the credentials
+			failConnection(conn);
+			return;
+		}
+
+		if (cbRead < REACTOR_INPUT_SIZE) {
+			// the socket is drained, wait for the next notification
+			return;
+		}
+	}
+}
+
+/*
+ * Sends the pending control messages.
+ *
+ * @return FALSE while they are not all sent.
+ */
+static BOOL flushControl(LPReactorConnectionT conn)
+{
+	DWORD cbWritten;
+
+	while (conn->cbOutSent < conn->cbOutUsed) {
+		if (!transportWriteSome(conn->connection, conn->outBuff + conn->cbOutSent,
+			conn->cbOutUsed - conn->cbOutSent, &cbWritten)) {
+			failConnection(conn);
+			return FALSE;
+		}
+		if (cbWritten == 0) {
+			// send buffer full, wait for EPOLLOUT
+			conn->bWriteBlocked = TRUE;
+			return FALSE;
+		}
+		conn->cbOutSent += cbWritten;
+	}
+
+	conn->cbOutSent = conn->cbOutUsed = 0;
+	return TRUE;
+}
+
+/*
+ * Gets the encrypted packets at the front of the pending queue, in order.
+ *
+ * @return the number of packets, at most nrMax.
+ */
+static DWORD peekEncrypted(LPReactorConnectionT conn, LPEncryptDataT *packets, DWORD nrMax)
+{
+	LPReactorThreadT thread = conn->thread;
+	LPEncryptDataT data;
+	DWORD nrPackets = 0;
+
+	EnterCriticalSection(&thread->criticalSection);
+	while (nrPackets < nrMax && nrPackets < conn->dwPendingCount) {
+		data = conn->pending[(conn->dwPendingHead + nrPackets) % conn->dwPendingSize];
+		if (data->dwStatus != DATA_ENCRYPTED) {
+			break;
+		}
+		packets[nrPackets++] = data;
+	}
+	LeaveCriticalSection(&thread->criticalSection);
+
+	return nrPackets;
+}
+
+static VOID popPending(LPReactorConnectionT conn)
+{
+	LPEncryptDataT data = conn->pending[conn->dwPendingHead];
+
+	conn->dwPendingHead = (conn->dwPendingHead + 1) % conn->dwPendingSize;
+	conn->dwPendingCount--;
+	conn->nrInFlight--;
+	conn->cbPacketSent = 0;
+	releasePacket(data);
+}
+
+/*
+ * Sends the control messages, then the encrypted packets at the front of the pending queue,
+ * in order and each from its own buffer, as many as possible with one gather write.
+ */
+static VOID flushOutput(LPReactorConnectionT conn)
+{
+	LPEncryptDataT packets[TRANSPORT_MAX_GATHER];
+	TransportBufferT buffers[TRANSPORT_MAX_GATHER];
+	DWORD nrPackets;
+	DWORD cbWritten;
+	DWORD cbFrameLeft;
+	DWORD nrSent;
+	DWORD cbSent;
+	ULONGLONG qwSentSequence = 0;
+	LONGLONG llSentTicks;
+
+	conn->bWriteBlocked = FALSE;
+
+	if (conn->bFailed) {
+		// nothing is sent anymore, the packets are only waited for
+		while (peekEncrypted(conn, packets, 1) != 0) {
+			popPending(conn);
+		}
+		return;
+	}
+
+	if (!flushControl(conn)) {
+		return;
+	}
+
+	while ((nrPackets = peekEncrypted(conn, packets, TRANSPORT_MAX_GATHER)) != 0) {
+		// nothing is sent past a record that could not be decompressed
+		for (DWORD i = 0; i < nrPackets; i++) {
+			if (packets[i]->bInvalid) {
+				nrPackets = i;
+				break;
+			}
+		}
+		if (nrPackets == 0) {
+			failConnection(conn);
+			flushOutput(conn);
+			return;
+		}
+		for (DWORD i = 0; i < nrPackets; i++) {
+			buffers[i].buff = framePacket((PTCHAR)packets[i]->payload.pData, packets[i]->payload.cbData);
+			buffers[i].cbBuff = PACKET_HEADER_SIZE + packets[i]->payload.cbData;
+		}
+		// the first packet may have gone out partially already
+		buffers[0].buff = (const BYTE*)buffers[0].buff + conn->cbPacketSent;
+		buffers[0].cbBuff -= conn->cbPacketSent;
+
+		if (!transportWriteSomeGather(conn->connection, buffers, nrPackets, &cbWritten)) {
+			failConnection(conn);
+			flushOutput(conn);
+			return;
+		}
+		if (cbWritten == 0) {
+			conn->bWriteBlocked = TRUE;
+			return;
+		}
+
+		nrSent = 0;
+		cbSent = 0;
+		llSentTicks = metricTicks();
+		for (DWORD i = 0; i < nrPackets && cbWritten > 0; i++) {
+			cbFrameLeft = buffers[i].cbBuff;
+			if (cbWritten < cbFrameLeft) {
+				conn->cbPacketSent += cbWritten;
+				break;
+			}
+			cbWritten -= cbFrameLeft;
+			recordLatency(METRIC_PACKET_LATENCY, llSentTicks - packets[i]->llReadTicks);
+			nrSent++;
+			cbSent += packets[i]->payload.cbData;
+			qwSentSequence = packets[i]->qwSequence + 1;
+			popPending(conn);
+		}
+		if (nrSent != 0) {
+			conn->thread->reactor->callbacks->packetsSent(conn->credential, nrSent, cbSent);
+			if (conn->session != NULL) {
+				advanceSession(conn->session, qwSentSequence);
+			}
+		}
+	}
+
+	if (conn->state == STATE_DRAINING && conn->dwPendingCount == 0) {
+		conn->state = STATE_DONE;
+		if (appendCommand(conn, conn->bAborted ? TERMINATE_CONNECTION : LAST_PACKET)) {
+			conn->bCompleted = !conn->bAborted;
+			flushControl(conn);
+		} else {
+			failConnection(conn);
+		}
+	}
+}
+
+static VOID destroyConnection(LPReactorConnectionT conn)
+{
+	const ReactorCallbacksT *callbacks = conn->thread->reactor->callbacks;
+
+	if (conn->prevLive != NULL) {
+		conn->prevLive->nextLive = conn->nextLive;
+	} else {
+		conn->thread->live = conn->nextLive;
+	}
+	if (conn->nextLive != NULL) {
+		conn->nextLive->prevLive = conn->prevLive;
+	}
+	InterlockedDecrement(&conn->thread->reactor->nrConnections);
+	if (conn->bThrottled) {
+		conn->thread->nrThrottled--;
+	}
+
+	if (conn->current != NULL) {
+		releasePacket(conn->current);
+		conn->current = NULL;
+	}
+	if (conn->bRegistered) {
+		// every packet charged to the user is back in the pool
+		callbacks->unregisterClient(conn->credential, conn->share);
+	}
+	if (conn->session != NULL) {
+		// a client that did not get all its packets may come back for the rest
+		closeSession(conn->session, conn->bCompleted && !conn->bFailed);
+	}
+	closeConnection(conn->connection);
+	free(conn->sCredentials);
+	free(conn->encryptionKey.pData);
+	destroyCipherContext(conn->cipher);
+	free(conn->pending);
+	free(conn->outBuff);
+	free(conn);
+}
+
+/*
+ * Updates the epoll registration after the connection has been processed,
+ * and schedules it for closing once nothing references it anymore.
+ */
+static VOID updateConnection(LPReactorConnectionT conn)
+{
+	LPReactorThreadT thread = conn->thread;
+	struct epoll_event event;
+	DWORD dwEvents = 0;
+	BOOL bQueuedReady;
+	BOOL bThrottled;
+
+	if (conn->bClosing) {
+		return;
+	}
+
+	bThrottled = !conn->bFailed && isReading(conn) && isWindowOpen(conn) && !isQuotaOpen(conn);
+	if (bThrottled != conn->bThrottled) {
+		conn->bThrottled = bThrottled;
+		if (bThrottled) {
+			thread->nrThrottled++;
+		} else {
+			thread->nrThrottled--;
+		}
+	}
+
+	if (conn->bFailed) {
+		// stop polling now, a hung up socket would be reported forever
+		if (conn->dwEvents != 0) {
+			epoll_ctl(thread->epollFd, EPOLL_CTL_DEL, conn->connection->socket, NULL);
+			conn->dwEvents = 0;
+		}
+	} else {
+		if (isReading(conn) && isWindowOpen(conn) && isQuotaOpen(conn)) {
+			dwEvents |= EPOLLIN;
+		}
+		if (conn->bWriteBlocked) {
+			dwEvents |= EPOLLOUT;
+		}
+		if (dwEvents != conn->dwEvents) {
+			event.events = dwEvents;
+			event.data.ptr = conn;
+			epoll_ctl(thread->epollFd, dwEvents == 0 ? EPOLL_CTL_DEL :
+				(conn->dwEvents == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD),
+				conn->connection->socket, &event);
+			conn->dwEvents = dwEvents;
+		}
+	}
+
+	if (conn->state != STATE_DONE || conn->nrInFlight != 0 || conn->bVerifying || conn->dwEvents != 0) {
+		return;
+	}
+
+	// a worker may have queued it again, it comes back through the ready list then
+	EnterCriticalSection(&thread->criticalSection);
+	bQueuedReady = conn->bQueuedReady;
+	LeaveCriticalSection(&thread->criticalSection);
+	if (bQueuedReady) {
+		return;
+	}
+
+	conn->bClosing = TRUE;
+	conn->next = thread->closing;
+	thread->closing = conn;
+}
+
+/*
+ * Applies the shutdown phase to a connection: a streaming one stops reading and drains,
+ * one still in the handshake is failed, and in the last phase every connection is failed.
+ */
+static VOID stopConnection(LPReactorConnectionT conn, LONG dwPhase)
+{
+	if (conn->bClosing) {
+		return;
+	}
+	if (dwPhase == REACTOR_STOP_FAIL) {
+		failConnection(conn);
+	} else if (conn->state == STATE_STREAMING) {
+		conn->bAborted = TRUE;
+		conn->state = STATE_DRAINING;
+	} else if (conn->state < STATE_STREAMING) {
+		failConnection(conn);
+	}
+	flushOutput(conn);
+	updateConnection(conn);
+}
+
+static VOID processWakeup(LPReactorThreadT thread)
+{
+	LPReactorConnectionT inbox;
+	LPReactorConnectionT ready;
+	LPReactorConnectionT conn;
+	LONG dwPhase;
+	uint64_t value;
+	ssize_t cbRead = read(thread->eventFd, &value, sizeof(value));
+	(void)cbRead;
+
+	EnterCriticalSection(&thread->criticalSection);
+	inbox = thread->inbox;
+	thread->inbox = NULL;
+	ready = thread->ready;
+	thread->ready = NULL;
+	LeaveCriticalSection(&thread->criticalSection);
+
+	while (inbox != NULL) {
+		conn = inbox;
+		inbox = inbox->next;
+		conn->prevLive = NULL;
+		conn->nextLive = thread->live;
+		if (thread->live != NULL) {
+			thread->live->prevLive = conn;
+		}
+		thread->live = conn;
+		updateConnection(conn);
+	}
+
+	while (ready != NULL) {
+		conn = ready;
+
+		// once the flag is cleared a worker may link the connection into the ready list again
+		EnterCriticalSection(&thread->criticalSection);
+		ready = ready->next;
+		conn->bQueuedReady = FALSE;
+		LeaveCriticalSection(&thread->criticalSection);
+
+		// while verifying only the auth thread queues the connection, with its answer
+		if (conn->bVerifying) {
+			finishVerification(conn);
+		}
+		flushOutput(conn);
+		updateConnection(conn);
+	}
+
+	dwPhase = ReadAcquire(&thread->reactor->dwStopPhase);
+	if (dwPhase != REACTOR_RUNNING) {
+		for (conn = thread->live; conn != NULL; conn = conn->nextLive) {
+			stopConnection(conn, dwPhase);
+		}
+	}
+}
+
+static DWORD WINAPI reactorThread(LPVOID arg)
+{
+	LPReactorThreadT thread = (LPReactorThreadT)arg;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	LPReactorConnectionT conn;
+	INT nrEvents;
+
+	while (TRUE) {
+		nrEvents = epoll_wait(thread->epollFd, events, REACTOR_MAX_EVENTS,
+			thread->nrThrottled != 0 ? REACTOR_THROTTLE_POLL_MS : -1);
+		if (nrEvents < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+
+		for (INT i = 0; i < nrEvents; i++) {
+			conn = (LPReactorConnectionT)events[i].data.ptr;
+			if (conn == NULL) {
+				processWakeup(thread);
+				continue;
+			}
+			if (conn->bClosing) {
+				continue;
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				handleReadable(conn);
+			}
+			// LAST_PACKET may arrive after every packet was already sent back
+			flushOutput(conn);
+			updateConnection(conn);
+		}
+
+		// the throttled connections whose user got quota back are polled again
+		if (thread->nrThrottled != 0) {
+			for (conn = thread->live; conn != NULL; conn = conn->nextLive) {
+				if (conn->bThrottled) {
+					updateConnection(conn);
+				}
+			}
+		}
+
+		// connections are freed only here, the batch may still reference them
+		while (thread->closing != NULL) {
+			conn = thread->closing;
+			thread->closing = conn->next;
+			destroyConnection(conn);
+		}
+
+		// no connection is added once the reactor stops
+		if (thread->live == NULL && ReadAcquire(&thread->reactor->dwStopPhase) != REACTOR_RUNNING) {
+			releaseSlabCaches();
+			return 0;
+		}
+	}
+}
+
+static VOID setStopPhase(LPReactorT reactor, LONG dwPhase)
+{
+	WriteRelease(&reactor->dwStopPhase, dwPhase);
+	for (DWORD i = 0; i < reactor->nrThreads; i++) {
+		wakeThread(reactor->threads[i]);
+	}
+}
+
+/*
+ * Closes the descriptors of a thread that is not running and frees it.
+ */
+static VOID freeReactorThread(LPReactorThreadT thread)
+{
+	if (thread->epollFd >= 0) {
+		close(thread->epollFd);
+	}
+	if (thread->eventFd >= 0) {
+		close(thread->eventFd);
+	}
+	DeleteCriticalSection(&thread->criticalSection);
+	free(thread);
+}
+
+/*
+ * Joins the I/O threads once they were told to stop, then the auth threads, and frees the reactor.
+ */
+static VOID joinReactorThreads(LPReactorT reactor)
+{
+	for (DWORD i = 0; i < reactor->nrThreads; i++) {
+		WaitForSingleObject(reactor->threads[i]->hThread, INFINITE);
+		CloseHandle(reactor->threads[i]->hThread);
+		freeReactorThread(reactor->threads[i]);
+	}
+
+	// every connection is closed, none is left in the auth queue
+	EnterCriticalSection(&reactor->csAuth);
+	reactor->bAuthStopping = TRUE;
+	LeaveCriticalSection(&reactor->csAuth);
+	WakeAllConditionVariable(&reactor->authQueued);
+	for (DWORD i = 0; i < reactor->nrAuthThreads; i++) {
+		WaitForSingleObject(reactor->authThreads[i], INFINITE);
+		CloseHandle(reactor->authThreads[i]);
+	}
+	DeleteCriticalSection(&reactor->csAuth);
+	free(reactor->threads);
+	free(reactor);
+}
+
+LPReactorT createReactor(DWORD nrThreads, LPWorkSchedulerT scheduler, LPPacketPoolT pool, LPKeyCacheT keyCache, LONG cbClientQuota, const ReactorCallbacksT *callbacks)
+{
+	struct epoll_event event;
+
+	LPReactorT reactor = (LPReactorT)malloc(sizeof(ReactorT));
+	if (reactor == NULL) {
+		return NULL;
+	}
+	reactor->threads = (LPReactorThreadT*)malloc(sizeof(LPReactorThreadT) * nrThreads);
+	if (reactor->threads == NULL) {
+		free(reactor);
+		return NULL;
+	}
+	// only the threads started so far are stopped if one cannot be
+	reactor->nrThreads = 0;
+	reactor->dwNextThread = 0;
+	reactor->scheduler = scheduler;
+	reactor->pool = pool;
+	reactor->keyCache = keyCache;
+	reactor->cbClientQuota = cbClientQuota;
+	reactor->callbacks = callbacks;
+	reactor->nrConnections = 0;
+	reactor->dwStopPhase = REACTOR_RUNNING;
+	InitializeCriticalSection(&reactor->csAuth);
+	InitializeConditionVariable(&reactor->authQueued);
+	reactor->authFirst = reactor->authLast = NULL;
+	reactor->bAuthStopping = FALSE;
+	reactor->nrAuthThreads = 0;
+
+	for (DWORD i = 0; i < REACTOR_AUTH_THREADS; i++) {
+		reactor->authThreads[i] = (HANDLE)_beginthreadex(
+			NULL,
+			0,
+			(_beginthreadex_proc_type)authThread,
+			reactor,
+			0,
+			NULL
+		);
+		if (reactor->authThreads[i] == NULL) {
+			break;
+		}
+		reactor->nrAuthThreads++;
+	}
+
+	// without every auth thread no I/O thread is started, the reactor is unwound below
+	for (DWORD i = 0; i < nrThreads && reactor->nrAuthThreads == REACTOR_AUTH_THREADS; i++) {
+		LPReactorThreadT thread = (LPReactorThreadT)malloc(sizeof(ReactorThreadT));
+		if (thread == NULL) {
+			break;
+		}
+		thread->reactor = reactor;
+		thread->inbox = thread->ready = thread->closing = thread->live = NULL;
+		thread->nrThrottled = 0;
+		InitializeCriticalSection(&thread->criticalSection);
+
+		thread->epollFd = epoll_create1(0);
+		thread->eventFd = eventfd(0, EFD_NONBLOCK);
+		if (thread->epollFd < 0 || thread->eventFd < 0) {
+			freeReactorThread(thread);
+			break;
+		}
+
+		// the wakeup descriptor is the only one registered with a NULL pointer
+		event.events = EPOLLIN;
+		event.data.ptr = NULL;
+		if (epoll_ctl(thread->epollFd, EPOLL_CTL_ADD, thread->eventFd, &event) != 0) {
+			freeReactorThread(thread);
+			break;
+		}
+
+		thread->hThread = (HANDLE)_beginthreadex(
+			NULL,
+			0,
+			(_beginthreadex_proc_type)reactorThread,
+			thread,
+			0,
+			NULL
+		);
+		if (thread->hThread == NULL) {
+			freeReactorThread(thread);
+			break;
+		}
+		reactor->threads[reactor->nrThreads++] = thread;
+	}
+
+	if (reactor->nrThreads != nrThreads) {
+		// no connection was added, the threads leave as soon as they are woken up
+		setStopPhase(reactor, REACTOR_STOP_FAIL);
+		joinReactorThreads(reactor);
+		return NULL;
+	}
+	return reactor;
+}
+
+BOOL addReactorConnection(LPReactorT reactor, LPConnectionT connection)
+{
+	LPReactorThreadT thread;
+
+	if (!setConnectionNonBlocking(connection)) {
+		return FALSE;
+	}
+
+	LPReactorConnectionT conn = (LPReactorConnectionT)calloc(1, sizeof(ReactorConnectionT));
+	if (conn == NULL) {
+		return FALSE;
+	}
+
+	// connections are only added from the accepting thread
+	thread = reactor->threads[reactor->dwNextThread];
+	reactor->dwNextThread = (reactor->dwNextThread + 1) % reactor->nrThreads;
+
+	conn->connection = connection;
+	conn->thread = thread;
+	conn->state = STATE_INIT;
+	initPacketQuota(&conn->quota, reactor->cbClientQuota, NULL);
+	InterlockedIncrement(&reactor->nrConnections);
+	setTarget(conn, &conn->init, sizeof(InitT));
+
+	EnterCriticalSection(&thread->criticalSection);
+	conn->next = thread->inbox;
+	thread->inbox = conn;
+	LeaveCriticalSection(&thread->criticalSection);
+
+	wakeThread(thread);
+	return TRUE;
+}
+
+DWORD getReactorConnections(LPReactorT reactor)
+{
+	return (DWORD)ReadAcquire(&reactor->nrConnections);
+}
+
+VOID destroyReactor(LPReactorT reactor, DWORD dwTimeoutMs)
+{
+	DWORD dwWaited = 0;
+
+	setStopPhase(reactor, REACTOR_STOP_ABORT);
+	while (getReactorConnections(reactor) != 0 && dwWaited < dwTimeoutMs) {
+		Sleep(REACTOR_STOP_POLL_MS);
+		dwWaited += REACTOR_STOP_POLL_MS;
+	}
+	// clients that stopped reading are not waited for
+	setStopPhase(reactor, REACTOR_STOP_FAIL);
+	joinReactorThreads(reactor);
+}
+
+#else
+
+BOOL reactorSupported()
+{
+	return FALSE;
+}
+
+LPReactorT createReactor(DWORD nrThreads, LPWorkSchedulerT scheduler, LPPacketPoolT pool, LPKeyCacheT keyCache, LONG cbClientQuota, const ReactorCallbacksT *callbacks)
+{
+	return NULL;
+}
+
+BOOL addReactorConnection(LPReactorT reactor, LPConnectionT connection)
+{
+	return FALSE;
+}
+
+DWORD getReactorConnections(LPReactorT reactor)
+{
+	return 0;
+}
+
+VOID destroyReactor(LPReactorT reactor, DWORD dwTimeoutMs)
+{
+}
+
+#endif
@@ -0,0 +1,87 @@
+#pragma once
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "Portability.h"
+#include "Transport.h"
+#include "CommunicationProtocol.h"
+#include "EncSyncQueue.h"
+#include "WorkScheduler.h"
+#include "PacketPool.h"
+#include "CipherEngine.h"
+#include "Metrics.h"
+#include "UserShares.h"
+#include "Sessions.h"
+#include "UserManagement.h"
+#include "Compression.h"
+
+/*
+ * Event driven server core: a small fixed set of I/O threads multiplex all client
+ * connections with epoll, so a connection costs a state machine instead of a thread.
+ * Only socket transports can be used, named pipes are not pollable.
+ * Available on Linux only, reactorSupported() tells if it was compiled in.
+ */
+
+/*
+ * Decisions the reactor delegates to the server, they are the same ones
+ * the thread per client path makes. A connection keeps the credential of its user
+ * from the authentication on, the accounting callbacks get it instead of the user name.
+ */
+typedef struct ReactorCallbacksTag {
+	// checks the init message and if there is room for one more client, grants the options and the cipher
+	BOOL(*admitClient)(LPInitT init, LPInitExT options, LPCipherInitT cipher);
+	// checks the credentials of a client, called from the auth threads of the reactor as it runs the KDF;
+	// returns the credential of the user, NULL rejects it
+	LPCredentialT(*verifyClient)(PTCHAR sUserName, PTCHAR sPassword);
+	// opens the session of an authenticated client granted INIT_RESUMABLE, NULL fails it
+	LPSessionT(*openClientSession)(LPCredentialT credential);
+	// looks up the session a reconnecting client takes over, NULL rejects it
+	LPSessionT(*resumeClientSession)(LPResumeT resume);
+	// the client is authenticated and sent its key, it starts streaming; returns the share of its user, NULL fails it
+	LPUserShareT(*registerClient)(LPCredentialT credential);
+	// nrPackets packets of cbSent payload bytes were sent back to a registered client
+	VOID(*packetsSent)(LPCredentialT credential, DWORD nrPackets, DWORD cbSent);
+	// a registered client is gone, its packets are back in the pool
+	VOID(*unregisterClient)(LPCredentialT credential, LPUserShareT share);
+}ReactorCallbacksT, *LPReactorCallbacksT;
+
+typedef struct ReactorTag *LPReactorT;
+
+BOOL reactorSupported();
+
+/*
+ * Creates the reactor and starts its I/O threads.
+ *
+ * @param nrThreads: number of I/O threads.
+ * @param scheduler: the packets are submitted here for encryption.
+ * @param pool: the packets are read into buffers from this pool.
+ * @param keyCache: the cipher contexts of the connections share their key schedules through it.
+ * @param cbClientQuota: payload bytes each connection may have in the pool at once.
+ * @param callbacks: server decisions, must outlive the reactor.
+ * @return the reactor, or NULL on failure.
+ */
+LPReactorT createReactor(DWORD nrThreads, LPWorkSchedulerT scheduler, LPPacketPoolT pool, LPKeyCacheT keyCache, LONG cbClientQuota, const ReactorCallbacksT *callbacks);
+
+/*
+ * Hands a freshly accepted connection to one of the I/O threads.
+ * The reactor owns the connection afterwards.
+ *
+ * @return FALSE if the connection cannot be polled, the caller still owns it then.
+ */
+BOOL addReactorConnection(LPReactorT reactor, LPConnectionT connection);
+
+/*
+ * @return the connections added and not closed yet.
+ */
+DWORD getReactorConnections(LPReactorT reactor);
+
+/*
+ * Stops the reactor, no connection may be added anymore.
+ * The streaming connections stop reading, send back the packets they already read
+ * and end with TERMINATE_CONNECTION. After dwTimeoutMs the connections still open are dropped.
+ * Joins the I/O threads and frees the reactor.
+ */
+VOID destroyReactor(LPReactorT reactor, DWORD dwTimeoutMs);
+
+#endif
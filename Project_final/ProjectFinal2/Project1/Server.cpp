@@ -6,84 +6,261 @@
 
 #define _CRT_SECURE_NO_WARNINGS
 
-#include "Everything.h"
+#include "Portability.h"
 #include "CommunicationProtocol.h"
 #include "UserManagement.h"
 #include "EncSyncQueue.h"
-#include <crtdbg.h>
+#include "WorkScheduler.h"
+#include "PacketPool.h"
+#include "CipherEngine.h"
+#include "Reactor.h"
+#include "Logger.h"
+#include "Metrics.h"
+#include "UserShares.h"
+#include "Accounting.h"
+#include "Sessions.h"
+#include "Compression.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
 
 #define BUFFSIZE 4096
+// longest request read from a metrics connection
+#define METRICS_REQUEST_SIZE 4096
+// a scraper that sends nothing, or stops reading, for this long is dropped so the next one is served
+#define METRICS_TIMEOUT_MS 2000
+// how often a stopping server checks whether its clients are done
+#define DRAIN_POLL_MS 100
+// clients get this long to take their aborted streams before their connections are cut
+#define ABORT_GRACE_MS 5000
 
 typedef struct ClientThreadTag{
-	HANDLE hPipe;
-	PTCHAR sEncryptionKey;
-	DWORD dwThreadId;
+	LPConnectionT connection;
+	// owned by the client thread
+	LPCipherContextT cipher;
+	// compression of the packets, borrowed by them like the cipher
+	CodecStateT codec;
+	// number of the first packet the client sends
+	ULONGLONG qwFirstSequence;
 	PTCHAR clientName;
+	// of the user, resolved by the authentication
+	LPCredentialT credential;
+	// flow and quota of the user in the work scheduler
+	LPUserShareT share;
+	// NULL when the client did not ask for INIT_RESUMABLE
+	LPSessionT session;
+	InitExT options;
+	HANDLE hThread;
+	// set by the client thread right before it returns
+	volatile LONG bFinished;
+	// next client thread not joined yet
+	struct ClientThreadTag *next;
 }ClientThreadT, *LPClientThreadT;
 
-
-PTCHAR sRealPipeName;
+/*
+ * Packets of a client on their way back: the reader appends them in the order they were received,
+ * the sender sends them in that order once encrypted. Guarded by criticalSection.
+ */
+typedef struct ClientStreamTag {
+	LPConnectionT connection;
+	CRITICAL_SECTION criticalSection;
+	// the head packet is encrypted, or a packet was appended, or the reader is done
+	CONDITION_VARIABLE packetReady;
+	// the sender gave a packet back
+	CONDITION_VARIABLE windowOpen;
+	LPEncryptDataT first;
+	LPEncryptDataT last;
+	// packets read and not sent back yet, at most nrWindow when it is not 0
+	DWORD nrHeld;
+	DWORD nrWindow;
+	// the packets go back in NEXT_BATCH frames
+	BOOL bBatched;
+	BOOL bReaderDone;
+	// stops the sending, the remaining packets are only waited for
+	BOOL bFailed;
+	LPCredentialT credential;
+	// the sender records the packets it sent back in it, NULL for clients without a session
+	LPSessionT session;
+}ClientStreamT, *LPClientStreamT;
+
+
+PTCHAR sListenAddress = NULL;
 PTCHAR sPipeName = _T("defaultpipename");
 PTCHAR sLoggingFile = _T("log.log");
 PTCHAR sCredFile = _T("cred.txt");
-FILE *logFile = NULL;
-TCHAR logBuffer[BUFFSIZE];
+LPLoggerT gLogger = NULL;
+// records below this level are not logged, set with log_level=
+DWORD dwLogLevel = LOG_INFO;
+// the log file is rotated once it reaches this size, set with log_size= in MB, 0 never rotates it
+DWORD nrLogMegabytes = 0;
 INT nrMaxClients = 8;
 INT nrCurrentClients = 0;
 INT nrWorkers = 4;
-BOOL quit = FALSE;
-LPHANDLE gpClientThreads;
+INT nrIoThreads = 0;
+// payload bytes a client may have in the server at once, set with client_quota= in MB
+LONG cbClientQuota = 1024 * 1024 * 1024;
+// payload bytes the clients of a user may have in the server together, set with user_quota= in MB
+LONG cbUserQuota = 64 * 1024 * 1024;
+// weights and quotas of the users, set with weights=, NULL gives every user the defaults
+PTCHAR sWeightsFile = NULL;
+// journal of the bytes encrypted for every user, set with accounting=
+LPCTSTR sAccountingFile = _T("accounting.jnl");
+// largest window granted to pipelined clients, in packets
+INT nrMaxWindow = 64;
+// largest packet granted to clients using INITIALIZE_CONNECTION_EX
+DWORD cbMaxPacket = MAX_LARGE_PACKET_SIZE;
+// key schedules kept once their clients are gone, set with key_cache=
+INT nrCachedKeys = 64;
+// scrypt cost (log2 N) of the plain text passwords of the credential file, set with kdf_cost=
+DWORD dwKdfLogCost = DEFAULT_KDF_LOG_COST;
+// successful logins remembered to skip the KDF, set with login_cache=
+INT nrCachedLogins = 256;
+// seconds between two checks of the credential file for changes, set with cred_poll=, 0 never reloads it
+DWORD dwCredPollSeconds = 2;
+// seconds a broken client connection can be resumed, set with session_timeout=, 0 resumes none
+DWORD dwSessionSeconds = 60;
+// clients may ask for their packets to be compressed before they are encrypted, set with compress=
+BOOL bCompression = TRUE;
+// password given with hashpass=, its hash is printed for the credential file
+PTCHAR sHashPassword = NULL;
+// address the metrics are served on, set with metrics=, NULL serves none
+PTCHAR sMetricsAddress = NULL;
+// seconds the clients get to finish their files once the server stops, set with drain_timeout=
+DWORD dwDrainSeconds = 30;
+// set once the server stops, the accepting threads leave their loops
+volatile LONG bStopping = FALSE;
+// set at the drain deadline, the client threads stop reading at the next packet
+volatile LONG bAbortStreams = FALSE;
+// set once everything else stopped, the metrics thread leaves its loop
+volatile LONG bMetricsStopping = FALSE;
+// set once the clients are gone, the credential watcher leaves its loop
+volatile LONG bWatcherStopping = FALSE;
+// client threads not joined yet, guarded by g_cs
+LPClientThreadT gClientThreads = NULL;
+LPHANDLE gpWorkerThreads;
+HANDLE hMetricsThread = NULL;
+// connection the metrics thread is serving, guarded by g_cs so stopServer can cut it
+LPConnectionT gMetricsConnection = NULL;
+HANDLE hWatcherThread = NULL;
+LPListenerT gListener;
+LPListenerT gMetricsListener = NULL;
+LPReactorT gReactor;
 
 //critical section used to get mutual exclusion on thread creation and the updating of number of threads.
 CRITICAL_SECTION g_cs;
-//critical section used to synchronize the use of credential manager.
-CRITICAL_SECTION gcsCredentialManger;
 
 LPCredentialManagerT gCredentialManager;
+LPUserSharesT gUserShares;
+LPAccountingT gAccounting;
+// sessions the clients can resume, NULL when session_timeout=0
+LPSessionStoreT gSessions = NULL;
 
-//synchronized queue, for communication between client and worker threads.
-LPSyncCircQueueT gQueue;
+//per worker queues, for communication between client and worker threads.
+LPWorkSchedulerT gScheduler;
+//packet buffers shared by the client threads, the reactor and the workers.
+LPPacketPoolT gPacketPool;
+//key schedules shared by the connections of a user with the same key.
+LPKeyCacheT gKeyCache;
 
 
 /*
- * Logs a message to the logFile.
+ * Logs a message through the asynchronous logger (see Logger.h).
+ * Messages printed to the screen are printed right away, they are startup messages and fatal errors.
  */
-VOID log(PTCHAR logString, BOOL printToScreen)
+VOID logEvent(DWORD dwLevel, BOOL printToScreen, LPCTSTR format, ...)
 {
+	TCHAR sMessage[LOG_MESSAGE_CHARS];
 	SYSTEMTIME st;
-	GetLocalTime(&st);
+	va_list args;
+
+	if (!printToScreen && (gLogger == NULL || !isLogEnabled(gLogger, dwLevel))) {
+		return;
+	}
+
+	va_start(args, format);
+	_vsntprintf(sMessage, LOG_MESSAGE_CHARS, format, args);
+	va_end(args);
+	sMessage[LOG_MESSAGE_CHARS - 1] = '\0';
 
 	if (printToScreen) {
-		_tprintf(_T("[%u. %u. %u][%u:%u]: %s\n"), st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, logString);
+		GetLocalTime(&st);
+		_tprintf(_T("[%u. %u. %u][%u:%u]: %s\n"), st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, sMessage);
+	}
+	if (gLogger != NULL) {
+		writeLog(gLogger, dwLevel, sMessage);
 	}
+}
 
-	if (logFile != NULL) {
-		_ftprintf(logFile, _T("[%u. %u. %u][%u:%u]: %s\n"), st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, logString);
+/*
+ * Writes the queued log records before the process exits.
+ */
+VOID closeServerLog()
+{
+	if (gLogger != NULL) {
+		closeLogger(gLogger);
 	}
 }
 
 /*
- * Returns a correct pipe name constructed from a string.
+ * Returns the transport address used when only a pipe name is given:
+ * a named pipe on Windows, a unix domain socket in the working directory elsewhere.
  */
-PTCHAR getRealPipeName(PTCHAR sPipeName)
+PTCHAR getDefaultListenAddress(PTCHAR sPipeName)
 {
-	PTCHAR sRealPipeName = (PTCHAR)malloc(sizeof(TCHAR) * (_tcslen(sPipeName) + 10));
-	if (sRealPipeName == NULL) {
+	PTCHAR sAddress = (PTCHAR)malloc(sizeof(TCHAR) * (_tcslen(sPipeName) + 11));
+	if (sAddress == NULL) {
 		return NULL;
 	}
-	_tcscpy(sRealPipeName, _T("\\\\.\\pipe\\"));
-	_tcscat(sRealPipeName, sPipeName);
-	return sRealPipeName;
+#ifdef _WIN32
+	_tcscpy(sAddress, _T("pipe:"));
+	_tcscat(sAddress, sPipeName);
+#else
+	_tcscpy(sAddress, _T("unix:"));
+	_tcscat(sAddress, sPipeName);
+	_tcscat(sAddress, _T(".sock"));
+#endif
+	return sAddress;
 }
 
 VOID printUsage()
 {
 	_tprintf(_T("Usage:\n"));
-	_tprintf(_T("    program.exe [pipe=<pipename> logfile=<log file path> credfile=<cred file path> nr_clients=<max_nr_clients> nr_workers=<nr_worker_threads>]\n"));
+	_tprintf(_T("    program.exe [pipe=<pipename> listen=<address> logfile=<log file path> credfile=<cred file path> nr_clients=<max_nr_clients> nr_workers=<nr_worker_threads> io_threads=<nr_io_threads> client_quota=<megabytes> user_quota=<megabytes> weights=<weights file path> accounting=<journal path> window=<nr_packets> max_packet=<kilobytes> key_cache=<nr_keys> kdf_cost=<log2_n> login_cache=<nr_logins> cred_poll=<seconds> session_timeout=<seconds> compress=<on|off> log_level=<level> log_size=<megabytes> metrics=<address> drain_timeout=<seconds>]\n"));
+	_tprintf(_T("    program.exe [kdf_cost=<log2_n>] hashpass=<password>\n"));
 	_tprintf(_T("        where <pipename> is the name of the pipe to be used to accept client connections.\n"));
+	_tprintf(_T("        where <address> is pipe:<pipename>, unix:<socket path> or tcp:[<host>:]<port>, it overrides pipe=.\n"));
 	_tprintf(_T("        where <log file path> is the path where the logging file should be created and updated, having default value of \"log.log\".\n"));
 	_tprintf(_T("        where <max_nr_clients> is the maximum number of concurent clients, default value of 8.\n"));
 	_tprintf(_T("        where <nr_worker_threads> is the number of worker thread used to encrypt, default value of 4.\n"));
+	_tprintf(_T("        where <nr_io_threads> is the number of epoll threads serving all clients (socket transports, Linux only),\n"));
+	_tprintf(_T("            default value of 0: one thread per client.\n"));
+	_tprintf(_T("        where <megabytes> is the packet memory a client may use at once, default value of 1024, at most 2047.\n"));
+	_tprintf(_T("        user_quota= is the packet memory the clients of a user may use together before they are read slower,\n"));
+	_tprintf(_T("            default value of 64, at most 2047.\n"));
+	_tprintf(_T("        where <weights file path> has <user name>;<weight>[;<user_quota>] lines, the workers are shared\n"));
+	_tprintf(_T("            between the users in proportion to their weights, 1 to %d, users not listed get 1.\n"), WORK_MAX_WEIGHT);
+	_tprintf(_T("        where <journal path> is the journal of the bytes encrypted for every user, default value of \"accounting.jnl\",\n"));
+	_tprintf(_T("            committed every %d ms and compacted into <journal path>.snapshot, both replayed at startup.\n"), ACCOUNTING_COMMIT_MS);
+	_tprintf(_T("        where <nr_packets> is the largest number of packets a pipelined client may have in the server, default value of 64.\n"));
+	_tprintf(_T("        where <kilobytes> is the largest packet a client may negotiate, default value of 4096, at least 4.\n"));
+	_tprintf(_T("        where <nr_keys> is the number of key schedules kept for returning clients, default value of 64.\n"));
+	_tprintf(_T("        where <log2_n> is the scrypt cost of the passwords hashed by the server, default value of %d, at most %d.\n"),
+		DEFAULT_KDF_LOG_COST, MAX_KDF_LOG_COST);
+	_tprintf(_T("        where <nr_logins> is the number of successful logins remembered to skip the KDF, default value of 256.\n"));
+	_tprintf(_T("        cred_poll= is how often the cred file is checked for changes, in seconds, default value of 2, 0 never reloads it.\n"));
+	_tprintf(_T("            A changed file is reloaded without stopping the clients, write it elsewhere and rename it over the old one.\n"));
+	_tprintf(_T("        session_timeout= is how long a client whose connection broke can resume its file from the last packet\n"));
+	_tprintf(_T("            it got back, in seconds, default value of 60, 0 resumes none.\n"));
+	_tprintf(_T("        compress=off refuses to compress the packets of the clients before encrypting them, default value of on.\n"));
+	_tprintf(_T("            Compressed files are still decompressed.\n"));
+	_tprintf(_T("        where <level> is debug, info, warning or error, the least severe level logged, default value of info.\n"));
+	_tprintf(_T("        log_size= is the size at which the log file is rotated, default value of 0: never.\n"));
+	_tprintf(_T("        metrics= serves the counters and latency histograms in the Prometheus text format on <address>,\n"));
+	_tprintf(_T("            for an HTTP GET or any line sent to it, for example metrics=unix:server.metrics.\n"));
+	_tprintf(_T("        drain_timeout= is how long the clients get to finish their files when the server stops, default value of 30,\n"));
+	_tprintf(_T("            the streams still running afterwards end with TERMINATE_CONNECTION.\n"));
+	_tprintf(_T("        hashpass= prints the hash of <password> to be stored in the cred file instead of the password.\n"));
 	_tprintf(_T("\nNOTE: for some errors, you can see the error message only in the log file.\n"));
 	_tprintf(_T("    program.exe /h for this message\n"));
 }
@@ -96,347 +273,1416 @@ VOID parseArgument(PTCHAR arg)
 {
 	if (_tcsncmp(arg, _T("pipe="), 5) == 0) {
 		sPipeName = arg + 5;
+	} else if (_tcsncmp(arg, _T("listen="), 7) == 0) {
+		sListenAddress = arg + 7;
 	} else if (_tcsncmp(arg, _T("logfile="), 8) == 0) {
 		sLoggingFile = arg + 8;
 	} else if (_tcsncmp(arg, _T("credfile="), 9) == 0) {
 		sCredFile = arg + 9;
 	} else if (_tcsncmp(arg, _T("nr_clients="), 11) == 0) {
 		if(_stscanf(arg + 11, _T("%d"), &nrMaxClients) != 1 || nrMaxClients <= 0) {
-			_stprintf(logBuffer, _T("invalid number at nr_clients"));
-			log(logBuffer, TRUE);
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at nr_clients"));
 			exit(3);
 		}
 	} else if (_tcsncmp(arg, _T("nr_workers="), 11) == 0) {
 		if(_stscanf(arg + 11, _T("%d"), &nrWorkers) != 1 || nrWorkers <= 0) {
-			_stprintf(logBuffer, _T("invalid number at nr_workers"));
-			log(logBuffer, TRUE);
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at nr_workers"));
 			exit(3);
 		}
+	} else if (_tcsncmp(arg, _T("io_threads="), 11) == 0) {
+		if(_stscanf(arg + 11, _T("%d"), &nrIoThreads) != 1 || nrIoThreads < 0) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at io_threads"));
+			exit(3);
+		}
+	} else if (_tcsncmp(arg, _T("client_quota="), 13) == 0) {
+		INT nrMegabytes;
+		if(_stscanf(arg + 13, _T("%d"), &nrMegabytes) != 1 || nrMegabytes <= 0 || nrMegabytes > 2047) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at client_quota"));
+			exit(3);
+		}
+		cbClientQuota = (LONG)nrMegabytes * 1024 * 1024;
+	} else if (_tcsncmp(arg, _T("user_quota="), 11) == 0) {
+		INT nrMegabytes;
+		if(_stscanf(arg + 11, _T("%d"), &nrMegabytes) != 1 || nrMegabytes <= 0 || nrMegabytes > 2047) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at user_quota"));
+			exit(3);
+		}
+		cbUserQuota = (LONG)nrMegabytes * 1024 * 1024;
+	} else if (_tcsncmp(arg, _T("weights="), 8) == 0) {
+		sWeightsFile = arg + 8;
+	} else if (_tcsncmp(arg, _T("accounting="), 11) == 0) {
+		sAccountingFile = arg + 11;
+	} else if (_tcsncmp(arg, _T("max_packet="), 11) == 0) {
+		DWORD nrKilobytes;
+		if(_stscanf(arg + 11, _T("%u"), &nrKilobytes) != 1 || nrKilobytes < MAX_PACKET_SIZE / 1024 ||
+			nrKilobytes > MAX_LARGE_PACKET_SIZE / 1024) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at max_packet"));
+			exit(3);
+		}
+		cbMaxPacket = nrKilobytes * 1024;
+	} else if (_tcsncmp(arg, _T("window="), 7) == 0) {
+		if(_stscanf(arg + 7, _T("%d"), &nrMaxWindow) != 1 || nrMaxWindow <= 0) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at window"));
+			exit(3);
+		}
+	} else if (_tcsncmp(arg, _T("key_cache="), 10) == 0) {
+		if(_stscanf(arg + 10, _T("%d"), &nrCachedKeys) != 1 || nrCachedKeys < 0) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at key_cache"));
+			exit(3);
+		}
+	} else if (_tcsncmp(arg, _T("kdf_cost="), 9) == 0) {
+		if(_stscanf(arg + 9, _T("%u"), &dwKdfLogCost) != 1 || dwKdfLogCost == 0 || dwKdfLogCost > MAX_KDF_LOG_COST) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at kdf_cost"));
+			exit(3);
+		}
+	} else if (_tcsncmp(arg, _T("login_cache="), 12) == 0) {
+		if(_stscanf(arg + 12, _T("%d"), &nrCachedLogins) != 1 || nrCachedLogins < 0) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at login_cache"));
+			exit(3);
+		}
+	} else if (_tcsncmp(arg, _T("cred_poll="), 10) == 0) {
+		if(_stscanf(arg + 10, _T("%u"), &dwCredPollSeconds) != 1 || dwCredPollSeconds > 3600) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at cred_poll"));
+			exit(3);
+		}
+	} else if (_tcsncmp(arg, _T("session_timeout="), 16) == 0) {
+		if(_stscanf(arg + 16, _T("%u"), &dwSessionSeconds) != 1 || dwSessionSeconds > 86400) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at session_timeout"));
+			exit(3);
+		}
+	} else if (_tcscmp(arg, _T("compress=on")) == 0) {
+		bCompression = TRUE;
+	} else if (_tcscmp(arg, _T("compress=off")) == 0) {
+		bCompression = FALSE;
+	} else if (_tcsncmp(arg, _T("log_level="), 10) == 0) {
+		if (!parseLogLevel(arg + 10, &dwLogLevel)) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid level at log_level"));
+			exit(3);
+		}
+	} else if (_tcsncmp(arg, _T("log_size="), 9) == 0) {
+		if(_stscanf(arg + 9, _T("%u"), &nrLogMegabytes) != 1) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at log_size"));
+			exit(3);
+		}
+	} else if (_tcsncmp(arg, _T("drain_timeout="), 14) == 0) {
+		if(_stscanf(arg + 14, _T("%u"), &dwDrainSeconds) != 1) {
+			logEvent(LOG_ERROR, TRUE, _T("invalid number at drain_timeout"));
+			exit(3);
+		}
+	} else if (_tcsncmp(arg, _T("metrics="), 8) == 0) {
+		sMetricsAddress = arg + 8;
+	} else if (_tcsncmp(arg, _T("hashpass="), 9) == 0) {
+		sHashPassword = arg + 9;
 	} else if (_tcscmp(arg, _T("/h")) == 0) {
 		printUsage();
 		exit(0);
 	} else {
-		_stprintf(logBuffer, _T("invalid parameter: \"%s\""), arg);
-		log(logBuffer, TRUE);
+		logEvent(LOG_ERROR, TRUE, _T("invalid parameter: \"%s\""), arg);
 		printUsage();
-		_stprintf(logBuffer, _T("exiting..."));
-		log(logBuffer, TRUE);
+		logEvent(LOG_WARNING, TRUE, _T("exiting..."));
 		exit(1);
 	}
 }
 
 /*
- * Encrypts a buff with key using xor.
+ * Encrypts a packet in place with the cipher its client picked (see CipherEngine.h).
+ * With a codec the packet is compressed first and only the stored bytes of its record
+ * are encrypted, or the stored bytes of a record are decrypted and then decompressed.
+ * A record that cannot be decompressed is marked invalid.
+ */
+VOID encryptData(LPEncryptDataT encData)
+{
+	LPCodecStateT codec = encData->codec;
+	PBYTE pRecord = encData->payload.pData;
+	DWORD cbPlain;
+	DWORD cbStored;
+
+	if (codec == NULL) {
+		encryptPacket(encData->cipher, encData->qwSequence, encData->payload);
+		return;
+	}
+
+	if (codec->dwMode == CODEC_COMPRESS) {
+		cbPlain = encData->payload.cbData - PACKET_RECORD_HEADER_SIZE;
+		cbStored = compressRecord(codec, pRecord, cbPlain);
+		encryptPacket(encData->cipher, encData->qwSequence, makeByteSpan(pRecord + PACKET_RECORD_HEADER_SIZE, cbStored));
+		encData->payload.cbData = PACKET_RECORD_HEADER_SIZE + cbStored;
+		countMetric(METRIC_CODEC_PLAIN_BYTES, cbPlain);
+		countMetric(METRIC_CODEC_STORED_BYTES, cbStored);
+		if (cbStored == cbPlain) {
+			countMetric(METRIC_CODEC_RAW_PACKETS, 1);
+		}
+		return;
+	}
+
+	if (!checkRecord(codec, encData->payload)) {
+		encData->bInvalid = TRUE;
+		return;
+	}
+	cbStored = encData->payload.cbData - PACKET_RECORD_HEADER_SIZE;
+	encryptPacket(encData->cipher, encData->qwSequence, makeByteSpan(pRecord + PACKET_RECORD_HEADER_SIZE, cbStored));
+	encData->payload.cbData = expandRecord(pRecord);
+	encData->bInvalid = encData->payload.cbData == 0;
+}
+
+/*
+ * Function of worker threads.
+ * Gets packet info from its queue in gScheduler, or steals it from another worker, and ecrypts it.
+ * When the packet is encrypted, the thread requesting the encryption will be signaled.
+ * Returns once it takes the poison pill of stopWorkScheduler.
+ */
+DWORD WINAPI workerThread(LPVOID arg)
+{
+	DWORD dwWorker = (DWORD)(uintptr_t)arg;
+	LPEncryptDataT encData;
+	LONGLONG llTaken;
+
+	while (takeWork(gScheduler, dwWorker, &encData)) {
+		llTaken = metricTicks();
+		recordLatency(METRIC_QUEUE_WAIT, llTaken - encData->llQueuedTicks);
+		encryptData(encData);
+		recordLatency(METRIC_ENCRYPT_TIME, metricTicks() - llTaken);
+
+		// the owner holds its reference until it sees the packet encrypted, so this is never the last one
+		releasePacket(encData);
+
+		if (encData->onEncrypted != NULL) {
+			encData->onEncrypted(encData, encData->lpContext);
+			continue;
+		}
+
+		EnterCriticalSection(encData->pCriticalSection);
+
+		encData->dwStatus = DATA_ENCRYPTED;
+		// woken before leaving, the client thread may return and drop the condition variable right after
+		WakeConditionVariable(encData->pConditionVariable);
+
+		LeaveCriticalSection(encData->pCriticalSection);
+	}
+
+	releaseSlabCaches();
+	releaseCodecScratch();
+	releaseLogRing();
+
+	return 0;
+}
+
+/*
+ * Checks the init message of a client and whether the server has room for one more client.
+ * The key may be any binary string of 1 to MAX_KEY_SIZE bytes for XOR,
+ * the other ciphers take a key of exactly their key size.
+ * The options asked for with INITIALIZE_CONNECTION_EX are replaced by the granted ones,
+ * they are all 0 for INITIALIZE_CONNECTION. Without INIT_CIPHER, cipher is set to XOR.
+ * A client asking for both INIT_COMPRESS and INIT_DECOMPRESS gets neither.
+ * User names and passwords longer than MAX_CREDENTIAL_SIZE bytes are refused.
+ * A client resuming a session sends no key, the session has it.
+ */
+BOOL admitClient(LPInitT init, LPInitExT options, LPCipherInitT cipher)
+{
+	DWORD cbKeySize;
+
+	BOOL bAccepted;
+
+	if (init->command == INITIALIZE_CONNECTION) {
+		memset(options, 0, sizeof(InitExT));
+		options->cbMaxPacket = MAX_PACKET_SIZE;
+	} else if (init->command == INITIALIZE_CONNECTION_EX || init->command == RESUME_SESSION) {
+		if (options->dwVersion > PROTOCOL_VERSION) {
+			options->dwVersion = PROTOCOL_VERSION;
+		}
+		options->dwFlags &= INIT_PIPELINED | INIT_BATCHED | INIT_CIPHER | INIT_RESUMABLE | INIT_COMPRESS | INIT_DECOMPRESS;
+		if (gSessions == NULL) {
+			options->dwFlags &= ~INIT_RESUMABLE;
+		}
+		if (!bCompression) {
+			options->dwFlags &= ~INIT_COMPRESS;
+		}
+		if (options->nrWindow == 0 || options->nrWindow > (DWORD)nrMaxWindow) {
+			options->nrWindow = nrMaxWindow;
+		}
+		if (options->cbMaxPacket == 0 || options->cbMaxPacket > cbMaxPacket) {
+			options->cbMaxPacket = cbMaxPacket;
+		}
+		// a record must hold more than its header
+		if (((options->dwFlags & INIT_COMPRESS) && (options->dwFlags & INIT_DECOMPRESS)) ||
+			options->cbMaxPacket <= PACKET_RECORD_HEADER_SIZE) {
+			options->dwFlags &= ~(INIT_COMPRESS | INIT_DECOMPRESS);
+		}
+	} else {
+		countMetric(METRIC_REJECTED_INVALID, 1);
+		return FALSE;
+	}
+
+	if (!(options->dwFlags & INIT_CIPHER) || init->command == RESUME_SESSION) {
+		memset(cipher, 0, sizeof(CipherInitT));
+	}
+	if (cipher->dwCipher >= NR_CIPHERS) {
+		countMetric(METRIC_REJECTED_INVALID, 1);
+		return FALSE;
+	}
+
+	cbKeySize = getCipherKeySize(cipher->dwCipher);
+	if (init->command != RESUME_SESSION && (init->cbKeyNrBytes == 0 || init->cbKeyNrBytes > MAX_KEY_SIZE ||
+		(cbKeySize != 0 && init->cbKeyNrBytes != cbKeySize) ||
+		init->cbUsernameNrBytes > MAX_CREDENTIAL_SIZE || init->cbPasswordNrBytes > MAX_CREDENTIAL_SIZE)) {
+		countMetric(METRIC_REJECTED_INVALID, 1);
+		return FALSE;
+	}
+
+	EnterCriticalSection(&g_cs);
+	bAccepted = nrCurrentClients < nrMaxClients;
+	if (bAccepted) {
+		logEvent(LOG_INFO, FALSE, _T("Connection accepted, current nr_clients: %d"), nrCurrentClients);
+	} else {
+		countMetric(METRIC_REJECTED_BUSY, 1);
+		logEvent(LOG_WARNING, FALSE, _T("Connection not accepted, due to high number of clients"));
+	}
+	LeaveCriticalSection(&g_cs);
+
+	return bAccepted;
+}
+
+/*
+ * Checks the credentials of a client against the credential manager.
+ *
+ * @return the credential of the user, NULL if rejected.
+ */
+LPCredentialT verifyClient(PTCHAR sUserName, PTCHAR sPassword)
+{
+	LPCredentialT credential = checkClientCredentials(gCredentialManager, sUserName, sPassword);
+
+	if (credential == NULL) {
+		countMetric(METRIC_REJECTED_AUTH, 1);
+	}
+	return credential;
+}
+
+/*
+ * Opens the session of an authenticated client that asked for INIT_RESUMABLE.
+ *
+ * @return the session, NULL if out of memory.
+ */
+LPSessionT openClientSession(LPCredentialT credential)
+{
+	LPSessionT session = openSession(gSessions, credential);
+
+	if (session == NULL) {
+		logEvent(LOG_ERROR, FALSE, _T("could not open a session for client %s"), credential->sUserName);
+	}
+	return session;
+}
+
+/*
+ * Looks up the session a reconnecting client takes over.
+ * Its user must still be in the credential file, a removed user cannot come back through a session.
+ *
+ * @return the attached session, NULL if it cannot be resumed.
+ */
+LPSessionT resumeClientSession(LPResumeT resume)
+{
+	LPSessionT session = (gSessions != NULL) ? resumeSession(gSessions, resume) : NULL;
+
+	if (session != NULL && ReadAcquire(&session->credential->bRemoved)) {
+		closeSession(session, TRUE);
+		session = NULL;
+	}
+
+	if (session == NULL) {
+		countMetric(METRIC_REJECTED_AUTH, 1);
+		logEvent(LOG_WARNING, FALSE, _T("Could not resume the session of a client"));
+	} else {
+		logEvent(LOG_INFO, FALSE, _T("Client %s resumed its session from packet %llu"), session->sUserName, resume->qwSequence);
+	}
+	return session;
+}
+
+/*
+ * Counts a client that starts streaming packets.
+ *
+ * @return the share of its user, NULL if out of memory.
+ */
+LPUserShareT registerClient(LPCredentialT credential)
+{
+	LPUserShareT share = acquireUserShare(gUserShares, credential->sUserName);
+
+	if (share == NULL) {
+		logEvent(LOG_ERROR, FALSE, _T("could not allocate memory"));
+		return NULL;
+	}
+	countMetric(METRIC_CONNECTIONS, 1);
+
+	EnterCriticalSection(&g_cs);
+	nrCurrentClients++;
+	LeaveCriticalSection(&g_cs);
+
+	return share;
+}
+
+/*
+ * Accounts packets sent back to a client, to its user and to the server metrics.
+ */
+VOID packetsSent(LPCredentialT credential, DWORD nrPackets, DWORD cbSent)
+{
+	countMetric(METRIC_PACKETS, nrPackets);
+	countMetric(METRIC_BYTES, cbSent);
+	InterlockedExchangeAdd64(&credential->qwBytesEncrypted, cbSent);
+}
+
+/*
+ * Releases the slot of a client, once its packets are back in the pool.
+ */
+VOID unregisterClient(LPCredentialT credential, LPUserShareT share)
+{
+	InterlockedExchange(&credential->bConnected, FALSE);
+	releaseUserShare(gUserShares, share);
+
+	EnterCriticalSection(&g_cs);
+	nrCurrentClients--;
+	LeaveCriticalSection(&g_cs);
+}
+
+/*
+ * Sender stage of a client: sends the encrypted packets back in the order they were read.
+ * It runs on its own thread for pipelined clients, after the reader for the others.
+ */
+DWORD WINAPI sendClientPackets(LPClientStreamT stream)
+{
+	LPEncryptDataT packets[MAX_BATCH_PACKETS];
+	PTCHAR buffs[MAX_BATCH_PACKETS];
+	DWORD cbPacketLens[MAX_BATCH_PACKETS];
+	DWORD nrPackets;
+	DWORD nrMaxPackets = stream->bBatched ? MAX_BATCH_PACKETS : 1;
+	DWORD cbSent;
+	LONGLONG llSentTicks;
+	BOOL bSend;
+	BOOL bInvalid;
+
+	EnterCriticalSection(&stream->criticalSection);
+	while (true) {
+		while ((stream->first == NULL && !stream->bReaderDone) ||
+			(stream->first != NULL && stream->first->dwStatus != DATA_ENCRYPTED)) {
+			SleepConditionVariableCS(&stream->packetReady, &stream->criticalSection, INFINITE);
+		}
+		if (stream->first == NULL) {
+			break;
+		}
+
+		// every encrypted packet at the front goes out in the same frame
+		nrPackets = 0;
+		bInvalid = FALSE;
+		while (nrPackets < nrMaxPackets && stream->first != NULL && stream->first->dwStatus == DATA_ENCRYPTED) {
+			packets[nrPackets] = stream->first;
+			buffs[nrPackets] = (PTCHAR)stream->first->payload.pData;
+			cbPacketLens[nrPackets] = stream->first->payload.cbData;
+			bInvalid |= stream->first->bInvalid;
+			nrPackets++;
+			stream->first = stream->first->next;
+		}
+		if (stream->first == NULL) {
+			stream->last = NULL;
+		}
+		if (bInvalid && !stream->bFailed) {
+			logEvent(LOG_WARNING, FALSE, _T("client %s sent a record that could not be decompressed"), stream->credential->sUserName);
+		}
+		// nothing is sent past a record that could not be decompressed
+		bSend = !stream->bFailed && !bInvalid;
+		LeaveCriticalSection(&stream->criticalSection);
+
+		if (bSend) {
+			if (stream->bBatched) {
+				bSend = sendPacketBatch(stream->connection, buffs, cbPacketLens, nrPackets);
+			} else {
+				bSend = sendFramedPacket(stream->connection, buffs[0], cbPacketLens[0]);
+			}
+		}
+		if (bSend) {
+			cbSent = 0;
+			llSentTicks = metricTicks();
+			for (DWORD i = 0; i < nrPackets; i++) {
+				recordLatency(METRIC_PACKET_LATENCY, llSentTicks - packets[i]->llReadTicks);
+				cbSent += cbPacketLens[i];
+			}
+			packetsSent(stream->credential, nrPackets, cbSent);
+			if (stream->session != NULL) {
+				advanceSession(stream->session, packets[nrPackets - 1]->qwSequence + 1);
+			}
+		}
+		for (DWORD i = 0; i < nrPackets; i++) {
+			releasePacket(packets[i]);
+		}
+
+		EnterCriticalSection(&stream->criticalSection);
+		if (!bSend) {
+			stream->bFailed = TRUE;
+		}
+		stream->nrHeld -= nrPackets;
+		WakeConditionVariable(&stream->windowOpen);
+	}
+	LeaveCriticalSection(&stream->criticalSection);
+
+	// the cached packet buffers of this thread go back to the pool
+	releaseSlabCaches();
+	releaseLogRing();
+
+	return 0;
+}
+
+/*
+ *Function of client threads.
+ *Gets packet from the pipe and puts it in the gScheduler.
+ *The encrypted packets are sent back by the sender stage, concurrently for pipelined clients,
+ *otherwise once all the packets are read.
+*/
+DWORD WINAPI serveClient(LPClientThreadT clientThreadArg)
+{
+	DWORD cbPacketSize;
+	DWORD cbBuffer;
+	DWORD dwRecordOffset;
+	BOOL bPipelined = (clientThreadArg->options.dwFlags & INIT_PIPELINED) != 0;
+	LPCodecStateT codec = (clientThreadArg->codec.dwMode != CODEC_NONE) ? &clientThreadArg->codec : NULL;
+	ClientStreamT stream;
+	PacketReaderT reader;
+	PacketQuotaT quota;
+	HANDLE hSender = NULL;
+	BOOL bSuccess = TRUE;
+	DWORD dwResponse;
+	ULONGLONG qwSequence = clientThreadArg->qwFirstSequence;
+
+	memset(&stream, 0, sizeof(ClientStreamT));
+	stream.connection = clientThreadArg->connection;
+	stream.nrWindow = bPipelined ? clientThreadArg->options.nrWindow : 0;
+	stream.bBatched = (clientThreadArg->options.dwFlags & INIT_BATCHED) != 0;
+	stream.credential = clientThreadArg->credential;
+	stream.session = clientThreadArg->session;
+	initPacketReader(&reader, clientThreadArg->connection, clientThreadArg->options.cbMaxPacket);
+	InitializeCriticalSection(&stream.criticalSection);
+	InitializeConditionVariable(&stream.packetReady);
+	InitializeConditionVariable(&stream.windowOpen);
+	initPacketQuota(&quota, cbClientQuota, &clientThreadArg->share->quota);
+
+	if (bPipelined) {
+		hSender = (HANDLE)_beginthreadex(
+			NULL,
+			0,
+			(_beginthreadex_proc_type)sendClientPackets,
+			&stream,
+			0,
+			NULL
+		);
+		if (hSender == NULL) {
+			logEvent(LOG_ERROR, FALSE, _T("could not create sender thread for client %s"), clientThreadArg->clientName);
+			stream.nrWindow = 0;
+		}
+	}
+
+	while (true) {
+		EnterCriticalSection(&stream.criticalSection);
+		while (stream.nrWindow != 0 && stream.nrHeld >= stream.nrWindow) {
+			SleepConditionVariableCS(&stream.windowOpen, &stream.criticalSection, INFINITE);
+		}
+		stream.nrHeld++;
+		LeaveCriticalSection(&stream.criticalSection);
+
+		// a pipelined client is read slower while its user has too much in the server,
+		// the others send everything before reading and would never get their packets back
+		while (stream.nrWindow != 0 && !waitPacketQuota(&quota, DRAIN_POLL_MS) && !ReadAcquire(&bAbortStreams)) {
+		}
+
+		// the server is stopping and the drain deadline passed
+		if (ReadAcquire(&bAbortStreams)) {
+			bSuccess = FALSE;
+			break;
+		}
+
+		bSuccess = readPacketHeader(&reader, &cbPacketSize);
+		if (!bSuccess || cbPacketSize == 0) {
+			//we got all the packets, or the client is gone
+			break;
+		}
+
+		cbBuffer = getRecordBufferSize(&clientThreadArg->codec, cbPacketSize, &dwRecordOffset);
+		if (cbBuffer == 0) {
+			logEvent(LOG_ERROR, FALSE, _T("client %s sent a packet too large to be compressed"), clientThreadArg->clientName);
+			bSuccess = FALSE;
+			break;
+		}
+
+		// the packet is read straight into a pooled buffer, it is encrypted and sent from there
+		LPEncryptDataT packet = acquirePacket(
+			gPacketPool,
+			&quota,
+			cbBuffer,
+			clientThreadArg->cipher,
+			&stream.criticalSection,
+			&stream.packetReady
+		);
+		if (packet == NULL) {
+			logEvent(LOG_ERROR, FALSE, _T("client %s exceeded its quota of %u bytes, or the server is out of memory"),
+				clientThreadArg->clientName, (DWORD)cbClientQuota);
+			bSuccess = FALSE;
+			break;
+		}
+
+		bSuccess = transportRead(clientThreadArg->connection, packet->payload.pData + dwRecordOffset, cbPacketSize);
+		if (!bSuccess) {
+			releasePacket(packet);
+			break;
+		}
+		packet->payload.cbData = dwRecordOffset + cbPacketSize;
+		packet->codec = codec;
+		packet->qwSequence = qwSequence++;
+		packet->llReadTicks = metricTicks();
+
+		//the worker holds its own reference
+		retainPacket(packet);
+
+		EnterCriticalSection(&stream.criticalSection);
+		if (stream.last == NULL) {
+			stream.first = packet;
+			WakeConditionVariable(&stream.packetReady);
+		} else {
+			stream.last->next = packet;
+		}
+		stream.last = packet;
+		LeaveCriticalSection(&stream.criticalSection);
+
+		// the packets of a user are served in turn with those of the other users
+		packet->llQueuedTicks = metricTicks();
+		submitWork(gScheduler, clientThreadArg->share->flow, packet);
+	}
+
+	// even after a failure every packet is waited for, the workers signal the stream
+	EnterCriticalSection(&stream.criticalSection);
+	stream.nrHeld--;
+	stream.bReaderDone = TRUE;
+	if (!bSuccess) {
+		stream.bFailed = TRUE;
+	}
+	WakeConditionVariable(&stream.packetReady);
+	LeaveCriticalSection(&stream.criticalSection);
+
+	if (hSender != NULL) {
+		WaitForSingleObject(hSender, INFINITE);
+		CloseHandle(hSender);
+	} else {
+		sendClientPackets(&stream);
+	}
+
+	dwResponse = (!stream.bFailed) ? LAST_PACKET : TERMINATE_CONNECTION;
+
+	bSuccess = sendCommand(clientThreadArg->connection, dwResponse);
+
+	if (clientThreadArg->session != NULL) {
+		// a client that did not get all its packets may come back for the rest
+		closeSession(clientThreadArg->session, bSuccess && !stream.bFailed);
+	}
+
+	//connection terminated, under g_cs so a stopping server does not interrupt it meanwhile
+	EnterCriticalSection(&g_cs);
+	closeConnection(clientThreadArg->connection);
+	clientThreadArg->connection = NULL;
+	LeaveCriticalSection(&g_cs);
+
+	unregisterClient(clientThreadArg->credential, clientThreadArg->share);
+
+	// every packet borrowing the cipher is back in the pool
+	destroyCipherContext(clientThreadArg->cipher);
+	releaseSlabCaches();
+	releaseLogRing();
+
+	// the record is freed once the thread is joined, see reapClientThreads
+	WriteRelease(&clientThreadArg->bFinished, TRUE);
+
+	return 0;
+}
+
+
+/*
+ * Initializes connection with the client on the connection.
+ * Initialization parameters are saved in init, options and cipher, or in resume for RESUME_SESSION.
+ */
+BOOL initializeConnection(LPConnectionT connection, LPInitT init, LPInitExT options, LPCipherInitT cipher, LPResumeT resume)
+{
+	BOOL bSuccess;
+	BOOL bAccepted;
+	DWORD dwInitMessage;
+
+	bSuccess = transportRead(connection, init, sizeof(InitT));
+
+	if (!bSuccess) {
+		return FALSE;
+	}
+
+	if (init->command == INITIALIZE_CONNECTION_EX || init->command == RESUME_SESSION) {
+		bSuccess = transportRead(connection, options, sizeof(InitExT));
+		if (bSuccess && init->command == RESUME_SESSION) {
+			bSuccess = transportRead(connection, resume, sizeof(ResumeT));
+		} else if (bSuccess && (options->dwFlags & INIT_CIPHER)) {
+			bSuccess = transportRead(connection, cipher, sizeof(CipherInitT));
+		}
+		if (!bSuccess) {
+			return FALSE;
+		}
+	} else if (init->command != INITIALIZE_CONNECTION) {
+		return FALSE;
+	}
+	bAccepted = admitClient(init, options, cipher);
+	if (connection->kind == TRANSPORT_PIPE) {
+		// synchronous I/O on a pipe handle is serialized, a pipe cannot be read and written at once
+		options->dwFlags &= ~INIT_PIPELINED;
+	}
+
+	dwInitMessage = (bAccepted) ? CONNECTION_ACCEPTED : CONNECTION_REJECTED;
+	bSuccess = sendCommand(connection, dwInitMessage);
+
+	if (bSuccess && bAccepted && init->command != INITIALIZE_CONNECTION) {
+		bSuccess = transportWrite(connection, options, sizeof(InitExT));
+	}
+
+	return bSuccess && bAccepted;
+}
+
+/*
+ * Wipes the password of a client and frees it, NULL is ignored.
+ */
+VOID freePassword(PTCHAR sPassword, DWORD cbPassword)
+{
+	if (sPassword != NULL) {
+		memset(sPassword, 0, cbPassword + sizeof(TCHAR));
+		free(sPassword);
+	}
+}
+
+/*
+ * Authenticates a client through the connection.
+ * For auth the global CredentialManager is used.
+ * A client granted INIT_RESUMABLE gets the token of its new session after AUTH_SUCCESSFUL.
+ * admitClient bounded the lengths of the user name and the password.
+ *
+ * @param sUserName: the user name of the client, freed and set to NULL when FALSE is returned.
+ * @param credential: the credential of the user, when TRUE is returned.
+ */
+BOOL authenticateClient(LPConnectionT connection, LPInitT init, LPInitExT options, PTCHAR *sUserName, LPCredentialT *credential, LPSessionT *session)
+{
+	BOOL bSuccess;
+	DWORD dwResponse;
+	BOOL auth;
+
+	*session = NULL;
+	*sUserName = (PTCHAR)malloc(init->cbUsernameNrBytes + sizeof(TCHAR));
+	PTCHAR sPassword = (PTCHAR)malloc(init->cbPasswordNrBytes + sizeof(TCHAR));
+	if (*sUserName == NULL || sPassword == NULL) {
+		free(*sUserName);
+		*sUserName = NULL;
+		freePassword(sPassword, init->cbPasswordNrBytes);
+		return FALSE;
+	}
+
+	(*sUserName)[init->cbUsernameNrBytes/sizeof(TCHAR)] = '\0';
+	sPassword[init->cbPasswordNrBytes/sizeof(TCHAR)] = '\0';
+
+	bSuccess = transportRead(connection, *sUserName, init->cbUsernameNrBytes) &&
+		transportRead(connection, sPassword, init->cbPasswordNrBytes);
+	*credential = bSuccess ? verifyClient(*sUserName, sPassword) : NULL;
+	auth = *credential != NULL;
+	freePassword(sPassword, init->cbPasswordNrBytes);
+
+	if (auth && (options->dwFlags & INIT_RESUMABLE)) {
+		*session = openClientSession(*credential);
+		bSuccess = *session != NULL;
+	}
+	if (!bSuccess) {
+		free(*sUserName);
+		*sUserName = NULL;
+		return FALSE;
+	}
+
+	dwResponse = (auth) ? AUTH_SUCCESSFUL : AUTH_REJECTED;
+
+	bSuccess = sendCommand(connection, dwResponse);
+
+	if (bSuccess && *session != NULL) {
+		bSuccess = transportWrite(connection, (*session)->token, SESSION_TOKEN_SIZE);
+	}
+
+	if (!bSuccess || !auth) {
+		if (*session != NULL) {
+			closeSession(*session, TRUE);
+			*session = NULL;
+		}
+		free(*sUserName);
+		*sUserName = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Answers a client resuming a session, in place of the authentication.
+ */
+BOOL resumeClient(LPConnectionT connection, LPResumeT resume, LPSessionT *session)
+{
+	*session = resumeClientSession(resume);
+
+	if (!sendCommand(connection, (*session != NULL) ? AUTH_SUCCESSFUL : AUTH_REJECTED)) {
+		if (*session != NULL) {
+			// the client may try again
+			closeSession(*session, FALSE);
+			*session = NULL;
+		}
+		return FALSE;
+	}
+
+	return *session != NULL;
+}
+
+/*
+ * Reads the encryption key of the client, exactly the cbKeyNrBytes bytes of the init message.
+ * The key is binary, it is not terminated. The caller frees key->pData.
+ */
+BOOL getEncryptionKey(LPConnectionT connection, LPInitT init, LPByteSpanT key)
+{
+	*key = makeByteSpan(malloc(init->cbKeyNrBytes), init->cbKeyNrBytes);
+	if (key->pData == NULL) {
+		return FALSE;
+	}
+
+	if (!transportRead(connection, key->pData, key->cbData)) {
+		free(key->pData);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Prints the work stealing statistics of the encryption workers.
+ */
+VOID listWorkers()
+{
+	WorkerStatsT stats;
+
+	for (DWORD i = 0; i < getNrWorkers(gScheduler); i++) {
+		getWorkerStats(gScheduler, i, &stats);
+		_tprintf(_T("worker %u: %llu own packets, %llu stolen packets, %u%% busy, %u queued in %u flows\n"),
+			i, stats.nrLocal, stats.nrStolen, stats.dwUtilization, stats.nrQueued, stats.nrActiveFlows);
+	}
+}
+
+VOID printUserShare(LPUserShareT share, LPVOID context)
+{
+	_tprintf(_T("user %s: weight %u, %u clients, %u queued packets, %ld of %ld quota bytes used\n"),
+		share->sUserName, share->dwWeight, share->nrConnections,
+		(share->flow != NULL) ? getFlowQueued(share->flow) : 0,
+		(long)ReadAcquire(&share->quota.cbUsed), (long)share->quota.cbLimit);
+}
+
+/*
+ * Prints the weight and the load of every user that has a share.
+ */
+VOID listShares()
+{
+	visitUserShares(gUserShares, printUserShare, NULL);
+}
+
+/*
+ * Prints the packet allocator and key cache statistics, a long running server should stay flat.
+ */
+VOID listMemory()
+{
+	PacketPoolStatsT stats;
+	LPSlabStatsT slab;
+	KeyCacheStatsT keyStats;
+	LoggerStatsT logStats;
+	AccountingStatsT accountingStats;
+
+	getPacketPoolStats(gPacketPool, &stats);
+	for (DWORD i = 0; i <= PACKET_SIZE_CLASSES; i++) {
+		slab = (i == 0) ? &stats.descriptors : &stats.payloads[i - 1];
+		_tprintf(_T("%s %u bytes: %u slabs, %llu objects, %llu live, %llu peak, %llu cache hits, %llu cache misses\n"),
+			(i == 0) ? _T("descriptors") : _T("payloads"), slab->cbObject, slab->nrSlabs, slab->nrObjects,
+			slab->nrLive, slab->nrPeak, slab->nrCacheHits, slab->nrCacheMisses);
+	}
+
+	getKeyCacheStats(gKeyCache, &keyStats);
+	_tprintf(_T("key schedules: %u cached, %u idle, %llu hits, %llu misses, %llu evictions\n"),
+		keyStats.nrSchedules, keyStats.nrIdle, keyStats.nrHits, keyStats.nrMisses, keyStats.nrEvictions);
+
+	getLoggerStats(gLogger, &logStats);
+	_tprintf(_T("log rings: %u rings of %u records, %llu written, %llu dropped, %llu rotations\n"),
+		logStats.nrRings, LOG_RING_RECORDS, logStats.nrWritten, logStats.nrDropped, logStats.nrRotations);
+
+	getAccountingStats(gAccounting, &accountingStats);
+	_tprintf(_T("accounting: %llu commits, %llu records, %llu snapshots, %llu failures, last sequence %llu\n"),
+		accountingStats.nrCommits, accountingStats.nrRecords, accountingStats.nrSnapshots, accountingStats.nrFailures,
+		accountingStats.qwLastSequence);
+}
+
+/*
+ * @return the packets waiting in the queues of the workers.
+ */
+DWORD getQueuedPackets()
+{
+	WorkerStatsT stats;
+	DWORD nrQueued = 0;
+
+	for (DWORD i = 0; i < getNrWorkers(gScheduler); i++) {
+		getWorkerStats(gScheduler, i, &stats);
+		nrQueued += stats.nrQueued;
+	}
+	return nrQueued;
+}
+
+INT getCurrentClients()
+{
+	INT nrClients;
+
+	EnterCriticalSection(&g_cs);
+	nrClients = nrCurrentClients;
+	LeaveCriticalSection(&g_cs);
+	return nrClients;
+}
+
+VOID printUserBytes(LPCredentialT credential, LPVOID context)
+{
+	_tprintf(_T("user %s: %llu bytes%s%s\n"), credential->sUserName,
+		(ULONGLONG)ReadAcquire64(&credential->qwBytesEncrypted), ReadAcquire(&credential->bConnected) ? _T(", connected") : _T(""),
+		ReadAcquire(&credential->bRemoved) ? _T(", removed") : _T(""));
+}
+
+/*
+ * Prints the throughput since the previous stats command, the latency percentiles and the bytes of every user.
+ * Only the command thread calls it.
+ */
+VOID listStats()
+{
+	// a snapshot is too large for the stack of the command thread on every platform
+	static MetricsSnapshotT snapshot;
+	static ULONGLONG lastCounters[NR_METRIC_COUNTERS];
+	static double dLastUptime = 0;
+	const ULONGLONG *counters = snapshot.counters;
+	double dElapsed;
+	TCHAR sValues[6][16];
+	CredentialStatsT credentialStats;
+	SessionStatsT sessionStats;
+
+	getMetricsSnapshot(&snapshot);
+	dElapsed = snapshot.dUptime - dLastUptime;
+
+	_tprintf(_T("uptime %.1f s, %d active clients, %u packets queued\n"),
+		snapshot.dUptime, getCurrentClients(), getQueuedPackets());
+	_tprintf(_T("connections: %llu, rejected: %llu busy, %llu auth, %llu invalid\n"), counters[METRIC_CONNECTIONS],
+		counters[METRIC_REJECTED_BUSY], counters[METRIC_REJECTED_AUTH], counters[METRIC_REJECTED_INVALID]);
+	_tprintf(_T("throughput over the last %.1f s: %.1f packets/s, %.2f MB/s; %llu packets, %llu bytes in total\n"), dElapsed,
+		(counters[METRIC_PACKETS] - lastCounters[METRIC_PACKETS]) / dElapsed,
+		(counters[METRIC_BYTES] - lastCounters[METRIC_BYTES]) / dElapsed / (1024 * 1024),
+		counters[METRIC_PACKETS], counters[METRIC_BYTES]);
+	if (counters[METRIC_CODEC_PLAIN_BYTES] != 0) {
+		_tprintf(_T("compression: %llu bytes stored as %llu (%.1f%%), %llu packets stored as they are\n"),
+			counters[METRIC_CODEC_PLAIN_BYTES], counters[METRIC_CODEC_STORED_BYTES],
+			100.0 * counters[METRIC_CODEC_STORED_BYTES] / counters[METRIC_CODEC_PLAIN_BYTES], counters[METRIC_CODEC_RAW_PACKETS]);
+	}
+
+	for (DWORD i = 0; i < NR_METRIC_HISTOGRAMS; i++) {
+		const HistogramSnapshotT *histogram = &snapshot.histograms[i];
+
+		formatLatency((histogram->nrValues != 0) ? histogram->qwSumNs / histogram->nrValues : 0, sValues[0]);
+		formatLatency(getHistogramPercentile(histogram, 50), sValues[1]);
+		formatLatency(getHistogramPercentile(histogram, 90), sValues[2]);
+		formatLatency(getHistogramPercentile(histogram, 99), sValues[3]);
+		formatLatency(getHistogramPercentile(histogram, 99.9), sValues[4]);
+		formatLatency(getHistogramPercentile(histogram, 100), sValues[5]);
+		_tprintf(_T("%s: %llu packets, mean %s, p50 %s, p90 %s, p99 %s, p99.9 %s, max %s\n"),
+			getMetricHistogramName(i), histogram->nrValues,
+			sValues[0], sValues[1], sValues[2], sValues[3], sValues[4], sValues[5]);
+	}
+
+	getCredentialStats(gCredentialManager, &credentialStats);
+	_tprintf(_T("credentials: %u users, %u removed, %u slots; %llu reloads, last one in %.3f ms, %llu failed\n"),
+		credentialStats.nrCredentials, credentialStats.nrRemoved, credentialStats.nrSlots, credentialStats.nrReloads,
+		credentialStats.qwLastReloadUs / 1000.0, credentialStats.nrReloadFailures);
+	if (gSessions != NULL) {
+		getSessionStats(gSessions, &sessionStats);
+		_tprintf(_T("sessions: %u attached, %u detached; %llu opened, %llu resumed, %llu rejected, %llu expired\n"),
+			sessionStats.nrAttached, sessionStats.nrDetached, sessionStats.nrOpened, sessionStats.nrResumed,
+			sessionStats.nrRejected, sessionStats.nrExpired);
+	}
+	visitCredentials(gCredentialManager, printUserBytes, NULL);
+
+	memcpy(lastCounters, counters, sizeof(lastCounters));
+	dLastUptime = snapshot.dUptime;
+}
+
+/*
+ * Appends a user's byte counter, the name is escaped as a Prometheus label value.
+ */
+VOID appendUserMetrics(LPCredentialT credential, LPVOID context)
+{
+	LPMetricsTextT text = (LPMetricsTextT)context;
+
+	appendMetricsText(text, _T("encsrv_user_bytes_total{user=\""));
+	for (PTCHAR p = credential->sUserName; *p != '\0'; p++) {
+		if (*p == '\\' || *p == '"') {
+			appendMetricsText(text, _T("\\%c"), *p);
+		} else if (*p == '\n') {
+			appendMetricsText(text, _T("\\n"));
+		} else {
+			appendMetricsText(text, _T("%c"), *p);
+		}
+	}
+	appendMetricsText(text, _T("\"} %llu\n"), (ULONGLONG)ReadAcquire64(&credential->qwBytesEncrypted));
+}
+
+/*
+ * Reads a request from a metrics connection: an HTTP request up to its empty line, or any other line.
+ *
+ * @return FALSE if the connection failed before the request was complete.
+ */
+BOOL readMetricsRequest(LPConnectionT connection, BOOL *pbHttp)
+{
+	CHAR request[METRICS_REQUEST_SIZE];
+	DWORD cchRequest = 0;
+
+	*pbHttp = FALSE;
+	while (cchRequest < METRICS_REQUEST_SIZE) {
+		if (!transportRead(connection, &request[cchRequest], 1)) {
+			return FALSE;
+		}
+		cchRequest++;
+		if (cchRequest == 4) {
+			*pbHttp = memcmp(request, "GET ", 4) == 0;
+		}
+		if (request[cchRequest - 1] != '\n') {
+			continue;
+		}
+		if (!*pbHttp) {
+			return TRUE;
+		}
+		if ((cchRequest >= 2 && request[cchRequest - 2] == '\n') ||
+			(cchRequest >= 3 && request[cchRequest - 2] == '\r' && request[cchRequest - 3] == '\n')) {
+			return TRUE;
+		}
+	}
+	// an overly long request still gets the metrics
+	return TRUE;
+}
+
+/*
+ * Closes the connection of the metrics thread once stopServer cannot interrupt it anymore.
+ */
+VOID closeMetricsConnection(LPConnectionT connection)
+{
+	EnterCriticalSection(&g_cs);
+	gMetricsConnection = NULL;
+	LeaveCriticalSection(&g_cs);
+	closeConnection(connection);
+}
+
+/*
+ * Function of the metrics thread, serves one scraper at a time on the metrics= address,
+ * a socket connection gets METRICS_TIMEOUT_MS for every read and write.
+ * Every request gets the counters and histograms of Metrics.h, the client gauges and the bytes of every user.
+ * It keeps serving while the clients are drained, stopServer ends it last.
  */
-VOID encryptData(PTCHAR buff, DWORD dwBuffLen, PTCHAR key, DWORD dwKeyLen)
+DWORD WINAPI metricsThread(LPVOID arg)
 {
-	DWORD i;
-	DWORD dwKeyIndex;
+	// a snapshot is too large for the stack of a thread on every platform
+	static MetricsSnapshotT snapshot;
+	LPConnectionT connection;
+	MetricsTextT text;
+	CHAR sHeader[256];
+	BOOL bHttp;
+	CredentialStatsT credentialStats;
+	SessionStatsT sessionStats;
 
-	for(i = 0; i < dwBuffLen; i++) {
-		dwKeyIndex = i % dwKeyLen;
-		buff[i] ^= key[dwKeyIndex];
+	while (true) {
+		connection = acceptConnection(gMetricsListener);
+		if (connection == NULL) {
+			logEvent(LOG_WARNING, FALSE, _T("Could not accept metrics connection!"));
+			continue;
+		}
+		// checked under the lock stopServer interrupts the connection with, so the stop is not missed
+		EnterCriticalSection(&g_cs);
+		if (ReadAcquire(&bMetricsStopping)) {
+			LeaveCriticalSection(&g_cs);
+			closeConnection(connection);
+			break;
+		}
+		gMetricsConnection = connection;
+		LeaveCriticalSection(&g_cs);
+
+		// a named pipe cannot time out, it is only cut when the server stops
+		setConnectionTimeout(connection, METRICS_TIMEOUT_MS);
+		if (!readMetricsRequest(connection, &bHttp)) {
+			closeMetricsConnection(connection);
+			continue;
+		}
+
+		memset(&text, 0, sizeof(MetricsTextT));
+		getMetricsSnapshot(&snapshot);
+		appendPrometheusMetrics(&text, &snapshot);
+		appendMetricsText(&text, _T("# HELP encsrv_active_clients Clients streaming packets.\n"));
+		appendMetricsText(&text, _T("# TYPE encsrv_active_clients gauge\n"));
+		appendMetricsText(&text, _T("encsrv_active_clients %d\n"), getCurrentClients());
+		appendMetricsText(&text, _T("# HELP encsrv_queued_packets Packets waiting in the queues of the workers.\n"));
+		appendMetricsText(&text, _T("# TYPE encsrv_queued_packets gauge\n"));
+		appendMetricsText(&text, _T("encsrv_queued_packets %u\n"), getQueuedPackets());
+		getCredentialStats(gCredentialManager, &credentialStats);
+		appendMetricsText(&text, _T("# HELP encsrv_credentials Users of the credential table, removed ones are kept for their counters.\n"));
+		appendMetricsText(&text, _T("# TYPE encsrv_credentials gauge\n"));
+		appendMetricsText(&text, _T("encsrv_credentials{state=\"active\"} %u\n"), credentialStats.nrCredentials);
+		appendMetricsText(&text, _T("encsrv_credentials{state=\"removed\"} %u\n"), credentialStats.nrRemoved);
+		appendMetricsText(&text, _T("# HELP encsrv_credential_slots Slots of the credential table.\n"));
+		appendMetricsText(&text, _T("# TYPE encsrv_credential_slots gauge\n"));
+		appendMetricsText(&text, _T("encsrv_credential_slots %u\n"), credentialStats.nrSlots);
+		appendMetricsText(&text, _T("# HELP encsrv_credential_reloads_total Reloads of the credential file.\n"));
+		appendMetricsText(&text, _T("# TYPE encsrv_credential_reloads_total counter\n"));
+		appendMetricsText(&text, _T("encsrv_credential_reloads_total{result=\"ok\"} %llu\n"), credentialStats.nrReloads);
+		appendMetricsText(&text, _T("encsrv_credential_reloads_total{result=\"failed\"} %llu\n"), credentialStats.nrReloadFailures);
+		appendMetricsText(&text, _T("# HELP encsrv_credential_reload_seconds Duration of the last reload of the credential file.\n"));
+		appendMetricsText(&text, _T("# TYPE encsrv_credential_reload_seconds gauge\n"));
+		appendMetricsText(&text, _T("encsrv_credential_reload_seconds %.6f\n"), credentialStats.qwLastReloadUs / 1000000.0);
+		if (gSessions != NULL) {
+			getSessionStats(gSessions, &sessionStats);
+			appendMetricsText(&text, _T("# HELP encsrv_sessions Sessions of resumable clients, detached ones wait for their client to reconnect.\n"));
+			appendMetricsText(&text, _T("# TYPE encsrv_sessions gauge\n"));
+			appendMetricsText(&text, _T("encsrv_sessions{state=\"attached\"} %u\n"), sessionStats.nrAttached);
+			appendMetricsText(&text, _T("encsrv_sessions{state=\"detached\"} %u\n"), sessionStats.nrDetached);
+			appendMetricsText(&text, _T("# HELP encsrv_session_resumes_total Attempts of clients to resume a session.\n"));
+			appendMetricsText(&text, _T("# TYPE encsrv_session_resumes_total counter\n"));
+			appendMetricsText(&text, _T("encsrv_session_resumes_total{result=\"ok\"} %llu\n"), sessionStats.nrResumed);
+			appendMetricsText(&text, _T("encsrv_session_resumes_total{result=\"rejected\"} %llu\n"), sessionStats.nrRejected);
+		}
+		appendMetricsText(&text, _T("# HELP encsrv_user_bytes_total Payload bytes encrypted for each user.\n"));
+		appendMetricsText(&text, _T("# TYPE encsrv_user_bytes_total counter\n"));
+		visitCredentials(gCredentialManager, appendUserMetrics, &text);
+
+		if (text.bFailed) {
+			logEvent(LOG_ERROR, FALSE, _T("could not allocate memory for the metrics"));
+		} else {
+			// the server is built without UNICODE, the text is sent as it is
+			if (bHttp) {
+				sprintf(sHeader, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+					"Content-Length: %u\r\nConnection: close\r\n\r\n", text.cchUsed * (DWORD)sizeof(TCHAR));
+			} else {
+				sHeader[0] = '\0';
+			}
+			if (!transportWrite(connection, sHeader, (DWORD)strlen(sHeader)) ||
+				!transportWrite(connection, text.sText, text.cchUsed * sizeof(TCHAR))) {
+				logEvent(LOG_DEBUG, FALSE, _T("metrics connection closed before the metrics were sent"));
+			}
+		}
+		free(text.sText);
+		closeMetricsConnection(connection);
 	}
+
+	releaseLogRing();
+	return 0;
 }
 
 /*
- * Function of worker threads.
- * Gets packet info from gQueue and ecrypts it.
- * When the packet is encrypted, the thread requesting the encryption will be signaled.
+ * Wakes the thread blocked in acceptConnection on the listener with a connection of our own.
  */
-DWORD WINAPI workerThread(LPVOID arg)
+VOID wakeAcceptingThread(LPListenerT listener)
 {
-	LPEncryptDataT encData;
-
-	while(true) {
-		popSyncQueue(gQueue, &encData);
-		encryptData(encData->toBeEncrypted, encData->dwBuffLen,
-			encData->encryptionKey, encData->dwKeyLen);
-
-		EnterCriticalSection(encData->pCriticalSection);
+	LPConnectionT connection = connectTransport(getListenerAddress(listener));
 
-		encData->dwStatus = DATA_ENCRYPTED;
-		
-		LeaveCriticalSection(encData->pCriticalSection);
-		WakeConditionVariable(encData->pConditionVariable);
+	if (connection == NULL) {
+		logEvent(LOG_WARNING, FALSE, _T("could not wake the thread accepting on %s, it stops at its next client"),
+			getListenerAddress(listener));
+		return;
 	}
+	closeConnection(connection);
 }
 
 /*
- *Function of client threads.
- *Gets packet from the pipe and puts it in the gQueue.
- *Once the thread this thread has been signaled that the encryption is done the ecrypted packets will be sent back to the client though the pipe.
-*/
-DWORD WINAPI serveClient(LPClientThreadT clientThreadArg)
+ * Reloads the cred file, the connected clients keep streaming and the logins meanwhile keep working.
+ * Called by the credential watcher and the reload command, the reloads run one at a time.
+ */
+VOID reloadCredentials()
 {
-	TCHAR buff[BUFFSIZE];
-	DWORD cbPacketSize;
-	DWORD dwKeyLen = _tcslen(clientThreadArg->sEncryptionKey);
-	CONDITION_VARIABLE conditionVariable;
-	CRITICAL_SECTION criticalSection;
-	DWORD cbTotalEncrypted = 0;
-	BOOL bSuccess;
-	DWORD dwIndex = 0;
-	DWORD dwEcryptArraySize = 1024;
-	DWORD dwResponse;
-	DWORD cbWritten;
-
-	InitializeCriticalSection(&criticalSection);
-	InitializeConditionVariable(&conditionVariable);
-
-	HANDLE hHeap = HeapCreate(
-		0, //default options
-		0, // default initial size: one page
-		0 // default max size (allows increase of heap)
-	);
+	CredentialStatsT stats;
 
-	if (hHeap == NULL) {
-		return 1;
+	if (!reloadCredentialsFromFile(gCredentialManager, sCredFile)) {
+		logEvent(LOG_ERROR, TRUE, _T("Could not reload the cred file \"%s\", the old credentials are kept!"), sCredFile);
+		return;
 	}
+	getCredentialStats(gCredentialManager, &stats);
+	logEvent(LOG_INFO, TRUE, _T("cred file reloaded in %.3f ms: %u users, %u removed, %u slots"),
+		stats.qwLastReloadUs / 1000.0, stats.nrCredentials, stats.nrRemoved, stats.nrSlots);
+	if (stats.nrPlainPasswords != 0) {
+		logEvent(LOG_WARNING, TRUE, _T("%u of %u passwords are stored in plain text, replace them with the output of hashpass="),
+			stats.nrPlainPasswords, stats.nrCredentials);
+	}
+}
 
-	LPEncryptDataT* lplpEncryptDataT = (LPEncryptDataT*)HeapAlloc(
-		hHeap,
-		0,
-		sizeof(LPEncryptDataT) * dwEcryptArraySize);
-
-	while (true) {
-		bSuccess = getNextPacket(clientThreadArg->hPipe, buff, &cbPacketSize);
-
-		if (!bSuccess) {
-			return 2;
-		}
+static BOOL getCredFileVersion(WIN32_FILE_ATTRIBUTE_DATA *version)
+{
+	if (!GetFileAttributesEx(sCredFile, GetFileExInfoStandard, version)) {
+		memset(version, 0, sizeof(WIN32_FILE_ATTRIBUTE_DATA));
+		return FALSE;
+	}
+	return TRUE;
+}
 
-		if (cbPacketSize == 0) {
-			//we got all the packets
+/*
+ * Function of the credential watcher, reloads the cred file once its modification time or size changed.
+ * A file that cannot be read is retried once it changes again.
+ */
+DWORD WINAPI credentialWatcherThread(LPVOID arg)
+{
+	WIN32_FILE_ATTRIBUTE_DATA loaded;
+	WIN32_FILE_ATTRIBUTE_DATA current;
+	LONG bStop = FALSE;
+
+	getCredFileVersion(&loaded);
+	while (!ReadAcquire(&bWatcherStopping)) {
+		WaitOnAddress(&bWatcherStopping, &bStop, sizeof(LONG), dwCredPollSeconds * 1000);
+		if (ReadAcquire(&bWatcherStopping)) {
 			break;
 		}
 
-		LPEncryptDataT encryptDataField = create_EcryptData(
-			hHeap,
-			buff,
-			cbPacketSize,
-			clientThreadArg->sEncryptionKey,
-			dwKeyLen,
-			&criticalSection,
-			&conditionVariable
-		);
-
-		pushSyncQueue(gQueue, encryptDataField);
-		dwIndex++;
-
-		if (dwIndex - 1 >= dwEcryptArraySize) {
-			//resize the array
-			dwEcryptArraySize *= 2;
-			_tprintf(_T("realloc\n"));
-
-			/*
-			 * WARNING: for reasons beyond my comprehension this code crashes for large files
-			 * the debugger said the heap is corrupted. I can't find the source of the problem. nr_hours_wasted_here=2;
-			 * Please increment the counter, if you cannot solve the problem either.
-			 */
-			LPEncryptDataT* aux = (LPEncryptDataT*)HeapReAlloc(
-				hHeap,
-				0,
-				lplpEncryptDataT,
-				dwEcryptArraySize * sizeof(LPEncryptDataT)
-			);
-
-			lplpEncryptDataT = aux;
+		getCredFileVersion(&current);
+		if (memcmp(&current.ftLastWriteTime, &loaded.ftLastWriteTime, sizeof(FILETIME)) == 0 &&
+			current.nFileSizeLow == loaded.nFileSizeLow && current.nFileSizeHigh == loaded.nFileSizeHigh) {
+			continue;
 		}
-
-		//save encryptDAtafield
-		lplpEncryptDataT[dwIndex] = encryptDataField;
+		loaded = current;
+		logEvent(LOG_INFO, FALSE, _T("the cred file changed, reloading it"));
+		reloadCredentials();
 	}
 
-	_tprintf(_T("last packet got\n"));
-	for(DWORD i = 0; i < dwIndex; i++) {
-		EnterCriticalSection(&criticalSection);
-		LPEncryptDataT lpEncryptData = lplpEncryptDataT[i];
-
-		_tprintf(_T("waiting packet encryption\n"));
-		while (lpEncryptData->dwStatus != DATA_ENCRYPTED) {
-			SleepConditionVariableCS(&conditionVariable, &criticalSection, INFINITE);
-		}
-		LeaveCriticalSection(&criticalSection);
-		_tprintf(_T("packet encrypted\n"));
-
-		bSuccess = sendPacket(clientThreadArg->hPipe, lpEncryptData->toBeEncrypted, lpEncryptData->dwBuffLen);
-		if (!bSuccess) {
-			break;
-		}
-		_tprintf(_T("packet sent\n"));
-		cbTotalEncrypted += lpEncryptData->dwBuffLen;
+	releaseLogRing();
+	return 0;
+}
 
-		//free_EncryptData(hHeap, lpEncryptData);
+/*
+ * Stops accepting clients, the accepting thread leaves its loop and stops the server (see stopServer).
+ * It may be called from any thread and more than once.
+ */
+VOID requestShutdown()
+{
+	if (InterlockedCompareExchange(&bStopping, TRUE, FALSE) != FALSE) {
+		_tprintf(_T("the server is already stopping\n"));
+		return;
 	}
-	dwResponse = (bSuccess) ? LAST_PACKET : TERMINATE_CONNECTION;
-
-	WriteFile(
-		clientThreadArg->hPipe,
-		&dwResponse,
-		sizeof(DWORD),
-		&cbWritten,
-		NULL
-	);
-	_tprintf(_T("last encrypted packet sent\n"));
 
-	//HeapFree(hHeap, 0, lplpEncryptDataT);
+	// clients still in their handshake are turned away as when the server is full
+	EnterCriticalSection(&g_cs);
+	nrMaxClients = 0;
+	LeaveCriticalSection(&g_cs);
 
-	//connection terminated
-	CloseHandle(clientThreadArg->hPipe);
+	logEvent(LOG_INFO, TRUE, _T("no more clients are accepted, the connected ones get %u s to finish"), dwDrainSeconds);
+	wakeAcceptingThread(gListener);
+}
 
-	EnterCriticalSection(&gcsCredentialManger);
-	addBytesToClientAndDisconnect(gCredentialManager, clientThreadArg->clientName, cbTotalEncrypted);
-	LeaveCriticalSection(&gcsCredentialManger);
+#ifdef _WIN32
+BOOL WINAPI consoleHandler(DWORD dwCtrlType)
+{
+	requestShutdown();
+	return TRUE;
+}
+#else
+static sigset_t stopSignals;
 
-	EnterCriticalSection(&g_cs);
-	nrCurrentClients--;
-	LeaveCriticalSection(&g_cs);
+/*
+ * SIGTERM and SIGINT are blocked in every thread (see blockStopSignals) and taken here,
+ * so they stop the server gracefully.
+ */
+DWORD WINAPI signalThread(LPVOID arg)
+{
+	sigset_t *signals = (sigset_t*)arg;
+	INT signal;
 
+	while (sigwait(signals, &signal) == 0) {
+		logEvent(LOG_INFO, FALSE, _T("got signal %d"), signal);
+		requestShutdown();
+	}
 	return 0;
 }
+#endif
 
+/*
+ * Blocks SIGTERM and SIGINT in the calling thread, and so in the threads it creates afterwards,
+ * call it before the first thread is created.
+ */
+VOID blockStopSignals()
+{
+#ifndef _WIN32
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGTERM);
+	sigaddset(&stopSignals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+#endif
+}
 
 /*
- * Initializes connection with the client on the pipe.
- * Initialization parameters are saved in init.
+ * Lets SIGTERM, SIGINT or Ctrl+C stop the server like the exit command.
+ * The signals received since blockStopSignals stay pending until then.
  */
-BOOL initializeConnection(HANDLE hPipe, LPInitT init)
+VOID handleStopSignals()
 {
-	BOOL bSuccess;
-	BOOL bAccepted;
-	DWORD cbRead;
-	DWORD dwInitMessage;
-	DWORD cbBytesWritten;
+#ifdef _WIN32
+	if (!SetConsoleCtrlHandler(consoleHandler, TRUE)) {
+		logEvent(LOG_WARNING, TRUE, _T("could not set the console handler, stop the server with the exit command"));
+	}
+#else
+	HANDLE hThread = (HANDLE)_beginthreadex(NULL, 0, (_beginthreadex_proc_type)signalThread, &stopSignals, 0, NULL);
+	if (hThread == NULL) {
+		logEvent(LOG_ERROR, TRUE, _T("could not create signal thread!"));
+		exit(5);
+	}
+	CloseHandle(hThread);
+#endif
+}
 
-	bSuccess = ReadFile(
-		hPipe,
-		init,
-		sizeof(InitT),
-		&cbRead,
-		NULL);
+/*
+ * Joins the client threads that returned and frees their records.
+ *
+ * @return the number of client threads still running.
+ */
+DWORD reapClientThreads()
+{
+	LPClientThreadT *link = &gClientThreads;
+	LPClientThreadT client;
+	DWORD nrRunning = 0;
 
-	if (!bSuccess) {
-		return FALSE;
+	EnterCriticalSection(&g_cs);
+	while (*link != NULL) {
+		client = *link;
+		if (!ReadAcquire(&client->bFinished)) {
+			nrRunning++;
+			link = &client->next;
+			continue;
+		}
+		*link = client->next;
+		// the thread does not touch g_cs after setting bFinished, it is returning
+		WaitForSingleObject(client->hThread, INFINITE);
+		CloseHandle(client->hThread);
+		free(client->clientName);
+		free(client);
 	}
+	LeaveCriticalSection(&g_cs);
 
-	if (init->command != INITIALIZE_CONNECTION) {
-		return FALSE;
-	}
+	return nrRunning;
+}
+
+/*
+ * Fails the reads and writes of the client threads still blocked on their connections.
+ */
+VOID interruptClientConnections()
+{
 	EnterCriticalSection(&g_cs);
-	bAccepted = nrCurrentClients < nrMaxClients;
-	if (bAccepted) {
-		_stprintf(logBuffer, _T("Connection accepted, current nr_clients: %d"), nrCurrentClients);
-	} else {
-		_stprintf(logBuffer, _T("Connection not accepted, due to high number of clients"));
+	for (LPClientThreadT client = gClientThreads; client != NULL; client = client->next) {
+		if (client->connection != NULL) {
+			interruptConnection(client->connection);
+		}
 	}
-	log(logBuffer, FALSE);
 	LeaveCriticalSection(&g_cs);
+}
 
-	dwInitMessage = (bAccepted) ? CONNECTION_ACCEPTED : CONNECTION_REJECTED;
-	bSuccess = WriteFile(
-		hPipe,
-		&dwInitMessage,
-		sizeof(DWORD),
-		&cbBytesWritten,
-		NULL);
-
-	return bSuccess && bAccepted;
+/*
+ * @return the clients still connected, in either mode.
+ */
+DWORD getConnectedClients()
+{
+	return (nrIoThreads > 0) ? getReactorConnections(gReactor) : reapClientThreads();
 }
 
 /*
- * Authenticates a client through hPipe.
- * For auth a CredentialManager is used.
+ * Waits up to dwTimeoutMs for the clients to be gone.
+ *
+ * @return the clients still connected.
  */
-BOOL authenticateClient(HANDLE hPipe, LPInitT init, LPCredentialManagerT manager, PTCHAR *sUserName)
+DWORD waitForClients(DWORD dwTimeoutMs)
 {
-	BOOL bSuccess;
-	DWORD dwResponse;
-	DWORD cbWrittenOrRead;
-	BOOL auth;
+	DWORD nrClients = getConnectedClients();
 
-	*sUserName = (PTCHAR)malloc(init->cbUsernameNrBytes + sizeof(TCHAR));
-	PTCHAR sPassword = (PTCHAR)malloc(init->cbPasswordNrBytes + sizeof(TCHAR));
-	if (*sUserName == NULL || sPassword == NULL) {
-		return FALSE;
+	for (DWORD dwWaited = 0; nrClients != 0 && dwWaited < dwTimeoutMs; dwWaited += DRAIN_POLL_MS) {
+		Sleep(DRAIN_POLL_MS);
+		nrClients = getConnectedClients();
 	}
+	return nrClients;
+}
 
-	(*sUserName)[init->cbUsernameNrBytes/sizeof(TCHAR)] = '\0';
-	sPassword[init->cbPasswordNrBytes/sizeof(TCHAR)] = '\0';
+VOID logUserBytes(LPCredentialT credential, LPVOID context)
+{
+	logEvent(LOG_INFO, FALSE, _T("user %s: %llu bytes encrypted"), credential->sUserName,
+		(ULONGLONG)ReadAcquire64(&credential->qwBytesEncrypted));
+}
 
-	bSuccess = ReadFile(
-		hPipe,
-		*sUserName,
-		init->cbUsernameNrBytes,
-		&cbWrittenOrRead,
-		NULL
-	);
+/*
+ * Stops the server once the accepting thread left its loop.
+ * The clients get dwDrainSeconds to finish their files, the streams still running afterwards
+ * stop reading and end with TERMINATE_CONNECTION, so no client takes a cut file for a complete one.
+ * Then the workers take their poison pill, every thread is joined,
+ * and the accounting journal, the bytes of every user and the log are written.
+ */
+VOID stopServer()
+{
+	DWORD nrClients = waitForClients(dwDrainSeconds * 1000);
 
-	if (!bSuccess) {
-		return FALSE;
+	if (nrClients != 0) {
+		logEvent(LOG_WARNING, TRUE, _T("%u clients did not finish in %u s, their streams are aborted"), nrClients, dwDrainSeconds);
 	}
-	
-	bSuccess = ReadFile(
-		hPipe,
-		sPassword,
-		init->cbPasswordNrBytes,
-		&cbWrittenOrRead,
-		NULL
-	);
 
-	if (!bSuccess) {
-		return FALSE;
+	if (nrIoThreads > 0) {
+		destroyReactor(gReactor, ABORT_GRACE_MS);
+	} else {
+		WriteRelease(&bAbortStreams, TRUE);
+		// an idle client leaves its thread blocked in a read
+		if (waitForClients(ABORT_GRACE_MS) != 0) {
+			interruptClientConnections();
+			while (reapClientThreads() != 0) {
+				Sleep(DRAIN_POLL_MS);
+			}
+		}
 	}
 
-	LPCredentialT credential = create_CredentialT(*sUserName, sPassword);
-	auth = checkClientCredentials(manager, credential);
-
-	free(credential);
-	free(sPassword);
-
-	dwResponse = (auth) ? AUTH_SUCCESSFUL : AUTH_REJECTED;
-
-	bSuccess = WriteFile(
-		hPipe,
-		&dwResponse,
-		sizeof(DWORD),
-		&cbWrittenOrRead,
-		NULL
-	);
-
-	if (!bSuccess) {
-		return FALSE;
+	// no packet is submitted anymore, the workers finish the queued ones and stop
+	stopWorkScheduler(gScheduler);
+	for (INT i = 0; i < nrWorkers; i++) {
+		WaitForSingleObject(gpWorkerThreads[i], INFINITE);
+		CloseHandle(gpWorkerThreads[i]);
 	}
+	free(gpWorkerThreads);
 
-	return auth;
-}
+	if (hMetricsThread != NULL) {
+		// a scraper being served is cut, the thread then finds the stop at its next connection
+		EnterCriticalSection(&g_cs);
+		WriteRelease(&bMetricsStopping, TRUE);
+		if (gMetricsConnection != NULL) {
+			interruptConnection(gMetricsConnection);
+		}
+		LeaveCriticalSection(&g_cs);
+		wakeAcceptingThread(gMetricsListener);
+		WaitForSingleObject(hMetricsThread, INFINITE);
+		CloseHandle(hMetricsThread);
+		closeListener(gMetricsListener);
+	}
+	closeListener(gListener);
 
-/*
- * Returns the encryption key of the client.
- */
-PTCHAR getEncryptionKey(HANDLE hPipe, LPInitT init)
-{
-	BOOL bSuccess;
-	DWORD cbRead;
+	if (hWatcherThread != NULL) {
+		WriteRelease(&bWatcherStopping, TRUE);
+		WakeByAddressAll((LPVOID)&bWatcherStopping);
+		WaitForSingleObject(hWatcherThread, INFINITE);
+		CloseHandle(hWatcherThread);
+	}
 
-	PTCHAR sKey = (PTCHAR)malloc(init->cbKeyNrBytes + 1);
-	if (sKey == NULL) {
-		return NULL;
+	// no client holds a session anymore
+	if (gSessions != NULL) {
+		destroySessionStore(gSessions);
 	}
-	sKey[init->cbKeyNrBytes/sizeof(TCHAR)] = '\0';
-	bSuccess = ReadFile(
-		hPipe,
-		sKey,
-		init->cbKeyNrBytes,
-		&cbRead,
-		NULL
-	);
 
-	if (!bSuccess) {
-		return NULL;
+	if (!closeAccounting(gAccounting)) {
+		logEvent(LOG_ERROR, TRUE, _T("Could not write the last bytes to the accounting journal \"%s\"!"), sAccountingFile);
 	}
+	visitCredentials(gCredentialManager, logUserBytes, NULL);
+	destroyCredentialManager(gCredentialManager);
 
-	return sKey;
+	logEvent(LOG_INFO, TRUE, _T("server stopped"));
+	closeServerLog();
 }
 
 /*
@@ -444,46 +1690,41 @@ PTCHAR getEncryptionKey(HANDLE hPipe, LPInitT init)
  */
 DWORD WINAPI commandThread(LPVOID arg)
 {
-	DWORD max_clients;
 	TCHAR buff[BUFFSIZE];
 
-	_fgetts(buff, BUFFSIZE, stdin);
-
-	while (_tcscmp(buff, _T("exit\n")) != 0) {
-		if (_tcscmp(buff, _T("list\n")) == 0) {
+	while (_fgetts(buff, BUFFSIZE, stdin) != NULL) {
+		if (_tcscmp(buff, _T("exit\n")) == 0) {
+			// the commands keep working while the clients are drained
+			requestShutdown();
+		}else if (_tcscmp(buff, _T("list\n")) == 0) {
 			listCredentials(gCredentialManager);
+			listWorkers();
+		}else if(_tcscmp(buff, _T("memory\n")) == 0) {
+			listMemory();
+		}else if(_tcscmp(buff, _T("stats\n")) == 0) {
+			listStats();
+		}else if(_tcscmp(buff, _T("shares\n")) == 0) {
+			listShares();
+		}else if(_tcscmp(buff, _T("reload\n")) == 0) {
+			reloadCredentials();
 		}else if(_tcscmp(buff, _T("help\n")) == 0) {
 			_tprintf(_T("possible commands:\n"));
-			_tprintf(_T("list -- list information about clients\n"));
-			_tprintf(_T("exit -- gracefully ends the execution of the program\n"));
+			_tprintf(_T("list -- list information about clients and workers\n"));
+			_tprintf(_T("memory -- list the packet allocator, key cache and log statistics\n"));
+			_tprintf(_T("stats -- print the throughput since the last stats, the latency percentiles and the bytes of every user\n"));
+			_tprintf(_T("shares -- list the weight, clients and queued packets of every user\n"));
+			_tprintf(_T("reload -- read the cred file again, the connected clients are not stopped\n"));
+			_tprintf(_T("exit -- stops accepting clients, lets the connected ones finish and ends the program\n"));
 		}
 		else {
 			_tprintf(_T("invalid command -- check out our cool help function!\n"));
 		}
-		_fgetts(buff, BUFFSIZE, stdin);
-	}
-
-	EnterCriticalSection(&g_cs);
-	max_clients = nrMaxClients;
-	nrMaxClients = 0;
-	LeaveCriticalSection(&g_cs);
-
-	_tprintf(_T("no more clients are accepted!\n"));
-	_tprintf(_T("waiting for client threads to terminate\n"));
-	for(DWORD i = 0; i < max_clients; i++) {
-		if (gpClientThreads[i] != NULL) {
-			WaitForSingleObject(gpClientThreads[i], INFINITE);
-		}
 	}
 
-	free(sRealPipeName);
-	free(gCredentialManager);
-	free(gpClientThreads);
-	if (logFile != NULL) {
-		fclose(logFile);
-	}
-	_tprintf(_T("exiting..."));
-	ExitProcess(0);
+	// a server started without a console keeps running, it is stopped with a signal
+	logEvent(LOG_INFO, FALSE, _T("the standard input is closed, no more commands are read"));
+	releaseLogRing();
+	return 0;
 }
 
 
@@ -492,75 +1733,145 @@ DWORD WINAPI commandThread(LPVOID arg)
  */
 VOID initializeServer(INT argc, PTCHAR argv[])
 {
+	CredentialStatsT credentialStats;
+	AccountingStatsT accountingStats;
+
 	for (int i = 1; i < argc; i++) {
 		parseArgument(argv[i]);
 	}
 
-	gpClientThreads = (LPHANDLE)malloc(sizeof(HANDLE) * nrMaxClients);
-	if (gpClientThreads == NULL) {
-		_stprintf(logBuffer, _T("Could not allocate memory\n"));
-		log(logBuffer, TRUE);
-		exit(4);
+	if (sHashPassword != NULL) {
+		PasswordHashT passwordHash;
+		TCHAR sEncoded[PASSWORD_HASH_MAX_CHARS];
+
+		if (!hashPassword(sHashPassword, dwKdfLogCost, &passwordHash)) {
+			_tprintf(_T("could not hash the password\n"));
+			exit(4);
+		}
+		formatPasswordHash(&passwordHash, sEncoded);
+		_tprintf(_T("%s\n"), sEncoded);
+		exit(0);
 	}
 
-	logFile = _tfopen(sLoggingFile, _T("w"));
-	if (logFile == NULL) {
-		_stprintf(logBuffer, _T("could not open log file for writing"));
-		log(logBuffer, TRUE);
+	initMetrics();
+	// the log writer is the first thread
+	blockStopSignals();
+
+	gLogger = createLogger(sLoggingFile, dwLogLevel, (ULONGLONG)nrLogMegabytes * 1024 * 1024);
+	if (gLogger == NULL) {
+		logEvent(LOG_ERROR, TRUE, _T("could not open log file for writing"));
 		exit(5);
 	}
+	atexit(closeServerLog);
 
-	for (INT i = 0; i < nrMaxClients; i++) {
-		gpClientThreads[i] = NULL;
+	if (sListenAddress == NULL) {
+		sListenAddress = getDefaultListenAddress(sPipeName);
+		if (sListenAddress == NULL) {
+			logEvent(LOG_ERROR, TRUE, _T("Could not allocate memory\n"));
+			exit(4);
+		}
 	}
 
-	sRealPipeName = getRealPipeName(sPipeName);
+	gListener = createListener(sListenAddress);
+	if (gListener == NULL) {
+		logEvent(LOG_ERROR, TRUE, _T("Could not listen on \"%s\""), sListenAddress);
+		exit(1);
+	}
 
-	_stprintf(logBuffer, _T("Server started with parameters:"));
-	log(logBuffer, TRUE);
-	_stprintf(logBuffer, _T("pipe name: %s"), sPipeName);
-	log(logBuffer, TRUE);
-	if (logFile != NULL) {
-		_stprintf(logBuffer, _T("logging file: %s"), sLoggingFile);
-		log(logBuffer, TRUE);
-	}else {
-		_stprintf(logBuffer, _T("no logging file specified or the file could not be opened"));
-		log(logBuffer, TRUE);
+	logEvent(LOG_INFO, TRUE, _T("Server started with parameters:"));
+	logEvent(LOG_INFO, TRUE, _T("listening on: %s"), getListenerAddress(gListener));
+	if (sMetricsAddress != NULL) {
+		gMetricsListener = createListener(sMetricsAddress);
+		if (gMetricsListener == NULL) {
+			logEvent(LOG_ERROR, TRUE, _T("Could not serve the metrics on \"%s\""), sMetricsAddress);
+			exit(1);
+		}
+		logEvent(LOG_INFO, TRUE, _T("metrics on: %s"), getListenerAddress(gMetricsListener));
 	}
-	_stprintf(logBuffer, _T("max number of clients: %d"), nrMaxClients);
-	log(logBuffer, TRUE);
-	_stprintf(logBuffer, _T("number of worker_threads: %d"), nrWorkers);
-	log(logBuffer, TRUE);
-	_stprintf(logBuffer, _T("cred file: %s"), sCredFile);
-	log(logBuffer, TRUE);
+	logEvent(LOG_INFO, TRUE, _T("logging file: %s, level %s"), sLoggingFile, getLogLevelName(dwLogLevel));
+	logEvent(LOG_INFO, TRUE, _T("max number of clients: %d"), nrMaxClients);
+	logEvent(LOG_INFO, TRUE, _T("number of worker_threads: %d"), nrWorkers);
+	logEvent(LOG_INFO, TRUE, _T("cipher kernels: xor %s, chacha20 %s, aes-ctr %s"), getCipherKernelName(CIPHER_XOR),
+		getCipherKernelName(CIPHER_CHACHA20), getCipherKernelName(CIPHER_AES128_CTR));
+	if (nrIoThreads > 0) {
+		logEvent(LOG_INFO, TRUE, _T("number of io_threads: %d"), nrIoThreads);
+		if (!reactorSupported() || gListener->kind == TRANSPORT_PIPE) {
+			logEvent(LOG_ERROR, TRUE, _T("io_threads needs a unix or tcp socket on Linux"));
+			exit(1);
+		}
+	}
+	logEvent(LOG_INFO, TRUE, _T("cred file: %s"), sCredFile);
 
-	gCredentialManager = loadCredentialsFromFile(sCredFile);
+	gCredentialManager = loadCredentialsFromFile(sCredFile, dwKdfLogCost, nrCachedLogins);
 	if (gCredentialManager == NULL) {
-		_stprintf(logBuffer, _T("Could not load credentials!"));
-		log(logBuffer, TRUE);
+		logEvent(LOG_ERROR, TRUE, _T("Could not load credentials!"));
+		exit(1);
+	}
+	getCredentialStats(gCredentialManager, &credentialStats);
+	logEvent(LOG_INFO, TRUE, _T("logins: scrypt N=2^%u, %u cached"), dwKdfLogCost, nrCachedLogins);
+	if (credentialStats.nrPlainPasswords != 0) {
+		logEvent(LOG_WARNING, TRUE, _T("%u of %u passwords are stored in plain text, replace them with the output of hashpass="),
+			credentialStats.nrPlainPasswords, credentialStats.nrCredentials);
+	}
+
+	gAccounting = openAccounting(sAccountingFile, gCredentialManager);
+	if (gAccounting == NULL) {
+		logEvent(LOG_ERROR, TRUE, _T("Could not open the accounting journal \"%s\"!"), sAccountingFile);
 		exit(1);
 	}
+	getAccountingStats(gAccounting, &accountingStats);
+	logEvent(LOG_INFO, TRUE, _T("accounting journal: %s, %u records replayed"), sAccountingFile, accountingStats.nrReplayed);
+	if (accountingStats.cbTorn != 0) {
+		logEvent(LOG_WARNING, TRUE, _T("%u bytes of damaged or cut records were dropped from the end of the accounting journal"),
+			accountingStats.cbTorn);
+	}
 
-	gQueue = create_SyncCircQueueT(nrMaxClients);
-	if (gQueue == NULL) {
-		_stprintf(logBuffer, _T("Could not allocate memory!"));
-		log(logBuffer, TRUE);
+	if (dwSessionSeconds != 0) {
+		gSessions = createSessionStore(dwSessionSeconds);
+		if (gSessions == NULL) {
+			logEvent(LOG_ERROR, TRUE, _T("Could not allocate memory!"));
+			exit(6);
+		}
+	}
+	logEvent(LOG_INFO, TRUE, _T("session timeout: %u s"), dwSessionSeconds);
+	logEvent(LOG_INFO, TRUE, _T("compression: %s"), bCompression ? _T("lz4 before encryption, on request") : _T("off, decompression only"));
+
+	gScheduler = createWorkScheduler(nrWorkers);
+	if (gScheduler == NULL) {
+		logEvent(LOG_ERROR, TRUE, _T("Could not allocate memory!"));
+		exit(6);
+	}
+
+	gUserShares = loadUserShares(sWeightsFile, gScheduler, cbUserQuota);
+	if (gUserShares == NULL) {
+		logEvent(LOG_ERROR, TRUE, _T("Could not load the weights file \"%s\"!"), sWeightsFile);
+		exit(1);
+	}
+	logEvent(LOG_INFO, TRUE, _T("weights file: %s, user quota: %ld MB"), (sWeightsFile != NULL) ? sWeightsFile : _T("none"),
+		(long)(cbUserQuota / (1024 * 1024)));
+
+	gPacketPool = createPacketPool();
+	gKeyCache = createKeyCache(nrCachedKeys);
+	gpWorkerThreads = (LPHANDLE)malloc(sizeof(HANDLE) * nrWorkers);
+	if (gScheduler == NULL || gPacketPool == NULL || gKeyCache == NULL || gpWorkerThreads == NULL) {
+		logEvent(LOG_ERROR, TRUE, _T("Could not allocate memory!"));
 		exit(6);
 	}
 
+	InitializeCriticalSection(&g_cs);
+
 	for(INT i = 0; i < nrWorkers; i++) {
-		HANDLE hThread = (HANDLE)_beginthreadex(
+		gpWorkerThreads[i] = (HANDLE)_beginthreadex(
 			NULL,
 			0,
 			(_beginthreadex_proc_type)workerThread,
-			(void*)i,
+			(LPVOID)(uintptr_t)i,
 			0,
 			NULL
 		);
 
-		if (hThread == NULL) {
-			_stprintf(logBuffer, _T("could not create worker threads!"));
-			log(logBuffer, TRUE);
+		if (gpWorkerThreads[i] == NULL) {
+			logEvent(LOG_ERROR, TRUE, _T("could not create worker threads!"));
 			exit(5);
 		}
 	}
@@ -575,14 +1886,28 @@ VOID initializeServer(INT argc, PTCHAR argv[])
 	);
 
 	if (hThread == NULL) {
-		_stprintf(logBuffer, _T("could not create command thread!"));
-		log(logBuffer, TRUE);
+		logEvent(LOG_ERROR, TRUE, _T("could not create command thread!"));
 		exit(5);
 	}
 	CloseHandle(hThread);
 
-	InitializeCriticalSection(&g_cs);
-	InitializeCriticalSection(&gcsCredentialManger);
+	handleStopSignals();
+
+	if (dwCredPollSeconds != 0) {
+		hWatcherThread = (HANDLE)_beginthreadex(NULL, 0, (_beginthreadex_proc_type)credentialWatcherThread, NULL, 0, NULL);
+		if (hWatcherThread == NULL) {
+			logEvent(LOG_ERROR, TRUE, _T("could not create credential watcher thread!"));
+			exit(5);
+		}
+	}
+
+	if (gMetricsListener != NULL) {
+		hMetricsThread = (HANDLE)_beginthreadex(NULL, 0, (_beginthreadex_proc_type)metricsThread, NULL, 0, NULL);
+		if (hMetricsThread == NULL) {
+			logEvent(LOG_ERROR, TRUE, _T("could not create metrics thread!"));
+			exit(5);
+		}
+	}
 
 	HANDLE hPipeFile = CreateFile(
 		_T("pipe.txt"),
@@ -602,8 +1927,8 @@ VOID initializeServer(INT argc, PTCHAR argv[])
 	DWORD cbWritten;
 	BOOL bSuccess = WriteFile(
 		hPipeFile,
-		sRealPipeName,
-		_tcslen(sRealPipeName) * sizeof(TCHAR),
+		getListenerAddress(gListener),
+		_tcslen(getListenerAddress(gListener)) * sizeof(TCHAR),
 		&cbWritten,
 		NULL
 	);
@@ -617,50 +1942,51 @@ VOID initializeServer(INT argc, PTCHAR argv[])
 }
 
 /*
- * returns a pipe to a connected client.
+ * returns a connection to a connected client.
  */
-HANDLE getClientConnection(PTCHAR pipeName)
+LPConnectionT getClientConnection(LPListenerT listener)
 {
-	HANDLE hPipe;
-	BOOL bConnected;
+	LPConnectionT connection;
 
 	while(true) {
-		_stprintf(logBuffer, _T("Creating pipe"));
-		log(logBuffer, FALSE);
-
-		hPipe = CreateNamedPipe(
-			sRealPipeName,				//pipe name
-			PIPE_ACCESS_DUPLEX,			//pipe open mode, we need to write and to read
-			PIPE_TYPE_MESSAGE,			//message mode
-			PIPE_UNLIMITED_INSTANCES,	//unlimited instances (as system resources permit)
-			BUFFSIZE,					// size of output buffer
-			BUFFSIZE,					//size of input buffer
-			0,							// default time out of 50 milliseconds
-			NULL						//default security attributes
-		);
-		if (hPipe == INVALID_HANDLE_VALUE) {
-			_stprintf(logBuffer, _T("Could not create named pipe!"));
-			log(logBuffer, FALSE);
-			exit(1);
+		logEvent(LOG_DEBUG, FALSE, _T("waiting for client"));
+
+		connection = acceptConnection(listener);
+		if (connection != NULL) {
+			return connection;
 		}
 
-		_stprintf(logBuffer, _T("waiting for client"));
-		log(logBuffer, FALSE);
+		// the client could not connect
+		logEvent(LOG_WARNING, FALSE, _T("Could not accept client connection!"));
+	}
+}
 
-		if (ConnectNamedPipe(hPipe, NULL) != 0) {
-			bConnected = TRUE;
-		} else {
-			// an error may occour if the client is connected before the call of ConnectNamedPipe function
-			// if this is the case, then we can continue safely
-			bConnected = GetLastError() == ERROR_PIPE_CONNECTED;
-		}
+/*
+ * Accept loop of the reactor mode: connections are handed to the I/O threads,
+ * which run the whole protocol for them without a thread per client.
+ */
+VOID serveWithReactor()
+{
+	static const ReactorCallbacksT callbacks = {
+		admitClient, verifyClient, openClientSession, resumeClientSession, registerClient, packetsSent, unregisterClient
+	};
+	LPConnectionT connection;
+
+	gReactor = createReactor(nrIoThreads, gScheduler, gPacketPool, gKeyCache, cbClientQuota, &callbacks);
+	if (gReactor == NULL) {
+		logEvent(LOG_ERROR, TRUE, _T("could not create the reactor!"));
+		exit(6);
+	}
 
-		if (!bConnected) {
-			// the client could not connect
-			CloseHandle(hPipe);
+	while (true) {
+		connection = getClientConnection(gListener);
+		if (ReadAcquire(&bStopping)) {
+			closeConnection(connection);
+			break;
 		}
-		else {
-			return hPipe;
+		if (!addReactorConnection(gReactor, connection)) {
+			logEvent(LOG_ERROR, FALSE, _T("Could not hand the client to the reactor"));
+			closeConnection(connection);
 		}
 	}
 }
@@ -671,64 +1997,134 @@ HANDLE getClientConnection(PTCHAR pipeName)
  * Once a client has connected, the server will authenticate the client and get the encryption key from the client.
  * A separate thread is created for each of the authenticated clients, which will read the bytes to be encrypted, submit those bytes to encryption to the worker threads.
  * Once the bytes are ecrypted, they are sent back to client.
+ * With io_threads=<n> the clients are served by n epoll threads instead (see Reactor.h).
+ * The exit command, SIGTERM, SIGINT or Ctrl+C stop the server: no more clients are accepted,
+ * the connected ones get drain_timeout seconds to finish, then the server stops (see stopServer).
  */
 INT _tmain(INT argc, PTCHAR argv[])
 {
-	HANDLE hPipe;
+	LPConnectionT connection;
 	InitT init;
+	InitExT options;
+	CipherInitT cipherInit;
+	ResumeT resume;
 	HANDLE hThread;
-	DWORD dwThreadId = 0;
 	PTCHAR clientName;
+	LPCredentialT credential;
+	LPSessionT session;
+	ByteSpanT encryptionKey;
 
 	_CrtSetDbgFlag(_CRTDBG_CHECK_ALWAYS_DF);
 
 	initializeServer(argc, argv);
 
+	if (nrIoThreads > 0) {
+		serveWithReactor();
+		stopServer();
+		return 0;
+	}
+
 	while(true) {
 
-		hPipe = getClientConnection(sRealPipeName);
+		connection = getClientConnection(gListener);
+		if (ReadAcquire(&bStopping)) {
+			closeConnection(connection);
+			break;
+		}
 		//the client is connected
-		_stprintf(logBuffer, _T("Client connected to the pipe"));
-		log(logBuffer, FALSE);
+		logEvent(LOG_DEBUG, FALSE, _T("Client connected to the server"));
 
-		if (!initializeConnection(hPipe, &init)) {
-			_stprintf(logBuffer, _T("Could not initialize connection with client"));
-			log(logBuffer, FALSE);
-			CloseHandle(hPipe);
+		if (!initializeConnection(connection, &init, &options, &cipherInit, &resume)) {
+			logEvent(LOG_ERROR, FALSE, _T("Could not initialize connection with client"));
+			closeConnection(connection);
 			continue;
 		}
 
-		if (!authenticateClient(hPipe, &init, gCredentialManager, &clientName)) {
-			_stprintf(logBuffer, _T("Access denied for client"));
-			log(logBuffer, FALSE);
-			CloseHandle(hPipe);
+		if (init.command == RESUME_SESSION) {
+			if (!resumeClient(connection, &resume, &session)) {
+				closeConnection(connection);
+				continue;
+			}
+			clientName = _tcsdup(session->sUserName);
+			credential = session->credential;
+			if (clientName == NULL) {
+				logEvent(LOG_ERROR, FALSE, _T("could not allocate memory"));
+				closeSession(session, FALSE);
+				closeConnection(connection);
+				continue;
+			}
+			// the packets continue from the last one the client got back, with the key of the session
+			cipherInit.dwCipher = session->dwCipher;
+			memcpy(cipherInit.nonce, session->nonce, CIPHER_NONCE_SIZE);
+			cipherInit.qwFirstSequence = resume.qwSequence;
+			encryptionKey = session->key;
+		} else {
+			if (!authenticateClient(connection, &init, &options, &clientName, &credential, &session)) {
+				logEvent(LOG_WARNING, FALSE, _T("Access denied for client"));
+				closeConnection(connection);
+				continue;
+			}
+			logEvent(LOG_DEBUG, FALSE, _T("Client successfully authentificated"));
+
+			if (!getEncryptionKey(connection, &init, &encryptionKey)) {
+				logEvent(LOG_ERROR, FALSE, _T("Could not get encryption key"));
+				if (session != NULL) {
+					closeSession(session, TRUE);
+				}
+				free(clientName);
+				closeConnection(connection);
+				continue;
+			}
+			if (session != NULL && !startSession(session, &cipherInit, encryptionKey)) {
+				logEvent(LOG_WARNING, FALSE, _T("the session of client %s cannot be resumed, out of memory"), clientName);
+			}
+		}
+
+		// the cache keeps its own copy of the key
+		LPCipherContextT cipher = acquireCipherContext(gKeyCache, clientName, cipherInit.dwCipher, encryptionKey, cipherInit.nonce);
+		if (init.command != RESUME_SESSION) {
+			free(encryptionKey.pData);
+		}
+		if (cipher == NULL) {
+			logEvent(LOG_ERROR, FALSE, _T("Could not set up the %s cipher"), getCipherName(cipherInit.dwCipher));
+			if (session != NULL) {
+				closeSession(session, FALSE);
+			}
+			closeConnection(connection);
 			continue;
 		}
-		_stprintf(logBuffer, _T("Client successfully authentificated"));
-		log(logBuffer, FALSE);
 
-		PTCHAR sEncryptionKey = getEncryptionKey(hPipe, &init);
-		if (sEncryptionKey == NULL) {
-			_stprintf(logBuffer, _T("Could not get encryption key"));
-			log(logBuffer, FALSE);
-			CloseHandle(hPipe);
+		LPUserShareT share = registerClient(credential);
+		if (share == NULL) {
+			if (session != NULL) {
+				closeSession(session, FALSE);
+			}
+			destroyCipherContext(cipher);
+			free(clientName);
+			closeConnection(connection);
 			continue;
 		}
 
 		LPClientThreadT clientThreadArg = (LPClientThreadT)malloc(sizeof(ClientThreadT));
 		if (clientThreadArg == NULL) {
-			_stprintf(logBuffer, _T("could not allocate memory"));
-			log(logBuffer, FALSE);
+			logEvent(LOG_ERROR, FALSE, _T("could not allocate memory"));
 			exit(5);
 		}
 
-		clientThreadArg->hPipe = hPipe;
-		clientThreadArg->sEncryptionKey = sEncryptionKey;
+		clientThreadArg->connection = connection;
+		clientThreadArg->cipher = cipher;
+		clientThreadArg->qwFirstSequence = cipherInit.qwFirstSequence;
 		clientThreadArg->clientName = clientName;
-
+		clientThreadArg->credential = credential;
+		clientThreadArg->share = share;
+		clientThreadArg->session = session;
+		clientThreadArg->options = options;
+		initCodecState(&clientThreadArg->codec, &options);
+		clientThreadArg->bFinished = FALSE;
+
+		reapClientThreads();
 		EnterCriticalSection(&g_cs);
 
-		clientThreadArg->dwThreadId = dwThreadId;
 		hThread = (HANDLE)_beginthreadex(
 			NULL, //default security attr
 			0, //default stack
@@ -739,18 +2135,18 @@ INT _tmain(INT argc, PTCHAR argv[])
 		);
 
 		if (hThread == NULL) {
-			_stprintf(logBuffer, _T("Thread creation failed"));
-			log(logBuffer, FALSE);
+			logEvent(LOG_ERROR, FALSE, _T("Thread creation failed"));
 			exit(6);
 		}
-		gpClientThreads[dwThreadId] = hThread;
-		dwThreadId = (dwThreadId + 1) % nrMaxClients;
-
-		nrCurrentClients++;
+		clientThreadArg->hThread = hThread;
+		clientThreadArg->next = gClientThreads;
+		gClientThreads = clientThreadArg;
 		LeaveCriticalSection(&g_cs);
 
-		_stprintf(logBuffer, _T("Client thread has been created"));
-		log(logBuffer, FALSE);
+		logEvent(LOG_DEBUG, FALSE, _T("Client thread has been created"));
 	}
+
+	stopServer();
+	return 0;
 }
 
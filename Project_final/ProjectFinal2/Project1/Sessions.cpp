@@ -0,0 +1,219 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Sessions.h"
+
+typedef struct SessionStoreTag {
+	ULONGLONG qwTimeoutMs;
+	// guards the list, the attached flags and the statistics
+	CRITICAL_SECTION criticalSection;
+	LPSessionT first;
+	SessionStatsT stats;
+}SessionStoreT;
+
+/*
+ * Wipes the key and frees the session, it must not be in the list anymore.
+ */
+static VOID freeSession(LPSessionT session)
+{
+	if (session->key.pData != NULL) {
+		memset(session->key.pData, 0, session->key.cbData);
+		free(session->key.pData);
+	}
+	free(session->sUserName);
+	memset(session, 0, sizeof(SessionT));
+	free(session);
+}
+
+static VOID unlinkSession(LPSessionStoreT store, LPSessionT session)
+{
+	LPSessionT *link = &store->first;
+
+	while (*link != session) {
+		link = &(*link)->next;
+	}
+	*link = session->next;
+}
+
+/*
+ * Drops the detached sessions whose time is up. The lock of the store is held.
+ */
+static VOID expireSessions(LPSessionStoreT store)
+{
+	ULONGLONG qwNow = GetTickCount64();
+	LPSessionT *link = &store->first;
+	LPSessionT session;
+
+	while (*link != NULL) {
+		session = *link;
+		if (session->bAttached || session->qwExpires > qwNow) {
+			link = &session->next;
+			continue;
+		}
+		*link = session->next;
+		store->stats.nrDetached--;
+		store->stats.nrExpired++;
+		freeSession(session);
+	}
+}
+
+/*
+ * Compares every byte, so the time taken does not tell how much of a token was right.
+ */
+static BOOL matchToken(const BYTE *token, const BYTE *other)
+{
+	BYTE bDifference = 0;
+
+	for (DWORD i = 0; i < SESSION_TOKEN_SIZE; i++) {
+		bDifference |= token[i] ^ other[i];
+	}
+	return bDifference == 0;
+}
+
+LPSessionStoreT createSessionStore(DWORD dwTimeoutSeconds)
+{
+	LPSessionStoreT store = (LPSessionStoreT)calloc(1, sizeof(SessionStoreT));
+
+	if (store == NULL) {
+		return NULL;
+	}
+	store->qwTimeoutMs = (ULONGLONG)dwTimeoutSeconds * 1000;
+	InitializeCriticalSection(&store->criticalSection);
+	return store;
+}
+
+VOID destroySessionStore(LPSessionStoreT store)
+{
+	LPSessionT session;
+
+	while (store->first != NULL) {
+		session = store->first;
+		store->first = session->next;
+		freeSession(session);
+	}
+	DeleteCriticalSection(&store->criticalSection);
+	free(store);
+}
+
+LPSessionT openSession(LPSessionStoreT store, LPCredentialT credential)
+{
+	LPSessionT session = (LPSessionT)calloc(1, sizeof(SessionT));
+	UINT dwRandom;
+
+	if (session == NULL) {
+		return NULL;
+	}
+	session->sUserName = _tcsdup(credential->sUserName);
+	session->credential = credential;
+	if (session->sUserName == NULL) {
+		free(session);
+		return NULL;
+	}
+	for (DWORD i = 0; i < SESSION_TOKEN_SIZE; i += sizeof(UINT)) {
+		if (rand_s(&dwRandom) != 0) {
+			freeSession(session);
+			return NULL;
+		}
+		memcpy(session->token + i, &dwRandom, sizeof(UINT));
+	}
+	session->store = store;
+	session->bAttached = TRUE;
+
+	EnterCriticalSection(&store->criticalSection);
+	expireSessions(store);
+	session->next = store->first;
+	store->first = session;
+	store->stats.nrAttached++;
+	store->stats.nrOpened++;
+	LeaveCriticalSection(&store->criticalSection);
+
+	return session;
+}
+
+BOOL startSession(LPSessionT session, LPCipherInitT cipherInit, ByteSpanT key)
+{
+	PBYTE pKey = (PBYTE)malloc(key.cbData);
+
+	if (pKey == NULL) {
+		return FALSE;
+	}
+	memcpy(pKey, key.pData, key.cbData);
+
+	session->dwCipher = cipherInit->dwCipher;
+	memcpy(session->nonce, cipherInit->nonce, CIPHER_NONCE_SIZE);
+	session->qwAckedSequence = cipherInit->qwFirstSequence;
+	session->qwSentSequence = cipherInit->qwFirstSequence;
+	session->key = makeByteSpan(pKey, key.cbData);
+	return TRUE;
+}
+
+LPSessionT resumeSession(LPSessionStoreT store, LPResumeT resume)
+{
+	LPSessionT session;
+
+	EnterCriticalSection(&store->criticalSection);
+	expireSessions(store);
+	for (session = store->first; session != NULL; session = session->next) {
+		if (matchToken(session->token, resume->token)) {
+			break;
+		}
+	}
+	// the client cannot have packets the server never sent, nor give back ones it acknowledged
+	if (session == NULL || session->bAttached || session->key.pData == NULL ||
+		resume->qwSequence < session->qwAckedSequence || resume->qwSequence > session->qwSentSequence) {
+		store->stats.nrRejected++;
+		LeaveCriticalSection(&store->criticalSection);
+		return NULL;
+	}
+	session->bAttached = TRUE;
+	session->qwAckedSequence = resume->qwSequence;
+	session->qwSentSequence = resume->qwSequence;
+	store->stats.nrDetached--;
+	store->stats.nrAttached++;
+	store->stats.nrResumed++;
+	LeaveCriticalSection(&store->criticalSection);
+
+	return session;
+}
+
+VOID advanceSession(LPSessionT session, ULONGLONG qwNextSequence)
+{
+	session->qwSentSequence = qwNextSequence;
+}
+
+VOID closeSession(LPSessionT session, BOOL bFinished)
+{
+	LPSessionStoreT store = session->store;
+	LPSessionT oldest = NULL;
+
+	EnterCriticalSection(&store->criticalSection);
+	store->stats.nrAttached--;
+	if (bFinished || session->key.pData == NULL) {
+		unlinkSession(store, session);
+		freeSession(session);
+		LeaveCriticalSection(&store->criticalSection);
+		return;
+	}
+
+	session->bAttached = FALSE;
+	session->qwExpires = GetTickCount64() + store->qwTimeoutMs;
+	store->stats.nrDetached++;
+	if (store->stats.nrDetached > SESSIONS_MAX_DETACHED) {
+		for (LPSessionT other = store->first; other != NULL; other = other->next) {
+			if (!other->bAttached && (oldest == NULL || other->qwExpires < oldest->qwExpires)) {
+				oldest = other;
+			}
+		}
+		unlinkSession(store, oldest);
+		freeSession(oldest);
+		store->stats.nrDetached--;
+		store->stats.nrExpired++;
+	}
+	LeaveCriticalSection(&store->criticalSection);
+}
+
+VOID getSessionStats(LPSessionStoreT store, LPSessionStatsT stats)
+{
+	EnterCriticalSection(&store->criticalSection);
+	*stats = store->stats;
+	LeaveCriticalSection(&store->criticalSection);
+}
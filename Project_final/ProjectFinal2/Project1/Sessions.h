@@ -0,0 +1,105 @@
+#pragma once
+
+#ifndef SESSIONS_H
+#define SESSIONS_H
+
+#include "Portability.h"
+#include "ByteSpan.h"
+#include "CommunicationProtocol.h"
+#include "UserManagement.h"
+
+/*
+ * Sessions of the clients that asked for INIT_RESUMABLE. A session is opened at the
+ * authentication, which sends its token to the client, and started once the key is received.
+ * The connection holding it records the packets it sent back; when the connection breaks
+ * the session is detached and kept for the timeout of the store, a client presenting the token
+ * on a new connection takes it over from the last packet it got back (see ResumeT).
+ * A session whose file was encrypted to the end is closed for good.
+ *
+ * The session keeps a copy of the key of its client, wiped when the session is freed.
+ */
+
+// detached sessions kept at most, the one closest to expiring goes first
+#define SESSIONS_MAX_DETACHED 4096
+
+typedef struct SessionStoreTag *LPSessionStoreT;
+
+typedef struct SessionTag {
+	struct SessionStoreTag *store;
+	BYTE token[SESSION_TOKEN_SIZE];
+	PTCHAR sUserName;
+	// of the user, a resumed client accounts its bytes to it without a lookup
+	LPCredentialT credential;
+	DWORD dwCipher;
+	BYTE nonce[CIPHER_NONCE_SIZE];
+	// NULL until the session is started, it cannot be resumed before
+	ByteSpanT key;
+	// the client acknowledged every packet before it when it last resumed, or it started there
+	ULONGLONG qwAckedSequence;
+	// one past the last packet sent back, only the connection holding the session writes it
+	ULONGLONG qwSentSequence;
+	// the fields below are guarded by the lock of the store
+	BOOL bAttached;
+	// GetTickCount64 time a detached session is dropped at
+	ULONGLONG qwExpires;
+	struct SessionTag *next;
+}SessionT, *LPSessionT;
+
+typedef struct SessionStatsTag {
+	DWORD nrAttached;
+	DWORD nrDetached;
+	ULONGLONG nrOpened;
+	ULONGLONG nrResumed;
+	// resumptions refused: unknown token, expired, in use or a sequence never sent
+	ULONGLONG nrRejected;
+	ULONGLONG nrExpired;
+}SessionStatsT, *LPSessionStatsT;
+
+/*
+ * @param dwTimeoutSeconds: how long a detached session can be resumed.
+ * @return the store, or NULL if out of memory.
+ */
+LPSessionStoreT createSessionStore(DWORD dwTimeoutSeconds);
+
+/*
+ * Frees the store and every session left, no connection may hold one anymore.
+ */
+VOID destroySessionStore(LPSessionStoreT store);
+
+/*
+ * Opens an attached session for an authenticated user and draws its token.
+ *
+ * @return the session, or NULL if out of memory or no random token could be drawn.
+ */
+LPSessionT openSession(LPSessionStoreT store, LPCredentialT credential);
+
+/*
+ * Records the cipher and a copy of the key of the session, once the client sent them.
+ *
+ * @return FALSE if out of memory, the session stays unresumable then.
+ */
+BOOL startSession(LPSessionT session, LPCipherInitT cipherInit, ByteSpanT key);
+
+/*
+ * Takes over a detached session for a new connection, from resume->qwSequence on.
+ *
+ * @return the attached session, or NULL if it cannot be resumed.
+ */
+LPSessionT resumeSession(LPSessionStoreT store, LPResumeT resume);
+
+/*
+ * The packets before qwNextSequence were sent back to the client.
+ */
+VOID advanceSession(LPSessionT session, ULONGLONG qwNextSequence);
+
+/*
+ * Lets go of the session once its connection is done.
+ *
+ * @param bFinished: the file was encrypted to the end, the session is freed.
+ *     Otherwise it is detached and waits to be resumed, unless it was never started.
+ */
+VOID closeSession(LPSessionT session, BOOL bFinished);
+
+VOID getSessionStats(LPSessionStoreT store, LPSessionStatsT stats);
+
+#endif
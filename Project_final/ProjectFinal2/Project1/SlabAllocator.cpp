@@ -0,0 +1,256 @@
+#include "SlabAllocator.h"
+
+// bytes of free objects a thread cache holds at most, and the bounds on their number
+#define SLAB_CACHE_BYTES (512 * 1024)
+#define SLAB_CACHE_MIN 2
+#define SLAB_CACHE_MAX 64
+
+typedef struct SlabFreeTag {
+	struct SlabFreeTag *next;
+}SlabFreeT, *LPSlabFreeT;
+
+typedef struct SlabCacheTag {
+	struct SlabAllocatorTag *allocator;
+	LPVOID objects[SLAB_CACHE_MAX];
+	DWORD nrCached;
+	// only the owning thread writes the counters
+	ULONGLONG nrAllocs;
+	ULONGLONG nrFrees;
+	ULONGLONG nrHits;
+	ULONGLONG nrMisses;
+	// link in the list of caches of the allocator
+	struct SlabCacheTag *next;
+}SlabCacheT, *LPSlabCacheT;
+
+typedef struct SlabAllocatorTag {
+	DWORD dwIndex;
+	DWORD cbObject;
+	DWORD nrPerSlab;
+	// objects moved between a cache and the free list at a time
+	DWORD nrBatch;
+	DWORD nrCacheMax;
+
+	// guards everything below
+	CRITICAL_SECTION criticalSection;
+	LPSlabFreeT freeList;
+	DWORD nrSlabs;
+	ULONGLONG nrFree;
+	ULONGLONG nrPeak;
+	LPSlabCacheT caches;
+	// counters of the caches of threads that are gone
+	ULONGLONG nrAllocs;
+	ULONGLONG nrFrees;
+	ULONGLONG nrHits;
+	ULONGLONG nrMisses;
+}SlabAllocatorT;
+
+static volatile LONG nrAllocators = 0;
+
+// caches of the calling thread, by allocator index
+static thread_local LPSlabCacheT tCaches[SLAB_MAX_ALLOCATORS];
+
+LPSlabAllocatorT createSlabAllocator(DWORD cbObject, DWORD cbSlab)
+{
+	LONG dwIndex = InterlockedIncrement(&nrAllocators) - 1;
+	if (dwIndex >= SLAB_MAX_ALLOCATORS) {
+		return NULL;
+	}
+
+	LPSlabAllocatorT allocator = (LPSlabAllocatorT)calloc(1, sizeof(SlabAllocatorT));
+	if (allocator == NULL) {
+		return NULL;
+	}
+
+	cbObject = (cbObject + sizeof(LPVOID) - 1) / sizeof(LPVOID) * sizeof(LPVOID);
+	allocator->dwIndex = dwIndex;
+	allocator->cbObject = cbObject;
+	allocator->nrPerSlab = (cbSlab > cbObject) ? cbSlab / cbObject : 1;
+
+	allocator->nrCacheMax = SLAB_CACHE_BYTES / cbObject;
+	if (allocator->nrCacheMax < SLAB_CACHE_MIN) {
+		allocator->nrCacheMax = SLAB_CACHE_MIN;
+	} else if (allocator->nrCacheMax > SLAB_CACHE_MAX) {
+		allocator->nrCacheMax = SLAB_CACHE_MAX;
+	}
+	allocator->nrBatch = allocator->nrCacheMax / 2;
+
+	InitializeCriticalSection(&allocator->criticalSection);
+	return allocator;
+}
+
+/*
+ * Takes one more slab from the system, the caller holds the critical section.
+ */
+static BOOL growAllocator(LPSlabAllocatorT allocator)
+{
+	PBYTE slab = (PBYTE)malloc((SIZE_T)allocator->cbObject * allocator->nrPerSlab);
+	if (slab == NULL) {
+		return FALSE;
+	}
+
+	for (DWORD i = 0; i < allocator->nrPerSlab; i++) {
+		LPSlabFreeT object = (LPSlabFreeT)(slab + (SIZE_T)i * allocator->cbObject);
+		object->next = allocator->freeList;
+		allocator->freeList = object;
+	}
+	allocator->nrSlabs++;
+	allocator->nrFree += allocator->nrPerSlab;
+	return TRUE;
+}
+
+static LPSlabCacheT getCache(LPSlabAllocatorT allocator)
+{
+	LPSlabCacheT cache = tCaches[allocator->dwIndex];
+	if (cache != NULL) {
+		return cache;
+	}
+
+	cache = (LPSlabCacheT)calloc(1, sizeof(SlabCacheT));
+	if (cache == NULL) {
+		return NULL;
+	}
+	cache->allocator = allocator;
+
+	EnterCriticalSection(&allocator->criticalSection);
+	cache->next = allocator->caches;
+	allocator->caches = cache;
+	LeaveCriticalSection(&allocator->criticalSection);
+
+	tCaches[allocator->dwIndex] = cache;
+	return cache;
+}
+
+/*
+ * Moves up to nrBatch objects from the free list to the cache.
+ */
+static VOID refillCache(LPSlabAllocatorT allocator, LPSlabCacheT cache)
+{
+	ULONGLONG nrOut;
+
+	EnterCriticalSection(&allocator->criticalSection);
+	while (cache->nrCached < allocator->nrBatch) {
+		if (allocator->freeList == NULL && !growAllocator(allocator)) {
+			break;
+		}
+		cache->objects[cache->nrCached++] = allocator->freeList;
+		allocator->freeList = allocator->freeList->next;
+		allocator->nrFree--;
+	}
+
+	nrOut = (ULONGLONG)allocator->nrSlabs * allocator->nrPerSlab - allocator->nrFree;
+	if (nrOut > allocator->nrPeak) {
+		allocator->nrPeak = nrOut;
+	}
+	LeaveCriticalSection(&allocator->criticalSection);
+}
+
+/*
+ * Moves all but nrKeep objects from the cache to the free list.
+ */
+static VOID spillCache(LPSlabAllocatorT allocator, LPSlabCacheT cache, DWORD nrKeep)
+{
+	EnterCriticalSection(&allocator->criticalSection);
+	while (cache->nrCached > nrKeep) {
+		LPSlabFreeT object = (LPSlabFreeT)cache->objects[--cache->nrCached];
+		object->next = allocator->freeList;
+		allocator->freeList = object;
+		allocator->nrFree++;
+	}
+	LeaveCriticalSection(&allocator->criticalSection);
+}
+
+LPVOID slabAlloc(LPSlabAllocatorT allocator)
+{
+	LPSlabCacheT cache = getCache(allocator);
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	if (cache->nrCached > 0) {
+		cache->nrHits++;
+	} else {
+		cache->nrMisses++;
+		refillCache(allocator, cache);
+		if (cache->nrCached == 0) {
+			return NULL;
+		}
+	}
+
+	cache->nrAllocs++;
+	return cache->objects[--cache->nrCached];
+}
+
+VOID slabFree(LPSlabAllocatorT allocator, LPVOID object)
+{
+	LPSlabCacheT cache = getCache(allocator);
+	if (cache == NULL) {
+		// no cache for this thread, the object goes straight back
+		EnterCriticalSection(&allocator->criticalSection);
+		((LPSlabFreeT)object)->next = allocator->freeList;
+		allocator->freeList = (LPSlabFreeT)object;
+		allocator->nrFree++;
+		allocator->nrFrees++;
+		LeaveCriticalSection(&allocator->criticalSection);
+		return;
+	}
+
+	if (cache->nrCached == allocator->nrCacheMax) {
+		spillCache(allocator, cache, allocator->nrCacheMax - allocator->nrBatch);
+	}
+	cache->objects[cache->nrCached++] = object;
+	cache->nrFrees++;
+}
+
+VOID releaseSlabCaches()
+{
+	for (LONG i = 0; i < nrAllocators && i < SLAB_MAX_ALLOCATORS; i++) {
+		LPSlabCacheT cache = tCaches[i];
+		if (cache == NULL) {
+			continue;
+		}
+		LPSlabAllocatorT allocator = cache->allocator;
+
+		spillCache(allocator, cache, 0);
+
+		EnterCriticalSection(&allocator->criticalSection);
+		LPSlabCacheT *link = &allocator->caches;
+		while (*link != cache) {
+			link = &(*link)->next;
+		}
+		*link = cache->next;
+		allocator->nrAllocs += cache->nrAllocs;
+		allocator->nrFrees += cache->nrFrees;
+		allocator->nrHits += cache->nrHits;
+		allocator->nrMisses += cache->nrMisses;
+		LeaveCriticalSection(&allocator->criticalSection);
+
+		free(cache);
+		tCaches[i] = NULL;
+	}
+}
+
+VOID getSlabStats(LPSlabAllocatorT allocator, LPSlabStatsT stats)
+{
+	ULONGLONG nrAllocs;
+	ULONGLONG nrFrees;
+
+	EnterCriticalSection(&allocator->criticalSection);
+	stats->cbObject = allocator->cbObject;
+	stats->nrSlabs = allocator->nrSlabs;
+	stats->nrObjects = (ULONGLONG)allocator->nrSlabs * allocator->nrPerSlab;
+	stats->nrPeak = allocator->nrPeak;
+	nrAllocs = allocator->nrAllocs;
+	nrFrees = allocator->nrFrees;
+	stats->nrCacheHits = allocator->nrHits;
+	stats->nrCacheMisses = allocator->nrMisses;
+	for (LPSlabCacheT cache = allocator->caches; cache != NULL; cache = cache->next) {
+		nrAllocs += cache->nrAllocs;
+		nrFrees += cache->nrFrees;
+		stats->nrCacheHits += cache->nrHits;
+		stats->nrCacheMisses += cache->nrMisses;
+	}
+	LeaveCriticalSection(&allocator->criticalSection);
+
+	// a free counted before its allocation would make this wrap for a moment
+	stats->nrLive = (nrAllocs > nrFrees) ? nrAllocs - nrFrees : 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include "Portability.h"
+
+/*
+ * Allocator for objects of one fixed size. Memory is taken from the system a slab
+ * of objects at a time and never given back, so a server under a steady load stays flat.
+ * Every thread keeps a small cache of free objects per allocator, the shared free list
+ * is only locked to refill or to spill a cache, a batch of objects at a time.
+ */
+
+#define SLAB_MAX_ALLOCATORS 16
+
+typedef struct SlabStatsTag {
+	DWORD cbObject;
+	// slabs taken from the system and the objects they hold
+	DWORD nrSlabs;
+	ULONGLONG nrObjects;
+	// objects in use
+	ULONGLONG nrLive;
+	// highest number of objects out of the shared free list, in use or in a thread cache
+	ULONGLONG nrPeak;
+	// allocations served by the cache of the calling thread, and the ones that refilled it
+	ULONGLONG nrCacheHits;
+	ULONGLONG nrCacheMisses;
+}SlabStatsT, *LPSlabStatsT;
+
+typedef struct SlabAllocatorTag *LPSlabAllocatorT;
+
+/*
+ * @param cbObject: size of the objects, rounded up to a multiple of the pointer size.
+ * @param cbSlab: bytes taken from the system at a time, at least one object.
+ * @return the allocator, or NULL on failure or when SLAB_MAX_ALLOCATORS already exist.
+ */
+LPSlabAllocatorT createSlabAllocator(DWORD cbObject, DWORD cbSlab);
+
+/*
+ * @return an object, or NULL when out of memory.
+ */
+LPVOID slabAlloc(LPSlabAllocatorT allocator);
+
+/*
+ * Gives an object back, any thread may free an object allocated by another one.
+ */
+VOID slabFree(LPSlabAllocatorT allocator, LPVOID object);
+
+/*
+ * Gives the cached objects of the calling thread back to their allocators.
+ * Threads that end while the server keeps running must call it before returning.
+ */
+VOID releaseSlabCaches();
+
+/*
+ * The counters of other threads are read without locking them, they may be slightly behind.
+ */
+VOID getSlabStats(LPSlabAllocatorT allocator, LPSlabStatsT stats);
+
+#endif
@@ -0,0 +1,836 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "Transport.h"
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#include <afunix.h>
+#pragma comment(lib, "Ws2_32.lib")
+#define closeSocket closesocket
+#define SHUTDOWN_BOTH SD_BOTH
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/uio.h>
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closeSocket close
+#define SHUTDOWN_BOTH SHUT_RDWR
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define TRANSPORT_PIPE_BUFFSIZE 4096
+#define TRANSPORT_MAX_LOCATION 1024
+#define TRANSPORT_DEFAULT_HOST "127.0.0.1"
+
+#ifdef UNICODE
+#define NARROW_STRING_FORMAT _T("%hs")
+#else
+#define NARROW_STRING_FORMAT _T("%s")
+#endif
+
+/*
+ * Splits an address into its scheme and location.
+ * Addresses without a known scheme are full named pipe paths.
+ */
+static TransportKindE parseAddress(LPCTSTR sAddress, LPCTSTR *sLocation)
+{
+	if (_tcsncmp(sAddress, _T("pipe:"), 5) == 0) {
+		*sLocation = sAddress + 5;
+		return TRANSPORT_PIPE;
+	}
+	if (_tcsncmp(sAddress, _T("unix:"), 5) == 0) {
+		*sLocation = sAddress + 5;
+		return TRANSPORT_UNIX;
+	}
+	if (_tcsncmp(sAddress, _T("tcp:"), 4) == 0) {
+		*sLocation = sAddress + 4;
+		return TRANSPORT_TCP;
+	}
+	*sLocation = sAddress;
+	return TRANSPORT_PIPE;
+}
+
+/*
+ * Returns a newly allocated copy of the string.
+ */
+static PTCHAR duplicateString(LPCTSTR sSource)
+{
+	PTCHAR sCopy = (PTCHAR)malloc(sizeof(TCHAR) * (_tcslen(sSource) + 1));
+	if (sCopy == NULL) {
+		return NULL;
+	}
+	_tcscpy(sCopy, sSource);
+	return sCopy;
+}
+
+/*
+ * Socket addresses are always narrow strings, even in UNICODE builds.
+ */
+static BOOL toNarrowString(LPCTSTR sSource, char *sDest, size_t cbDest)
+{
+#ifdef UNICODE
+	size_t cbConverted = wcstombs(sDest, sSource, cbDest);
+	return cbConverted != (size_t)-1 && cbConverted < cbDest;
+#else
+	if (_tcslen(sSource) >= cbDest) {
+		return FALSE;
+	}
+	strcpy(sDest, sSource);
+	return TRUE;
+#endif
+}
+
+static LPConnectionT allocConnection(const TransportOpsT *ops, TransportKindE kind)
+{
+	LPConnectionT connection = (LPConnectionT)malloc(sizeof(ConnectionT));
+	if (connection == NULL) {
+		return NULL;
+	}
+	connection->ops = ops;
+	connection->kind = kind;
+	connection->hPipe = INVALID_HANDLE_VALUE;
+	connection->socket = INVALID_SOCKET;
+	return connection;
+}
+
+/*
+ * Named pipe backend.
+ */
+#ifdef _WIN32
+static BOOL pipeRead(LPConnectionT connection, LPVOID buff, DWORD cbToRead)
+{
+	DWORD cbDone = 0;
+	DWORD cbRead;
+
+	while (cbDone < cbToRead) {
+		if (!ReadFile(connection->hPipe, (PBYTE)buff + cbDone, cbToRead - cbDone, &cbRead, NULL)) {
+			// a message longer than the request is consumed by the following reads
+			if (GetLastError() != ERROR_MORE_DATA) {
+				return FALSE;
+			}
+		} else if (cbRead == 0) {
+			return FALSE;
+		}
+		cbDone += cbRead;
+	}
+	return TRUE;
+}
+
+static BOOL pipeWrite(LPConnectionT connection, const void *buff, DWORD cbToWrite)
+{
+	DWORD cbWritten;
+
+	return WriteFile(connection->hPipe, buff, cbToWrite, &cbWritten, NULL) && cbWritten == cbToWrite;
+}
+
+static BOOL pipeWriteGather(LPConnectionT connection, const TransportBufferT *buffers, DWORD nrBuffers)
+{
+	for (DWORD i = 0; i < nrBuffers; i++) {
+		if (!pipeWrite(connection, buffers[i].buff, buffers[i].cbBuff)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static VOID pipeInterrupt(LPConnectionT connection)
+{
+	// cancels the blocking calls of other threads, the disconnect fails the later ones
+	CancelIoEx(connection->hPipe, NULL);
+	DisconnectNamedPipe(connection->hPipe);
+}
+
+static VOID pipeClose(LPConnectionT connection)
+{
+	CloseHandle(connection->hPipe);
+}
+
+static const TransportOpsT gPipeOps = { pipeRead, pipeWrite, pipeWriteGather, pipeInterrupt, pipeClose };
+
+static LPConnectionT pipeAccept(LPListenerT listener)
+{
+	HANDLE hPipe;
+	BOOL bConnected;
+	LPConnectionT connection;
+
+	while (true) {
+		hPipe = CreateNamedPipe(
+			listener->sLocation,		//pipe name
+			PIPE_ACCESS_DUPLEX,			//pipe open mode, we need to write and to read
+			PIPE_TYPE_MESSAGE,			//message mode
+			PIPE_UNLIMITED_INSTANCES,	//unlimited instances (as system resources permit)
+			TRANSPORT_PIPE_BUFFSIZE,	// size of output buffer
+			TRANSPORT_PIPE_BUFFSIZE,	//size of input buffer
+			0,							// default time out of 50 milliseconds
+			NULL						//default security attributes
+		);
+		if (hPipe == INVALID_HANDLE_VALUE) {
+			return NULL;
+		}
+
+		if (ConnectNamedPipe(hPipe, NULL) != 0) {
+			bConnected = TRUE;
+		} else {
+			// an error may occour if the client is connected before the call of ConnectNamedPipe function
+			// if this is the case, then we can continue safely
+			bConnected = GetLastError() == ERROR_PIPE_CONNECTED;
+		}
+
+		if (bConnected) {
+			break;
+		}
+		// the client could not connect
+		CloseHandle(hPipe);
+	}
+
+	connection = allocConnection(&gPipeOps, TRANSPORT_PIPE);
+	if (connection == NULL) {
+		CloseHandle(hPipe);
+		return NULL;
+	}
+	connection->hPipe = hPipe;
+	return connection;
+}
+
+static LPConnectionT pipeConnect(LPCTSTR sPipeName)
+{
+	HANDLE hPipe;
+	DWORD dwMode;
+	LPConnectionT connection;
+
+	//trying to connect to the pipe
+	while (true) {
+		hPipe = CreateFile(
+			sPipeName, //name of the pipe
+			GENERIC_READ | GENERIC_WRITE, //read and write access
+			0, //we don't need sharing
+			NULL, //default security attributes
+			OPEN_EXISTING, //opens an existing (duh?)
+			0, //default attributes
+			NULL //we dont' need template
+		);
+
+		if (hPipe != INVALID_HANDLE_VALUE) {
+			//successfully connected to pipe, break the loop
+			break;
+		}
+
+		if (GetLastError() != ERROR_PIPE_BUSY) {
+			return NULL;
+		}
+
+		//all pipes are busy, wait for 10 sec
+		if (!WaitNamedPipe(sPipeName, 10000)) {
+			return NULL;
+		}
+	}
+
+	dwMode = PIPE_READMODE_MESSAGE;
+	if (!SetNamedPipeHandleState(hPipe, &dwMode, NULL, NULL)) {
+		CloseHandle(hPipe);
+		return NULL;
+	}
+
+	connection = allocConnection(&gPipeOps, TRANSPORT_PIPE);
+	if (connection == NULL) {
+		CloseHandle(hPipe);
+		return NULL;
+	}
+	connection->hPipe = hPipe;
+	return connection;
+}
+#endif
+
+/*
+ * Socket backend, shared by AF_UNIX and TCP.
+ */
+static BOOL socketRead(LPConnectionT connection, LPVOID buff, DWORD cbToRead)
+{
+	DWORD cbDone = 0;
+	INT cbResult;
+
+	while (cbDone < cbToRead) {
+		cbResult = (INT)recv(connection->socket, (char*)buff + cbDone, (INT)(cbToRead - cbDone), 0);
+		if (cbResult == SOCKET_ERROR) {
+#ifndef _WIN32
+			if (errno == EINTR) {
+				continue;
+			}
+#endif
+			return FALSE;
+		}
+		if (cbResult == 0) {
+			// peer closed the connection
+			return FALSE;
+		}
+		cbDone += (DWORD)cbResult;
+	}
+	return TRUE;
+}
+
+static BOOL socketWrite(LPConnectionT connection, const void *buff, DWORD cbToWrite)
+{
+	DWORD cbDone = 0;
+	INT cbResult;
+
+	while (cbDone < cbToWrite) {
+		cbResult = (INT)send(connection->socket, (const char*)buff + cbDone, (INT)(cbToWrite - cbDone), MSG_NOSIGNAL);
+		if (cbResult == SOCKET_ERROR) {
+#ifndef _WIN32
+			if (errno == EINTR) {
+				continue;
+			}
+#endif
+			return FALSE;
+		}
+		cbDone += (DWORD)cbResult;
+	}
+	return TRUE;
+}
+
+/*
+ * One gather send on the socket.
+ *
+ * @return the number of bytes sent, or SOCKET_ERROR.
+ */
+static INT socketSendGather(TransportSocketT sock, const TransportBufferT *buffers, DWORD nrBuffers)
+{
+#ifdef _WIN32
+	WSABUF wsaBuffers[TRANSPORT_MAX_GATHER];
+	DWORD cbSent;
+
+	for (DWORD i = 0; i < nrBuffers; i++) {
+		wsaBuffers[i].buf = (CHAR*)buffers[i].buff;
+		wsaBuffers[i].len = buffers[i].cbBuff;
+	}
+	if (WSASend(sock, wsaBuffers, nrBuffers, &cbSent, 0, NULL, NULL) == SOCKET_ERROR) {
+		return SOCKET_ERROR;
+	}
+	return (INT)cbSent;
+#else
+	struct iovec vectors[TRANSPORT_MAX_GATHER];
+	struct msghdr message;
+
+	for (DWORD i = 0; i < nrBuffers; i++) {
+		vectors[i].iov_base = (void*)buffers[i].buff;
+		vectors[i].iov_len = buffers[i].cbBuff;
+	}
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = vectors;
+	message.msg_iovlen = nrBuffers;
+	return (INT)sendmsg(sock, &message, MSG_NOSIGNAL);
+#endif
+}
+
+static BOOL socketWriteGather(LPConnectionT connection, const TransportBufferT *buffers, DWORD nrBuffers)
+{
+	TransportBufferT remaining[TRANSPORT_MAX_GATHER];
+	DWORD nrRemaining = nrBuffers;
+	DWORD dwFirst = 0;
+	INT cbResult;
+
+	memcpy(remaining, buffers, sizeof(TransportBufferT) * nrBuffers);
+	while (dwFirst < nrRemaining) {
+		cbResult = socketSendGather(connection->socket, remaining + dwFirst, nrRemaining - dwFirst);
+		if (cbResult == SOCKET_ERROR) {
+#ifndef _WIN32
+			if (errno == EINTR) {
+				continue;
+			}
+#endif
+			return FALSE;
+		}
+
+		// skip what was sent, a buffer may have gone out partially
+		DWORD cbSent = (DWORD)cbResult;
+		while (dwFirst < nrRemaining && cbSent >= remaining[dwFirst].cbBuff) {
+			cbSent -= remaining[dwFirst].cbBuff;
+			dwFirst++;
+		}
+		if (dwFirst < nrRemaining) {
+			remaining[dwFirst].buff = (const BYTE*)remaining[dwFirst].buff + cbSent;
+			remaining[dwFirst].cbBuff -= cbSent;
+		}
+	}
+	return TRUE;
+}
+
+static VOID socketInterrupt(LPConnectionT connection)
+{
+	shutdown(connection->socket, SHUTDOWN_BOTH);
+}
+
+static VOID socketClose(LPConnectionT connection)
+{
+	closeSocket(connection->socket);
+}
+
+static const TransportOpsT gSocketOps = { socketRead, socketWrite, socketWriteGather, socketInterrupt, socketClose };
+
+static BOOL initializeSockets()
+{
+#ifdef _WIN32
+	static BOOL bInitialized = FALSE;
+	WSADATA wsaData;
+
+	if (!bInitialized) {
+		if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+			return FALSE;
+		}
+		bInitialized = TRUE;
+	}
+#endif
+	return TRUE;
+}
+
+/*
+ * Splits a tcp location in host and port, the host defaults to the loopback address.
+ */
+static BOOL splitHostPort(LPCTSTR sLocation, char *sHost, size_t cbHost, char *sPort, size_t cbPort)
+{
+	char sNarrow[TRANSPORT_MAX_LOCATION];
+	char *sSeparator;
+
+	if (!toNarrowString(sLocation, sNarrow, sizeof(sNarrow))) {
+		return FALSE;
+	}
+
+	sSeparator = strrchr(sNarrow, ':');
+	if (sSeparator == NULL) {
+		if (strlen(TRANSPORT_DEFAULT_HOST) >= cbHost || strlen(sNarrow) >= cbPort) {
+			return FALSE;
+		}
+		strcpy(sHost, TRANSPORT_DEFAULT_HOST);
+		strcpy(sPort, sNarrow);
+		return TRUE;
+	}
+
+	*sSeparator = '\0';
+	if (strlen(sNarrow) >= cbHost || strlen(sSeparator + 1) >= cbPort) {
+		return FALSE;
+	}
+	strcpy(sHost, sNarrow);
+	strcpy(sPort, sSeparator + 1);
+	return TRUE;
+}
+
+static VOID setNoDelay(LPConnectionT connection)
+{
+	INT nEnabled = 1;
+
+	if (connection->kind == TRANSPORT_TCP) {
+		// the protocol sends small headers, do not let them wait for the payload ack
+		setsockopt(connection->socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&nEnabled, sizeof(nEnabled));
+	}
+}
+
+static TransportSocketT createUnixSocket(LPCTSTR sPath, BOOL bListen)
+{
+	struct sockaddr_un address;
+	TransportSocketT sock;
+	INT result;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (!toNarrowString(sPath, address.sun_path, sizeof(address.sun_path))) {
+		return INVALID_SOCKET;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == INVALID_SOCKET) {
+		return INVALID_SOCKET;
+	}
+
+	if (bListen) {
+		// a socket file left behind by a previous run would make bind fail
+#ifdef _WIN32
+		DeleteFileA(address.sun_path);
+#else
+		unlink(address.sun_path);
+#endif
+		result = bind(sock, (struct sockaddr*)&address, sizeof(address));
+		if (result != SOCKET_ERROR) {
+			result = listen(sock, SOMAXCONN);
+		}
+	} else {
+		result = connect(sock, (struct sockaddr*)&address, sizeof(address));
+	}
+
+	if (result == SOCKET_ERROR) {
+		closeSocket(sock);
+		return INVALID_SOCKET;
+	}
+	return sock;
+}
+
+static TransportSocketT createTcpSocket(LPCTSTR sLocation, BOOL bListen)
+{
+	char sHost[256];
+	char sPort[32];
+	struct addrinfo hints;
+	struct addrinfo *result;
+	struct addrinfo *walker;
+	TransportSocketT sock = INVALID_SOCKET;
+	INT nEnabled = 1;
+
+	if (!splitHostPort(sLocation, sHost, sizeof(sHost), sPort, sizeof(sPort))) {
+		return INVALID_SOCKET;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	if (getaddrinfo(sHost, sPort, &hints, &result) != 0) {
+		return INVALID_SOCKET;
+	}
+
+	for (walker = result; walker != NULL; walker = walker->ai_next) {
+		sock = socket(walker->ai_family, walker->ai_socktype, walker->ai_protocol);
+		if (sock == INVALID_SOCKET) {
+			continue;
+		}
+
+		if (bListen) {
+			setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&nEnabled, sizeof(nEnabled));
+			if (bind(sock, walker->ai_addr, (INT)walker->ai_addrlen) != SOCKET_ERROR &&
+				listen(sock, SOMAXCONN) != SOCKET_ERROR) {
+				break;
+			}
+		} else if (connect(sock, walker->ai_addr, (INT)walker->ai_addrlen) != SOCKET_ERROR) {
+			break;
+		}
+
+		closeSocket(sock);
+		sock = INVALID_SOCKET;
+	}
+
+	freeaddrinfo(result);
+	return sock;
+}
+
+/*
+ * Builds the public address of a tcp listener, resolving port 0 to the port chosen by the system.
+ */
+static PTCHAR getTcpListenerAddress(TransportSocketT sock)
+{
+	struct sockaddr_storage address;
+	socklen_t cbAddress = sizeof(address);
+	char sHost[INET6_ADDRSTRLEN];
+	unsigned short port;
+	PTCHAR sAddress;
+
+	if (getsockname(sock, (struct sockaddr*)&address, &cbAddress) == SOCKET_ERROR) {
+		return NULL;
+	}
+
+	if (address.ss_family == AF_INET6) {
+		struct sockaddr_in6 *address6 = (struct sockaddr_in6*)&address;
+		inet_ntop(AF_INET6, &address6->sin6_addr, sHost, sizeof(sHost));
+		port = ntohs(address6->sin6_port);
+	} else {
+		struct sockaddr_in *address4 = (struct sockaddr_in*)&address;
+		inet_ntop(AF_INET, &address4->sin_addr, sHost, sizeof(sHost));
+		port = ntohs(address4->sin_port);
+	}
+
+	sAddress = (PTCHAR)malloc(sizeof(TCHAR) * (strlen(sHost) + 16));
+	if (sAddress == NULL) {
+		return NULL;
+	}
+	_stprintf(sAddress, _T("tcp:"));
+	_stprintf(sAddress + 4, NARROW_STRING_FORMAT, sHost);
+	_stprintf(sAddress + _tcslen(sAddress), _T(":%u"), (UINT)port);
+	return sAddress;
+}
+
+static LPConnectionT socketAccept(LPListenerT listener)
+{
+	TransportSocketT sock;
+	LPConnectionT connection;
+
+	do {
+		sock = accept(listener->socket, NULL, NULL);
+#ifndef _WIN32
+	} while (sock == INVALID_SOCKET && errno == EINTR);
+#else
+	} while (false);
+#endif
+
+	if (sock == INVALID_SOCKET) {
+		return NULL;
+	}
+
+	connection = allocConnection(&gSocketOps, listener->kind);
+	if (connection == NULL) {
+		closeSocket(sock);
+		return NULL;
+	}
+	connection->socket = sock;
+	setNoDelay(connection);
+	return connection;
+}
+
+LPListenerT createListener(LPCTSTR sAddress)
+{
+	LPCTSTR sLocation;
+	LPListenerT listener = (LPListenerT)malloc(sizeof(ListenerT));
+	if (listener == NULL) {
+		return NULL;
+	}
+
+	listener->kind = parseAddress(sAddress, &sLocation);
+	listener->socket = INVALID_SOCKET;
+	listener->sAddress = NULL;
+	listener->sLocation = NULL;
+
+	switch (listener->kind) {
+	case TRANSPORT_PIPE:
+#ifdef _WIN32
+		if (sLocation != sAddress) {
+			// pipe:<name> is a short name, build the real pipe path
+			listener->sLocation = (PTCHAR)malloc(sizeof(TCHAR) * (_tcslen(sLocation) + 10));
+			if (listener->sLocation != NULL) {
+				_tcscpy(listener->sLocation, _T("\\\\.\\pipe\\"));
+				_tcscat(listener->sLocation, sLocation);
+			}
+		} else {
+			listener->sLocation = duplicateString(sLocation);
+		}
+		listener->sAddress = duplicateString(listener->sLocation != NULL ? listener->sLocation : sLocation);
+#endif
+		break;
+	case TRANSPORT_UNIX:
+		if (initializeSockets()) {
+			listener->socket = createUnixSocket(sLocation, TRUE);
+		}
+		listener->sLocation = duplicateString(sLocation);
+		listener->sAddress = duplicateString(sAddress);
+		break;
+	case TRANSPORT_TCP:
+		if (initializeSockets()) {
+			listener->socket = createTcpSocket(sLocation, TRUE);
+		}
+		listener->sLocation = duplicateString(sLocation);
+		if (listener->socket != INVALID_SOCKET) {
+			listener->sAddress = getTcpListenerAddress(listener->socket);
+		}
+		break;
+	}
+
+	if (listener->sAddress == NULL || listener->sLocation == NULL ||
+		(listener->kind != TRANSPORT_PIPE && listener->socket == INVALID_SOCKET)) {
+		closeListener(listener);
+		return NULL;
+	}
+	return listener;
+}
+
+LPConnectionT acceptConnection(LPListenerT listener)
+{
+#ifdef _WIN32
+	if (listener->kind == TRANSPORT_PIPE) {
+		return pipeAccept(listener);
+	}
+#endif
+	return socketAccept(listener);
+}
+
+PTCHAR getListenerAddress(LPListenerT listener)
+{
+	return listener->sAddress;
+}
+
+VOID closeListener(LPListenerT listener)
+{
+	if (listener->socket != INVALID_SOCKET) {
+		closeSocket(listener->socket);
+	}
+#ifndef _WIN32
+	if (listener->kind == TRANSPORT_UNIX && listener->sLocation != NULL) {
+		unlink(listener->sLocation);
+	}
+#endif
+	free(listener->sAddress);
+	free(listener->sLocation);
+	free(listener);
+}
+
+LPConnectionT connectTransport(LPCTSTR sAddress)
+{
+	LPCTSTR sLocation;
+	TransportKindE kind = parseAddress(sAddress, &sLocation);
+	TransportSocketT sock = INVALID_SOCKET;
+	LPConnectionT connection;
+
+	if (kind == TRANSPORT_PIPE) {
+#ifdef _WIN32
+		if (sLocation != sAddress) {
+			TCHAR sRealPipeName[TRANSPORT_MAX_LOCATION];
+			if (_tcslen(sLocation) + 10 > TRANSPORT_MAX_LOCATION) {
+				return NULL;
+			}
+			_tcscpy(sRealPipeName, _T("\\\\.\\pipe\\"));
+			_tcscat(sRealPipeName, sLocation);
+			return pipeConnect(sRealPipeName);
+		}
+		return pipeConnect(sLocation);
+#else
+		return NULL;
+#endif
+	}
+
+	if (!initializeSockets()) {
+		return NULL;
+	}
+
+	if (kind == TRANSPORT_UNIX) {
+		sock = createUnixSocket(sLocation, FALSE);
+	} else {
+		sock = createTcpSocket(sLocation, FALSE);
+	}
+
+	if (sock == INVALID_SOCKET) {
+		return NULL;
+	}
+
+	connection = allocConnection(&gSocketOps, kind);
+	if (connection == NULL) {
+		closeSocket(sock);
+		return NULL;
+	}
+	connection->socket = sock;
+	setNoDelay(connection);
+	return connection;
+}
+
+BOOL transportRead(LPConnectionT connection, LPVOID buff, DWORD cbToRead)
+{
+	return connection->ops->read(connection, buff, cbToRead);
+}
+
+BOOL transportWrite(LPConnectionT connection, const void *buff, DWORD cbToWrite)
+{
+	return connection->ops->write(connection, buff, cbToWrite);
+}
+
+BOOL transportWriteGather(LPConnectionT connection, const TransportBufferT *buffers, DWORD nrBuffers)
+{
+	return connection->ops->writeGather(connection, buffers, nrBuffers);
+}
+
+VOID interruptConnection(LPConnectionT connection)
+{
+	connection->ops->interrupt(connection);
+}
+
+VOID closeConnection(LPConnectionT connection)
+{
+	connection->ops->close(connection);
+	free(connection);
+}
+
+BOOL setConnectionTimeout(LPConnectionT connection, DWORD dwTimeoutMs)
+{
+	if (connection->kind == TRANSPORT_PIPE) {
+		return FALSE;
+	}
+#ifdef _WIN32
+	DWORD timeout = dwTimeoutMs;
+#else
+	struct timeval timeout;
+	timeout.tv_sec = dwTimeoutMs / 1000;
+	timeout.tv_usec = (dwTimeoutMs % 1000) * 1000;
+#endif
+	return setsockopt(connection->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == 0 &&
+		setsockopt(connection->socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout)) == 0;
+}
+
+BOOL setConnectionNonBlocking(LPConnectionT connection)
+{
+	if (connection->kind == TRANSPORT_PIPE) {
+		return FALSE;
+	}
+#ifdef _WIN32
+	u_long nonBlocking = 1;
+	return ioctlsocket(connection->socket, FIONBIO, &nonBlocking) == 0;
+#else
+	INT flags = fcntl(connection->socket, F_GETFL, 0);
+	return flags >= 0 && fcntl(connection->socket, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+/*
+ * Tells if the last socket call failed only because it would have blocked.
+ */
+static BOOL socketWouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+BOOL transportReadSome(LPConnectionT connection, LPVOID buff, DWORD cbMax, LPDWORD pcbRead)
+{
+	INT cbResult;
+
+	*pcbRead = 0;
+	if (connection->kind == TRANSPORT_PIPE) {
+		return FALSE;
+	}
+
+	cbResult = (INT)recv(connection->socket, (char*)buff, (INT)cbMax, 0);
+	if (cbResult == SOCKET_ERROR) {
+		return socketWouldBlock();
+	}
+	if (cbResult == 0) {
+		// peer closed the connection
+		return FALSE;
+	}
+	*pcbRead = (DWORD)cbResult;
+	return TRUE;
+}
+
+BOOL transportWriteSome(LPConnectionT connection, const void *buff, DWORD cbMax, LPDWORD pcbWritten)
+{
+	INT cbResult;
+
+	*pcbWritten = 0;
+	if (connection->kind == TRANSPORT_PIPE) {
+		return FALSE;
+	}
+
+	cbResult = (INT)send(connection->socket, (const char*)buff, (INT)cbMax, MSG_NOSIGNAL);
+	if (cbResult == SOCKET_ERROR) {
+		return socketWouldBlock();
+	}
+	*pcbWritten = (DWORD)cbResult;
+	return TRUE;
+}
+
+BOOL transportWriteSomeGather(LPConnectionT connection, const TransportBufferT *buffers, DWORD nrBuffers, LPDWORD pcbWritten)
+{
+	INT cbResult;
+
+	*pcbWritten = 0;
+	if (connection->kind == TRANSPORT_PIPE) {
+		return FALSE;
+	}
+
+	cbResult = socketSendGather(connection->socket, buffers, nrBuffers);
+	if (cbResult == SOCKET_ERROR) {
+		return socketWouldBlock();
+	}
+	*pcbWritten = (DWORD)cbResult;
+	return TRUE;
+}
@@ -2,141 +2,828 @@
 
 #include "UserManagement.h"
 
-unsigned int credential_hash(const LPCredentialT credential) 
+#define INITIAL_TABLE_SLOTS 16
+// how often a reload checks whether the readers of the old epoch are gone
+#define READERS_POLL_MS 1
+
+typedef struct LoginCacheSetTag {
+	CRITICAL_SECTION criticalSection;
+	BYTE digests[LOGIN_CACHE_WAYS][SHA256_DIGEST_SIZE];
+	// 0 for an empty way, the least recently used way is replaced
+	ULONGLONG qwLastUsed[LOGIN_CACHE_WAYS];
+	ULONGLONG qwClock;
+}LoginCacheSetT, *LPLoginCacheSetT;
+
+/*
+ * Each set has its own lock, logins of different users seldom wait for each other.
+ */
+typedef struct LoginCacheTag {
+	// keys the digests, they cannot be computed without it
+	BYTE secret[SHA256_DIGEST_SIZE];
+	DWORD nrSets;
+	LoginCacheSetT sets[1];
+}LoginCacheT, *LPLoginCacheT;
+
+/*
+ * FNV-1a over the characters of the name.
+ */
+static DWORD hashUserName(const TCHAR *sUserName, DWORD cchUserName)
 {
-	unsigned int hash = 5381;
-	int c;
+	const BYTE *p = (const BYTE*)sUserName;
+	DWORD cb = cchUserName * sizeof(TCHAR);
+	DWORD hash = 2166136261u;
 
-	TCHAR *walker = credential->sUserName;
-	while ((c = *walker++) != '\0') {
-		hash = ((hash << 5) + hash) + c;
+	for (DWORD i = 0; i < cb; i++) {
+		hash = (hash ^ p[i]) * 16777619u;
 	}
 	return hash;
 }
 
-int compare_credential(const LPCredentialT a, const LPCredentialT b)
+static LPCredentialTableT createTable(DWORD nrSlots)
+{
+	LPCredentialTableT table = (LPCredentialTableT)calloc(1, sizeof(CredentialTableT) + (nrSlots - 1) * sizeof(CredentialSlotT));
+	if (table == NULL) {
+		return NULL;
+	}
+	table->dwMask = nrSlots - 1;
+	return table;
+}
+
+static BOOL slotNameEquals(const CredentialSlotT *slot, const TCHAR *sUserName, DWORD cchUserName)
+{
+	if (cchUserName < CREDENTIAL_INLINE_NAME) {
+		return memcmp(slot->sInlineName, sUserName, cchUserName * sizeof(TCHAR)) == 0;
+	}
+	LPCredentialT credential = slot->credential;
+	return credential != NULL && memcmp(credential->sUserName, sUserName, cchUserName * sizeof(TCHAR)) == 0;
+}
+
+/*
+ * Probes the table for the name. A slot closer to its home than the probe ends the search,
+ * the name would have taken its place on insert.
+ * The probe is bounded by the table size, a reader racing with an insert may see any slot contents.
+ */
+static LPCredentialT probeTable(const CredentialTableT *table, DWORD dwHash, const TCHAR *sUserName, DWORD cchUserName)
+{
+	DWORD index = dwHash & table->dwMask;
+
+	for (DWORD dwDistance = 1; dwDistance <= table->dwMask + 1; dwDistance++) {
+		const CredentialSlotT *slot = &table->slots[index];
+		if (slot->dwDistance < dwDistance) {
+			return NULL;
+		}
+		if (slot->dwHash == dwHash && slot->cchName == cchUserName && slotNameEquals(slot, sUserName, cchUserName)) {
+			return slot->credential;
+		}
+		index = (index + 1) & table->dwMask;
+	}
+	return NULL;
+}
+
+/*
+ * Robin Hood insert: the entry takes the slot of any resident that is closer to its home.
+ */
+static VOID placeSlot(LPCredentialTableT table, CredentialSlotT entry)
+{
+	DWORD index = entry.dwHash & table->dwMask;
+	entry.dwDistance = 1;
+
+	for (;;) {
+		LPCredentialSlotT slot = &table->slots[index];
+		if (slot->dwDistance == 0) {
+			*slot = entry;
+			break;
+		}
+		if (slot->dwDistance < entry.dwDistance) {
+			CredentialSlotT resident = *slot;
+			*slot = entry;
+			entry = resident;
+		}
+		index = (index + 1) & table->dwMask;
+		entry.dwDistance++;
+	}
+	table->nrCredentials++;
+}
+
+static CredentialSlotT makeSlot(LPCredentialT credential)
+{
+	CredentialSlotT entry;
+
+	entry.dwDistance = 0;
+	entry.cchName = credential->cchUserName;
+	entry.dwHash = hashUserName(credential->sUserName, entry.cchName);
+	entry.credential = credential;
+	memset(entry.sInlineName, 0, sizeof(entry.sInlineName));
+	if (entry.cchName < CREDENTIAL_INLINE_NAME) {
+		memcpy(entry.sInlineName, credential->sUserName, entry.cchName * sizeof(TCHAR));
+	}
+	return entry;
+}
+
+/*
+ * @return the number of slots keeping nrCredentials at most 3/4 full.
+ */
+static DWORD getTableSlots(DWORD nrCredentials)
+{
+	DWORD nrSlots = INITIAL_TABLE_SLOTS;
+
+	while (nrCredentials * 4 > nrSlots * 3) {
+		nrSlots *= 2;
+	}
+	return nrSlots;
+}
+
+/*
+ * Adds a credential to a table no reader sees yet, the table is replaced when it grows.
+ *
+ * @return FALSE if out of memory.
+ */
+static BOOL addStagedCredential(LPCredentialTableT *pTable, LPCredentialT credential)
+{
+	CredentialSlotT entry = makeSlot(credential);
+	LPCredentialTableT table = *pTable;
+
+	if ((table->nrCredentials + 1) * 4 > (table->dwMask + 1) * 3) {
+		LPCredentialTableT bigger = createTable(2 * (table->dwMask + 1));
+		if (bigger == NULL) {
+			return FALSE;
+		}
+		for (DWORD i = 0; i <= table->dwMask; i++) {
+			if (table->slots[i].dwDistance != 0) {
+				placeSlot(bigger, table->slots[i]);
+			}
+		}
+		free(table);
+		*pTable = table = bigger;
+	}
+	placeSlot(table, entry);
+	return TRUE;
+}
+
+/*
+ * Enters a read section: the tables and password hashes read until leaveReadSection are not freed.
+ *
+ * @return the counter to pass to leaveReadSection.
+ */
+static LONG enterReadSection(LPCredentialManagerT manager)
+{
+	for (;;) {
+		LONG dwEpoch = ReadAcquire(&manager->dwEpoch);
+		InterlockedIncrement(&manager->nrReaders[dwEpoch & 1]);
+		// a reader counted after the reload flipped the epoch would not be waited for
+		if (ReadAcquire(&manager->dwEpoch) == dwEpoch) {
+			return dwEpoch & 1;
+		}
+		InterlockedDecrement(&manager->nrReaders[dwEpoch & 1]);
+	}
+}
+
+static VOID leaveReadSection(LPCredentialManagerT manager, LONG dwReaders)
+{
+	InterlockedDecrement(&manager->nrReaders[dwReaders]);
+}
+
+/*
+ * Waits until every read section entered before the call is left, reloads call it one at a time.
+ * Read sections entered afterwards only see what was published before the call.
+ */
+static VOID waitForReaders(LPCredentialManagerT manager)
+{
+	LONG dwEpoch = InterlockedIncrement(&manager->dwEpoch) - 1;
+
+	while (ReadAcquire(&manager->nrReaders[dwEpoch & 1]) != 0) {
+		Sleep(READERS_POLL_MS);
+	}
+}
+
+static VOID freeTables(LPCredentialTableT table)
+{
+	while (table != NULL) {
+		LPCredentialTableT retired = table->retired;
+		free(table);
+		table = retired;
+	}
+}
+
+/*
+ * Copies the table into one twice as big and publishes it.
+ * The old table is not changed anymore, so readers still probing it stay consistent.
+ */
+static BOOL growTable(LPCredentialManagerT manager)
+{
+	LPCredentialTableT old = manager->table;
+	LPCredentialTableT table = createTable(2 * (old->dwMask + 1));
+	if (table == NULL) {
+		return FALSE;
+	}
+
+	for (DWORD i = 0; i <= old->dwMask; i++) {
+		if (old->slots[i].dwDistance != 0) {
+			placeSlot(table, old->slots[i]);
+		}
+	}
+	table->retired = old;
+	WritePointerRelease((LPVOID volatile*)&manager->table, table);
+	return TRUE;
+}
+
+static LPLoginCacheT createLoginCache(DWORD nrCachedLogins)
+{
+	DWORD nrSets = (nrCachedLogins + LOGIN_CACHE_WAYS - 1) / LOGIN_CACHE_WAYS;
+	LPLoginCacheT cache = (LPLoginCacheT)calloc(1, sizeof(LoginCacheT) + (nrSets - 1) * sizeof(LoginCacheSetT));
+	if (cache == NULL) {
+		return NULL;
+	}
+
+	for (DWORD i = 0; i < SHA256_DIGEST_SIZE; i += sizeof(UINT)) {
+		UINT dwRandom;
+		if (rand_s(&dwRandom) != 0) {
+			free(cache);
+			return NULL;
+		}
+		memcpy(cache->secret + i, &dwRandom, sizeof(UINT));
+	}
+	cache->nrSets = nrSets;
+	for (DWORD i = 0; i < nrSets; i++) {
+		InitializeCriticalSection(&cache->sets[i].criticalSection);
+	}
+	return cache;
+}
+
+static VOID destroyLoginCache(LPLoginCacheT cache)
+{
+	for (DWORD i = 0; i < cache->nrSets; i++) {
+		DeleteCriticalSection(&cache->sets[i].criticalSection);
+	}
+	memset(cache->secret, 0, sizeof(cache->secret));
+	free(cache);
+}
+
+/*
+ * Digest of a login keyed by the secret of the cache. The stored hash is part of it,
+ * a login cached before the password changed no longer matches.
+ */
+static VOID getLoginDigest(LPLoginCacheT cache, LPCredentialT credential, const PasswordHashT *passwordHash,
+	PTCHAR sPassword, PBYTE digest)
+{
+	Sha256T sha;
+
+	sha256Init(&sha);
+	sha256Update(&sha, cache->secret, sizeof(cache->secret));
+	sha256Update(&sha, credential->sUserName, (credential->cchUserName + 1) * sizeof(TCHAR));
+	sha256Update(&sha, sPassword, (DWORD)(_tcslen(sPassword) * sizeof(TCHAR)));
+	sha256Update(&sha, passwordHash->salt, PASSWORD_SALT_SIZE);
+	sha256Update(&sha, passwordHash->hash, PASSWORD_HASH_SIZE);
+	sha256Final(&sha, digest);
+}
+
+static LPLoginCacheSetT getLoginSet(LPLoginCacheT cache, const BYTE *digest)
+{
+	DWORD dwIndex;
+
+	memcpy(&dwIndex, digest, sizeof(dwIndex));
+	return &cache->sets[dwIndex % cache->nrSets];
+}
+
+static BOOL lookupLogin(LPLoginCacheT cache, const BYTE *digest)
+{
+	LPLoginCacheSetT set = getLoginSet(cache, digest);
+	BOOL bFound = FALSE;
+
+	EnterCriticalSection(&set->criticalSection);
+	for (DWORD i = 0; i < LOGIN_CACHE_WAYS; i++) {
+		if (set->qwLastUsed[i] != 0 && memcmp(set->digests[i], digest, SHA256_DIGEST_SIZE) == 0) {
+			set->qwLastUsed[i] = ++set->qwClock;
+			bFound = TRUE;
+			break;
+		}
+	}
+	LeaveCriticalSection(&set->criticalSection);
+	return bFound;
+}
+
+static VOID rememberLogin(LPLoginCacheT cache, const BYTE *digest)
+{
+	LPLoginCacheSetT set = getLoginSet(cache, digest);
+	DWORD dwVictim = 0;
+
+	EnterCriticalSection(&set->criticalSection);
+	for (DWORD i = 0; i < LOGIN_CACHE_WAYS; i++) {
+		if (set->qwLastUsed[i] != 0 && memcmp(set->digests[i], digest, SHA256_DIGEST_SIZE) == 0) {
+			// logged in by another thread meanwhile
+			dwVictim = i;
+			break;
+		}
+		if (set->qwLastUsed[i] < set->qwLastUsed[dwVictim]) {
+			dwVictim = i;
+		}
+	}
+	memcpy(set->digests[dwVictim], digest, SHA256_DIGEST_SIZE);
+	set->qwLastUsed[dwVictim] = ++set->qwClock;
+	LeaveCriticalSection(&set->criticalSection);
+}
+
+static VOID resetLoginThrottle(LPLoginThrottleT throttle)
 {
-	return _tcscmp(a->sUserName, b->sUserName);
+	if (ReadAcquire(&throttle->nrFailures) != 0) {
+		WriteRelease(&throttle->nrFailures, 0);
+		WriteRelease64(&throttle->qwRetryAfterMs, 0);
+	}
+}
+
+static BOOL isLoginThrottled(LPLoginThrottleT throttle)
+{
+	return GetTickCount64() < (ULONGLONG)ReadAcquire64(&throttle->qwRetryAfterMs);
+}
+
+/*
+ * Past LOGIN_FREE_FAILURES failures in a row the next logins are rejected for a while,
+ * twice as long after each failure up to LOGIN_MAX_THROTTLE_MS.
+ */
+static VOID onLoginFailed(LPLoginThrottleT throttle)
+{
+	LONG nrFailures = InterlockedIncrement(&throttle->nrFailures);
+	ULONGLONG qwDelayMs = LOGIN_THROTTLE_MS;
+
+	if (nrFailures <= LOGIN_FREE_FAILURES) {
+		return;
+	}
+	for (LONG i = LOGIN_FREE_FAILURES + 1; i < nrFailures && qwDelayMs < LOGIN_MAX_THROTTLE_MS; i++) {
+		qwDelayMs *= 2;
+	}
+	if (qwDelayMs > LOGIN_MAX_THROTTLE_MS) {
+		qwDelayMs = LOGIN_MAX_THROTTLE_MS;
+	}
+	WriteRelease64(&throttle->qwRetryAfterMs, (LONGLONG)(GetTickCount64() + qwDelayMs));
 }
 
-LPCredentialManagerT create_CredentialManagerT()
+LPCredentialManagerT create_CredentialManagerT(DWORD dwKdfLogCost, DWORD nrCachedLogins)
 {
-	LPCredentialManagerT manager = (LPCredentialManagerT)malloc(sizeof(CredentialManagerT));
+	LPCredentialManagerT manager = (LPCredentialManagerT)calloc(1, sizeof(CredentialManagerT));
 	if (manager == NULL) {
 		return NULL;
 	}
 
-	manager->hash_table = create_empty_GenericHashTableT((unsigned(*)(const void*))credential_hash);
-	if (manager->hash_table == NULL) {
+	manager->dwKdfLogCost = dwKdfLogCost;
+	if (!hashPassword(_T(""), dwKdfLogCost, &manager->unknownUserHash)) {
 		free(manager);
 		return NULL;
 	}
+	if (nrCachedLogins != 0) {
+		manager->loginCache = createLoginCache(nrCachedLogins);
+		if (manager->loginCache == NULL) {
+			free(manager);
+			return NULL;
+		}
+	}
+	manager->table = createTable(INITIAL_TABLE_SLOTS);
+	if (manager->table == NULL) {
+		if (manager->loginCache != NULL) {
+			destroyLoginCache(manager->loginCache);
+		}
+		free(manager);
+		return NULL;
+	}
+	InitializeCriticalSection(&manager->csWriters);
+	InitializeCriticalSection(&manager->csReload);
 
 	return manager;
 }
 
-LPCredentialT create_CredentialT(PTCHAR sUserName, PTCHAR sPassword)
+LPCredentialT create_CredentialT(PTCHAR sUserName, const PasswordHashT *passwordHash)
 {
 	LPCredentialT credential = (LPCredentialT)malloc(sizeof(CredentialT));
 	if (credential == NULL) {
 		return NULL;
 	}
 
-	credential->sUserName = (PTCHAR)malloc(sizeof(TCHAR) * _tcslen(sUserName));
-	if (credential->sUserName == NULL) {
-		free(credential);
-		return NULL;
-	}
-
-	credential->sPassword = (PTCHAR)malloc(sizeof(TCHAR) * _tcslen(sPassword));
-	if (credential->sPassword == NULL) {
+	credential->sUserName = _tcsdup(sUserName);
+	credential->passwordHash = (LPPasswordHashT)malloc(sizeof(PasswordHashT));
+	if (credential->sUserName == NULL || credential->passwordHash == NULL) {
 		free(credential->sUserName);
+		free(credential->passwordHash);
 		free(credential);
 		return NULL;
 	}
-	_tcscpy(credential->sUserName, sUserName);
-	_tcscpy(credential->sPassword, sPassword);
-	credential->nrBytesEncrypted = 0;
+	*credential->passwordHash = *passwordHash;
+	credential->cchUserName = (DWORD)_tcslen(sUserName);
+	credential->qwBytesEncrypted = 0;
+	credential->qwBytesJournaled = 0;
 	credential->bConnected = FALSE;
+	credential->bRemoved = FALSE;
+	resetLoginThrottle(&credential->throttle);
 
 	return credential;
 }
 
-LPCredentialManagerT loadCredentialsFromFile(PTCHAR path)
+VOID destroy_CredentialT(LPCredentialT credential)
+{
+	free(credential->sUserName);
+	memset(credential->passwordHash, 0, sizeof(PasswordHashT));
+	free(credential->passwordHash);
+	memset(credential, 0, sizeof(CredentialT));
+	free(credential);
+}
+
+static LPCredentialT lookupCredential(LPCredentialManagerT manager, const TCHAR *sUserName, DWORD cchUserName);
+
+/*
+ * Parses the credential file into a table of new credentials, no reader sees it yet.
+ * A plain text password that matches the hash of the user in the manager keeps that hash.
+ *
+ * @return the table, or NULL if the file could not be opened or out of memory.
+ */
+static LPCredentialTableT parseCredentialFile(LPCredentialManagerT manager, PTCHAR path, LPDWORD pnrPlainPasswords)
 {
 	TCHAR buffer[1024];
+	LPCredentialTableT table;
+	BOOL bFailed = FALSE;
 	FILE *file = _tfopen(path, _T("r"));
 	if (file == NULL) {
 		return NULL;
 	}
 
-	LPCredentialManagerT manager = create_CredentialManagerT();
-	if (manager == NULL) {
+	table = createTable(INITIAL_TABLE_SLOTS);
+	if (table == NULL) {
+		fclose(file);
 		return NULL;
 	}
 
-	while(_fgetts(buffer, 1024, file) != NULL) {
-		PTCHAR sUserName = _tcstok(buffer, _T(";\n"));
-		PTCHAR sPassword = _tcstok(NULL, _T(";\n"));
-		CredentialT *credential = create_CredentialT(sUserName, sPassword);
+	*pnrPlainPasswords = 0;
+	while(!bFailed && _fgetts(buffer, 1024, file) != NULL) {
+		PTCHAR sUserName = _tcstok(buffer, _T(";\r\n"));
+		PTCHAR sPassword = _tcstok(NULL, _T(";\r\n"));
+		PasswordHashT passwordHash;
+		BOOL bHashed = FALSE;
+		// a user listed twice keeps its first line
+		if (sUserName == NULL || sPassword == NULL ||
+			probeTable(table, hashUserName(sUserName, (DWORD)_tcslen(sUserName)), sUserName, (DWORD)_tcslen(sUserName)) != NULL) {
+			continue;
+		}
 
-		insertCredentials(manager, credential);
-	}
+		if (parsePasswordHash(sPassword, &passwordHash)) {
+			bHashed = TRUE;
+		} else if (sPassword[0] != '$') {
+			LONG dwReaders = enterReadSection(manager);
+			LPCredentialT existing = lookupCredential(manager, sUserName, (DWORD)_tcslen(sUserName));
+			const PasswordHashT *existingHash = (existing != NULL) ?
+				(const PasswordHashT*)ReadPointerAcquire((LPVOID const volatile*)&existing->passwordHash) : NULL;
+
+			if (existingHash != NULL && verifyPassword(existingHash, sPassword)) {
+				passwordHash = *existingHash;
+				bHashed = TRUE;
+			} else {
+				bHashed = hashPassword(sPassword, manager->dwKdfLogCost, &passwordHash);
+			}
+			leaveReadSection(manager, dwReaders);
+			(*pnrPlainPasswords)++;
+		}
 
+		if (bHashed) {
+			LPCredentialT credential = create_CredentialT(sUserName, &passwordHash);
+			if (credential == NULL || !addStagedCredential(&table, credential)) {
+				if (credential != NULL) {
+					destroy_CredentialT(credential);
+				}
+				bFailed = TRUE;
+			}
+		}
+	}
+	memset(buffer, 0, sizeof(buffer));
 	fclose(file);
-	return manager;
+
+	if (bFailed) {
+		for (DWORD i = 0; i <= table->dwMask; i++) {
+			if (table->slots[i].dwDistance != 0) {
+				destroy_CredentialT(table->slots[i].credential);
+			}
+		}
+		free(table);
+		return NULL;
+	}
+	return table;
 }
 
-BOOL insertCredentials(LPCredentialManagerT manager, LPCredentialT credential)
+/*
+ * Merges the parsed credentials into a new table and publishes it.
+ * The users of the live table keep their credentials: a changed password swaps its hash
+ * with the parsed credential, which is freed with the replaced tables after waitForReaders.
+ *
+ * @return the new table, or NULL if out of memory; *pRetired gets the tables to free.
+ */
+static LPCredentialTableT swapCredentialTable(LPCredentialManagerT manager, LPCredentialTableT staged,
+	LPCredentialTableT *pRetired)
 {
-	if (search_element_in_hash_table(manager->hash_table, credential,
-		(int(*)(const void*, const void*)) compare_credential) != NULL) {
-			return FALSE;
+	LPCredentialTableT live;
+	LPCredentialTableT table;
+
+	EnterCriticalSection(&manager->csWriters);
+	live = manager->table;
+	table = createTable(getTableSlots(staged->nrCredentials + live->nrCredentials));
+	if (table == NULL) {
+		LeaveCriticalSection(&manager->csWriters);
+		return NULL;
 	}
-	add_element_in_hash_table(manager->hash_table, credential);
-	return TRUE;
+
+	for (DWORD i = 0; i <= staged->dwMask; i++) {
+		LPCredentialSlotT slot = &staged->slots[i];
+		if (slot->dwDistance == 0) {
+			continue;
+		}
+		LPCredentialT credential = probeTable(live, slot->dwHash, slot->credential->sUserName, slot->cchName);
+		if (credential == NULL) {
+			placeSlot(table, *slot);
+			// adopted by the new table
+			slot->credential = NULL;
+			continue;
+		}
+		if (memcmp(credential->passwordHash, slot->credential->passwordHash, sizeof(PasswordHashT)) != 0) {
+			LPPasswordHashT replaced = credential->passwordHash;
+			WritePointerRelease((LPVOID volatile*)&credential->passwordHash, slot->credential->passwordHash);
+			slot->credential->passwordHash = replaced;
+			// the failures were guesses of the old password
+			resetLoginThrottle(&credential->throttle);
+		}
+		InterlockedExchange(&credential->bRemoved, FALSE);
+		placeSlot(table, makeSlot(credential));
+	}
+
+	for (DWORD i = 0; i <= live->dwMask; i++) {
+		LPCredentialSlotT slot = &live->slots[i];
+		if (slot->dwDistance != 0 && probeTable(table, slot->dwHash, slot->credential->sUserName, slot->cchName) == NULL) {
+			InterlockedExchange(&slot->credential->bRemoved, TRUE);
+			placeSlot(table, *slot);
+			table->nrRemoved++;
+		}
+	}
+
+	WritePointerRelease((LPVOID volatile*)&manager->table, table);
+	LeaveCriticalSection(&manager->csWriters);
+
+	*pRetired = live;
+	return table;
 }
 
-BOOL checkClientCredentials(LPCredentialManagerT manager, LPCredentialT credential)
+/*
+ * Frees a parsed table and the credentials the new table did not adopt.
+ */
+static VOID freeStagedTable(LPCredentialTableT staged)
 {
-	LPCredentialT found_cred = (LPCredentialT)search_element_in_hash_table(manager->hash_table, credential,
-		(int(*)(const void*, const void*)) compare_credential);
+	for (DWORD i = 0; i <= staged->dwMask; i++) {
+		if (staged->slots[i].dwDistance != 0 && staged->slots[i].credential != NULL) {
+			destroy_CredentialT(staged->slots[i].credential);
+		}
+	}
+	free(staged);
+}
 
-	if (found_cred == NULL) {
+static BOOL reloadCredentials(LPCredentialManagerT manager, PTCHAR path)
+{
+	LPCredentialTableT staged;
+	LPCredentialTableT retired;
+	DWORD nrPlainPasswords;
+
+	staged = parseCredentialFile(manager, path, &nrPlainPasswords);
+	if (staged == NULL) {
 		return FALSE;
 	}
-	BOOL bValid = _tcscmp(found_cred->sPassword, credential->sPassword) == 0;
-	if (bValid) {
-		found_cred->bConnected = TRUE;
+	if (swapCredentialTable(manager, staged, &retired) == NULL) {
+		freeStagedTable(staged);
+		return FALSE;
 	}
+	manager->nrPlainPasswords = nrPlainPasswords;
 
-	return bValid;
+	waitForReaders(manager);
+	freeStagedTable(staged);
+	freeTables(retired);
+	return TRUE;
 }
 
-BOOL addBytesToClientAndDisconnect(LPCredentialManagerT manager, PTCHAR clientName, DWORD nrBytes)
+LPCredentialManagerT loadCredentialsFromFile(PTCHAR path, DWORD dwKdfLogCost, DWORD nrCachedLogins)
 {
-	LPCredentialT credential = create_CredentialT(clientName, _T("asdf"));
-	
-	LPCredentialT found_cred = (LPCredentialT)search_element_in_hash_table(manager->hash_table, credential,
-		(int(*)(const void*, const void*)) compare_credential);
+	LPCredentialManagerT manager = create_CredentialManagerT(dwKdfLogCost, nrCachedLogins);
+	if (manager == NULL) {
+		return NULL;
+	}
 
-	if (found_cred == NULL) {
-		return FALSE;
+	if (!reloadCredentials(manager, path)) {
+		destroyCredentialManager(manager);
+		return NULL;
 	}
+	return manager;
+}
 
-	found_cred->nrBytesEncrypted += nrBytes;
-	found_cred->bConnected = FALSE;
+BOOL reloadCredentialsFromFile(LPCredentialManagerT manager, PTCHAR path)
+{
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER start;
+	LARGE_INTEGER end;
+	BOOL bReloaded;
 
-	return TRUE;
+	EnterCriticalSection(&manager->csReload);
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	bReloaded = reloadCredentials(manager, path);
+	QueryPerformanceCounter(&end);
+	LeaveCriticalSection(&manager->csReload);
+
+	if (bReloaded) {
+		InterlockedExchangeAdd64(&manager->nrReloads, 1);
+		WriteRelease64(&manager->qwLastReloadUs, (end.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart);
+	} else {
+		InterlockedExchangeAdd64(&manager->nrReloadFailures, 1);
+	}
+	return bReloaded;
+}
+
+VOID destroyCredentialManager(LPCredentialManagerT manager)
+{
+	LPCredentialTableT table = manager->table;
+
+	for (DWORD i = 0; i <= table->dwMask; i++) {
+		if (table->slots[i].dwDistance != 0) {
+			destroy_CredentialT(table->slots[i].credential);
+		}
+	}
+	freeTables(table);
+	if (manager->loginCache != NULL) {
+		destroyLoginCache(manager->loginCache);
+	}
+	DeleteCriticalSection(&manager->csWriters);
+	DeleteCriticalSection(&manager->csReload);
+	free(manager);
+}
+
+BOOL insertCredentials(LPCredentialManagerT manager, LPCredentialT credential)
+{
+	CredentialSlotT entry = makeSlot(credential);
+	BOOL bInserted = FALSE;
+
+	EnterCriticalSection(&manager->csWriters);
+	if (probeTable(manager->table, entry.dwHash, credential->sUserName, entry.cchName) == NULL &&
+		((manager->table->nrCredentials + 1) * 4 <= (manager->table->dwMask + 1) * 3 || growTable(manager))) {
+		// odd while the slots move, lookups started meanwhile retry
+		InterlockedIncrement(&manager->dwSequence);
+		placeSlot(manager->table, entry);
+		InterlockedIncrement(&manager->dwSequence);
+		bInserted = TRUE;
+	}
+	LeaveCriticalSection(&manager->csWriters);
+
+	return bInserted;
+}
+
+/*
+ * Looks up a user inside a read section, the table probed stays allocated.
+ */
+static LPCredentialT lookupCredential(LPCredentialManagerT manager, const TCHAR *sUserName, DWORD cchUserName)
+{
+	DWORD dwHash = hashUserName(sUserName, cchUserName);
+
+	for (;;) {
+		LONG dwSequence = ReadAcquire(&manager->dwSequence);
+		if (dwSequence & 1) {
+			YieldProcessor();
+			continue;
+		}
+
+		const CredentialTableT *table = (const CredentialTableT*)ReadPointerAcquire((LPVOID const volatile*)&manager->table);
+		LPCredentialT credential = probeTable(table, dwHash, sUserName, cchUserName);
+
+		// the slot reads must complete before the sequence is checked again
+		MemoryBarrier();
+		if (ReadAcquire(&manager->dwSequence) == dwSequence) {
+			return credential;
+		}
+	}
+}
+
+LPCredentialT findCredential(LPCredentialManagerT manager, const TCHAR *sUserName, DWORD cchUserName)
+{
+	LONG dwReaders = enterReadSection(manager);
+	LPCredentialT credential = lookupCredential(manager, sUserName, cchUserName);
+
+	leaveReadSection(manager, dwReaders);
+	return credential;
+}
+
+/*
+ * The whole login runs in a read section, a reload meanwhile does not free the hash it verifies.
+ */
+LPCredentialT checkClientCredentials(LPCredentialManagerT manager, PTCHAR sUserName, PTCHAR sPassword)
+{
+	LONG dwReaders = enterReadSection(manager);
+	LPCredentialT credential = lookupCredential(manager, sUserName, (DWORD)_tcslen(sUserName));
+	// copied out of the read section, a reload may free the hash once the section is left
+	PasswordHashT passwordHash;
+	BYTE digest[SHA256_DIGEST_SIZE];
+	BOOL bVerified;
+
+	if (credential == NULL || ReadAcquire(&credential->bRemoved)) {
+		leaveReadSection(manager, dwReaders);
+		if (isLoginThrottled(&manager->unknownUserThrottle)) {
+			InterlockedExchangeAdd64(&manager->nrThrottled, 1);
+		} else {
+			// the hash of the unknown users is never replaced
+			verifyPassword(&manager->unknownUserHash, sPassword);
+			InterlockedExchangeAdd64(&manager->nrKdfRuns, 1);
+			onLoginFailed(&manager->unknownUserThrottle);
+		}
+		InterlockedExchangeAdd64(&manager->nrRejected, 1);
+		return NULL;
+	}
+	passwordHash = *(const PasswordHashT*)ReadPointerAcquire((LPVOID const volatile*)&credential->passwordHash);
+
+	if (manager->loginCache != NULL) {
+		getLoginDigest(manager->loginCache, credential, &passwordHash, sPassword, digest);
+		if (lookupLogin(manager->loginCache, digest)) {
+			leaveReadSection(manager, dwReaders);
+			InterlockedExchangeAdd64(&manager->nrCacheHits, 1);
+			InterlockedExchange(&credential->bConnected, TRUE);
+			return credential;
+		}
+	}
+	leaveReadSection(manager, dwReaders);
+
+	// a cached login gets in while the user is throttled, only new passwords are held back
+	if (isLoginThrottled(&credential->throttle)) {
+		InterlockedExchangeAdd64(&manager->nrThrottled, 1);
+		InterlockedExchangeAdd64(&manager->nrRejected, 1);
+		memset(&passwordHash, 0, sizeof(PasswordHashT));
+		return NULL;
+	}
+
+	InterlockedExchangeAdd64(&manager->nrKdfRuns, 1);
+	bVerified = verifyPassword(&passwordHash, sPassword);
+	memset(&passwordHash, 0, sizeof(PasswordHashT));
+	if (!bVerified) {
+		onLoginFailed(&credential->throttle);
+		InterlockedExchangeAdd64(&manager->nrRejected, 1);
+		return NULL;
+	}
+	resetLoginThrottle(&credential->throttle);
+	if (manager->loginCache != NULL) {
+		rememberLogin(manager->loginCache, digest);
+	}
+	InterlockedExchange(&credential->bConnected, TRUE);
+
+	return credential;
+}
+
+VOID getCredentialStats(LPCredentialManagerT manager, LPCredentialStatsT stats)
+{
+	LONG dwReaders = enterReadSection(manager);
+	const CredentialTableT *table = (const CredentialTableT*)ReadPointerAcquire((LPVOID const volatile*)&manager->table);
+
+	stats->nrCredentials = table->nrCredentials - table->nrRemoved;
+	stats->nrRemoved = table->nrRemoved;
+	stats->nrSlots = table->dwMask + 1;
+	leaveReadSection(manager, dwReaders);
+	stats->nrPlainPasswords = manager->nrPlainPasswords;
+	stats->dwKdfLogCost = manager->dwKdfLogCost;
+	stats->nrCachedLogins = (manager->loginCache != NULL) ? manager->loginCache->nrSets * LOGIN_CACHE_WAYS : 0;
+	stats->nrCacheHits = (ULONGLONG)ReadAcquire64(&manager->nrCacheHits);
+	stats->nrKdfRuns = (ULONGLONG)ReadAcquire64(&manager->nrKdfRuns);
+	stats->nrRejected = (ULONGLONG)ReadAcquire64(&manager->nrRejected);
+	stats->nrThrottled = (ULONGLONG)ReadAcquire64(&manager->nrThrottled);
+	stats->nrReloads = (ULONGLONG)ReadAcquire64(&manager->nrReloads);
+	stats->nrReloadFailures = (ULONGLONG)ReadAcquire64(&manager->nrReloadFailures);
+	stats->qwLastReloadUs = (ULONGLONG)ReadAcquire64(&manager->qwLastReloadUs);
+}
+
+VOID visitCredentials(LPCredentialManagerT manager, VOID(*visit)(LPCredentialT credential, LPVOID context), LPVOID context)
+{
+	EnterCriticalSection(&manager->csWriters);
+	LPCredentialTableT table = manager->table;
+	for (DWORD i = 0; i <= table->dwMask; i++) {
+		if (table->slots[i].dwDistance != 0) {
+			visit(table->slots[i].credential, context);
+		}
+	}
+	LeaveCriticalSection(&manager->csWriters);
+}
+
+static VOID printCredential(LPCredentialT credential, LPVOID context)
+{
+	print_CredentialT(credential, (FILE*)context);
+	_ftprintf((FILE*)context, _T("\n"));
 }
 
 VOID listCredentials(LPCredentialManagerT manager)
 {
-	print_elements_in_hash_table(manager->hash_table, stdout, print_CredentialT);
+	CredentialStatsT stats;
+
+	visitCredentials(manager, printCredential, stdout);
+
+	getCredentialStats(manager, &stats);
+	_tprintf(_T("logins: scrypt N=2^%u, %llu from the cache of %u, %llu verified with the KDF, %llu rejected, %llu of them throttled\n"),
+		stats.dwKdfLogCost, stats.nrCacheHits, stats.nrCachedLogins, stats.nrKdfRuns, stats.nrRejected, stats.nrThrottled);
 }
 
 void print_CredentialT(const void *e, FILE* file)
 {
 	LPCredentialT a = (LPCredentialT)e;
-	_ftprintf(file, _T("name: %s, pass: %s, bytes: %lu, connected: %d"), a->sUserName, a->sPassword, a->nrBytesEncrypted, a->bConnected);
+	_ftprintf(file, _T("name: %s, bytes: %llu, connected: %d%s"), a->sUserName,
+		(ULONGLONG)ReadAcquire64(&a->qwBytesEncrypted), (INT)ReadAcquire(&a->bConnected),
+		ReadAcquire(&a->bRemoved) ? _T(", removed") : _T(""));
 }
@@ -3,35 +3,192 @@
 #ifndef USER_MANAGEMENT_H
 #define USER_MANAGEMENT_H
 
-#include "Everything.h"
-#include "generic_hash_table.h"
+#include "Portability.h"
+#include "PasswordHash.h"
 
-typedef struct CredentialManagerTag{
-	GenericHashTableT *hash_table;
-}CredentialManagerT, *LPCredentialManagerT;
+// user names shorter than this are kept in the slot, lookups of such names never leave the table
+#define CREDENTIAL_INLINE_NAME 24
+
+// sets of the login cache, each holds LOGIN_CACHE_WAYS logins
+#define LOGIN_CACHE_WAYS 4
+
+// failed logins in a row that are let through, the next ones wait LOGIN_THROTTLE_MS doubled each time
+#define LOGIN_FREE_FAILURES 3
+#define LOGIN_THROTTLE_MS 250
+#define LOGIN_MAX_THROTTLE_MS 8000
 
+/*
+ * Failed logins of a user in a row. While it is throttled its logins are rejected
+ * without running the KDF, so guessing passwords cannot keep the auth threads busy.
+ */
+typedef struct LoginThrottleTag {
+	volatile LONG nrFailures;
+	// GetTickCount64() before which the logins are rejected, 0 if they are not throttled
+	volatile LONGLONG qwRetryAfterMs;
+}LoginThrottleT, *LPLoginThrottleT;
+
+/*
+ * A credential record, it stays at the same address for the lifetime of the manager,
+ * a reload keeps the record of every user, so its counters carry over.
+ * Only the salted hash of the password is kept.
+ * The byte counter and the flags are only changed with interlocked operations.
+ */
 typedef struct CredentialTag {
 	PTCHAR sUserName;
-	PTCHAR sPassword;
-	DWORD nrBytesEncrypted;
-	BOOL bConnected;
+	// replaced by a reload that changes the password, the old one is freed once no login reads it
+	LPPasswordHashT volatile passwordHash;
+	DWORD cchUserName;
+	volatile LONGLONG qwBytesEncrypted;
+	// part of qwBytesEncrypted already in the accounting journal, see Accounting.h
+	ULONGLONG qwBytesJournaled;
+	volatile LONG bConnected;
+	// set while the user is not in the credential file anymore, its logins are rejected
+	volatile LONG bRemoved;
+	LoginThrottleT throttle;
 }CredentialT, *LPCredentialT;
 
-unsigned int credential_hash(const LPCredentialT credential);
+/*
+ * Slot of the open addressing table.
+ * dwDistance is 0 for an empty slot and 1 + the distance from the home slot otherwise.
+ */
+typedef struct CredentialSlotTag {
+	DWORD dwDistance;
+	DWORD dwHash;
+	DWORD cchName;
+	TCHAR sInlineName[CREDENTIAL_INLINE_NAME];
+	LPCredentialT credential;
+}CredentialSlotT, *LPCredentialSlotT;
+
+typedef struct CredentialTableTag {
+	DWORD dwMask;
+	DWORD nrCredentials;
+	// credentials of users removed from the file, included in nrCredentials
+	DWORD nrRemoved;
+	// tables replaced by a bigger one, freed by the next reload once no reader is probing them
+	struct CredentialTableTag *retired;
+	CredentialSlotT slots[1];
+}CredentialTableT, *LPCredentialTableT;
+
+typedef struct CredentialStatsTag {
+	// users of the credential file
+	DWORD nrCredentials;
+	// users removed by a reload, kept for their counters
+	DWORD nrRemoved;
+	DWORD nrSlots;
+	// passwords of the credential file stored in plain text, hashed when loaded
+	DWORD nrPlainPasswords;
+	DWORD dwKdfLogCost;
+	DWORD nrCachedLogins;
+	ULONGLONG nrCacheHits;
+	ULONGLONG nrKdfRuns;
+	ULONGLONG nrRejected;
+	// rejected without running the KDF, the user failed too many logins in a row
+	ULONGLONG nrThrottled;
+	ULONGLONG nrReloads;
+	ULONGLONG nrReloadFailures;
+	// duration of the last successful reload, hashing and waiting for the readers included
+	ULONGLONG qwLastReloadUs;
+}CredentialStatsT, *LPCredentialStatsT;
 
-LPCredentialManagerT create_CredentialManagerT();
-LPCredentialT create_CredentialT(PTCHAR sUserName, PTCHAR sPassword);
+/*
+ * Robin Hood hash map from user names to credentials.
+ * Lookups take no lock: they run under a sequence lock and retry if an insert moved slots meanwhile.
+ * Inserts are serialized by csWriters.
+ *
+ * A reload builds a new table off to the side and publishes it with one pointer store.
+ * Lookups run in a read section counted in nrReaders[dwEpoch & 1]; the reload flips the epoch
+ * and frees the tables and password hashes it replaced once the readers of the old epoch are gone,
+ * so a login that started before the swap finishes with what it read.
+ *
+ * Successful logins are remembered in a set associative cache, by a keyed digest of the user name,
+ * the password and its stored hash, so clients that reconnect often skip the KDF.
+ * Failed logins run it unless the user is throttled, the unknown users share one throttle.
+ * The KDF runs outside the read section, a reload does not wait for it.
+ */
+typedef struct CredentialManagerTag{
+	LPCredentialTableT volatile table;
+	volatile LONG dwSequence;
+	CRITICAL_SECTION csWriters;
+	// serializes the reloads, taken before csWriters
+	CRITICAL_SECTION csReload;
+	volatile LONG dwEpoch;
+	volatile LONG nrReaders[2];
+	struct LoginCacheTag *loginCache;
+	// verified when the user is unknown, so the time of a login does not tell which users exist
+	PasswordHashT unknownUserHash;
+	LoginThrottleT unknownUserThrottle;
+	DWORD dwKdfLogCost;
+	DWORD nrPlainPasswords;
+	volatile LONGLONG nrCacheHits;
+	volatile LONGLONG nrKdfRuns;
+	volatile LONGLONG nrRejected;
+	volatile LONGLONG nrThrottled;
+	volatile LONGLONG nrReloads;
+	volatile LONGLONG nrReloadFailures;
+	volatile LONGLONG qwLastReloadUs;
+}CredentialManagerT, *LPCredentialManagerT;
+
+/*
+ * @param dwKdfLogCost: scrypt cost of the passwords hashed by the manager, see PasswordHash.h.
+ * @param nrCachedLogins: successful logins remembered, 0 runs the KDF for every login.
+ */
+LPCredentialManagerT create_CredentialManagerT(DWORD dwKdfLogCost, DWORD nrCachedLogins);
+LPCredentialT create_CredentialT(PTCHAR sUserName, const PasswordHashT *passwordHash);
+VOID destroy_CredentialT(LPCredentialT credential);
+
+/*
+ * Loads <user name>;<password> lines, the password is either a hash made by formatPasswordHash
+ * or plain text, which is hashed with the cost of the manager. A plain password cannot start with '$'.
+ */
+LPCredentialManagerT loadCredentialsFromFile(PTCHAR path, DWORD dwKdfLogCost, DWORD nrCachedLogins);
 
-LPCredentialManagerT loadCredentialsFromFile(PTCHAR path);
+/*
+ * Reads the credential file again and swaps the new table in, without stopping the lookups.
+ * Users that are still in the file keep their credential and counters, a changed password
+ * replaces their hash, new users are added and the users no longer in the file are marked removed.
+ * Plain text passwords that still match keep their hash and their cached logins.
+ * It returns once the replaced tables and hashes are freed.
+ *
+ * @return FALSE if the file could not be read or out of memory, the credentials are unchanged then.
+ */
+BOOL reloadCredentialsFromFile(LPCredentialManagerT manager, PTCHAR path);
 
+/*
+ * Frees the manager, its tables and its credentials. No lookup may be running.
+ */
+VOID destroyCredentialManager(LPCredentialManagerT manager);
+
+/*
+ * Adds the credential, the manager takes ownership of it.
+ *
+ * @return FALSE if the user already exists or the table could not grow.
+ */
 BOOL insertCredentials(LPCredentialManagerT manager, LPCredentialT credential);
 
-BOOL addBytesToClientAndDisconnect(LPCredentialManagerT manager,PTCHAR clientName, DWORD nrBytes);
+/*
+ * Looks up a user name given by pointer and length, the name does not need to be terminated.
+ *
+ * @return the credential, removed users included, or NULL if the user is unknown.
+ */
+LPCredentialT findCredential(LPCredentialManagerT manager, const TCHAR *sUserName, DWORD cchUserName);
+
+/*
+ * Checks a login. The credential it returns keeps its address, the clients of the user
+ * account their bytes to it with interlocked operations instead of looking the user up again.
+ *
+ * @return the credential of the user, or NULL if the login is rejected.
+ */
+LPCredentialT checkClientCredentials(LPCredentialManagerT manager, PTCHAR sUserName, PTCHAR sPassword);
+
+VOID getCredentialStats(LPCredentialManagerT manager, LPCredentialStatsT stats);
 
-BOOL checkClientCredentials(LPCredentialManagerT manager, LPCredentialT credential);
+/*
+ * Calls visit for every credential, removed users included, inserts and reloads wait until it returns.
+ */
+VOID visitCredentials(LPCredentialManagerT manager, VOID(*visit)(LPCredentialT credential, LPVOID context), LPVOID context);
 
 VOID listCredentials(LPCredentialManagerT manager);
 
 void print_CredentialT(const void *a, FILE* file);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,129 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "UserShares.h"
+
+typedef struct UserSharesTag {
+	LPWorkSchedulerT scheduler;
+	LONG cbDefaultQuota;
+	// guards the list and the connection counts, taken once per connection
+	CRITICAL_SECTION criticalSection;
+	LPUserShareT first;
+}UserSharesT;
+
+static LPUserShareT findUserShare(LPUserSharesT shares, PTCHAR sUserName)
+{
+	for (LPUserShareT share = shares->first; share != NULL; share = share->next) {
+		if (_tcscmp(share->sUserName, sUserName) == 0) {
+			return share;
+		}
+	}
+	return NULL;
+}
+
+static LPUserShareT addUserShare(LPUserSharesT shares, PTCHAR sUserName, DWORD dwWeight, LONG cbQuota)
+{
+	LPUserShareT share = (LPUserShareT)calloc(1, sizeof(UserShareT));
+	if (share == NULL) {
+		return NULL;
+	}
+	share->sUserName = _tcsdup(sUserName);
+	if (share->sUserName == NULL) {
+		free(share);
+		return NULL;
+	}
+	share->dwWeight = dwWeight;
+	initPacketQuota(&share->quota, cbQuota, NULL);
+
+	share->next = shares->first;
+	shares->first = share;
+	return share;
+}
+
+LPUserSharesT loadUserShares(PTCHAR sPath, LPWorkSchedulerT scheduler, LONG cbDefaultQuota)
+{
+	TCHAR buffer[1024];
+	FILE *file = NULL;
+
+	if (sPath != NULL) {
+		file = _tfopen(sPath, _T("r"));
+		if (file == NULL) {
+			return NULL;
+		}
+	}
+
+	LPUserSharesT shares = (LPUserSharesT)malloc(sizeof(UserSharesT));
+	if (shares == NULL) {
+		if (file != NULL) {
+			fclose(file);
+		}
+		return NULL;
+	}
+	shares->scheduler = scheduler;
+	shares->cbDefaultQuota = cbDefaultQuota;
+	shares->first = NULL;
+	InitializeCriticalSection(&shares->criticalSection);
+
+	while (file != NULL && _fgetts(buffer, 1024, file) != NULL) {
+		PTCHAR sUserName = _tcstok(buffer, _T(";\r\n"));
+		PTCHAR sWeight = _tcstok(NULL, _T(";\r\n"));
+		PTCHAR sQuota = _tcstok(NULL, _T(";\r\n"));
+		DWORD dwWeight;
+		DWORD nrMegabytes = 0;
+
+		if (sUserName == NULL || sUserName[0] == '#' || sWeight == NULL ||
+			_stscanf(sWeight, _T("%u"), &dwWeight) != 1 || dwWeight == 0 || dwWeight > WORK_MAX_WEIGHT) {
+			continue;
+		}
+		if (sQuota != NULL && (_stscanf(sQuota, _T("%u"), &nrMegabytes) != 1 || nrMegabytes == 0 || nrMegabytes > 2047)) {
+			continue;
+		}
+		if (findUserShare(shares, sUserName) != NULL) {
+			continue;
+		}
+		addUserShare(shares, sUserName, dwWeight, nrMegabytes != 0 ? (LONG)nrMegabytes * 1024 * 1024 : cbDefaultQuota);
+	}
+
+	if (file != NULL) {
+		fclose(file);
+	}
+	return shares;
+}
+
+LPUserShareT acquireUserShare(LPUserSharesT shares, PTCHAR sUserName)
+{
+	LPUserShareT share;
+
+	EnterCriticalSection(&shares->criticalSection);
+	share = findUserShare(shares, sUserName);
+	if (share == NULL) {
+		share = addUserShare(shares, sUserName, 1, shares->cbDefaultQuota);
+	}
+	if (share != NULL && share->flow == NULL) {
+		share->flow = createWorkFlow(shares->scheduler, share->dwWeight);
+		if (share->flow == NULL) {
+			share = NULL;
+		}
+	}
+	if (share != NULL) {
+		share->nrConnections++;
+	}
+	LeaveCriticalSection(&shares->criticalSection);
+
+	return share;
+}
+
+VOID releaseUserShare(LPUserSharesT shares, LPUserShareT share)
+{
+	EnterCriticalSection(&shares->criticalSection);
+	share->nrConnections--;
+	LeaveCriticalSection(&shares->criticalSection);
+}
+
+VOID visitUserShares(LPUserSharesT shares, VOID(*visit)(LPUserShareT share, LPVOID context), LPVOID context)
+{
+	EnterCriticalSection(&shares->criticalSection);
+	for (LPUserShareT share = shares->first; share != NULL; share = share->next) {
+		visit(share, context);
+	}
+	LeaveCriticalSection(&shares->criticalSection);
+}
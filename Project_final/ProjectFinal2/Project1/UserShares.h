@@ -0,0 +1,58 @@
+#pragma once
+
+#ifndef USER_SHARES_H
+#define USER_SHARES_H
+
+#include "Portability.h"
+#include "WorkScheduler.h"
+#include "PacketPool.h"
+
+/*
+ * Share of the server of every user: its weight in the work scheduler
+ * and the payload bytes its clients may have in the server together.
+ * The shares are read from the weights file, one <user name>;<weight>[;<quota in MB>] per line,
+ * lines starting with # are comments. Users not listed get weight 1 and the default quota.
+ *
+ * The connections of a user share one flow of the scheduler and one quota,
+ * a pipelined client is not read while the quota of its user is used up.
+ */
+
+typedef struct UserShareTag {
+	PTCHAR sUserName;
+	DWORD dwWeight;
+	// created with the first connection of the user, kept afterwards
+	LPWorkFlowT flow;
+	// the quotas of the connections of the user are linked to it
+	PacketQuotaT quota;
+	// guarded by the lock of the shares
+	DWORD nrConnections;
+	struct UserShareTag *next;
+}UserShareT, *LPUserShareT;
+
+typedef struct UserSharesTag *LPUserSharesT;
+
+/*
+ * @param sPath: the weights file, NULL when every user gets the defaults.
+ * @param cbDefaultQuota: quota of the users not given one in the file.
+ * @return the shares, or NULL if the file could not be read or out of memory.
+ */
+LPUserSharesT loadUserShares(PTCHAR sPath, LPWorkSchedulerT scheduler, LONG cbDefaultQuota);
+
+/*
+ * Gets the share of a user for a new connection.
+ *
+ * @return the share, or NULL if out of memory.
+ */
+LPUserShareT acquireUserShare(LPUserSharesT shares, PTCHAR sUserName);
+
+/*
+ * Called when a connection is gone, once its packets are back in the pool.
+ */
+VOID releaseUserShare(LPUserSharesT shares, LPUserShareT share);
+
+/*
+ * Calls visit for every share listed in the file or used since.
+ */
+VOID visitUserShares(LPUserSharesT shares, VOID(*visit)(LPUserShareT share, LPVOID context), LPVOID context);
+
+#endif
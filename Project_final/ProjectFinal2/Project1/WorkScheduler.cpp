@@ -0,0 +1,372 @@
+#include "WorkScheduler.h"
+
+// rounds over all workers before a worker parks
+#define SCHEDULER_SPIN_COUNT 64
+// packets submitted to a worker and not yet sorted into its flows
+#define SCHEDULER_RING_SIZE 1024
+
+typedef struct WorkFlowTag {
+	struct WorkerSlotTag *home;
+	// weight times WORK_QUANTUM
+	LONG cbQuantum;
+
+	// guarded by the lock of the home worker
+	LONG cbDeficit;
+	// its turn started, it has been given its quantum
+	BOOL bInTurn;
+	BOOL bActive;
+	LPEncryptDataT first;
+	LPEncryptDataT last;
+	// next active flow of the home worker
+	struct WorkFlowTag *nextActive;
+	volatile LONG nrQueued;
+}WorkFlowT;
+
+typedef struct WorkerSlotTag {
+	DWORD dwWorker;
+	// submitWork pushes here without locking, the packets are sorted into the flows under the lock
+	LPSyncCircQueueT submitted;
+	// guards the flows of this worker
+	CRITICAL_SECTION criticalSection;
+	// active flows in round robin order, the one whose turn it is first
+	LPWorkFlowT firstActive;
+	LPWorkFlowT lastActive;
+	volatile LONG nrActive;
+	// packets of its flows, read without the lock to skip empty workers
+	volatile LONG nrQueued;
+	QueueParkingT parking;
+
+	// written by the owning worker only
+	volatile ULONGLONG nrLocal;
+	volatile ULONGLONG nrStolen;
+	volatile LONGLONG llIdleTicks;
+	// start of the current idle period, 0 while working
+	volatile LONGLONG llIdleSince;
+}WorkerSlotT, *LPWorkerSlotT;
+
+typedef struct WorkSchedulerTag {
+	DWORD nrWorkers;
+	// separate allocations, so workers do not share cache lines
+	LPWorkerSlotT *workers;
+	// workers parked or about to park
+	volatile LONG nrIdle;
+	volatile LONG dwNextHome;
+	// set by stopWorkScheduler, takeWork fails once there is no work left
+	volatile LONG bStopping;
+	LONGLONG llCreated;
+}WorkSchedulerT;
+
+typedef struct TakeContextTag {
+	LPWorkSchedulerT scheduler;
+	DWORD dwWorker;
+	LPEncryptDataT *data;
+}TakeContextT, *LPTakeContextT;
+
+static LONGLONG currentTicks()
+{
+	LARGE_INTEGER counter;
+
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+}
+
+/*
+ * Moves the packets submitted to a worker to the back of their flows, the lock of the worker is held.
+ * A flow that was idle joins at the back of the round.
+ */
+static VOID sortSubmitted(LPWorkerSlotT worker)
+{
+	LPEncryptDataT packet;
+	LPWorkFlowT flow;
+
+	while (tryPopSyncQueue(worker->submitted, &packet)) {
+		flow = packet->flow;
+		if (flow->last == NULL) {
+			flow->first = packet;
+		} else {
+			flow->last->nextQueued = packet;
+		}
+		flow->last = packet;
+
+		if (!flow->bActive) {
+			flow->bActive = TRUE;
+			flow->nextActive = NULL;
+			if (worker->lastActive == NULL) {
+				worker->firstActive = flow;
+			} else {
+				worker->lastActive->nextActive = flow;
+			}
+			worker->lastActive = flow;
+			InterlockedIncrement(&worker->nrActive);
+		}
+	}
+}
+
+/*
+ * Takes the next packet of the flows of a worker, by deficit round robin.
+ * A flow gets its quantum when its turn starts and keeps the turn while its deficit
+ * covers its next packet, the deficit left is kept for its next turn.
+ */
+static BOOL takeFromFlows(LPWorkerSlotT worker, LPEncryptDataT *data)
+{
+	LPWorkFlowT flow;
+	LPEncryptDataT packet;
+
+	if (ReadAcquire(&worker->nrQueued) == 0) {
+		return FALSE;
+	}
+
+	EnterCriticalSection(&worker->criticalSection);
+	sortSubmitted(worker);
+	if (worker->firstActive == NULL) {
+		LeaveCriticalSection(&worker->criticalSection);
+		return FALSE;
+	}
+
+	while (TRUE) {
+		flow = worker->firstActive;
+		if (!flow->bInTurn) {
+			flow->cbDeficit += flow->cbQuantum;
+			flow->bInTurn = TRUE;
+		}
+		packet = flow->first;
+		if ((LONG)packet->payload.cbData <= flow->cbDeficit) {
+			break;
+		}
+		// the turn is over, the flow goes to the back
+		flow->bInTurn = FALSE;
+		if (flow->nextActive != NULL) {
+			worker->firstActive = flow->nextActive;
+			worker->lastActive->nextActive = flow;
+			worker->lastActive = flow;
+			flow->nextActive = NULL;
+		}
+	}
+
+	flow->cbDeficit -= packet->payload.cbData;
+	flow->first = packet->nextQueued;
+	packet->nextQueued = NULL;
+	InterlockedDecrement(&flow->nrQueued);
+	InterlockedDecrement(&worker->nrQueued);
+	if (flow->first == NULL) {
+		// an idle flow does not save up deficit
+		flow->last = NULL;
+		flow->cbDeficit = 0;
+		flow->bInTurn = FALSE;
+		flow->bActive = FALSE;
+		worker->firstActive = flow->nextActive;
+		if (worker->firstActive == NULL) {
+			worker->lastActive = NULL;
+		}
+		flow->nextActive = NULL;
+		InterlockedDecrement(&worker->nrActive);
+	}
+	LeaveCriticalSection(&worker->criticalSection);
+
+	*data = packet;
+	return TRUE;
+}
+
+/*
+ * Takes a packet from the worker's own flows, or steals one, starting with its neighbour.
+ * Once the scheduler is stopping and there is no work left, it succeeds with no packet.
+ */
+static BOOL tryTakeWork(LPVOID context)
+{
+	LPTakeContextT take = (LPTakeContextT)context;
+	LPWorkSchedulerT scheduler = take->scheduler;
+	LPWorkerSlotT worker = scheduler->workers[take->dwWorker];
+
+	if (takeFromFlows(worker, take->data)) {
+		worker->nrLocal++;
+		return TRUE;
+	}
+
+	for (DWORD i = 1; i < scheduler->nrWorkers; i++) {
+		LPWorkerSlotT victim = scheduler->workers[(take->dwWorker + i) % scheduler->nrWorkers];
+		if (takeFromFlows(victim, take->data)) {
+			worker->nrStolen++;
+			return TRUE;
+		}
+	}
+
+	if (ReadAcquire(&scheduler->bStopping)) {
+		*take->data = NULL;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+BOOL takeWork(LPWorkSchedulerT scheduler, DWORD dwWorker, LPEncryptDataT *data)
+{
+	LPWorkerSlotT worker = scheduler->workers[dwWorker];
+	TakeContextT take = { scheduler, dwWorker, data };
+	DWORD dwSpin = 0;
+	BOOL bTaken;
+
+	worker->llIdleSince = currentTicks();
+
+	while (!tryTakeWork(&take)) {
+		if (dwSpin < SCHEDULER_SPIN_COUNT) {
+			dwSpin++;
+			YieldProcessor();
+			continue;
+		}
+		// counted before parking, so submitWork finds this worker when the home of a flow is busy
+		InterlockedIncrement(&scheduler->nrIdle);
+		bTaken = parkThread(&worker->parking, tryTakeWork, &take);
+		InterlockedDecrement(&scheduler->nrIdle);
+		if (bTaken) {
+			break;
+		}
+	}
+
+	worker->llIdleTicks += currentTicks() - worker->llIdleSince;
+	worker->llIdleSince = 0;
+
+	return *data != NULL;
+}
+
+VOID submitWork(LPWorkSchedulerT scheduler, LPWorkFlowT flow, LPEncryptDataT data)
+{
+	LPWorkerSlotT worker = flow->home;
+
+	data->nextQueued = NULL;
+	data->flow = flow;
+	// counted first, so the packet is never taken before it is counted
+	InterlockedIncrement(&flow->nrQueued);
+	InterlockedIncrement(&worker->nrQueued);
+
+	// the ring fills up only while every worker lags far behind, make room by sorting it ourselves
+	while (!tryPushSyncQueue(worker->submitted, data)) {
+		EnterCriticalSection(&worker->criticalSection);
+		sortSubmitted(worker);
+		LeaveCriticalSection(&worker->criticalSection);
+	}
+
+	if (wakeParkedThread(&worker->parking)) {
+		return;
+	}
+
+	// the owner is busy, let an idle worker steal the packet
+	MemoryBarrier();
+	if (ReadAcquire(&scheduler->nrIdle) == 0) {
+		return;
+	}
+	for (DWORD i = 1; i < scheduler->nrWorkers; i++) {
+		if (wakeParkedThread(&scheduler->workers[(worker->dwWorker + i) % scheduler->nrWorkers]->parking)) {
+			return;
+		}
+	}
+}
+
+VOID stopWorkScheduler(LPWorkSchedulerT scheduler)
+{
+	WriteRelease(&scheduler->bStopping, TRUE);
+	MemoryBarrier();
+	for (DWORD i = 0; i < scheduler->nrWorkers; i++) {
+		wakeParkedThread(&scheduler->workers[i]->parking);
+	}
+}
+
+LPWorkFlowT createWorkFlow(LPWorkSchedulerT scheduler, DWORD dwWeight)
+{
+	LPWorkFlowT flow = (LPWorkFlowT)calloc(1, sizeof(WorkFlowT));
+	if (flow == NULL) {
+		return NULL;
+	}
+
+	if (dwWeight == 0) {
+		dwWeight = 1;
+	} else if (dwWeight > WORK_MAX_WEIGHT) {
+		dwWeight = WORK_MAX_WEIGHT;
+	}
+	flow->cbQuantum = (LONG)dwWeight * WORK_QUANTUM;
+	flow->home = scheduler->workers[(DWORD)InterlockedIncrement(&scheduler->dwNextHome) % scheduler->nrWorkers];
+
+	return flow;
+}
+
+DWORD getFlowQueued(LPWorkFlowT flow)
+{
+	return (DWORD)ReadAcquire(&flow->nrQueued);
+}
+
+DWORD getNrWorkers(LPWorkSchedulerT scheduler)
+{
+	return scheduler->nrWorkers;
+}
+
+VOID getWorkerStats(LPWorkSchedulerT scheduler, DWORD dwWorker, LPWorkerStatsT stats)
+{
+	LPWorkerSlotT worker = scheduler->workers[dwWorker];
+	LONGLONG llNow = currentTicks();
+	LONGLONG llIdleSince = worker->llIdleSince;
+	LONGLONG llIdle = worker->llIdleTicks;
+	LONGLONG llElapsed = llNow - scheduler->llCreated;
+
+	if (llIdleSince != 0) {
+		llIdle += llNow - llIdleSince;
+	}
+	if (llIdle > llElapsed) {
+		llIdle = llElapsed;
+	}
+
+	stats->nrLocal = worker->nrLocal;
+	stats->nrStolen = worker->nrStolen;
+	stats->dwUtilization = (llElapsed > 0) ? (DWORD)((llElapsed - llIdle) * 100 / llElapsed) : 0;
+	stats->nrQueued = (DWORD)ReadAcquire(&worker->nrQueued);
+	stats->nrActiveFlows = (DWORD)ReadAcquire(&worker->nrActive);
+}
+
+LPWorkSchedulerT createWorkScheduler(DWORD nrWorkers)
+{
+	LPWorkSchedulerT scheduler = (LPWorkSchedulerT)malloc(sizeof(WorkSchedulerT));
+	if (scheduler == NULL) {
+		return NULL;
+	}
+
+	scheduler->workers = (LPWorkerSlotT*)malloc(sizeof(LPWorkerSlotT) * nrWorkers);
+	if (scheduler->workers == NULL) {
+		free(scheduler);
+		return NULL;
+	}
+
+	// only the slots created so far are freed if one cannot be
+	scheduler->nrWorkers = 0;
+	for (DWORD i = 0; i < nrWorkers; i++) {
+		LPWorkerSlotT worker = (LPWorkerSlotT)calloc(1, sizeof(WorkerSlotT));
+		if (worker == NULL) {
+			destroyWorkScheduler(scheduler);
+			return NULL;
+		}
+		worker->dwWorker = i;
+		worker->submitted = create_SyncCircQueueT(SCHEDULER_RING_SIZE);
+		if (worker->submitted == NULL) {
+			free(worker);
+			destroyWorkScheduler(scheduler);
+			return NULL;
+		}
+		InitializeCriticalSection(&worker->criticalSection);
+		scheduler->workers[i] = worker;
+		scheduler->nrWorkers++;
+	}
+
+	scheduler->nrIdle = 0;
+	scheduler->dwNextHome = 0;
+	scheduler->bStopping = FALSE;
+	scheduler->llCreated = currentTicks();
+
+	return scheduler;
+}
+
+VOID destroyWorkScheduler(LPWorkSchedulerT scheduler)
+{
+	for (DWORD i = 0; i < scheduler->nrWorkers; i++) {
+		DeleteCriticalSection(&scheduler->workers[i]->criticalSection);
+		destroy_SyncCircQueueT(scheduler->workers[i]->submitted);
+		free(scheduler->workers[i]);
+	}
+	free(scheduler->workers);
+	free(scheduler);
+}
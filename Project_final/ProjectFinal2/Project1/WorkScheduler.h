@@ -0,0 +1,93 @@
+#pragma once
+
+#ifndef WORK_SCHEDULER_H
+#define WORK_SCHEDULER_H
+
+#include "Portability.h"
+#include "EncSyncQueue.h"
+
+/*
+ * Spreads the packets over the encryption workers, fairly between the users.
+ * The packets are queued in flows, one per user, and every flow has a home worker,
+ * so the data of a user stays in one core's cache.
+ * A worker serves the flows of its home by deficit round robin: on its turn a flow may
+ * send its weight times WORK_QUANTUM bytes, so a user streaming a huge file gets its share
+ * and the small jobs of the others do not wait behind its queue.
+ * A worker with no flow of its own steals from the others, with the same rounds, before going idle.
+ * Submitting takes no lock: the packets go through a lock-free ring of the home worker
+ * (see EncSyncQueue.h) and are sorted into their flows by whoever takes work from it next.
+ */
+
+// bytes a flow of weight 1 may have encrypted per round
+#define WORK_QUANTUM (64 * 1024)
+#define WORK_MAX_WEIGHT 1000
+
+typedef struct WorkerStatsTag {
+	// packets taken from its own flows
+	ULONGLONG nrLocal;
+	// packets taken from the flows of other workers
+	ULONGLONG nrStolen;
+	// percentage of time spent working since the scheduler was created
+	DWORD dwUtilization;
+	// packets waiting in its flows
+	DWORD nrQueued;
+	// flows with packets waiting
+	DWORD nrActiveFlows;
+}WorkerStatsT, *LPWorkerStatsT;
+
+typedef struct WorkSchedulerTag *LPWorkSchedulerT;
+typedef struct WorkFlowTag *LPWorkFlowT;
+
+/*
+ * @return the scheduler, or NULL on failure.
+ */
+LPWorkSchedulerT createWorkScheduler(DWORD nrWorkers);
+
+/*
+ * Creates a flow, its home worker is picked round robin.
+ * Flows live as long as the scheduler.
+ *
+ * @param dwWeight: share of the flow, 1 to WORK_MAX_WEIGHT.
+ * @return the flow, or NULL if out of memory.
+ */
+LPWorkFlowT createWorkFlow(LPWorkSchedulerT scheduler, DWORD dwWeight);
+
+/*
+ * Queues a packet of a flow for encryption, it never blocks:
+ * the packets queued are bounded by the quotas of their owners (see PacketPool.h).
+ * The packets of a flow are taken in order, but may be encrypted concurrently.
+ */
+VOID submitWork(LPWorkSchedulerT scheduler, LPWorkFlowT flow, LPEncryptDataT data);
+
+/*
+ * Gets the next packet of worker dwWorker, blocks while there is no work anywhere.
+ * The time between two calls counts as busy time of the worker.
+ *
+ * @return FALSE when the worker must stop, see stopWorkScheduler.
+ */
+BOOL takeWork(LPWorkSchedulerT scheduler, DWORD dwWorker, LPEncryptDataT *data);
+
+/*
+ * Makes takeWork return FALSE once every queued packet is taken.
+ * Call it once no packet is submitted anymore.
+ */
+VOID stopWorkScheduler(LPWorkSchedulerT scheduler);
+
+/*
+ * Frees the scheduler once no thread uses it anymore, the flows created from it are not freed.
+ */
+VOID destroyWorkScheduler(LPWorkSchedulerT scheduler);
+
+DWORD getNrWorkers(LPWorkSchedulerT scheduler);
+
+/*
+ * The statistics are updated without locking, they may be slightly behind.
+ */
+VOID getWorkerStats(LPWorkSchedulerT scheduler, DWORD dwWorker, LPWorkerStatsT stats);
+
+/*
+ * @return the packets of the flow waiting for a worker.
+ */
+DWORD getFlowQueued(LPWorkFlowT flow);
+
+#endif
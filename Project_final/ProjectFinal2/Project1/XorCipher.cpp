@@ -0,0 +1,263 @@
+#include "XorCipher.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define XOR_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC compiles intrinsics of any instruction set, GCC needs them enabled per function
+#define XOR_TARGET(isa)
+#else
+#define XOR_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+/*
+ * Short keys are expanded into a pattern of whole key repetitions of about this size,
+ * so the kernels always XOR long runs of contiguous key bytes.
+ */
+#define XOR_PATTERN_SIZE 1024
+
+// XORs dst with n bytes of src
+typedef VOID(*XorRunT)(PBYTE dst, const BYTE *src, DWORD n);
+
+static VOID xorRunScalar(PBYTE dst, const BYTE *src, DWORD n)
+{
+	for (DWORD i = 0; i < n; i++) {
+		dst[i] ^= src[i];
+	}
+}
+
+#ifdef XOR_X86
+
+XOR_TARGET("sse2")
+static VOID xorRunSse2(PBYTE dst, const BYTE *src, DWORD n)
+{
+	DWORD i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i data = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i key = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(data, key));
+	}
+	xorRunScalar(dst + i, src + i, n - i);
+}
+
+/*
+ * The wide kernels finish their tails themselves: calling the SSE2 kernel
+ * with dirty upper registers costs an AVX to SSE transition on some processors.
+ */
+XOR_TARGET("avx2")
+static VOID xorRunAvx2(PBYTE dst, const BYTE *src, DWORD n)
+{
+	DWORD i = 0;
+
+	for (; i + 64 <= n; i += 64) {
+		__m256i data0 = _mm256_loadu_si256((const __m256i*)(dst + i));
+		__m256i data1 = _mm256_loadu_si256((const __m256i*)(dst + i + 32));
+		__m256i key0 = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i key1 = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(data0, key0));
+		_mm256_storeu_si256((__m256i*)(dst + i + 32), _mm256_xor_si256(data1, key1));
+	}
+	for (; i + 16 <= n; i += 16) {
+		__m128i data = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i key = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(data, key));
+	}
+	for (; i < n; i++) {
+		dst[i] ^= src[i];
+	}
+}
+
+XOR_TARGET("avx512f")
+static VOID xorRunAvx512(PBYTE dst, const BYTE *src, DWORD n)
+{
+	DWORD i = 0;
+
+	for (; i + 64 <= n; i += 64) {
+		__m512i data = _mm512_loadu_si512((const void*)(dst + i));
+		__m512i key = _mm512_loadu_si512((const void*)(src + i));
+		_mm512_storeu_si512((void*)(dst + i), _mm512_xor_si512(data, key));
+	}
+	for (; i + 16 <= n; i += 16) {
+		__m128i data = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i key = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(data, key));
+	}
+	for (; i < n; i++) {
+		dst[i] ^= src[i];
+	}
+}
+
+#endif
+
+/*
+ * Walks the key stream in contiguous runs and lets xorRun do the XOR.
+ * Keys shorter than the pattern are first repeated into it, once per call.
+ */
+static VOID xorWithRuns(PBYTE buff, DWORD cbBuff, const BYTE *key, DWORD cbKey, DWORD dwPhase, XorRunT xorRun)
+{
+	BYTE pattern[XOR_PATTERN_SIZE];
+	const BYTE *stream = key;
+	DWORD cbStream = cbKey;
+	DWORD dwOffset = dwPhase % cbKey;
+	DWORD cbRun;
+
+	if (cbKey < XOR_PATTERN_SIZE) {
+		cbStream = cbKey * (XOR_PATTERN_SIZE / cbKey);
+		memcpy(pattern, key, cbKey);
+		for (DWORD cbFilled = cbKey; cbFilled < cbStream; cbFilled *= 2) {
+			memcpy(pattern + cbFilled, pattern, (cbStream - cbFilled < cbFilled) ? cbStream - cbFilled : cbFilled);
+		}
+		stream = pattern;
+	}
+
+	while (cbBuff > 0) {
+		cbRun = cbStream - dwOffset;
+		if (cbRun > cbBuff) {
+			cbRun = cbBuff;
+		}
+		xorRun(buff, stream + dwOffset, cbRun);
+		buff += cbRun;
+		cbBuff -= cbRun;
+		dwOffset = 0;
+	}
+}
+
+static VOID xorKeystreamScalar(PBYTE buff, DWORD cbBuff, const BYTE *key, DWORD cbKey, DWORD dwPhase)
+{
+	xorWithRuns(buff, cbBuff, key, cbKey, dwPhase, xorRunScalar);
+}
+
+#ifdef XOR_X86
+
+static VOID xorKeystreamSse2(PBYTE buff, DWORD cbBuff, const BYTE *key, DWORD cbKey, DWORD dwPhase)
+{
+	xorWithRuns(buff, cbBuff, key, cbKey, dwPhase, xorRunSse2);
+}
+
+static VOID xorKeystreamAvx2(PBYTE buff, DWORD cbBuff, const BYTE *key, DWORD cbKey, DWORD dwPhase)
+{
+	xorWithRuns(buff, cbBuff, key, cbKey, dwPhase, xorRunAvx2);
+}
+
+static VOID xorKeystreamAvx512(PBYTE buff, DWORD cbBuff, const BYTE *key, DWORD cbKey, DWORD dwPhase)
+{
+	xorWithRuns(buff, cbBuff, key, cbKey, dwPhase, xorRunAvx512);
+}
+
+#define CPU_SSE2 1
+#define CPU_AVX2 2
+#define CPU_AVX512 4
+
+/*
+ * Instruction sets of the processor that the operating system also saves on context switches.
+ */
+static DWORD detectCpuFeatures()
+{
+	DWORD dwFeatures = 0;
+
+#ifdef _MSC_VER
+	INT info[4];
+	INT nrMaxLeaf;
+	BOOL bYmm = FALSE;
+	BOOL bZmm = FALSE;
+
+	__cpuid(info, 0);
+	nrMaxLeaf = info[0];
+
+	__cpuid(info, 1);
+	if (info[3] & (1 << 26)) {
+		dwFeatures |= CPU_SSE2;
+	}
+	// OSXSAVE: the register state enabled by the OS is in XCR0
+	if (info[2] & (1 << 27)) {
+		unsigned __int64 xcr0 = _xgetbv(0);
+		bYmm = (xcr0 & 0x6) == 0x6;
+		bZmm = (xcr0 & 0xE6) == 0xE6;
+	}
+
+	if (nrMaxLeaf >= 7) {
+		__cpuidex(info, 7, 0);
+		if (bYmm && (info[1] & (1 << 5))) {
+			dwFeatures |= CPU_AVX2;
+		}
+		if (bZmm && (info[1] & (1 << 16))) {
+			dwFeatures |= CPU_AVX512;
+		}
+	}
+#else
+	// checks the OS support as well
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		dwFeatures |= CPU_SSE2;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		dwFeatures |= CPU_AVX2;
+	}
+	if (__builtin_cpu_supports("avx512f")) {
+		dwFeatures |= CPU_AVX512;
+	}
+#endif
+
+	return dwFeatures;
+}
+
+#endif
+
+DWORD getSupportedXorKernels(LPXorKernelInfoT kernels, DWORD nrMaxKernels)
+{
+	XorKernelInfoT supported[4];
+	DWORD nrSupported = 0;
+
+	supported[nrSupported].sName = _T("scalar");
+	supported[nrSupported++].kernel = xorKeystreamScalar;
+
+#ifdef XOR_X86
+	DWORD dwFeatures = detectCpuFeatures();
+
+	if (dwFeatures & CPU_SSE2) {
+		supported[nrSupported].sName = _T("sse2");
+		supported[nrSupported++].kernel = xorKeystreamSse2;
+	}
+	if (dwFeatures & CPU_AVX2) {
+		supported[nrSupported].sName = _T("avx2");
+		supported[nrSupported++].kernel = xorKeystreamAvx2;
+	}
+	if (dwFeatures & CPU_AVX512) {
+		supported[nrSupported].sName = _T("avx512");
+		supported[nrSupported++].kernel = xorKeystreamAvx512;
+	}
+#endif
+
+	if (nrSupported > nrMaxKernels) {
+		nrSupported = nrMaxKernels;
+	}
+	memcpy(kernels, supported, sizeof(XorKernelInfoT) * nrSupported);
+	return nrSupported;
+}
+
+static XorKernelInfoT selectXorKernel()
+{
+	XorKernelInfoT kernels[4];
+	DWORD nrKernels = getSupportedXorKernels(kernels, 4);
+
+	return kernels[nrKernels - 1];
+}
+
+// picked once, before main runs
+static const XorKernelInfoT gXorKernel = selectXorKernel();
+
+VOID xorKeystream(PBYTE buff, DWORD cbBuff, const BYTE *key, DWORD cbKey, DWORD dwPhase)
+{
+	if (cbKey == 0) {
+		return;
+	}
+	gXorKernel.kernel(buff, cbBuff, key, cbKey, dwPhase);
+}
+
+LPCTSTR getXorKernelName()
+{
+	return gXorKernel.sName;
+}
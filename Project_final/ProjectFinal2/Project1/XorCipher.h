@@ -0,0 +1,39 @@
+#pragma once
+
+#ifndef XOR_CIPHER_H
+#define XOR_CIPHER_H
+
+#include "Portability.h"
+
+/*
+ * The cipher of the server: the data is XORed with the key repeated over it.
+ * The kernel is vectorized with SSE2, AVX2 or AVX-512, picked at runtime by CPUID,
+ * with a scalar fallback for other processors.
+ */
+
+typedef VOID(*XorKernelT)(PBYTE buff, DWORD cbBuff, const BYTE *key, DWORD cbKey, DWORD dwPhase);
+
+typedef struct XorKernelInfoTag {
+	LPCTSTR sName;
+	XorKernelT kernel;
+}XorKernelInfoT, *LPXorKernelInfoT;
+
+/*
+ * XORs buff in place with the repeated key, buff[0] is paired with key[dwPhase % cbKey].
+ * A stream split in packets continues with dwPhase + cbBuff for the next packet.
+ */
+VOID xorKeystream(PBYTE buff, DWORD cbBuff, const BYTE *key, DWORD cbKey, DWORD dwPhase);
+
+/*
+ * Name of the kernel xorKeystream runs on this processor.
+ */
+LPCTSTR getXorKernelName();
+
+/*
+ * Lists the kernels this processor can run, from the narrowest to the widest.
+ *
+ * @return the number of kernels written to kernels.
+ */
+DWORD getSupportedXorKernels(LPXorKernelInfoT kernels, DWORD nrMaxKernels);
+
+#endif
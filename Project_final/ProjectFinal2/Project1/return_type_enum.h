@@ -1,14 +0,0 @@
-/*
-author: Acs David
-file name: return_type_enum.h
-file creation date: 2016-11-20 23:26:24
-*/
-
-#ifndef RETURN_TYPE_ENUM_H
-#define RETURN_TYPE_ENUM_H
-
-typedef enum ReturnCodeEnum {
-	SUCCESS, MEMORY_ALLOCATION_ERROR, INCORRECT_INDEX, COMPARE_FUNCTION_MISMATCH
-}ReturnCodeE;
-
-#endif